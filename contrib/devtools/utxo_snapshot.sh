@@ -0,0 +1,37 @@
+#!/usr/bin/env bash
+#
+# Copyright (c) 2026 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+export LC_ALL=C
+
+set -ueo pipefail
+
+if (( $# < 3 )); then
+  echo 'Usage: utxo_snapshot.sh <generate-at-height> <snapshot-out-path> <zcash-cli-call ...>'
+  echo
+  echo '  <snapshot-out-path> is relative to the data directory of the node.'
+  echo
+  echo 'Example:'
+  echo
+  echo "  ./contrib/devtools/utxo_snapshot.sh 2000000 utxo.dat ./src/zcash-cli -datadir=\$(pwd)/testdata"
+  exit 1
+fi
+
+GENERATE_AT_HEIGHT="${1}"; shift;
+OUTPUT_PATH="${1}"; shift;
+# Most of the calls we make take a while to run, so pad with a lengthy timeout.
+ZCASH_CLI_CALL="${*} -rpcclienttimeout=9999999"
+
+# Block we'll invalidate/reconsider to rewind/fast-forward the chain.
+PIVOT_BLOCKHASH=$($ZCASH_CLI_CALL getblockhash $(( GENERATE_AT_HEIGHT + 1 )) )
+
+# Put the chain back however the dump ends.
+trap '(>&2 echo "Restoring chain to original height; this may take a while"); ${ZCASH_CLI_CALL} reconsiderblock "${PIVOT_BLOCKHASH}"' EXIT
+
+(>&2 echo "Rewinding chain back to height ${GENERATE_AT_HEIGHT} (by invalidating ${PIVOT_BLOCKHASH}); this may take a while")
+${ZCASH_CLI_CALL} invalidateblock "${PIVOT_BLOCKHASH}"
+
+(>&2 echo "Generating UTXO snapshot...")
+${ZCASH_CLI_CALL} dumptxoutset "${OUTPUT_PATH}"
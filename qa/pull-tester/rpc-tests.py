@@ -89,6 +89,8 @@ BASE_SCRIPTS= [
     'wallet_orchard_persistence.py',
     'wallet_orchard_reindex.py',
     'wallet_nullifiers.py',
+    'wallet_rescan_batches.py',
+    'wallet_rescan_reorg.py',
     'wallet_sapling.py',
     'wallet_sendmany_any_taddr.py',
     'wallet_treestate.py',
@@ -126,6 +128,7 @@ BASE_SCRIPTS= [
     'bip65-cltv-p2p.py',
     'bipdersig-p2p.py',
     'invalidblockrequest.py',
+    'pipelined_connect.py',
     'invalidtxrequest.py',
     'p2p_nu_peer_management.py',
     'rewind_index.py',
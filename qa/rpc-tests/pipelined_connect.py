@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+# Copyright (c) 2026 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.mininode import CBlock
+from test_framework.util import (
+    NU5_BRANCH_ID,
+    assert_equal,
+    bytes_to_hex_str,
+    get_coinbase_address,
+    hex_str_to_bytes,
+    nuparams,
+    start_nodes,
+    wait_and_assert_operationid_status,
+)
+from test_framework.zip317 import conventional_fee
+
+from decimal import Decimal
+from io import BytesIO
+
+# Check that a block containing an invalid Sapling proof is rejected when
+# ConnectBlock hands Sapling batch validation off to worker threads
+# (-pipelinedconnect), and that the chain tip does not move.
+class PipelinedConnectTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.num_nodes = 2
+        self.cache_behavior = 'sprout'
+
+    def setup_network(self, split=False):
+        self.nodes = start_nodes(self.num_nodes, self.options.tmpdir, extra_args=[[
+            nuparams(NU5_BRANCH_ID, 210),
+            '-par=4',
+            '-pipelinedconnect=1',
+            '-allowdeprecated=z_getnewaddress',
+        ]] * self.num_nodes)
+        # The nodes are deliberately left unconnected, so that node 1 only
+        # sees the blocks that are submitted to it.
+        self.is_network_split = True
+
+    def run_test(self):
+        # Node 0 mines a block containing a Sapling output.
+        taddr0 = get_coinbase_address(self.nodes[0])
+        saplingAddr0 = self.nodes[0].z_getnewaddress('sapling')
+        fee = conventional_fee(3)
+        recipients = [{"address": saplingAddr0, "amount": Decimal('10') - fee}]
+        myopid = self.nodes[0].z_sendmany(taddr0, recipients, 1, fee, 'AllowRevealedSenders')
+        mytxid = wait_and_assert_operationid_status(self.nodes[0], myopid)
+        blockhash = self.nodes[0].generate(1)[0]
+        blockhex = self.nodes[0].getblock(blockhash, 0)
+
+        block = CBlock()
+        block.deserialize(BytesIO(hex_str_to_bytes(blockhex)))
+        tx = [tx for tx in block.vtx if tx.shieldedOutputs][0]
+        tx.calc_sha256()
+        assert_equal(tx.hash, mytxid)
+        assert_equal(len(tx.shieldedOutputs), 2) # Non-coinbase bundles are padded
+
+        # Swap the proofs of the two outputs. Both remain well-formed, but
+        # neither proves the statement for the output it is attached to.
+        (tx.shieldedOutputs[0].zkproof, tx.shieldedOutputs[1].zkproof) = \
+            (tx.shieldedOutputs[1].zkproof, tx.shieldedOutputs[0].zkproof)
+        block.rehash()
+        block.solve()
+
+        tip = self.nodes[1].getbestblockhash()
+        assert_equal(
+            self.nodes[1].submitblock(bytes_to_hex_str(block.serialize())),
+            'bad-sapling-bundle-authorization')
+        assert_equal(self.nodes[1].getbestblockhash(), tip)
+
+        # The untampered block is accepted.
+        assert_equal(self.nodes[1].submitblock(blockhex), None)
+        assert_equal(self.nodes[1].getbestblockhash(), blockhash)
+
+if __name__ == '__main__':
+    PipelinedConnectTest().main()
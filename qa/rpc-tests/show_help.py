@@ -87,25 +87,66 @@ Options:
   -exportdir=<dir>
        Specify directory to be used when exporting data
 
+|  -ibdbatchproofs
+|       During initial block download, verify Sapling and Orchard proofs and
+|       signatures in batches spanning up to 32 blocks (default: 1)
+|
   -ibdskiptxverification
        Skip transaction verification during initial block download up to the
        last checkpoint height. Incompatible with flags that disable
        checkpoints. (default = 0)
 
+|  -incrementalcoinsflush
+|       Write the UTXO set to disk periodically without pausing validation or
+|       emptying the in-memory cache (default: 1)
+|
   -loadblock=<file>
        Imports blocks from external blk000??.dat file on startup
 
   -maxorphantx=<n>
-       Keep at most <n> unconnectable transactions in memory (default: 100)
+       Keep at most <n> unconnectable transactions in memory (default: 10000)
+
+  -maxorphantxpeersize=<n>
+       Keep at most <n> megabytes of unconnectable transactions from any one
+       peer in memory (default: 5)
 
+  -maxorphantxsize=<n>
+       Keep at most <n> megabytes of unconnectable transactions in memory
+       (default: 20)
+
+|  -mempoolpreverify
+|       Verify the proofs and signatures of relayed transactions before locking
+|       the chain state to accept them (default: 1)
+|
   -par=<n>
        Set the number of script verification threads (IGNORE_NONDETERMINISTIC, 0 = auto, <0 =
        leave that many cores free, default: 0)
 
+|  -parallelblocktxchecks
+|       Check the transactions of a block in parallel, when -par allows more
+|       than one thread (default: 1)
+|
+  -peroutpointcoins
+       Store the UTXO set with one record per transparent output, upgrading an
+       existing chain state in place. Reverting this setting requires
+       -reindex-chainstate (default: 0)
+
+  -persistmempool
+       Whether to save the mempool on shutdown and load on restart (default: 1)
+
+  -persistsigcache
+       Whether to save the signature and proof validity caches on shutdown and
+       load them on restart (default: 0)
+
   -pid=<file>
        Specify pid file. Relative paths will be prefixed by a net-specific
        datadir location. (default: zcashd.pid)
 
+|  -pipelinedconnect
+|       Verify Sapling and Orchard proofs and signatures in parallel with
+|       connecting a block's transactions, when -par allows more than one thread
+|       (default: 1)
+|
   -prune=<n>
        Reduce storage requirements by pruning (deleting) old blocks. This mode
        disables wallet support and is incompatible with -txindex. Warning:
@@ -148,6 +189,10 @@ Connection options:
        Bind to given address and always listen on it. Use [host]:port notation
        for IPv6
 
+  -compactblocks
+       Relay and request new blocks as compact blocks, reconstructed from the
+       mempool (default: 1)
+
   -connect=<ip>
        Connect only to the specified node(s); -noconnect or -connect=0 alone to
        disable automatic connections
@@ -430,7 +475,7 @@ Debugging/Testing options:
        Output debugging information (default: 0, supplying <category> is
        optional). If <category> is not supplied or if <category> = 1, output
        all debugging information. <category> can be: addrman, alert, bench,
-       coindb, db, http, libevent, lock, mempool, mempoolrej, net,
+       cmpctblock, coindb, db, http, libevent, lock, mempool, mempoolrej, net,
        partitioncheck, pow, proxy, prune, rand, receiveunsafe, reindex, rpc,
        selectcoins, tor, valuepool, zmq, zrpc, zrpcunsafe (implies zrpc). For
        multiple specific categories use -debug=<category> multiple times.
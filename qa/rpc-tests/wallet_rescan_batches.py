@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# Copyright (c) 2026 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import (
+    assert_equal,
+    get_coinbase_address,
+    start_nodes,
+    wait_and_assert_operationid_status,
+)
+from test_framework.zip317 import conventional_fee
+
+from decimal import Decimal
+
+# Blocks are read and applied to the wallet by a rescan in batches of this
+# many blocks (WALLET_RESCAN_BATCH_BLOCKS).
+RESCAN_BATCH_BLOCKS = 100
+
+# Check that a rescan triggered by a key import finds notes and transparent
+# outputs that were mined in several different rescan batches, and that
+# blocks mined straight afterwards still reach the wallet.
+class WalletRescanBatchesTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.num_nodes = 3
+        self.cache_behavior = 'sprout'
+
+    def setup_nodes(self):
+        return start_nodes(self.num_nodes, self.options.tmpdir, extra_args=[[
+            '-allowdeprecated=getnewaddress',
+            '-allowdeprecated=z_getnewaddress',
+            '-allowdeprecated=z_getbalance',
+        ]] * self.num_nodes)
+
+    def run_test(self):
+        taddr0 = get_coinbase_address(self.nodes[0])
+        saplingAddr1 = self.nodes[1].z_getnewaddress('sapling')
+        taddr1 = self.nodes[1].getnewaddress()
+
+        # Pay node 1's Sapling address in blocks that are more than a batch
+        # apart, so that a rescan from genesis meets each payment in a
+        # different batch.
+        fee = conventional_fee(3)
+        amount = Decimal('10') - fee
+        txids = []
+        for _ in range(3):
+            recipients = [{"address": saplingAddr1, "amount": amount}]
+            myopid = self.nodes[0].z_sendmany(taddr0, recipients, 1, fee, 'AllowRevealedSenders')
+            txids.append(wait_and_assert_operationid_status(self.nodes[0], myopid))
+            self.sync_all()
+            self.nodes[0].generate(RESCAN_BATCH_BLOCKS + 20)
+            self.sync_all()
+
+        # Node 1 moves some of its funds to a transparent address, in a
+        # block that falls in a later batch again.
+        recipients = [{"address": taddr1, "amount": Decimal('5')}]
+        myopid = self.nodes[1].z_sendmany(saplingAddr1, recipients, 1, conventional_fee(3), 'AllowRevealedRecipients')
+        txids.append(wait_and_assert_operationid_status(self.nodes[1], myopid))
+        self.sync_all()
+        self.nodes[0].generate(RESCAN_BATCH_BLOCKS + 20)
+        self.sync_all()
+
+        # The rescan covers more than five batches.
+        assert(self.nodes[2].getblockcount() > 5 * RESCAN_BATCH_BLOCKS)
+
+        expected = sorted(
+            (note['txid'], note['amount'], note['blockheight'])
+            for note in self.nodes[1].z_listreceivedbyaddress(saplingAddr1))
+        assert(len(expected) >= 3)
+
+        # Import node 1's keys into node 2, which rescans from genesis.
+        self.nodes[2].z_importkey(self.nodes[1].z_exportkey(saplingAddr1), 'yes')
+        self.nodes[2].importprivkey(self.nodes[1].dumpprivkey(taddr1), '', True)
+
+        assert_equal(
+            sorted(
+                (note['txid'], note['amount'], note['blockheight'])
+                for note in self.nodes[2].z_listreceivedbyaddress(saplingAddr1)),
+            expected)
+        assert_equal(
+            self.nodes[2].z_getbalance(saplingAddr1),
+            self.nodes[1].z_getbalance(saplingAddr1))
+        unspent = self.nodes[2].listunspent(1, 9999999, [taddr1])
+        assert_equal([(u['txid'], u['amount']) for u in unspent], [(txids[3], Decimal('5'))])
+
+        # Blocks mined after the rescan are still given to node 2's wallet.
+        recipients = [{"address": saplingAddr1, "amount": amount}]
+        myopid = self.nodes[0].z_sendmany(taddr0, recipients, 1, fee, 'AllowRevealedSenders')
+        txid = wait_and_assert_operationid_status(self.nodes[0], myopid)
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+        assert(txid in [note['txid'] for note in self.nodes[2].z_listreceivedbyaddress(saplingAddr1)])
+
+if __name__ == '__main__':
+    WalletRescanBatchesTest().main()
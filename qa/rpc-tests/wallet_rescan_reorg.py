@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+# Copyright (c) 2026 The Zcash developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php .
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import (
+    assert_equal,
+    get_coinbase_address,
+    get_rpc_proxy,
+    start_nodes,
+    wait_and_assert_operationid_status,
+)
+from test_framework.zip317 import conventional_fee
+
+from decimal import Decimal
+import threading
+
+# Blocks are read and applied to the wallet by a rescan in batches of this
+# many blocks (WALLET_RESCAN_BATCH_BLOCKS).
+RESCAN_BATCH_BLOCKS = 100
+
+class ImportKeyThread(threading.Thread):
+    def __init__(self, node, key):
+        threading.Thread.__init__(self)
+        self.key = key
+        # create a new connection to the node, we can't use the same
+        # connection from two threads
+        self.node = get_rpc_proxy(node.url, 2, timeout=600)
+
+    def run(self):
+        self.node.z_importkey(self.key, 'yes')
+
+# Check that a wallet whose rescan overlaps a reorg of the blocks it has been
+# notified of ends up at the same block as the wallet notifier, finds the
+# notes in the new chain, and can spend them.
+class WalletRescanReorgTest(BitcoinTestFramework):
+
+    def __init__(self):
+        super().__init__()
+        self.num_nodes = 3
+        self.cache_behavior = 'sprout'
+
+    def setup_nodes(self):
+        return start_nodes(self.num_nodes, self.options.tmpdir, extra_args=[[
+            '-allowdeprecated=z_getnewaddress',
+            '-allowdeprecated=z_getbalance',
+        ]] * self.num_nodes)
+
+    def run_test(self):
+        taddr0 = get_coinbase_address(self.nodes[0])
+        saplingAddr1 = self.nodes[1].z_getnewaddress('sapling')
+
+        fee = conventional_fee(3)
+        amount = Decimal('10') - fee
+
+        # Pay node 1's Sapling address, then mine enough blocks on top that
+        # a rescan from genesis takes several batches.
+        recipients = [{"address": saplingAddr1, "amount": amount}]
+        myopid = self.nodes[0].z_sendmany(taddr0, recipients, 1, fee, 'AllowRevealedSenders')
+        wait_and_assert_operationid_status(self.nodes[0], myopid)
+        self.sync_all()
+        self.nodes[0].generate(8 * RESCAN_BATCH_BLOCKS)
+        self.sync_all()
+
+        # Pay it again in a block that is about to be reorged out, with two
+        # blocks on top of it.
+        myopid = self.nodes[0].z_sendmany(taddr0, recipients, 1, fee, 'AllowRevealedSenders')
+        txid = wait_and_assert_operationid_status(self.nodes[0], myopid)
+        self.sync_all()
+        self.nodes[0].generate(3)
+        self.sync_all()
+        reorgedHash = self.nodes[2].getblockhash(self.nodes[2].getblockcount() - 2)
+        assert(txid in self.nodes[2].getblock(reorgedHash)['tx'])
+
+        # Import node 1's key into node 2, and while it rescans, replace the
+        # last three blocks with a longer chain on node 2. Node 2's wallet
+        # notifier has delivered the blocks being reorged out, and is held
+        # off until the rescan is done.
+        thr = ImportKeyThread(self.nodes[2], self.nodes[1].z_exportkey(saplingAddr1))
+        thr.start()
+        self.nodes[2].invalidateblock(reorgedHash)
+        self.nodes[2].generate(4)
+        if not thr.is_alive():
+            print("Warning: the rescan finished before the reorg")
+        thr.join()
+
+        # The other nodes follow node 2's chain, in which the second payment
+        # was mined again from node 2's mempool.
+        self.sync_all()
+        assert(reorgedHash != self.nodes[0].getblockhash(self.nodes[0].getblockcount() - 3))
+
+        expected = sorted(
+            (note['txid'], note['amount'], note['blockheight'])
+            for note in self.nodes[1].z_listreceivedbyaddress(saplingAddr1))
+        assert_equal(len(expected), 2)
+        assert(txid in [note[0] for note in expected])
+        assert_equal(
+            sorted(
+                (note['txid'], note['amount'], note['blockheight'])
+                for note in self.nodes[2].z_listreceivedbyaddress(saplingAddr1)),
+            expected)
+        assert_equal(
+            self.nodes[2].z_getbalance(saplingAddr1),
+            self.nodes[1].z_getbalance(saplingAddr1))
+
+        # Node 2's witnesses for the notes are usable, so it can spend both.
+        spendFee = conventional_fee(4)
+        recipients = [{"address": taddr0, "amount": 2 * amount - spendFee}]
+        myopid = self.nodes[2].z_sendmany(saplingAddr1, recipients, 1, spendFee, 'AllowRevealedRecipients')
+        spendTxid = wait_and_assert_operationid_status(self.nodes[2], myopid)
+        self.sync_all()
+        self.nodes[0].generate(1)
+        self.sync_all()
+        assert_equal(self.nodes[2].gettransaction(spendTxid)['confirmations'], 1)
+        assert_equal(self.nodes[2].z_getbalance(saplingAddr1), Decimal('0'))
+
+if __name__ == '__main__':
+    WalletRescanReorgTest().main()
@@ -7,6 +7,7 @@
 
 #include "primitives/transaction.h"
 #include "hash.h"
+#include "memusage.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "random.h"
@@ -284,3 +285,63 @@ void CRollingBloomFilter::initialize()
     nGeneration = 1;
     std::fill(data.begin(), data.end(), 0);
 }
+
+void CBlockedBloomFilter::Reset(size_t nCapacityIn)
+{
+    nCapacity = std::max(nCapacityIn, (size_t)1);
+    size_t nBlocks = (nCapacity * BITS_PER_ENTRY + 511) / 512;
+    std::vector<uint64_t>(nBlocks * WORDS_PER_BLOCK, 0).swap(data);
+    nEntries = 0;
+    k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    k2 = GetRand(std::numeric_limits<uint64_t>::max());
+    k3 = GetRand(std::numeric_limits<uint64_t>::max());
+}
+
+uint64_t* CBlockedBloomFilter::Block(uint64_t h)
+{
+    size_t nBlocks = data.size() / WORDS_PER_BLOCK;
+    return &data[((h >> 32) * nBlocks >> 32) * WORDS_PER_BLOCK];
+}
+
+const uint64_t* CBlockedBloomFilter::Block(uint64_t h) const
+{
+    size_t nBlocks = data.size() / WORDS_PER_BLOCK;
+    return &data[((h >> 32) * nBlocks >> 32) * WORDS_PER_BLOCK];
+}
+
+/* The block is chosen by the upper half of one hash, and each probe takes the
+ * next 9 bits of a second, independently salted hash as a bit index within
+ * the block. */
+void CBlockedBloomFilter::insert(const uint256& key)
+{
+    if (data.empty()) {
+        Reset(1 << 16);
+    }
+    uint64_t* block = Block(SipHashUint256(k0, k1, key));
+    uint64_t h = SipHashUint256(k2, k3, key);
+    for (unsigned int i = 0; i < NUM_PROBES; i++, h >>= 9) {
+        block[(h >> 6) & 7] |= ((uint64_t)1) << (h & 0x3F);
+    }
+    nEntries++;
+}
+
+bool CBlockedBloomFilter::contains(const uint256& key) const
+{
+    if (data.empty()) {
+        return false;
+    }
+    const uint64_t* block = Block(SipHashUint256(k0, k1, key));
+    uint64_t h = SipHashUint256(k2, k3, key);
+    for (unsigned int i = 0; i < NUM_PROBES; i++, h >>= 9) {
+        if (!((block[(h >> 6) & 7] >> (h & 0x3F)) & 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t CBlockedBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(data);
+}
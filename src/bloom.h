@@ -146,4 +146,48 @@ private:
     int nHashFuncs;
 };
 
+/**
+ * A bloom filter over uint256 keys that is split into 512-bit blocks, so that
+ * every lookup touches a single cache line. It is meant as an in-memory front
+ * end for large on-disk sets of uniformly distributed keys (such as
+ * nullifiers), sized at 16 bits per entry for a false positive rate of
+ * around 0.1%. Keys are hashed with a random salt, so that the false
+ * positives differ between nodes.
+ *
+ * Entries cannot be removed; once more than the capacity has been inserted,
+ * the false positive rate degrades and the filter should be rebuilt.
+ */
+class CBlockedBloomFilter
+{
+public:
+    CBlockedBloomFilter() : nEntries(0), nCapacity(0), k0(0), k1(0), k2(0), k3(0) {}
+
+    //! Clear the filter and size it for nCapacityIn entries.
+    void Reset(size_t nCapacityIn);
+
+    void insert(const uint256& key);
+    bool contains(const uint256& key) const;
+
+    //! Number of insertions since the last Reset.
+    size_t size() const { return nEntries; }
+    size_t capacity() const { return nCapacity; }
+    bool IsFull() const { return nEntries > nCapacity; }
+
+    size_t DynamicMemoryUsage() const;
+
+private:
+    static const unsigned int BITS_PER_ENTRY = 16;
+    static const unsigned int WORDS_PER_BLOCK = 8;
+    static const unsigned int NUM_PROBES = 7;
+
+    std::vector<uint64_t> data;
+    size_t nEntries;
+    size_t nCapacity;
+    //! Salts of the block hash (k0, k1) and of the probe hash (k2, k3)
+    uint64_t k0, k1, k2, k3;
+
+    uint64_t* Block(uint64_t h);
+    const uint64_t* Block(uint64_t h) const;
+};
+
 #endif // BITCOIN_BLOOM_H
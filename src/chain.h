@@ -183,6 +183,12 @@ enum BlockStatus: uint32_t {
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_ACTIVATES_UPGRADE  =   128, //! block activates a network upgrade
+
+    //! The chain state was loaded from a snapshot taken at this block. The
+    //! blocks below it have not been validated here yet, and until they are
+    //! this block's nTx and value fields hold the totals for the whole chain
+    //! up to it.
+    BLOCK_SNAPSHOT_BASE      =   256,
 };
 
 //! Short-hand for the highest consensus validity we implement.
@@ -338,6 +338,12 @@ public:
                             //   (total number of tx * 48 * 24) / checkpoint block height
         };
 
+        // Chain state snapshots that loadtxoutset will accept, keyed by the
+        // hash of the snapshot's base block. Entries are produced with
+        // contrib/devtools/utxo_snapshot.sh and independently reproduced
+        // before merging; see doc/release-process.md.
+        mapAssumeutxo = {};
+
         // Hardcoded fallback value for the Sprout shielded value pool balance
         // for nodes that have not reindexed since the introduction of monitoring
         // in #2795.
@@ -655,6 +661,9 @@ public:
             715          //   total number of tx / (checkpoint block height / (24 * 24))
         };
 
+        // Chain state snapshots that loadtxoutset will accept; see mainnet.
+        mapAssumeutxo = {};
+
         // Hardcoded fallback value for the Sprout shielded value pool balance
         // for nodes that have not reindexed since the introduction of monitoring
         // in #2795.
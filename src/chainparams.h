@@ -35,6 +35,18 @@ struct CCheckpointData {
     double fTransactionsPerDay;
 };
 
+/**
+ * A chain state snapshot that this release is willing to load, identified by
+ * the hash of the block it was taken at.
+ */
+struct CAssumeutxoData {
+    int nHeight;
+    //! Hash of the snapshot metadata and records, as reported by dumptxoutset.
+    uint256 hashSnapshot;
+};
+
+typedef std::map<uint256, CAssumeutxoData> MapAssumeutxo;
+
 /**
  * CChainParams defines various tweakable parameters of a given instance of the
  * Bitcoin system. There are three: the main network on which people trade goods
@@ -100,6 +112,7 @@ public:
     }
     const std::vector<SeedSpec6>& FixedSeeds() const { return vFixedSeeds; }
     const CCheckpointData& Checkpoints() const { return checkpointData; }
+    const MapAssumeutxo& Assumeutxo() const { return mapAssumeutxo; }
     /** Return the founder's reward address and script for a given block height */
     std::string GetFoundersRewardAddressAtHeight(int height) const;
     CScript GetFoundersRewardScriptAtHeight(int height) const;
@@ -126,6 +139,7 @@ protected:
     bool fMineBlocksOnDemand = false;
     bool fTestnetToBeDeprecatedFieldRPC = false;
     CCheckpointData checkpointData;
+    MapAssumeutxo mapAssumeutxo;
     std::vector<std::string> vFoundersRewardAddress;
 
     CAmount nSproutValuePoolCheckpointHeight = 0;
@@ -7,6 +7,11 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <deque>
+#include <memory>
 #include <vector>
 
 #include <boost/thread/condition_variable.hpp>
@@ -18,157 +23,349 @@
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+class CCheckQueuePool;
+
+/**
+ * Type-erased interface through which a CCheckQueuePool's worker threads
+ * pull work from the queues attached to it.
+ */
+class CCheckQueueBase
+{
+public:
+    virtual ~CCheckQueueBase() {}
+
+    /**
+     * Claim one batch of checks, preferring the given worker slot and
+     * stealing from the other slots if it is empty, and run it. Returns
+     * false if there was no queued work to claim.
+     */
+    virtual bool RunBatch(unsigned int nSlot) = 0;
+};
+
+/**
+ * A pool of worker threads shared by one or more CCheckQueues.
+ *
+ * Workers sleep only when no attached queue has unclaimed checks, so the
+ * pool mutex is taken when a worker goes idle or when work is added while
+ * some worker is idle, rather than for every batch.
+ */
+class CCheckQueuePool
+{
+public:
+    //! Maximum number of queues that may share a pool.
+    static constexpr unsigned int MAX_QUEUES = 8;
+
+private:
+    template <typename T>
+    friend class CCheckQueue;
+
+    //! Protects the sleeping state of the workers and masters.
+    boost::mutex mutex;
+
+    //! Worker threads block on this when out of work.
+    boost::condition_variable condWorker;
+
+    //! The queues serviced by this pool.
+    std::array<std::atomic<CCheckQueueBase*>, MAX_QUEUES> queues;
+
+    //! Number of checks that have been added to an attached queue but not yet claimed.
+    std::atomic<unsigned int> nPending;
+
+    //! The number of workers that are idle.
+    std::atomic<int> nIdle;
+
+    //! The total number of worker threads that have joined the pool.
+    std::atomic<unsigned int> nWorkers;
+
+    void Attach(CCheckQueueBase* queue)
+    {
+        for (auto& slot : queues) {
+            CCheckQueueBase* expected = nullptr;
+            if (slot.compare_exchange_strong(expected, queue)) return;
+        }
+        assert(!"CCheckQueuePool: too many queues attached");
+    }
+
+    void Detach(CCheckQueueBase* queue)
+    {
+        for (auto& slot : queues) {
+            CCheckQueueBase* expected = queue;
+            if (slot.compare_exchange_strong(expected, nullptr)) return;
+        }
+    }
+
+    /**
+     * Wake an idle worker, if there is one, after checks have been made
+     * available. A worker that finds more work than it takes wakes the next
+     * one, so bursts of additions do not wake every worker at once.
+     */
+    void NotifyPending()
+    {
+        if (nIdle > 0) {
+            // Taking the mutex orders this notification after any worker
+            // that has checked nPending but not yet started to wait.
+            { boost::unique_lock<boost::mutex> lock(mutex); }
+            condWorker.notify_one();
+        }
+    }
+
+public:
+    CCheckQueuePool() : nPending(0), nIdle(0), nWorkers(0)
+    {
+        for (auto& slot : queues) {
+            slot = nullptr;
+        }
+    }
+
+    CCheckQueuePool(const CCheckQueuePool&) = delete;
+    CCheckQueuePool& operator=(const CCheckQueuePool&) = delete;
+
+    //! Worker thread. Runs until interrupted.
+    void Thread()
+    {
+        // Slot 0 of each queue belongs to its master.
+        const unsigned int nSlot = ++nWorkers;
+        while (true) {
+            bool fFound = false;
+            for (auto& slot : queues) {
+                CCheckQueueBase* queue = slot.load();
+                if (queue != nullptr && queue->RunBatch(nSlot)) {
+                    fFound = true;
+                }
+            }
+            if (!fFound) {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nIdle++;
+                try {
+                    while (nPending == 0) {
+                        condWorker.wait(lock); // wait
+                    }
+                } catch (...) {
+                    nIdle--;
+                    throw;
+                }
+                nIdle--;
+            }
+        }
+    }
+
+    //! The number of worker threads that have joined the pool.
+    unsigned int WorkerCount() const
+    {
+        return nWorkers;
+    }
+};
+
+/**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
   *
   * One thread (the master) is assumed to push batches of verifications
-  * onto the queue, where they are processed by N-1 worker threads. When
-  * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
+  * onto the queue, where they are processed by the worker threads of a
+  * CCheckQueuePool. When the master is done adding work, it temporarily
+  * joins the workers, until all jobs are done.
+  *
+  * Queued checks are spread across per-worker deques. Each worker takes
+  * batches from the back of its own deque, and steals from the front of the
+  * others once its own is empty, so workers rarely contend for the same lock.
+  *
+  * A queue constructed without a pool owns a private one, whose workers are
+  * started by calling Thread().
   */
 template <typename T>
-class CCheckQueue
+class CCheckQueue : public CCheckQueueBase
 {
 private:
-    //! Mutex to protect the inner state
-    boost::mutex mutex;
+    //! Number of per-worker deques. Slot 0 is used by the master; if there
+    //! are more workers than slots, some of them share a slot.
+    static constexpr unsigned int NUM_SLOTS = 64;
 
-    //! Worker threads block on this when out of work
-    boost::condition_variable condWorker;
+    struct alignas(64) Slot {
+        boost::mutex mutex;
+        std::deque<T> checks;
+        //! Unsynchronized hint of checks.size(), to skip empty slots when stealing.
+        std::atomic<size_t> nSize{0};
+    };
 
-    //! Master thread blocks on this when out of work
-    boost::condition_variable condMaster;
+    //! The pool this queue is attached to, if it was not given one.
+    std::unique_ptr<CCheckQueuePool> ownedPool;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The pool whose workers process this queue.
+    CCheckQueuePool* const pool;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The per-worker deques of elements to be processed.
+    std::array<Slot, NUM_SLOTS> slots;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! Master thread blocks on this (with the pool mutex) when out of work.
+    boost::condition_variable condMaster;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
+
+    //! Number of verifications that are queued and not yet claimed by a worker.
+    std::atomic<unsigned int> nQueued;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! Next slot to receive added checks.
+    unsigned int nNextSlot;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
-    /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    //! Move up to nMax checks from the given slot into vChecks.
+    size_t Take(Slot& slot, std::vector<T>& vChecks, size_t nMax, bool fSteal)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        boost::unique_lock<boost::mutex> lock(slot.mutex);
+        size_t nSize = slot.checks.size();
+        if (nSize == 0) return 0;
+        size_t nNow = std::min(nMax, fSteal ? std::max<size_t>(1, nSize / 2) : nSize);
+        vChecks.resize(nNow);
+        for (size_t i = 0; i < nNow; i++) {
+            // We want the lock on the mutex to be as short as possible, so swap jobs from the slot
+            // to the local batch vector instead of copying.
+            if (fSteal) {
+                vChecks[i].swap(slot.checks.front());
+                slot.checks.pop_front();
+            } else {
+                vChecks[i].swap(slot.checks.back());
+                slot.checks.pop_back();
+            }
+        }
+        slot.nSize = slot.checks.size();
+        // Update the counters while still holding the slot lock, so that
+        // they never claim that checks are available when they are not.
+        nQueued -= nNow;
+        pool->nPending -= nNow;
+        return nNow;
+    }
+
+    bool RunBatch(unsigned int nWorker) override
+    {
+        if (nQueued == 0) return false;
+
+        const unsigned int nSlot = nWorker % NUM_SLOTS;
         std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+        size_t nNow = Take(slots[nSlot], vChecks, nBatchSize, false);
+        for (unsigned int i = 1; nNow == 0 && i < NUM_SLOTS; i++) {
+            Slot& victim = slots[(nSlot + i) % NUM_SLOTS];
+            if (victim.nSize > 0) {
+                nNow = Take(victim, vChecks, nBatchSize, true);
             }
-            // execute work
-            for (T& check : vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while (true);
+        }
+        if (nNow == 0) return false;
+        if (pool->nPending >= nNow) pool->NotifyPending();
+
+        // Check whether we need to do work at all
+        bool fOk = fAllOk;
+        // execute work
+        for (T& check : vChecks)
+            if (fOk)
+                fOk = check();
+        // Destroy the checks before reporting them as done, so that the
+        // master does not return while they are still being cleaned up.
+        vChecks.clear();
+        if (!fOk)
+            fAllOk = false;
+        if (nTodo.fetch_sub(nNow) == nNow) {
+            // We processed the last element; inform the master it can exit and return the result
+            boost::unique_lock<boost::mutex> lock(pool->mutex);
+            condMaster.notify_one();
+        }
+        return true;
     }
 
 public:
     //! Mutex to ensure only one concurrent CCheckQueueControl
     boost::mutex ControlMutex;
 
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue, with its own private worker pool
+    CCheckQueue(unsigned int nBatchSizeIn) :
+        ownedPool(new CCheckQueuePool()), pool(ownedPool.get()),
+        fAllOk(true), nTodo(0), nQueued(0), nNextSlot(0), nBatchSize(nBatchSizeIn)
+    {
+        pool->Attach(this);
+    }
+
+    //! Create a new check queue, processed by the workers of a shared pool
+    CCheckQueue(unsigned int nBatchSizeIn, CCheckQueuePool* poolIn) :
+        pool(poolIn),
+        fAllOk(true), nTodo(0), nQueued(0), nNextSlot(0), nBatchSize(nBatchSizeIn)
+    {
+        pool->Attach(this);
+    }
+
+    CCheckQueue(const CCheckQueue&) = delete;
+    CCheckQueue& operator=(const CCheckQueue&) = delete;
 
-    //! Worker thread
+    //! Worker thread (for the pool that this queue is attached to)
     void Thread()
     {
-        Loop();
+        pool->Thread();
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        while (true) {
+            if (RunBatch(0)) continue;
+
+            boost::unique_lock<boost::mutex> lock(pool->mutex);
+            if (nTodo == 0) {
+                bool fRet = fAllOk;
+                // reset the status for new work later
+                fAllOk = true;
+                // return the current status
+                return fRet;
+            }
+            if (nQueued == 0) {
+                condMaster.wait(lock); // wait
+            }
+        }
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        for (T& check : vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty()) return;
+
+        // Hand the checks to the slots of the workers that are running (plus
+        // the master's) in turn. Small additions go to a single slot, and
+        // are spread out by stealing; only additions larger than a batch
+        // are split up front.
+        const unsigned int nActive = std::min(pool->WorkerCount() + 1, NUM_SLOTS);
+        const size_t nChunk = std::max<size_t>(nBatchSize, (vChecks.size() + nActive - 1) / nActive);
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        for (size_t nStart = 0; nStart < vChecks.size(); nStart += nChunk) {
+            Slot& slot = slots[nNextSlot];
+            nNextSlot = (nNextSlot + 1) % nActive;
+            size_t nEnd = std::min(vChecks.size(), nStart + nChunk);
+            boost::unique_lock<boost::mutex> lock(slot.mutex);
+            for (size_t i = nStart; i < nEnd; i++) {
+                slot.checks.emplace_back();
+                vChecks[i].swap(slot.checks.back());
+            }
+            slot.nSize = slot.checks.size();
+            nQueued += nEnd - nStart;
+            pool->nPending += nEnd - nStart;
+        }
+        pool->NotifyPending();
     }
 
     ~CCheckQueue()
     {
+        pool->Detach(this);
     }
 
 };
 
-/** 
+/**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
  */
@@ -84,9 +84,12 @@ bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins,
                             historyCacheMap, cacheSaplingSubtrees, cacheOrchardSubtrees);
 }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStats(stats); }
+bool CCoinsViewBacked::GetNullifierFilterStats(CNullifierFilterStats &stats) const { return base->GetNullifierFilterStats(stats); }
 
 SaltedTxidHasher::SaltedTxidHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
+SaltedOutpointHasher::SaltedOutpointHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
 CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
 
 CCoinsViewCache::~CCoinsViewCache()
@@ -117,12 +120,13 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
     tmp.swap(ret->second.coins);
+    ret->second.StartTracking();
     if (ret->second.coins.IsPruned()) {
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
-    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
+    cachedCoinsUsage += ret->second.DynamicMemoryUsage();
     return ret;
 }
 
@@ -242,6 +246,13 @@ HistoryNode CCoinsViewCache::GetHistoryAt(uint32_t epochId, HistoryIndex index)
         return historyCache.appends[index];
     }
 
+    // Nodes below updateDepth that are still in appends were taken by an
+    // incremental flush that the base may not have written yet.
+    auto it = historyCache.appends.find(index);
+    if (it != historyCache.appends.end()) {
+        return it->second;
+    }
+
     return base->GetHistoryAt(epochId, index);
 }
 
@@ -736,8 +747,8 @@ void CCoinsViewCache::SetNullifiers(const CTransaction& tx, bool spent) {
             ret.first->second.flags |= CNullifiersCacheEntry::DIRTY;
         }
     }
-    for (const auto& spendDescription : tx.GetSaplingSpends()) {
-        std::pair<CNullifiersMap::iterator, bool> ret = cacheSaplingNullifiers.insert(std::make_pair(uint256::FromRawBytes(spendDescription.nullifier()), CNullifiersCacheEntry()));
+    for (const uint256& nf : tx.GetSaplingBundle().GetNullifiers()) {
+        std::pair<CNullifiersMap::iterator, bool> ret = cacheSaplingNullifiers.insert(std::make_pair(nf, CNullifiersCacheEntry()));
         ret.first->second.entered = spent;
         ret.first->second.flags |= CNullifiersCacheEntry::DIRTY;
     }
@@ -762,6 +773,7 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
     size_t cachedCoinUsage = 0;
     if (ret.second) {
+        ret.first->second.StartTracking();
         if (!base->GetCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
             ret.first->second.coins.Clear();
@@ -771,7 +783,7 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
         }
     } else {
-        cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
+        cachedCoinUsage = ret.first->second.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
@@ -838,6 +850,14 @@ void CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     hashBlock = hashBlockIn;
 }
 
+void CCoinsViewCache::ResetBest() {
+    assert(cacheCoins.empty());
+    hashBlock.SetNull();
+    hashSproutAnchor.SetNull();
+    hashSaplingAnchor.SetNull();
+    hashOrchardAnchor.SetNull();
+}
+
 void BatchWriteNullifiers(CNullifiersMap &mapNullifiers, CNullifiersMap &cacheNullifiers)
 {
     for (CNullifiersMap::iterator child_it = mapNullifiers.begin(); child_it != mapNullifiers.end();) {
@@ -947,7 +967,8 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
                     assert(it->second.flags & CCoinsCacheEntry::FRESH);
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
                     entry.coins.swap(it->second.coins);
-                    cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
+                    entry.StopTracking();
+                    cachedCoinsUsage += entry.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
                 }
             } else {
@@ -955,14 +976,15 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
-                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
+                    cachedCoinsUsage -= itUs->second.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
-                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
+                    cachedCoinsUsage -= itUs->second.DynamicMemoryUsage();
                     itUs->second.coins.swap(it->second.coins);
-                    cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    itUs->second.MergeTrackingFrom(it->second);
+                    cachedCoinsUsage += itUs->second.DynamicMemoryUsage();
                 }
             }
         }
@@ -1023,6 +1045,103 @@ bool CCoinsViewCache::Flush() {
     return fOk;
 }
 
+template<typename Map>
+static void SnapshotDirtyEntries(Map &cache, Map &snapshot)
+{
+    typedef typename Map::mapped_type MapEntry;
+    for (auto& entry : cache) {
+        if (entry.second.flags & MapEntry::DIRTY) {
+            snapshot.insert(entry);
+            entry.second.flags &= ~MapEntry::DIRTY;
+        }
+    }
+}
+
+void CCoinsViewCache::Snapshot(CCoinsCacheSnapshot &snapshot) {
+    assert(!hasModifier);
+    cacheSaplingSubtrees.Initialize(base);
+    cacheOrchardSubtrees.Initialize(base);
+
+    for (auto& entry : cacheCoins) {
+        if (entry.second.flags & CCoinsCacheEntry::DIRTY) {
+            snapshot.cacheCoins.insert(entry);
+            // Once the snapshot is written the base has this entry, even if
+            // it is pruned; keep it cached so that the base isn't consulted
+            // for it before then.
+            entry.second.flags = 0;
+            entry.second.StartTracking();
+        }
+    }
+    ::SnapshotDirtyEntries(cacheSproutAnchors, snapshot.cacheSproutAnchors);
+    ::SnapshotDirtyEntries(cacheSaplingAnchors, snapshot.cacheSaplingAnchors);
+    ::SnapshotDirtyEntries(cacheOrchardAnchors, snapshot.cacheOrchardAnchors);
+    ::SnapshotDirtyEntries(cacheSproutNullifiers, snapshot.cacheSproutNullifiers);
+    ::SnapshotDirtyEntries(cacheSaplingNullifiers, snapshot.cacheSaplingNullifiers);
+    ::SnapshotDirtyEntries(cacheOrchardNullifiers, snapshot.cacheOrchardNullifiers);
+
+    // Only epochs whose history changed are written. Their nodes stay in
+    // appends, so that they are served from here until SnapshotWritten().
+    for (auto& entry : historyCacheMap) {
+        HistoryCache& historyCache = entry.second;
+        if (historyCache.updateDepth < historyCache.length ||
+            historyCache.length != base->GetHistoryLength(entry.first)) {
+            snapshot.historyCacheMap.insert(entry);
+            historyCache.updateDepth = historyCache.length;
+        }
+    }
+    // The subtree caches only hold the subtrees that are not in the base
+    // yet, which SnapshotWritten() drops once they have been written.
+    snapshot.cacheSaplingSubtrees = cacheSaplingSubtrees;
+    snapshot.cacheOrchardSubtrees = cacheOrchardSubtrees;
+
+    snapshot.hashBlock = hashBlock;
+    snapshot.hashSproutAnchor = hashSproutAnchor;
+    snapshot.hashSaplingAnchor = hashSaplingAnchor;
+    snapshot.hashOrchardAnchor = hashOrchardAnchor;
+}
+
+bool CCoinsViewCache::WriteSnapshot(CCoinsCacheSnapshot &snapshot) const {
+    return base->BatchWrite(snapshot.cacheCoins,
+                            snapshot.hashBlock,
+                            snapshot.hashSproutAnchor,
+                            snapshot.hashSaplingAnchor,
+                            snapshot.hashOrchardAnchor,
+                            snapshot.cacheSproutAnchors,
+                            snapshot.cacheSaplingAnchors,
+                            snapshot.cacheOrchardAnchors,
+                            snapshot.cacheSproutNullifiers,
+                            snapshot.cacheSaplingNullifiers,
+                            snapshot.cacheOrchardNullifiers,
+                            snapshot.historyCacheMap,
+                            snapshot.cacheSaplingSubtrees,
+                            snapshot.cacheOrchardSubtrees);
+}
+
+void CCoinsViewCache::SnapshotWritten(const CCoinsCacheSnapshot &snapshot) {
+    assert(!hasModifier);
+    for (const auto& written : snapshot.historyCacheMap) {
+        auto it = historyCacheMap.find(written.first);
+        if (it == historyCacheMap.end())
+            continue;
+        // Snapshot() set updateDepth to the written length, and truncations
+        // since have only lowered it, so every node below it is in the base.
+        HistoryCache& historyCache = it->second;
+        for (auto node = historyCache.appends.begin(); node != historyCache.appends.end();) {
+            if (node->first < historyCache.updateDepth) {
+                node = historyCache.appends.erase(node);
+            } else {
+                ++node;
+            }
+        }
+        if (historyCache.updateDepth == historyCache.length &&
+            historyCache.length == written.second.length) {
+            historyCacheMap.erase(it);
+        }
+    }
+    cacheSaplingSubtrees.DropWritten(snapshot.cacheSaplingSubtrees);
+    cacheOrchardSubtrees.DropWritten(snapshot.cacheOrchardSubtrees);
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const {
     return cacheCoins.size();
 }
@@ -1159,19 +1278,48 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx) const
 CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage) {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
+    const CCoins &coins = it->second.coins;
+    if (it->second.fOutputsTracked && !(it->second.flags & CCoinsCacheEntry::FRESH)) {
+        vAvailableBefore.resize(coins.vout.size());
+        for (unsigned int i = 0; i < coins.vout.size(); i++)
+            vAvailableBefore[i] = !coins.vout[i].IsNull();
+    }
+    fCoinBaseBefore = coins.fCoinBase;
+    nHeightBefore = coins.nHeight;
+    nVersionBefore = coins.nVersion;
 }
 
 CCoinsModifier::~CCoinsModifier()
 {
     assert(cache.hasModifier);
     cache.hasModifier = false;
-    it->second.coins.Cleanup();
+    CCoinsCacheEntry &entry = it->second;
+    entry.coins.Cleanup();
+    if (entry.flags & CCoinsCacheEntry::FRESH) {
+        // The parent view does not have this entry, so it will be written out
+        // in full anyway.
+        entry.StopTracking();
+    } else if (entry.fOutputsTracked) {
+        if (entry.coins.fCoinBase != fCoinBaseBefore ||
+            entry.coins.nHeight != nHeightBefore ||
+            entry.coins.nVersion != nVersionBefore) {
+            // The entry was replaced (e.g. by a reorg); rewrite it entirely.
+            entry.StopTracking();
+        } else {
+            size_t nOutputs = std::max(vAvailableBefore.size(), entry.coins.vout.size());
+            for (unsigned int i = 0; i < nOutputs; i++) {
+                bool fBefore = i < vAvailableBefore.size() && vAvailableBefore[i];
+                if (fBefore != entry.coins.IsAvailable(i))
+                    entry.MarkOutputDirty(i);
+            }
+        }
+    }
     cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
         cache.cacheCoins.erase(it);
     } else {
         // If the coin still exists after the modification, add the new usage
-        cache.cachedCoinsUsage += it->second.coins.DynamicMemoryUsage();
+        cache.cachedCoinsUsage += it->second.DynamicMemoryUsage();
     }
 }
 
@@ -1327,3 +1475,37 @@ void SubtreeCache::BatchWrite(CCoinsView *parentView, SubtreeCache &childMap) {
 
     childMap.clear();
 }
+
+void SubtreeCache::DropWritten(const SubtreeCache &written) {
+    if (!initialized || !written.initialized) {
+        return;
+    }
+    // If subtrees were popped from the parent view in the meantime, keep
+    // everything; the next write pops them from the parent.
+    if (parentLatestSubtree.has_value() != written.parentLatestSubtree.has_value() ||
+        (parentLatestSubtree.has_value() &&
+         parentLatestSubtree.value().index != written.parentLatestSubtree.value().index)) {
+        return;
+    }
+
+    // The subtrees that were not popped since are now in the parent view.
+    size_t nWritten = 0;
+    while (nWritten < newSubtrees.size() && nWritten < written.newSubtrees.size() &&
+           newSubtrees[nWritten].root == written.newSubtrees[nWritten].root &&
+           newSubtrees[nWritten].nHeight == written.newSubtrees[nWritten].nHeight) {
+        nWritten++;
+    }
+    if (nWritten == 0) {
+        return;
+    }
+
+    libzcash::SubtreeIndex index;
+    if (parentLatestSubtree.has_value()) {
+        index = parentLatestSubtree.value().index + nWritten;
+    } else {
+        index = nWritten - 1;
+    }
+    const libzcash::SubtreeData& latest = newSubtrees[nWritten - 1];
+    parentLatestSubtree = libzcash::LatestSubtree(index, latest.root, latest.nHeight);
+    newSubtrees.erase(newSubtrees.begin(), newSubtrees.begin() + nWritten);
+}
@@ -245,6 +245,74 @@ public:
     }
 };
 
+/**
+ * A single unspent transaction output, as stored in the per-outpoint
+ * chainstate format (see CCoinsViewDB).
+ *
+ * Serialized format:
+ * - VARINT(nHeight * 2 + fCoinBase)
+ * - VARINT(nVersion)
+ * - the CTxOut (via CTxOutCompressor)
+ *
+ * The transaction metadata is repeated in every output's record, so that
+ * spending one output of a transaction only touches that output's record.
+ */
+class Coin
+{
+public:
+    //! the unspent transaction output
+    CTxOut out;
+
+    //! whether the containing transaction was a coinbase
+    bool fCoinBase;
+
+    //! at which height the containing transaction was included in the active block chain
+    unsigned int nHeight;
+
+    //! version of the containing CTransaction
+    int nVersion;
+
+    Coin() : out(), fCoinBase(false), nHeight(0), nVersion(0) { }
+    Coin(const CCoins &coins, unsigned int nPos) :
+        out(coins.vout[nPos]), fCoinBase(coins.fCoinBase), nHeight(coins.nHeight), nVersion(coins.nVersion) { }
+
+    bool IsSpent() const {
+        return out.IsNull();
+    }
+
+    //! copy this output and its metadata into position nPos of a CCoins
+    void ApplyTo(CCoins &coins, unsigned int nPos) const {
+        if (coins.vout.size() <= nPos)
+            coins.vout.resize(nPos + 1);
+        coins.vout[nPos] = out;
+        coins.fCoinBase = fCoinBase;
+        coins.nHeight = nHeight;
+        coins.nVersion = nVersion;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        assert(!IsSpent());
+        ::Serialize(s, VARINT(nHeight * 2 + (fCoinBase ? 1 : 0)));
+        ::Serialize(s, VARINT(this->nVersion));
+        ::Serialize(s, CTxOutCompressor(REF(out)));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        ::Unserialize(s, VARINT(nCode));
+        nHeight = nCode / 2;
+        fCoinBase = nCode & 1;
+        ::Unserialize(s, VARINT(this->nVersion));
+        ::Unserialize(s, REF(CTxOutCompressor(out)));
+    }
+
+    size_t DynamicMemoryUsage() const {
+        return RecursiveDynamicUsage(out.scriptPubKey);
+    }
+};
+
 class SaltedTxidHasher
 {
 private:
@@ -264,6 +332,20 @@ public:
     }
 };
 
+class SaltedOutpointHasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    SaltedOutpointHasher();
+
+    size_t operator()(const COutPoint& outpoint) const {
+        return SipHashUint256Extra(k0, k1, outpoint.hash, outpoint.n);
+    }
+};
+
 struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
@@ -274,7 +356,47 @@ struct CCoinsCacheEntry
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    // Outputs whose spentness may differ from the parent view. This is only
+    // meaningful when fOutputsTracked is set; otherwise every output of a
+    // DIRTY entry must be assumed to have changed.
+    std::vector<bool> vDirtyOutputs;
+    bool fOutputsTracked;
+
+    CCoinsCacheEntry() : coins(), flags(0), fOutputsTracked(false) {}
+
+    //! Record that the entry was just loaded from the parent view, unmodified.
+    void StartTracking() {
+        vDirtyOutputs.clear();
+        fOutputsTracked = true;
+    }
+
+    //! Give up on per-output tracking; the whole entry will be rewritten.
+    void StopTracking() {
+        std::vector<bool>().swap(vDirtyOutputs);
+        fOutputsTracked = false;
+    }
+
+    void MarkOutputDirty(unsigned int nPos) {
+        if (vDirtyOutputs.size() <= nPos)
+            vDirtyOutputs.resize(nPos + 1, false);
+        vDirtyOutputs[nPos] = true;
+    }
+
+    size_t DynamicMemoryUsage() const {
+        return coins.DynamicMemoryUsage() + memusage::DynamicUsage(vDirtyOutputs);
+    }
+
+    //! Merge the tracked changes of a child cache's entry for the same txid.
+    void MergeTrackingFrom(const CCoinsCacheEntry &child) {
+        if (!fOutputsTracked || !child.fOutputsTracked || (child.flags & FRESH)) {
+            StopTracking();
+            return;
+        }
+        for (unsigned int i = 0; i < child.vDirtyOutputs.size(); i++) {
+            if (child.vDirtyOutputs[i])
+                MarkOutputDirty(i);
+        }
+    }
 };
 
 struct CAnchorsSproutCacheEntry
@@ -358,6 +480,21 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
 };
 
+struct CNullifierFilterStats
+{
+    struct Pool {
+        uint64_t nEntries;
+        uint64_t nCapacity;
+        uint64_t nUsage;
+
+        Pool() : nEntries(0), nCapacity(0), nUsage(0) {}
+    };
+
+    Pool sprout;
+    Pool sapling;
+    Pool orchard;
+};
+
 class SubtreeCache;
 
 /** Abstract view on the open txout dataset. */
@@ -442,6 +579,9 @@ public:
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats) const = 0;
 
+    //! Report on the in-memory nullifier filters, for views that have them
+    virtual bool GetNullifierFilterStats(CNullifierFilterStats &stats) const { return false; }
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -492,6 +632,10 @@ class SubtreeCache {
 
     //! Writes a child map to this cache; this clears the child map.
     void BatchWrite(CCoinsView *parentView, SubtreeCache &childMap);
+
+    //! Drops the new subtrees that `written`, a copy of this cache taken
+    //! earlier, has since written to the parent view.
+    void DropWritten(const SubtreeCache &written);
 };
 
 namespace memusage {
@@ -579,6 +723,7 @@ public:
                     SubtreeCache &cacheSaplingSubtrees,
                     SubtreeCache &cacheOrchardSubtrees);
     bool GetStats(CCoinsStats &stats) const;
+    bool GetNullifierFilterStats(CNullifierFilterStats &stats) const;
 };
 
 
@@ -595,6 +740,10 @@ private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
     size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    std::vector<bool> vAvailableBefore; // Spentness of each output before modification, if tracked
+    bool fCoinBaseBefore;
+    int nHeightBefore;
+    int nVersionBefore;
     CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
@@ -614,6 +763,30 @@ enum class UnsatisfiedShieldedReq {
     OrchardUnknownAnchor,
 };
 
+/**
+ * The dirty state of a CCoinsViewCache, copied out by CCoinsViewCache::Snapshot
+ * so that it can be written to the backing view without access to the cache.
+ */
+struct CCoinsCacheSnapshot
+{
+    CCoinsMap cacheCoins;
+    uint256 hashBlock;
+    uint256 hashSproutAnchor;
+    uint256 hashSaplingAnchor;
+    uint256 hashOrchardAnchor;
+    CAnchorsSproutMap cacheSproutAnchors;
+    CAnchorsSaplingMap cacheSaplingAnchors;
+    CAnchorsOrchardMap cacheOrchardAnchors;
+    CNullifiersMap cacheSproutNullifiers;
+    CNullifiersMap cacheSaplingNullifiers;
+    CNullifiersMap cacheOrchardNullifiers;
+    CHistoryCacheMap historyCacheMap;
+    SubtreeCache cacheSaplingSubtrees;
+    SubtreeCache cacheOrchardSubtrees;
+
+    CCoinsCacheSnapshot() : cacheSaplingSubtrees(SAPLING), cacheOrchardSubtrees(ORCHARD) {}
+};
+
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
 class CCoinsViewCache : public CCoinsViewBacked
 {
@@ -665,6 +838,12 @@ public:
             ShieldedType type,
             libzcash::SubtreeIndex index) const;
     void SetBestBlock(const uint256 &hashBlock);
+    /**
+     * Forget the cached best block and anchors, so that they are read from
+     * the base view again. Only valid just after a flush, when the base has
+     * been changed underneath the cache.
+     */
+    void ResetBest();
     bool BatchWrite(CCoinsMap &mapCoins,
                     const uint256 &hashBlock,
                     const uint256 &hashSproutAnchor,
@@ -740,6 +919,30 @@ public:
      */
     bool Flush();
 
+    /**
+     * Copy the modifications applied to this cache into a snapshot, and mark
+     * them as clean without evicting anything. The cache keeps serving the
+     * copied entries itself, so its base may lag behind until the snapshot
+     * has been written with WriteSnapshot. The cache must not be flushed in
+     * the meantime.
+     */
+    void Snapshot(CCoinsCacheSnapshot &snapshot);
+
+    /**
+     * Push a snapshot taken by Snapshot() to the base. This does not touch
+     * the state of the cache itself, so it may run concurrently with other
+     * uses of the cache as long as the base supports concurrent reads and
+     * writes (as CCoinsViewDB does).
+     */
+    bool WriteSnapshot(CCoinsCacheSnapshot &snapshot) const;
+
+    /**
+     * Called with cs_main held once a snapshot has been written, to drop the
+     * history nodes and subtrees that the base now has. Until then they are
+     * kept, as the base may still be behind.
+     */
+    void SnapshotWritten(const CCoinsCacheSnapshot &snapshot);
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
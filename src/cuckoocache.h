@@ -368,6 +368,17 @@ public:
         return setup(bytes/sizeof(Element));
     }
 
+    /** clear removes every element, leaving the container as it was right
+     * after setup. Not threadsafe.
+     */
+    void clear()
+    {
+        table.assign(size, Element());
+        collection_flags.setup(size);
+        epoch_flags.assign(size, false);
+        epoch_heuristic_counter = epoch_size;
+    }
+
     /** insert loops at most depth_limit times trying to insert a hash
      * at various locations in the table via a variant of the Cuckoo Algorithm
      * with eight hash locations.
@@ -477,6 +488,20 @@ public:
             }
         return false;
     }
+
+    /** for_each calls `f` on every element that hasn't been marked for
+     * garbage collection, in table order. Threadsafe without any concurrent
+     * insert.
+     *
+     * @param f the callable to pass each live element to
+     */
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (uint32_t i = 0; i < size; ++i)
+            if (!collection_flags.bit_is_set(i))
+                f(table[i]);
+    }
 };
 } // namespace CuckooCache
 
@@ -137,6 +137,18 @@ public:
         return piter->value().size();
     }
 
+    //! The serialized key of the current entry, without decoding it.
+    std::vector<unsigned char> GetKeyBytes() {
+        leveldb::Slice slKey = piter->key();
+        return std::vector<unsigned char>(slKey.data(), slKey.data() + slKey.size());
+    }
+
+    //! The serialized value of the current entry, without decoding it.
+    std::vector<unsigned char> GetValueBytes() {
+        leveldb::Slice slValue = piter->value();
+        return std::vector<unsigned char>(slValue.data(), slValue.data() + slValue.size());
+    }
+
 };
 
 class CDBWrapper
@@ -7,6 +7,8 @@
 #include "util/test.h"
 #include "zcash/Proof.hpp"
 
+#include <boost/thread.hpp>
+
 class MockCValidationState : public CValidationState {
 public:
     MOCK_METHOD6(DoS, bool(int level, bool ret,
@@ -83,6 +85,64 @@ TEST(CheckBlock, BlockSproutRejectsBadVersion) {
     EXPECT_FALSE(CheckBlock(block, state, Params(), verifier, false, false, true));
 }
 
+// Test that when several transactions in a block are invalid, CheckBlock
+// reports the first of them whether or not the transactions are checked
+// on the validation threads.
+TEST(CheckBlock, ReportsFirstInvalidTransaction) {
+    SelectParams(CBaseChainParams::MAIN);
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    coinbase.vout[0].nValue = 0;
+
+    CMutableTransaction valid;
+    valid.vin.resize(1);
+    valid.vin[0].prevout = COutPoint(uint256S("0x1"), 0);
+    valid.vout.resize(1);
+    valid.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+    // No outputs.
+    CMutableTransaction noSink = valid;
+    noSink.vout.clear();
+
+    // No inputs.
+    CMutableTransaction noSource = valid;
+    noSource.vin.clear();
+
+    CBlock block;
+    block.vtx.push_back(CTransaction(coinbase));
+    for (int i = 0; i < 8; i++) {
+        valid.vin[0].prevout.n = i;
+        block.vtx.push_back(CTransaction(valid));
+    }
+    block.vtx.push_back(UNSAFE_CTransaction(noSink));
+    block.vtx.push_back(UNSAFE_CTransaction(noSource));
+
+    auto verifier = ProofVerifier::Strict();
+    for (int nThreads : {0, 4}) {
+        nScriptCheckThreads = nThreads;
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++) {
+            threadGroup.create_thread(&ThreadScriptCheck);
+        }
+
+        CValidationState state;
+        int nDoS = 0;
+        EXPECT_FALSE(CheckBlock(block, state, Params(), verifier, false, false, true));
+        EXPECT_TRUE(state.IsInvalid(nDoS));
+        EXPECT_EQ(nDoS, 10);
+        EXPECT_EQ(state.GetRejectReason(), "bad-txns-no-sink-of-funds");
+
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+    nScriptCheckThreads = 0;
+}
+
 
 class ContextualCheckBlockTest : public ::testing::Test {
 protected:
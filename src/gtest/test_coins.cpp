@@ -21,6 +21,7 @@
 
 #include <vector>
 #include <map>
+#include <set>
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -401,7 +402,7 @@ public:
                      memusage::DynamicUsage(cacheSaplingSubtrees) +
                      memusage::DynamicUsage(cacheOrchardSubtrees);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.DynamicMemoryUsage();
         }
         EXPECT_EQ(DynamicMemoryUsage(), ret);
     }
@@ -1203,3 +1204,412 @@ TEST(CoinsTests, SubtreesTest)
     testSubtreesForShieldedType(ORCHARD);
     }
 }
+
+static uint256 AddManyOutputCoins(CCoinsView &base, unsigned int nOutputs)
+{
+    uint256 txid = GetRandHash();
+    CCoinsViewCache cache(&base);
+    {
+        CCoinsModifier coins = cache.ModifyNewCoins(txid);
+        coins->nHeight = 7;
+        coins->nVersion = 4;
+        coins->vout.resize(nOutputs);
+        for (unsigned int i = 0; i < nOutputs; i++) {
+            coins->vout[i].nValue = i + 1;
+            coins->vout[i].scriptPubKey = CScript() << OP_TRUE;
+        }
+    }
+    cache.Flush();
+    return txid;
+}
+
+static void CheckSpentOutputs(CCoinsView &view, const uint256 &txid, unsigned int nOutputs, const std::set<unsigned int> &spent)
+{
+    CCoins coins;
+    ASSERT_TRUE(view.GetCoins(txid, coins));
+    EXPECT_EQ(coins.nHeight, 7);
+    EXPECT_EQ(coins.nVersion, 4);
+    EXPECT_FALSE(coins.fCoinBase);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        EXPECT_EQ(coins.IsAvailable(i), spent.count(i) == 0) << "output " << i;
+        if (coins.IsAvailable(i)) {
+            EXPECT_EQ(coins.vout[i].nValue, CAmount(i + 1));
+        }
+    }
+}
+
+TEST(CoinsTests, PerOutpointCoinsDB)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    CCoinsViewDB db(1 << 23, true);
+    ASSERT_TRUE(db.Upgrade(true));
+    EXPECT_TRUE(db.IsPerOutpoint());
+
+    const unsigned int nOutputs = 300;
+    uint256 txid = AddManyOutputCoins(db, nOutputs);
+    EXPECT_TRUE(db.HaveCoins(txid));
+    EXPECT_FALSE(db.HaveCoins(GetRandHash()));
+    CheckSpentOutputs(db, txid, nOutputs, {});
+
+    // Spending a few outputs only rewrites those outputs' records.
+    {
+        CCoinsViewCache cache(&db);
+        {
+            CCoinsModifier coins = cache.ModifyCoins(txid);
+            EXPECT_TRUE(coins->Spend(5));
+            EXPECT_TRUE(coins->Spend(nOutputs - 1));
+        }
+        cache.Flush();
+    }
+    CheckSpentOutputs(db, txid, nOutputs, {5, nOutputs - 1});
+
+    // Changes tracked in a child cache are merged into its parent.
+    {
+        CCoinsViewCache cache1(&db);
+        CCoinsViewCache cache2(&cache1);
+        {
+            CCoinsModifier coins = cache1.ModifyCoins(txid);
+            EXPECT_TRUE(coins->Spend(0));
+        }
+        {
+            CCoinsModifier coins = cache2.ModifyCoins(txid);
+            EXPECT_TRUE(coins->Spend(1));
+        }
+        cache2.Flush();
+        cache1.Flush();
+    }
+    CheckSpentOutputs(db, txid, nOutputs, {0, 1, 5, nOutputs - 1});
+
+    // Replacing the entry entirely falls back to rewriting every record.
+    {
+        CCoinsViewCache cache(&db);
+        {
+            CCoinsModifier coins = cache.ModifyCoins(txid);
+            coins->Clear();
+        }
+        cache.Flush();
+    }
+    EXPECT_FALSE(db.HaveCoins(txid));
+}
+
+TEST(CoinsTests, PerOutpointCoinsUpgrade)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    CCoinsViewDB db(1 << 23, true);
+    ASSERT_TRUE(db.Upgrade(false));
+    EXPECT_FALSE(db.IsPerOutpoint());
+
+    const unsigned int nOutputs = 20;
+    std::vector<uint256> txids;
+    for (int i = 0; i < 10; i++) {
+        txids.push_back(AddManyOutputCoins(db, nOutputs));
+    }
+    {
+        CCoinsViewCache cache(&db);
+        {
+            CCoinsModifier coins = cache.ModifyCoins(txids[0]);
+            EXPECT_TRUE(coins->Spend(3));
+        }
+        cache.Flush();
+    }
+
+    ASSERT_TRUE(db.Upgrade(true));
+    EXPECT_TRUE(db.IsPerOutpoint());
+    CheckSpentOutputs(db, txids[0], nOutputs, {3});
+    for (unsigned int i = 1; i < txids.size(); i++) {
+        CheckSpentOutputs(db, txids[i], nOutputs, {});
+    }
+
+    // Upgrading again is a no-op, and the format can't be switched back.
+    ASSERT_TRUE(db.Upgrade(false));
+    EXPECT_TRUE(db.IsPerOutpoint());
+    CheckSpentOutputs(db, txids[1], nOutputs, {});
+}
+
+TEST(CoinsTests, SnapshotKeepsCacheWarm)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    CCoinsViewDB db(1 << 23, true);
+    CCoinsViewCache cache(&db);
+
+    uint256 txid = GetRandHash();
+    {
+        CCoinsModifier coins = cache.ModifyNewCoins(txid);
+        coins->nHeight = 7;
+        coins->vout.resize(2);
+        coins->vout[0].nValue = 1;
+        coins->vout[1].nValue = 2;
+    }
+
+    CCoinsCacheSnapshot snapshot;
+    cache.Snapshot(snapshot);
+    EXPECT_EQ(snapshot.cacheCoins.size(), 1U);
+    // The database doesn't have the coins until the snapshot is written,
+    // but the cache still serves them.
+    EXPECT_FALSE(db.HaveCoins(txid));
+    EXPECT_TRUE(cache.HaveCoins(txid));
+    EXPECT_EQ(cache.GetCacheSize(), 1U);
+
+    // Modifications made while the snapshot is in flight are kept.
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txid);
+        EXPECT_TRUE(coins->Spend(0));
+    }
+
+    ASSERT_TRUE(cache.WriteSnapshot(snapshot));
+    CCoins coins;
+    ASSERT_TRUE(db.GetCoins(txid, coins));
+    EXPECT_TRUE(coins.IsAvailable(0));
+    EXPECT_TRUE(coins.IsAvailable(1));
+
+    // A second snapshot only contains the entry modified since the first.
+    CCoinsCacheSnapshot snapshot2;
+    cache.Snapshot(snapshot2);
+    EXPECT_EQ(snapshot2.cacheCoins.size(), 1U);
+    ASSERT_TRUE(cache.WriteSnapshot(snapshot2));
+    ASSERT_TRUE(db.GetCoins(txid, coins));
+    EXPECT_FALSE(coins.IsAvailable(0));
+    EXPECT_TRUE(coins.IsAvailable(1));
+
+    // Nothing is left to write.
+    CCoinsCacheSnapshot snapshot3;
+    cache.Snapshot(snapshot3);
+    EXPECT_TRUE(snapshot3.cacheCoins.empty());
+    EXPECT_TRUE(cache.Flush());
+    ASSERT_TRUE(db.GetCoins(txid, coins));
+    EXPECT_FALSE(coins.IsAvailable(0));
+}
+
+TEST(CoinsTests, SnapshotDropsWrittenSubtrees)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    CCoinsViewDB db(1 << 23, true);
+    CCoinsViewCache cache(&db);
+
+    cache.PushSubtree(SAPLING, RandomSubtree(0));
+    cache.PushSubtree(SAPLING, RandomSubtree(1));
+    CCoinsCacheSnapshot snapshot;
+    cache.Snapshot(snapshot);
+    EXPECT_EQ(snapshot.cacheSaplingSubtrees.newSubtrees.size(), 2U);
+
+    // Changes made while the snapshot is in flight survive its write.
+    cache.PopSubtree(SAPLING);
+    cache.PushSubtree(SAPLING, RandomSubtree(1));
+    cache.PushSubtree(SAPLING, RandomSubtree(2));
+    ASSERT_TRUE(cache.WriteSnapshot(snapshot));
+    cache.SnapshotWritten(snapshot);
+
+    // Only the subtree that was not replaced is dropped from the cache.
+    CCoinsCacheSnapshot snapshot2;
+    cache.Snapshot(snapshot2);
+    EXPECT_EQ(snapshot2.cacheSaplingSubtrees.newSubtrees.size(), 2U);
+    ASSERT_TRUE(cache.WriteSnapshot(snapshot2));
+    cache.SnapshotWritten(snapshot2);
+
+    CCoinsCacheSnapshot snapshot3;
+    cache.Snapshot(snapshot3);
+    EXPECT_TRUE(snapshot3.cacheSaplingSubtrees.newSubtrees.empty());
+    auto latest = cache.GetLatestSubtree(SAPLING);
+    ASSERT_TRUE(latest.has_value());
+    EXPECT_EQ(latest->index, 2U);
+    EXPECT_EQ(latest->nHeight, 2);
+    for (int i = 0; i <= 2; i++) {
+        auto subtree = db.GetSubtreeData(SAPLING, i);
+        ASSERT_TRUE(subtree.has_value());
+        EXPECT_EQ(subtree->nHeight, i);
+    }
+}
+
+TEST(CoinsTests, NullifierFilters)
+{
+    LoadProofParameters();
+    SelectParams(CBaseChainParams::REGTEST);
+    CCoinsViewDB db(1 << 23, true);
+
+    CNullifierFilterStats stats;
+    EXPECT_FALSE(db.GetNullifierFilterStats(stats));
+    ASSERT_TRUE(db.LoadNullifierFilters());
+    ASSERT_TRUE(db.GetNullifierFilterStats(stats));
+    EXPECT_EQ(stats.sapling.nEntries, 0U);
+    EXPECT_GT(stats.sapling.nCapacity, 0U);
+
+    TxWithNullifiers txWithNullifiers;
+    {
+        CCoinsViewCache cache(&db);
+        cache.SetNullifiers(txWithNullifiers.tx, true);
+        cache.SetNullifiers(txWithNullifiers.txV5, true);
+        EXPECT_TRUE(cache.Flush());
+    }
+
+    // Spent nullifiers are added to the filters as they are written.
+    ASSERT_TRUE(db.GetNullifierFilterStats(stats));
+    EXPECT_EQ(stats.sprout.nEntries, 1U);
+    EXPECT_EQ(stats.sapling.nEntries, 1U);
+    EXPECT_EQ(stats.orchard.nEntries, 1U);
+    EXPECT_TRUE(db.GetNullifier(txWithNullifiers.sproutNullifier, SPROUT));
+    EXPECT_TRUE(db.GetNullifier(txWithNullifiers.saplingNullifier, SAPLING));
+    EXPECT_TRUE(db.GetNullifier(txWithNullifiers.orchardNullifier, ORCHARD));
+    EXPECT_FALSE(db.GetNullifier(txWithNullifiers.saplingNullifier, ORCHARD));
+    EXPECT_FALSE(db.GetNullifier(GetRandHash(), SAPLING));
+
+    // Reloading rebuilds the filters from the database.
+    ASSERT_TRUE(db.LoadNullifierFilters());
+    ASSERT_TRUE(db.GetNullifierFilterStats(stats));
+    EXPECT_EQ(stats.sapling.nEntries, 1U);
+    EXPECT_TRUE(db.GetNullifier(txWithNullifiers.saplingNullifier, SAPLING));
+}
+
+template<typename Tree> void anchorDeltasImpl(ShieldedType type)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    CCoinsViewDB db(1 << 23, true);
+
+    // Enough anchors that some are rebuilt from deltas after falling out of
+    // the database's tree cache, with several anchors per flush as during
+    // initial block download.
+    Tree tree;
+    std::vector<Tree> trees;
+    while (trees.size() < ANCHOR_TREE_CACHE_SIZE + 2 * ANCHOR_CHECKPOINT_INTERVAL) {
+        CCoinsViewCacheTest cache(&db);
+        for (int i = 0; i < 3; i++) {
+            AppendRandomLeaf(tree);
+            cache.PushAnchor(tree);
+            trees.push_back(tree);
+        }
+        ASSERT_TRUE(cache.Flush());
+    }
+    EXPECT_EQ(db.GetBestAnchor(type), tree.root());
+
+    for (const Tree &expected : trees) {
+        CCoinsViewCacheTest cache(&db);
+        Tree read;
+        ASSERT_TRUE(GetAnchorAt(cache, expected.root(), read));
+        EXPECT_TRUE(read == expected);
+    }
+
+    // Popping anchors removes them from the database, including the cache.
+    {
+        CCoinsViewCacheTest cache(&db);
+        Tree read;
+        ASSERT_TRUE(GetAnchorAt(cache, tree.root(), read));
+        cache.PopAnchor(trees[trees.size() - 2].root(), type);
+        cache.PopAnchor(trees[trees.size() - 3].root(), type);
+        ASSERT_TRUE(cache.Flush());
+    }
+    {
+        CCoinsViewCacheTest cache(&db);
+        Tree read;
+        EXPECT_FALSE(GetAnchorAt(cache, tree.root(), read));
+        EXPECT_FALSE(GetAnchorAt(cache, trees[trees.size() - 2].root(), read));
+        ASSERT_TRUE(GetAnchorAt(cache, trees[trees.size() - 3].root(), read));
+        EXPECT_TRUE(read == trees[trees.size() - 3]);
+        EXPECT_EQ(db.GetBestAnchor(type), read.root());
+    }
+}
+
+TEST(CoinsTests, AnchorDeltas)
+{
+    LoadProofParameters();
+    {
+        SCOPED_TRACE("Sprout");
+        anchorDeltasImpl<SproutMerkleTree>(SPROUT);
+    }
+    {
+        SCOPED_TRACE("Sapling");
+        anchorDeltasImpl<SaplingMerkleTree>(SAPLING);
+    }
+}
+
+TEST(CoinsTests, ChainstateSnapshot)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    CCoinsViewDB source(1 << 23, true);
+    ASSERT_TRUE(source.Upgrade(true));
+
+    const unsigned int nOutputs = 20;
+    std::vector<uint256> txids;
+    for (int i = 0; i < 5; i++) {
+        txids.push_back(AddManyOutputCoins(source, nOutputs));
+    }
+    uint256 hashBlock = GetRandHash();
+    SaplingMerkleTree tree;
+    std::vector<SaplingMerkleTree> trees;
+    {
+        CCoinsViewCacheTest cache(&source);
+        {
+            CCoinsModifier coins = cache.ModifyCoins(txids[0]);
+            EXPECT_TRUE(coins->Spend(3));
+        }
+        for (int i = 0; i < 10; i++) {
+            AppendRandomLeaf(tree);
+            cache.PushAnchor(tree);
+            trees.push_back(tree);
+        }
+        cache.SetBestBlock(hashBlock);
+        ASSERT_TRUE(cache.Flush());
+    }
+
+    CChainstateSnapshotMetadata metadata;
+    memcpy(metadata.pchMessageStart, Params().MessageStart(), sizeof(metadata.pchMessageStart));
+    metadata.hashBlock = hashBlock;
+    metadata.nHeight = 10;
+    metadata.hashSproutAnchor = source.GetBestAnchor(SPROUT);
+    metadata.hashSaplingAnchor = source.GetBestAnchor(SAPLING);
+    metadata.hashOrchardAnchor = source.GetBestAnchor(ORCHARD);
+
+    fs::path path = fs::temp_directory_path() / fs::unique_path("snapshot-%%%%%%%%.dat");
+    CAutoFile file(fsbridge::fopen(path, "wb+"), SER_DISK, CLIENT_VERSION);
+    ASSERT_FALSE(file.IsNull());
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    file << metadata;
+    hasher << metadata;
+    uint64_t nRecords;
+    ASSERT_TRUE(source.DumpSnapshot(&file, hasher, nRecords));
+    EXPECT_GE(nRecords, txids.size() + trees.size());
+    uint256 hashSnapshot = hasher.GetHash();
+
+    // A snapshot that doesn't match its hash is rejected, and leaves the
+    // database marked as incomplete.
+    CCoinsViewDB dest(1 << 23, true);
+    ASSERT_TRUE(dest.Upgrade(false));
+    CChainstateSnapshotMetadata read;
+    ASSERT_EQ(fseek(file.Get(), 0, SEEK_SET), 0);
+    file >> read;
+    EXPECT_FALSE(dest.LoadSnapshot(file, read, GetRandHash()));
+    EXPECT_TRUE(dest.IsSnapshotLoadIncomplete());
+    EXPECT_TRUE(dest.GetBestBlock().IsNull());
+
+    // Loading it into a database in the other coins format gives the same
+    // chain state.
+    ASSERT_EQ(fseek(file.Get(), 0, SEEK_SET), 0);
+    file >> read;
+    ASSERT_TRUE(dest.LoadSnapshot(file, read, hashSnapshot));
+    EXPECT_FALSE(dest.IsSnapshotLoadIncomplete());
+    EXPECT_EQ(dest.GetBestBlock(), hashBlock);
+    EXPECT_EQ(dest.GetBestAnchor(SAPLING), tree.root());
+    CheckSpentOutputs(dest, txids[0], nOutputs, {3});
+    for (unsigned int i = 1; i < txids.size(); i++) {
+        CheckSpentOutputs(dest, txids[i], nOutputs, {});
+    }
+    for (const SaplingMerkleTree &expected : trees) {
+        CCoinsViewCacheTest cache(&dest);
+        SaplingMerkleTree readTree;
+        ASSERT_TRUE(GetAnchorAt(cache, expected.root(), readTree));
+        EXPECT_TRUE(readTree == expected);
+    }
+
+    // The loaded chain state remembers the snapshot's hash, and hashes to
+    // it again without a file.
+    uint256 hashStored;
+    ASSERT_TRUE(dest.GetSnapshotHash(hashStored));
+    EXPECT_EQ(hashStored, hashSnapshot);
+    CHashWriter rehasher(SER_GETHASH, PROTOCOL_VERSION);
+    rehasher << metadata;
+    ASSERT_TRUE(dest.DumpSnapshot(nullptr, rehasher, nRecords));
+    EXPECT_EQ(rehasher.GetHash(), hashSnapshot);
+    ASSERT_TRUE(dest.EraseSnapshotHash());
+    EXPECT_FALSE(dest.GetSnapshotHash(hashStored));
+
+    file.fclose();
+    fs::remove(path);
+}
@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 
 #include "main.h"
+#include "txdb.h"
 #include "util/test.h"
 #include "zcash/History.hpp"
 
@@ -154,3 +155,48 @@ TEST(History, GarbageMemoryHash) {
     // Check history root and garbage history root are equal
     EXPECT_EQ(historyRoot, historyRootGarbage);
 }
+
+TEST(History, IncrementalFlush) {
+    SelectParams(CBaseChainParams::REGTEST);
+    CCoinsViewDB db(1 << 23, true);
+    CCoinsViewCache view(&db);
+
+    uint32_t epochId = 0;
+    for (uint64_t i = 1; i <= 4; i++) {
+        view.PushHistoryNode(epochId, getLeafN(i));
+    }
+    uint256 h4Root = view.GetHistoryRoot(epochId);
+
+    CCoinsCacheSnapshot snapshot;
+    view.Snapshot(snapshot);
+    EXPECT_EQ(snapshot.historyCacheMap.size(), 1);
+
+    // The cache keeps serving the nodes while the database lacks them.
+    EXPECT_EQ(db.GetHistoryLength(epochId), 0);
+    view.PushHistoryNode(epochId, getLeafN(5));
+    view.PopHistoryNode(epochId);
+    EXPECT_EQ(view.GetHistoryRoot(epochId), h4Root);
+    view.PushHistoryNode(epochId, getLeafN(5));
+    uint256 h5Root = view.GetHistoryRoot(epochId);
+
+    ASSERT_TRUE(view.WriteSnapshot(snapshot));
+    EXPECT_EQ(db.GetHistoryLength(epochId), 7);
+    EXPECT_EQ(db.GetHistoryRoot(epochId), h4Root);
+    view.SnapshotWritten(snapshot);
+
+    // Only the node appended since is written next.
+    CCoinsCacheSnapshot snapshot2;
+    view.Snapshot(snapshot2);
+    ASSERT_EQ(snapshot2.historyCacheMap.size(), 1);
+    EXPECT_EQ(snapshot2.historyCacheMap[epochId].appends.size(), 1);
+    ASSERT_TRUE(view.WriteSnapshot(snapshot2));
+    view.SnapshotWritten(snapshot2);
+
+    // Nothing is left to write, and the history is read from the database.
+    CCoinsCacheSnapshot snapshot3;
+    view.Snapshot(snapshot3);
+    EXPECT_TRUE(snapshot3.historyCacheMap.empty());
+    EXPECT_EQ(view.GetHistoryLength(epochId), 8);
+    EXPECT_EQ(view.GetHistoryRoot(epochId), h5Root);
+    EXPECT_EQ(db.GetHistoryRoot(epochId), h5Root);
+}
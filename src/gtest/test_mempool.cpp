@@ -5,6 +5,7 @@
 #include "consensus/validation.h"
 #include "core_io.h"
 #include "main.h"
+#include "policy/policy.h"
 #include "primitives/transaction.h"
 #include "txmempool.h"
 #include "util/system.h"
@@ -298,3 +299,133 @@ TEST(Mempool, ExpiringSoonTxRejection) {
     // Revert to default
     UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
 }
+
+// Transactions whose inputs aren't known are left for AcceptToMemoryPool to
+// report as orphans, without verifying anything ahead of it.
+TEST(Mempool, PreVerifyNeedsInputs) {
+    SelectParams(CBaseChainParams::REGTEST);
+
+    CCoinsViewDummy dummy;
+    CCoinsViewCache view(&dummy);
+    CCoinsViewCache *pcoinsTipOld = pcoinsTip;
+    pcoinsTip = &view;
+
+    CBlock block;
+    CBlockIndex fakeIndex {block};
+    chainActive.SetTip(&fakeIndex);
+
+    CTxMemPool pool(::minRelayTxFee);
+    CMutableTransaction mtx = GetValidTransaction();
+    mtx.vJoinSplit.resize(0);
+    CValidationState state;
+    EXPECT_EQ(PreVerifyTransaction(Params(), pool, CTransaction(mtx), state), PreVerifyResult::Unchecked);
+    EXPECT_TRUE(state.IsValid());
+
+    // The same goes for every transaction in a batch.
+    CMutableTransaction mtx2 = mtx;
+    mtx2.vin[0].prevout.n = 1;
+    std::vector<CValidationState> vState;
+    auto vResult = PreVerifyTransactions(Params(), pool, {CTransaction(mtx), CTransaction(mtx2)}, vState);
+    EXPECT_EQ(vResult, std::vector<PreVerifyResult>({PreVerifyResult::Unchecked, PreVerifyResult::Unchecked}));
+
+    chainActive.SetTip(NULL);
+    pcoinsTip = pcoinsTipOld;
+}
+
+// Nonstandard transactions are rejected by the policy checks, before any of
+// their inputs are looked up or proofs verified.
+TEST(Mempool, PreVerifyRejectsNonstandard) {
+    SelectParams(CBaseChainParams::TESTNET);
+
+    CCoinsViewDummy dummy;
+    CCoinsViewCache view(&dummy);
+    CCoinsViewCache *pcoinsTipOld = pcoinsTip;
+    pcoinsTip = &view;
+
+    CTxMemPool pool(::minRelayTxFee);
+    CMutableTransaction mtx = GetValidTransaction();
+    mtx.vJoinSplit.resize(0);
+    mtx.fOverwintered = false;
+    mtx.nVersion = 3;
+    CValidationState state;
+    EXPECT_EQ(PreVerifyTransaction(Params(), pool, CTransaction(mtx), state), PreVerifyResult::Rejected);
+    int nDoS = -1;
+    EXPECT_TRUE(state.IsInvalid(nDoS));
+    EXPECT_EQ(nDoS, 0);
+    EXPECT_EQ(state.GetRejectCode(), REJECT_NONSTANDARD);
+    EXPECT_EQ(state.GetRejectReason(), "version");
+
+    pcoinsTip = pcoinsTipOld;
+}
+
+// A transaction whose inputs are known but whose JoinSplit proof doesn't
+// verify is rejected with the DoS score AcceptToMemoryPool would give it, so
+// that it isn't verified a second time.
+TEST(Mempool, PreVerifyRejectsInvalidProof) {
+    SelectParams(CBaseChainParams::REGTEST);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::ALWAYS_ACTIVE);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_SAPLING, Consensus::NetworkUpgrade::ALWAYS_ACTIVE);
+
+    FakeCoinsViewDB fakeDB;
+    CCoinsViewCache view(&fakeDB);
+    CCoinsViewCache *pcoinsTipOld = pcoinsTip;
+    pcoinsTip = &view;
+
+    CBlock block;
+    CBlockIndex fakeIndex {block};
+    chainActive.SetTip(&fakeIndex);
+
+    // The Sapling-format JoinSplits carry empty Groth16 proofs.
+    CTxMemPool pool(::minRelayTxFee);
+    CMutableTransaction mtx = GetValidTransaction(NetworkUpgradeInfo[Consensus::UPGRADE_SAPLING].nBranchId);
+    CValidationState state;
+    EXPECT_EQ(PreVerifyTransaction(Params(), pool, CTransaction(mtx), state), PreVerifyResult::Rejected);
+    int nDoS = 0;
+    EXPECT_TRUE(state.IsInvalid(nDoS));
+    EXPECT_EQ(nDoS, 100);
+    EXPECT_EQ(state.GetRejectReason(), "bad-txns-joinsplit-verification-failed");
+
+    chainActive.SetTip(NULL);
+    pcoinsTip = pcoinsTipOld;
+
+    // Revert to default
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_SAPLING, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+}
+
+// The sigop limit, like the other policy checks that need the inputs, is
+// checked before any proof is verified: this transaction's JoinSplit proofs
+// would fail too, but it is turned away for its sigops.
+TEST(Mempool, PreVerifyRejectsTooManySigOps) {
+    SelectParams(CBaseChainParams::REGTEST);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::ALWAYS_ACTIVE);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_SAPLING, Consensus::NetworkUpgrade::ALWAYS_ACTIVE);
+
+    FakeCoinsViewDB fakeDB;
+    CCoinsViewCache view(&fakeDB);
+    CCoinsViewCache *pcoinsTipOld = pcoinsTip;
+    pcoinsTip = &view;
+
+    CBlock block;
+    CBlockIndex fakeIndex {block};
+    chainActive.SetTip(&fakeIndex);
+
+    CTxMemPool pool(::minRelayTxFee);
+    CMutableTransaction mtx = GetValidTransaction(NetworkUpgradeInfo[Consensus::UPGRADE_SAPLING].nBranchId);
+    mtx.vout[0].scriptPubKey = CScript();
+    for (unsigned int i = 0; i <= MAX_STANDARD_TX_SIGOPS; i++)
+        mtx.vout[0].scriptPubKey << OP_CHECKSIG;
+    CValidationState state;
+    EXPECT_EQ(PreVerifyTransaction(Params(), pool, CTransaction(mtx), state), PreVerifyResult::Rejected);
+    int nDoS = -1;
+    EXPECT_TRUE(state.IsInvalid(nDoS));
+    EXPECT_EQ(nDoS, 0);
+    EXPECT_EQ(state.GetRejectReason(), "bad-txns-too-many-sigops");
+
+    chainActive.SetTip(NULL);
+    pcoinsTip = pcoinsTipOld;
+
+    // Revert to default
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_SAPLING, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+    UpdateNetworkUpgradeParameters(Consensus::UPGRADE_OVERWINTER, Consensus::NetworkUpgrade::NO_ACTIVATION_HEIGHT);
+}
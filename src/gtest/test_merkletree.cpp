@@ -288,6 +288,43 @@ TEST(merkletree, testZeroElements) {
     }
 }
 
+TEST(merkletree, deltas) {
+    SproutMerkleTree tree;
+    SproutMerkleTree base;
+
+    for (int i = 0; i < 300; i++) {
+        for (int j = 0; j <= i % 7; j++) {
+            tree.append(GetRandHash());
+        }
+
+        auto delta = tree.delta_from(base);
+        EXPECT_LE(delta.parents.size() + delta.nSharedParents, (size_t)INCREMENTAL_MERKLE_TREE_DEPTH);
+
+        // The delta survives serialization.
+        CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+        ss << delta;
+        SproutMerkleTree::Delta delta2;
+        ss >> delta2;
+
+        SproutMerkleTree rebuilt = base;
+        rebuilt.apply_delta(delta2);
+        ASSERT_TRUE(rebuilt == tree);
+        ASSERT_EQ(rebuilt.root(), tree.root());
+
+        base = tree;
+    }
+
+    // Appending a single leaf leaves the upper parents alone.
+    SproutMerkleTree next = tree;
+    next.append(GetRandHash());
+    auto delta = next.delta_from(tree);
+    EXPECT_GT(delta.nSharedParents, 0U);
+
+    // A delta can't be applied to a tree with different parents.
+    SproutMerkleTree empty;
+    EXPECT_THROW(empty.apply_delta(delta), std::runtime_error);
+}
+
 TEST(orchardMerkleTree, emptyroot) {
     // This literal is the depth-32 empty tree root with the bytes reversed, to
     // account for the fact that uint256S() loads a big-endian representation of
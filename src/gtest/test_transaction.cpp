@@ -91,3 +91,37 @@ TEST(Transaction, JSDescriptionRandomized) {
         EXPECT_EQ(expectedOutputMap, outputMap);
     }
 }
+
+TEST(Transaction, SaplingBundleBorrowedAccessors) {
+    SaplingBundle empty;
+    EXPECT_TRUE(empty.GetSpends().empty());
+    EXPECT_TRUE(empty.GetOutputs().empty());
+    EXPECT_TRUE(empty.GetNullifiers().empty());
+    EXPECT_TRUE(empty.GetNoteCommitments().empty());
+
+    SaplingBundle bundle(sapling::test_only_invalid_bundle(2, 3, 0));
+    auto spends = bundle.GetDetails().spends();
+    auto outputs = bundle.GetDetails().outputs();
+
+    auto nullifiers = bundle.GetNullifiers();
+    ASSERT_EQ(nullifiers.size(), 2);
+    ASSERT_EQ(bundle.GetSpends().size(), 2);
+    size_t i = 0;
+    for (const auto& spend : bundle.GetSpends()) {
+        EXPECT_EQ(nullifiers[i], uint256::FromRawBytes(spends[i].nullifier()));
+        EXPECT_EQ(spend.nullifier(), spends[i].nullifier());
+        EXPECT_EQ(spend.anchor(), spends[i].anchor());
+        i++;
+    }
+    EXPECT_EQ(i, 2);
+
+    auto cmus = bundle.GetNoteCommitments();
+    ASSERT_EQ(cmus.size(), 3);
+    auto borrowedOutputs = bundle.GetOutputs();
+    ASSERT_EQ(borrowedOutputs.size(), 3);
+    for (i = 0; i < 3; i++) {
+        EXPECT_EQ(cmus[i], uint256::FromRawBytes(outputs[i].cmu()));
+        EXPECT_EQ(borrowedOutputs[i].cmu(), outputs[i].cmu());
+        EXPECT_EQ(borrowedOutputs[i].enc_ciphertext(), outputs[i].enc_ciphertext());
+    }
+}
@@ -453,3 +453,58 @@ TEST(Validation, ReceivedBlockTransactions) {
     EnsureUnreferencedAsKeyOfMapBlocksUnlinked(&fakeIndex1);
     EnsureUnreferencedAsKeyOfMapBlocksUnlinked(&fakeIndex2);
 }
+
+TEST(Validation, IBDPrevalidationWindow) {
+    SelectParams(CBaseChainParams::REGTEST);
+    const auto& chainParams = Params();
+
+    // A fake chain whose best header is far enough ahead to batch.
+    const int nBlocks = 3 * IBD_BATCH_PROOFS_MIN_TIP_DISTANCE;
+    std::vector<CBlockIndex> indices(nBlocks);
+    for (int i = 0; i < nBlocks; i++) {
+        indices[i].nHeight = i;
+        indices[i].pprev = i > 0 ? &indices[i - 1] : nullptr;
+        indices[i].BuildSkip();
+    }
+    const CBlockIndex* pindexBest = &indices.back();
+
+    // ActivateBestChainStep passes the blocks to connect from highest to lowest.
+    auto toConnect = [&](int nFrom, int nTo) {
+        std::vector<CBlockIndex*> vpindex;
+        for (int h = nTo; h >= nFrom; h--) {
+            vpindex.push_back(&indices[h]);
+        }
+        return vpindex;
+    };
+
+    // The first window starts at the next block to connect, and is capped.
+    auto vWindow = GetIBDPrevalidationWindow(chainParams, toConnect(1, 40), pindexBest, nullptr);
+    ASSERT_EQ(IBD_BATCH_PROOFS_WINDOW, vWindow.size());
+    EXPECT_EQ(&indices[1], vWindow.front());
+    EXPECT_EQ(&indices[IBD_BATCH_PROOFS_WINDOW], vWindow.back());
+
+    // Later steps that only connect blocks from that window are skipped.
+    const CBlockIndex* pindexPrevalidated = vWindow.back();
+    EXPECT_TRUE(GetIBDPrevalidationWindow(
+        chainParams, toConnect(2, 40), pindexBest, pindexPrevalidated).empty());
+    EXPECT_TRUE(GetIBDPrevalidationWindow(
+        chainParams, toConnect(IBD_BATCH_PROOFS_WINDOW, 40), pindexBest, pindexPrevalidated).empty());
+
+    // The next window starts right after it.
+    vWindow = GetIBDPrevalidationWindow(
+        chainParams, toConnect(IBD_BATCH_PROOFS_WINDOW + 1, 80), pindexBest, pindexPrevalidated);
+    ASSERT_EQ(IBD_BATCH_PROOFS_WINDOW, vWindow.size());
+    EXPECT_EQ(&indices[IBD_BATCH_PROOFS_WINDOW + 1], vWindow.front());
+
+    // A window prevalidated on another branch does not cover this one.
+    CBlockIndex fork;
+    fork.nHeight = 11;
+    fork.pprev = &indices[10];
+    fork.BuildSkip();
+    EXPECT_FALSE(GetIBDPrevalidationWindow(chainParams, toConnect(11, 40), pindexBest, &fork).empty());
+
+    // Blocks close to the best header are never batched.
+    EXPECT_TRUE(GetIBDPrevalidationWindow(
+        chainParams, toConnect(nBlocks - 40, nBlocks - 10), pindexBest, nullptr).empty());
+    EXPECT_TRUE(GetIBDPrevalidationWindow(chainParams, toConnect(1, 40), nullptr, nullptr).empty());
+}
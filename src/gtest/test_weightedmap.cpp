@@ -16,12 +16,14 @@ TEST(WeightedMapTests, WeightedMap)
     EXPECT_EQ(0, m.size());
     EXPECT_TRUE(m.empty());
     EXPECT_EQ(0, m.getTotalWeight());
+    EXPECT_EQ(0, m.DynamicMemoryUsage());
     m.checkInvariants();
 
     EXPECT_TRUE(m.add(3, 30, 3));
     EXPECT_EQ(1, m.size());
     EXPECT_FALSE(m.empty());
     EXPECT_EQ(3, m.getTotalWeight());
+    EXPECT_GT(m.DynamicMemoryUsage(), 0);
     m.checkInvariants();
 
     EXPECT_TRUE(m.add(1, 10, 2));
@@ -172,8 +172,11 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
+/** Set once mempool.dat has been loaded, so that it is only overwritten after that. */
+static std::atomic<bool> fDumpMempoolLater(false);
+/** Set once the signature caches have been set up, so that they can be dumped. */
+static std::atomic<bool> fDumpSigCachesLater(false);
 
 void Interrupt(boost::thread_group& threadGroup)
 {
@@ -216,6 +219,12 @@ void Shutdown()
     StopNode();
     StopTorControl();
     UnregisterNodeSignals(GetNodeSignals());
+    if (fDumpMempoolLater && GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        DumpMempool();
+    }
+    if (fDumpSigCachesLater && GetBoolArg("-persistsigcache", DEFAULT_PERSIST_SIG_CACHE)) {
+        DumpSignatureCaches();
+    }
 
     {
         LOCK(cs_main);
@@ -344,14 +353,30 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-debuglogfile=<file>", strprintf(_("Specify location of debug log file. Relative paths will be prefixed by a net-specific datadir location. (default: %s)"), DEFAULT_DEBUGLOGFILE));
     strUsage += HelpMessageOpt("-exportdir=<dir>", _("Specify directory to be used when exporting data"));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-ibdbatchproofs", strprintf(_("During initial block download, verify Sapling and Orchard proofs and signatures in batches spanning up to %u blocks (default: %u)"), IBD_BATCH_PROOFS_WINDOW, DEFAULT_IBD_BATCH_PROOFS));
     strUsage += HelpMessageOpt("-ibdskiptxverification", strprintf(_("Skip transaction verification during initial block download up to the last checkpoint height. Incompatible with flags that disable checkpoints. (default = %u)"), DEFAULT_IBD_SKIP_TX_VERIFICATION));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-incrementalcoinsflush", strprintf(_("Write the UTXO set to disk periodically without pausing validation or emptying the in-memory cache (default: %u)"), DEFAULT_INCREMENTAL_COINS_FLUSH));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+    strUsage += HelpMessageOpt("-maxorphantxpeersize=<n>", strprintf(_("Keep at most <n> megabytes of unconnectable transactions from any one peer in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TX_PEER_SIZE));
+    strUsage += HelpMessageOpt("-maxorphantxsize=<n>", strprintf(_("Keep at most <n> megabytes of unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TX_SIZE));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-mempoolpreverify", strprintf(_("Verify the proofs and signatures of relayed transactions before locking the chain state to accept them (default: %u)"), DEFAULT_MEMPOOL_PREVERIFY));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"),
         -GetNumCores(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    if (showDebug)
+        strUsage += HelpMessageOpt("-parallelblocktxchecks", strprintf(_("Check the transactions of a block in parallel, when -par allows more than one thread (default: %u)"), DEFAULT_PARALLEL_BLOCK_TX_CHECKS));
+    strUsage += HelpMessageOpt("-peroutpointcoins", strprintf(_("Store the UTXO set with one record per transparent output, upgrading an existing chain state in place. "
+            "Reverting this setting requires -reindex-chainstate (default: %u)"), DEFAULT_PER_OUTPOINT_COINS));
+    strUsage += HelpMessageOpt("-persistmempool", strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL));
+    strUsage += HelpMessageOpt("-persistsigcache", strprintf(_("Whether to save the signature and proof validity caches on shutdown and load them on restart (default: %u)"), DEFAULT_PERSIST_SIG_CACHE));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file. Relative paths will be prefixed by a net-specific datadir location. (default: %s)"), BITCOIN_PID_FILENAME));
 #endif
+    if (showDebug)
+        strUsage += HelpMessageOpt("-pipelinedconnect", strprintf(_("Verify Sapling and Orchard proofs and signatures in parallel with connecting a block's transactions, when -par allows more than one thread (default: %u)"), DEFAULT_PIPELINED_CONNECT));
     strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode disables wallet support and is incompatible with -txindex. "
             "Warning: Reverting this setting requires re-downloading the entire blockchain. "
             "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
@@ -373,6 +398,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-banscore=<n>", strprintf(_("Threshold for disconnecting misbehaving peers (default: %u)"), DEFAULT_BANSCORE_THRESHOLD));
     strUsage += HelpMessageOpt("-bantime=<n>", strprintf(_("Number of seconds to keep misbehaving peers from reconnecting (default: %u)"), DEFAULT_MISBEHAVING_BANTIME));
     strUsage += HelpMessageOpt("-bind=<addr>", _("Bind to given address and always listen on it. Use [host]:port notation for IPv6"));
+    strUsage += HelpMessageOpt("-compactblocks", strprintf(_("Relay and request new blocks as compact blocks, reconstructed from the mempool (default: %u)"), DEFAULT_COMPACT_BLOCKS));
     strUsage += HelpMessageOpt("-connect=<ip>", _("Connect only to the specified node(s); -noconnect or -connect=0 alone to disable automatic connections"));
     strUsage += HelpMessageOpt("-discover", _("Discover own IP addresses (default: 1 when listening and no -externalip or -proxy)"));
     strUsage += HelpMessageOpt("-dns", _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + strprintf(_("(default: %u)"), DEFAULT_NAME_LOOKUP));
@@ -451,7 +477,7 @@ std::string HelpMessage(HelpMessageMode mode)
                 "-fundingstream=streamId:startHeight:endHeight:comma_delimited_addresses",
                 "Use given addresses for block subsidy share paid to the funding stream with id <streamId> (regtest-only)");
     }
-    std::string debugCategories = "addrman, alert, bench, coindb, db, http, libevent, lock, mempool, mempoolrej, net, partitioncheck, pow, proxy, prune, "
+    std::string debugCategories = "addrman, alert, bench, cmpctblock, coindb, db, http, libevent, lock, mempool, mempoolrej, net, partitioncheck, pow, proxy, prune, "
                              "rand, receiveunsafe, reindex, rpc, selectcoins, tor, valuepool, zmq, zrpc, zrpcunsafe (implies zrpc)"; // Don't translate these
     strUsage += HelpMessageOpt("-debug=<category>", strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + ". " +
         _("If <category> is not supplied or if <category> = 1, output all debugging information.") + " " + _("<category> can be:") + " " + debugCategories + ". " +
@@ -820,6 +846,11 @@ void ThreadImport(std::vector<fs::path> vImportFiles, const CChainParams& chainp
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool(chainparams);
+        fDumpMempoolLater = !ShutdownRequested();
+    }
 }
 
 /** Sanity checks
@@ -1163,6 +1194,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         nScriptCheckThreads = 0;
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    fPipelinedConnect = GetBoolArg("-pipelinedconnect", DEFAULT_PIPELINED_CONNECT);
+    fIBDBatchProofs = GetBoolArg("-ibdbatchproofs", DEFAULT_IBD_BATCH_PROOFS);
+    fIncrementalCoinsFlush = GetBoolArg("-incrementalcoinsflush", DEFAULT_INCREMENTAL_COINS_FLUSH);
+    fParallelBlockTxChecks = GetBoolArg("-parallelblocktxchecks", DEFAULT_PARALLEL_BLOCK_TX_CHECKS);
+    fMempoolPreVerify = GetBoolArg("-mempoolpreverify", DEFAULT_MEMPOOL_PREVERIFY);
+    fCompactBlocks = GetBoolArg("-compactblocks", DEFAULT_COMPACT_BLOCKS);
 
     fServer = GetBoolArg("-server", false);
 
@@ -1447,6 +1484,10 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     InitSignatureCache(nMaxCacheSize / 2);
     bundlecache::init(nMaxCacheSize / 4);
+    if (GetBoolArg("-persistsigcache", DEFAULT_PERSIST_SIG_CACHE)) {
+        LoadSignatureCaches();
+    }
+    fDumpSigCachesLater = true;
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
@@ -1713,6 +1754,25 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
+                if (pcoinsdbview->IsSnapshotLoadIncomplete()) {
+                    strLoadError = _("Loading a chain state snapshot did not complete. You need to rebuild the database using -reindex-chainstate.");
+                    break;
+                }
+
+                bool fPerOutpointCoins = GetBoolArg("-peroutpointcoins", DEFAULT_PER_OUTPOINT_COINS);
+                if (fPerOutpointCoins && !pcoinsdbview->IsPerOutpoint())
+                    uiInterface.InitMessage(_("Upgrading UTXO database..."));
+                if (!pcoinsdbview->Upgrade(fPerOutpointCoins)) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
+                uiInterface.InitMessage(_("Loading nullifier filters..."));
+                if (!pcoinsdbview->LoadNullifierFilters()) {
+                    strLoadError = _("Error loading nullifier filters");
+                    break;
+                }
+
                 if (fReindex) {
                     pblocktree->WriteReindexing(true);
                     //If we're reindexing in prune mode, wipe away unusable block files and all undo data files
@@ -1960,6 +2020,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    // if the chain state was loaded from a snapshot that hasn't been validated
+    // yet, we can't serve the blocks below it.
+    {
+        LOCK(cs_main);
+        if (pindexSnapshotBase != NULL) {
+            LogPrintf("Unsetting NODE_NETWORK until the chain state snapshot is validated\n");
+            nLocalServices &= ~NODE_NETWORK;
+        }
+    }
+
     // ********************************************************* Step 10: import blocks
 
     if (!CheckDiskSpace())
@@ -1987,6 +2057,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
 
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles, chainparams));
+    threadGroup.create_thread(boost::bind(&ThreadValidateSnapshot, (size_t)nCoinDBCache));
 
     // Wait for genesis block to be processed
     {
@@ -2033,6 +2104,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     StartNode(threadGroup, scheduler);
 
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        scheduler.scheduleEvery([]() {
+            if (fDumpMempoolLater) {
+                DumpMempool();
+            }
+        }, DUMP_MEMPOOL_INTERVAL);
+    }
+
 #ifdef ENABLE_MINING
     // Generate coins in the background
     GenerateBitcoins(GetBoolArg("-gen", DEFAULT_GENERATE), GetArg("-genproclimit", DEFAULT_GENERATE_THREADS), chainparams);
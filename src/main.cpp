@@ -9,6 +9,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -17,6 +18,7 @@
 #include "consensus/merkle.h"
 #include "consensus/upgrades.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
 #include "deprecation.h"
 #include "experimental_features.h"
 #include "init.h"
@@ -41,6 +43,9 @@
 
 #include <algorithm>
 #include <atomic>
+#include <deque>
+#include <functional>
+#include <numeric>
 #include <sstream>
 #include <variant>
 
@@ -80,12 +85,21 @@ RecursiveMutex cs_main;
 BlockMap mapBlockIndex;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
+CBlockIndex *pindexSnapshotBase = NULL;
+/** The last block below pindexSnapshotBase connected by ThreadValidateSnapshot. */
+static CBlockIndex *pindexSnapshotValidated = NULL;
 static std::atomic<int64_t> nTimeBestReceived(0); // Used only to inform the wallet of when we last received a block
 Mutex g_best_block_mutex;
 std::condition_variable g_best_block_cv;
 uint256 g_best_block;
 int g_best_block_height;
 int nScriptCheckThreads = 0;
+bool fPipelinedConnect = DEFAULT_PIPELINED_CONNECT;
+bool fIBDBatchProofs = DEFAULT_IBD_BATCH_PROOFS;
+bool fIncrementalCoinsFlush = DEFAULT_INCREMENTAL_COINS_FLUSH;
+bool fParallelBlockTxChecks = DEFAULT_PARALLEL_BLOCK_TX_CHECKS;
+bool fMempoolPreVerify = DEFAULT_MEMPOOL_PREVERIFY;
+bool fCompactBlocks = DEFAULT_COMPACT_BLOCKS;
 std::atomic_bool fImporting(false);
 std::atomic_bool fReindex(false);
 bool fTxIndex = false;
@@ -127,9 +141,15 @@ struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
     int64_t nTimeExpire;
+    int64_t nTimeAdded;
+    size_t nUsage; //!< Memory usage of tx, counted against the orphan pool budgets.
 };
 map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
-map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
+/** Orphan transactions indexed by the txids of the transactions whose outputs they spend. */
+map<uint256, set<map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByParent GUARDED_BY(cs_main);
+/** Memory usage of the orphan pool, in total and by the peer each orphan came from. */
+size_t nOrphanTxUsage GUARDED_BY(cs_main) = 0;
+map<NodeId, size_t> mapOrphanTxUsageByPeer GUARDED_BY(cs_main);
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
@@ -214,6 +234,12 @@ namespace {
 
     CBlockIndex *pindexBestInvalid;
 
+    /**
+     * The highest block whose Sapling and Orchard authorizations have already
+     * been batch-validated by PrevalidateShieldedAuthForIBD.
+     */
+    const CBlockIndex *pindexIBDPrevalidated = NULL;
+
     /**
      * The set of all CBlockIndex entries with BLOCK_VALID_TRANSACTIONS (for itself and all ancestors) and
      * as good as our current tip or better. Entries may be failed, though, and pruning nodes may be
@@ -286,6 +312,7 @@ namespace {
         int64_t nTime;           //!< Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //!< Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //!< The timeout for this block request (for disconnecting a slow peer)
+        std::shared_ptr<PartiallyDownloadedBlock> partialBlock; //!< Optional, set while reconstructing a compact block.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -306,6 +333,13 @@ namespace {
     MapRelay mapRelay;
     /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+
+    /**
+     * The compact block for the most recent tip that was announced to a
+     * high-bandwidth compact block peer, shared between all of them.
+     * Protected by cs_main.
+     */
+    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pMostRecentCompactBlock;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -355,6 +389,10 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer can give us compact blocks (it sent sendcmpct with a version we know).
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks announced with cmpctblock rather than inv.
+    bool fPreferHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -368,6 +406,8 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
     }
 };
 
@@ -544,6 +584,13 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     // If the peer reorganized, our previous pindexLastCommonBlock may not be an ancestor
     // of its current tip anymore. Go back enough to fix that.
     state->pindexLastCommonBlock = LastCommonAncestor(state->pindexLastCommonBlock, state->pindexBestKnownBlock);
+    // Blocks below the base of a chain state snapshot are fetched separately by
+    // FindNextSnapshotBlocksToDownload, so they mustn't hold back the blocks
+    // that extend the chain past the base.
+    if (pindexSnapshotBase && state->pindexLastCommonBlock->nHeight < pindexSnapshotBase->nHeight &&
+        state->pindexBestKnownBlock->GetAncestor(pindexSnapshotBase->nHeight) == pindexSnapshotBase) {
+        state->pindexLastCommonBlock = pindexSnapshotBase;
+    }
     if (state->pindexLastCommonBlock == state->pindexBestKnownBlock)
         return;
 
@@ -601,6 +648,42 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     }
 }
 
+/** Add not-in-flight blocks below the base of a chain state snapshot, that
+ *  ThreadValidateSnapshot needs next, to vBlocks, until it has at most count
+ *  entries. Only peers whose best known block descends from the base are asked. */
+void FindNextSnapshotBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks) {
+    if (pindexSnapshotBase == NULL || vBlocks.size() >= count)
+        return;
+
+    CNodeState *state = State(nodeid);
+    assert(state != NULL);
+    ProcessBlockAvailability(nodeid);
+    if (state->pindexBestKnownBlock == NULL ||
+        state->pindexBestKnownBlock->GetAncestor(pindexSnapshotBase->nHeight) != pindexSnapshotBase) {
+        return;
+    }
+
+    // Fetch no further than BLOCK_DOWNLOAD_WINDOW past the last block that
+    // was connected, so that the blocks can be connected as they arrive.
+    int nStartHeight = pindexSnapshotValidated ? pindexSnapshotValidated->nHeight + 1 : 0;
+    int nEndHeight = std::min<int>(nStartHeight + BLOCK_DOWNLOAD_WINDOW, pindexSnapshotBase->nHeight);
+    std::vector<CBlockIndex*> vToFetch(nEndHeight - nStartHeight + 1);
+    CBlockIndex *pindexWalk = pindexSnapshotBase->GetAncestor(nEndHeight);
+    for (auto it = vToFetch.rbegin(); it != vToFetch.rend(); ++it) {
+        *it = pindexWalk;
+        pindexWalk = pindexWalk->pprev;
+    }
+
+    for (CBlockIndex* pindex : vToFetch) {
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) && mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
+            vBlocks.push_back(pindex);
+            if (vBlocks.size() == count) {
+                return;
+            }
+        }
+    }
+}
+
 } // anon namespace
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
@@ -623,6 +706,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.GetHeight.connect(&GetHeight);
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
+    nodeSignals.ProcessPendingMessages.connect(&ProcessPendingTransactions);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
@@ -632,6 +716,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.GetHeight.disconnect(&GetHeight);
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
+    nodeSignals.ProcessPendingMessages.disconnect(&ProcessPendingTransactions);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
@@ -654,6 +739,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
     return chain.Genesis();
 }
 
+CCoinsViewDB *pcoinsdbview = NULL;
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
@@ -674,9 +760,8 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
     // send-big-orphans memory exhaustion attack. If a peer has a legitimate
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 100 orphans, each of which is at most 99,999 bytes big is
-    // at most 10 megabytes of orphans and somewhat more byprev index (in the worst case):
+    // have been mined or received. The memory used by orphans in total and
+    // from each peer is bounded separately by LimitOrphanTxSize.
     unsigned int sz = GetSerializeSize(tx, SER_NETWORK, tx.nVersion);
     if (sz >= 100000)
     {
@@ -684,14 +769,18 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         return false;
     }
 
-    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME});
+    int64_t nNow = GetTime();
+    size_t nUsage = RecursiveDynamicUsage(tx);
+    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, nNow + ORPHAN_TX_EXPIRE_TIME, nNow, nUsage});
     assert(ret.second);
     for (const CTxIn& txin : tx.vin) {
-        mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
+        mapOrphanTransactionsByParent[txin.prevout.hash].insert(ret.first);
     }
+    nOrphanTxUsage += nUsage;
+    mapOrphanTxUsageByPeer[peer] += nUsage;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u parentsz %u usage %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByParent.size(), nOrphanTxUsage);
     return true;
 }
 
@@ -702,13 +791,19 @@ int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
         return 0;
     for (const CTxIn& txin : it->second.tx.vin)
     {
-        auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
+        auto itParent = mapOrphanTransactionsByParent.find(txin.prevout.hash);
+        if (itParent == mapOrphanTransactionsByParent.end())
             continue;
-        itPrev->second.erase(it);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
+        itParent->second.erase(it);
+        if (itParent->second.empty())
+            mapOrphanTransactionsByParent.erase(itParent);
+    }
+    nOrphanTxUsage -= it->second.nUsage;
+    auto itPeer = mapOrphanTxUsageByPeer.find(it->second.fromPeer);
+    assert(itPeer != mapOrphanTxUsageByPeer.end());
+    itPeer->second -= it->second.nUsage;
+    if (itPeer->second == 0)
+        mapOrphanTxUsageByPeer.erase(itPeer);
     mapOrphanTransactions.erase(it);
     return 1;
 }
@@ -729,7 +824,7 @@ void EraseOrphansFor(NodeId peer)
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanUsage, size_t nMaxOrphanPeerUsage) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     unsigned int nEvicted = 0;
     static int64_t nNextSweep;
@@ -754,15 +849,46 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRE
         nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
         if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
     }
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
+
+    bool fPeerOverBudget = false;
+    for (const auto& peerUsage : mapOrphanTxUsageByPeer) {
+        if (peerUsage.second > nMaxOrphanPeerUsage) {
+            fPeerOverBudget = true;
+            break;
+        }
+    }
+    if (mapOrphanTransactions.size() <= nMaxOrphans && nOrphanTxUsage <= nMaxOrphanUsage && !fPeerOverBudget)
+        return nEvicted;
+
+    // Evict the orphans that have been waiting the longest for their parents,
+    // weighted by their size, so that a burst of small transactions that are
+    // likely to be resolved soon isn't pushed out by a few large ones. Ties
+    // are broken by txid.
+    std::vector<std::pair<int64_t, uint256>> vScored;
+    vScored.reserve(mapOrphanTransactions.size());
+    for (const auto& entry : mapOrphanTransactions) {
+        int64_t nAge = std::max<int64_t>(nNow - entry.second.nTimeAdded, 0) + 1;
+        vScored.emplace_back(nAge * (int64_t)entry.second.nUsage, entry.first);
+    }
+    std::sort(vScored.begin(), vScored.end(), std::greater<std::pair<int64_t, uint256>>());
+
+    // First bring each peer back within its own budget, so that one peer
+    // can't use up the whole pool, and then the pool as a whole.
+    if (fPeerOverBudget) {
+        for (const auto& scored : vScored) {
+            auto it = mapOrphanTransactions.find(scored.second);
+            if (it == mapOrphanTransactions.end())
+                continue;
+            auto itPeer = mapOrphanTxUsageByPeer.find(it->second.fromPeer);
+            if (itPeer != mapOrphanTxUsageByPeer.end() && itPeer->second > nMaxOrphanPeerUsage) {
+                nEvicted += EraseOrphanTx(scored.second);
+            }
+        }
+    }
+    for (const auto& scored : vScored) {
+        if (mapOrphanTransactions.size() <= nMaxOrphans && nOrphanTxUsage <= nMaxOrphanUsage)
+            break;
+        nEvicted += EraseOrphanTx(scored.second);
     }
     return nEvicted;
 }
@@ -1286,25 +1412,22 @@ bool ContextualCheckTransaction(
     return true;
 }
 
-bool ContextualCheckShieldedInputs(
+/**
+ * The part of ContextualCheckShieldedInputs that doesn't depend on the chain
+ * state: checks the JoinSplit signature, and queues the Sapling and Orchard
+ * bundles' authorizations.
+ */
+static bool CheckShieldedAuthorization(
         const CTransaction& tx,
         const PrecomputedTransactionData& txdata,
         CValidationState &state,
-        const CCoinsViewCache &view,
         std::optional<rust::Box<sapling::BatchValidator>>& saplingAuth,
         std::optional<rust::Box<orchard::BatchValidator>>& orchardAuth,
         const Consensus::Params& consensus,
         uint32_t consensusBranchId,
-        bool nu5Active,
         bool isMined,
         bool (*isInitBlockDownload)(const Consensus::Params&))
 {
-    // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
-    // for an attacker to attempt to split the network.
-    if (!Consensus::CheckTxShieldedInputs(tx, state, view, 0)) {
-        return false;
-    }
-
     const int DOS_LEVEL_BLOCK = 100;
     // DoS level set to 10 to be more forgiving.
     const int DOS_LEVEL_MEMPOOL = 10;
@@ -1378,6 +1501,30 @@ bool ContextualCheckShieldedInputs(
     return true;
 }
 
+bool ContextualCheckShieldedInputs(
+        const CTransaction& tx,
+        const PrecomputedTransactionData& txdata,
+        CValidationState &state,
+        const CCoinsViewCache &view,
+        std::optional<rust::Box<sapling::BatchValidator>>& saplingAuth,
+        std::optional<rust::Box<orchard::BatchValidator>>& orchardAuth,
+        const Consensus::Params& consensus,
+        uint32_t consensusBranchId,
+        bool nu5Active,
+        bool isMined,
+        bool (*isInitBlockDownload)(const Consensus::Params&))
+{
+    // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
+    // for an attacker to attempt to split the network.
+    if (!Consensus::CheckTxShieldedInputs(tx, state, view, 0)) {
+        return false;
+    }
+
+    return CheckShieldedAuthorization(
+        tx, txdata, state, saplingAuth, orchardAuth,
+        consensus, consensusBranchId, isMined, isInitBlockDownload);
+}
+
 
 bool CheckTransaction(const CTransaction& tx, CValidationState &state,
                       ProofVerifier& verifier)
@@ -1743,36 +1890,15 @@ std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
-bool AcceptToMemoryPool(
-        const CChainParams& chainparams,
-        CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-        bool* pfMissingInputs, bool fRejectAbsurdFee)
+/**
+ * The policy checks of AcceptToMemoryPool that need neither the transaction's
+ * inputs nor any proof or signature verification. Requires cs_main and
+ * pool.cs.
+ */
+static bool CheckMempoolPolicy(
+        const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state,
+        const CTransaction& tx, int nextBlockHeight)
 {
-    AssertLockHeld(cs_main);
-    LOCK(pool.cs); // mempool "read lock" (held through pool.addUnchecked())
-    if (pfMissingInputs) {
-        *pfMissingInputs = false;
-    }
-
-    int nextBlockHeight = chainActive.Height() + 1;
-
-    // Grab the branch ID we expect this transaction to commit to.
-    auto consensusBranchId = CurrentEpochBranchId(nextBlockHeight, chainparams.GetConsensus());
-
-    if (pool.IsRecentlyEvicted(tx.GetHash())) {
-        LogPrint("mempool", "Dropping txid %s : recently evicted", tx.GetHash().ToString());
-        return false;
-    }
-
-    auto verifier = ProofVerifier::Strict();
-    if (!CheckTransaction(tx, state, verifier))
-        return false;
-
-    // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
-    if (!ContextualCheckTransaction(tx, state, chainparams, nextBlockHeight, false)) {
-        return false;
-    }
-
     // DoS mitigation: reject transactions expiring soon
     // Note that if a valid transaction belonging to the wallet is in the mempool and the node is shutdown,
     // upon restart, CWalletTx::AcceptToMemoryPool() will be invoked which might result in rejection.
@@ -1817,6 +1943,319 @@ bool AcceptToMemoryPool(
         }
     }
 
+    return true;
+}
+
+/**
+ * The policy checks of AcceptToMemoryPool that need the transaction's inputs,
+ * but still no proof or signature verification: the sigop count, the minimum
+ * relay fee, the ZIP 317 unpaid action limit and the ancestor limits. On
+ * success, setAncestors holds the entry's in-mempool ancestors. Requires
+ * pool.cs.
+ */
+static bool CheckMempoolPolicyWithInputs(
+        CTxMemPool& pool, CValidationState& state, const CTxMemPoolEntry& entry,
+        CAmount nModifiedFees, bool fLimitFree, CTxMemPool::setEntries& setAncestors)
+{
+    const CTransaction& tx = entry.GetTx();
+
+    // Check that the transaction doesn't have an excessive number of
+    // sigops, making it impossible to mine. Since the coinbase transaction
+    // itself can contain sigops MAX_STANDARD_TX_SIGOPS is less than
+    // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
+    // merely non-standard transaction.
+    unsigned int nSigOps = entry.GetSigOpCount();
+    if (nSigOps > MAX_STANDARD_TX_SIGOPS)
+        return state.DoS(0, false, REJECT_NONSTANDARD, "bad-txns-too-many-sigops", false,
+            strprintf("%d > %d", nSigOps, MAX_STANDARD_TX_SIGOPS));
+
+    CAmount nFees = entry.GetFee();
+    unsigned int nSize = entry.GetTxSize();
+
+    // No transactions are allowed with modified fee below the minimum relay fee,
+    // except from disconnected blocks. The minimum relay fee will never be more
+    // than LEGACY_DEFAULT_FEE zatoshis.
+    CAmount minRelayFee = ::minRelayTxFee.GetFeeForRelay(nSize);
+    if (fLimitFree && nModifiedFees < minRelayFee) {
+        LogPrint("mempool",
+                "Not accepting transaction with txid %s, size %d bytes, effective fee %d " + MINOR_CURRENCY_UNIT +
+                ", and fee delta %d " + MINOR_CURRENCY_UNIT + " to the mempool due to insufficient fee. " +
+                " The minimum acceptance/relay fee for this transaction is %d " + MINOR_CURRENCY_UNIT,
+                tx.GetHash().ToString(), nSize, nModifiedFees, nModifiedFees - nFees, minRelayFee);
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "min relay fee not met");
+    }
+
+    // Transactions with more than `-txunpaidactionlimit` unpaid actions (calculated
+    // using the modified fee) are not accepted to the mempool or relayed.
+    // <https://zips.z.cash/zip-0317#transaction-relaying>
+    size_t nUnpaidActionCount = entry.GetUnpaidActionCount();
+    if (nUnpaidActionCount > nTxUnpaidActionLimit) {
+        LogPrint("mempool",
+                "Not accepting transaction with txid %s, size %d bytes, effective fee %d " + MINOR_CURRENCY_UNIT +
+                ", and fee delta %d " + MINOR_CURRENCY_UNIT + " to the mempool because it has %d unpaid actions"
+                ", which is over the limit of %d. The conventional fee for this transaction is %d " + MINOR_CURRENCY_UNIT,
+                tx.GetHash().ToString(), nSize, nModifiedFees, nModifiedFees - nFees, nUnpaidActionCount,
+                nTxUnpaidActionLimit, tx.GetConventionalFee());
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE,
+                         strprintf("tx unpaid action limit exceeded: %d action(s) exceeds limit of %d", nUnpaidActionCount, nTxUnpaidActionLimit));
+    }
+
+    // Calculate in-mempool ancestors, up to a limit.
+    size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+    size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+    size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+    size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+    std::string errString;
+    if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+        return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
+    }
+
+    return true;
+}
+
+/**
+ * Run the checks of PreVerifyTransactions that don't involve the Sapling and
+ * Orchard bundles: the JoinSplit proofs and the transparent scripts. A script
+ * failure is left for AcceptToMemoryPool to classify, as it depends on which
+ * flags and branch the script fails under.
+ */
+static PreVerifyResult PreVerifyTransactionWithoutBundles(
+    const CTransaction& tx,
+    const std::vector<CTxOut>& allPrevOutputs,
+    const PrecomputedTransactionData& txdata,
+    uint32_t consensusBranchId,
+    CValidationState& state)
+{
+    auto verifier = ProofVerifier::Strict();
+    for (const JSDescription& joinsplit : tx.vJoinSplit) {
+        if (!verifier.VerifySprout(joinsplit, tx.joinSplitPubKey)) {
+            state.DoS(100, error("PreVerifyTransactions(): joinsplit does not verify"),
+                      REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+            return PreVerifyResult::Rejected;
+        }
+    }
+
+    // Successful signature checks are stored in the signature cache, where
+    // AcceptToMemoryPool's script checks will find them.
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const CTxOut& prevout = allPrevOutputs[i];
+        CachingTransactionSignatureChecker checker(&tx, txdata, i, prevout.nValue, true);
+        if (!VerifyScript(tx.vin[i].scriptSig, prevout.scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, checker, consensusBranchId))
+            return PreVerifyResult::Unchecked;
+    }
+    return PreVerifyResult::Verified;
+}
+
+/**
+ * Check a transaction's Sapling and Orchard bundle authorizations on their
+ * own, after a batch that it was part of failed.
+ */
+static bool CheckShieldedAuthorizationAlone(
+    const CTransaction& tx,
+    const PrecomputedTransactionData& txdata,
+    CValidationState& state,
+    const Consensus::Params& consensus,
+    uint32_t consensusBranchId)
+{
+    std::optional<rust::Box<sapling::BatchValidator>> saplingAuth = sapling::init_batch_validator(true);
+    std::optional<rust::Box<orchard::BatchValidator>> orchardAuth = orchard::init_batch_validator(true);
+    if (!CheckShieldedAuthorization(
+            tx, txdata, state, saplingAuth, orchardAuth,
+            consensus, consensusBranchId, false, IsInitialBlockDownload)) {
+        return false;
+    }
+    if (!saplingAuth.value()->validate())
+        return state.DoS(100, false, REJECT_INVALID, "bad-sapling-bundle-authorization");
+    if (!orchardAuth.value()->validate())
+        return state.DoS(100, false, REJECT_INVALID, "bad-orchard-bundle-authorization");
+    return true;
+}
+
+std::vector<PreVerifyResult> PreVerifyTransactions(
+    const CChainParams& chainparams, CTxMemPool& pool,
+    const std::vector<CTransaction>& vtx, std::vector<CValidationState>& vState)
+{
+    AssertLockNotHeld(cs_main);
+    std::vector<PreVerifyResult> vResult(vtx.size(), PreVerifyResult::Unchecked);
+    vState.assign(vtx.size(), CValidationState());
+
+    // Take what the checks need from the chain state, and release the locks
+    // before running them. The cheap policy checks run here first, so that
+    // nothing is verified for a transaction that would be turned away anyway.
+    // Inputs may also spend the outputs of earlier transactions in the batch,
+    // so that a chain of dependent transactions is verified together.
+    // Transactions whose inputs can't be found are left to
+    // AcceptToMemoryPool.
+    uint32_t consensusBranchId;
+    std::vector<std::optional<std::vector<CTxOut>>> vAllPrevOutputs(vtx.size());
+    {
+        LOCK2(cs_main, pool.cs);
+        int nextBlockHeight = chainActive.Height() + 1;
+        consensusBranchId = CurrentEpochBranchId(nextBlockHeight, chainparams.GetConsensus());
+
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        CCoinsViewCache view(&viewMemPool);
+        std::map<uint256, size_t> mapBatchTxs;
+        for (size_t i = 0; i < vtx.size(); i++) {
+            const CTransaction& tx = vtx[i];
+            const uint256 hash = tx.GetHash();
+            mapBatchTxs.emplace(hash, i);
+            if (pool.IsRecentlyEvicted(hash))
+                continue;
+            if (!CheckTransactionWithoutProofVerification(tx, vState[i]) ||
+                !CheckMempoolPolicy(chainparams, pool, vState[i], tx, nextBlockHeight)) {
+                vResult[i] = PreVerifyResult::Rejected;
+                continue;
+            }
+
+            std::vector<CTxOut> allPrevOutputs;
+            allPrevOutputs.reserve(tx.vin.size());
+            CAmount nValueIn = tx.GetShieldedValueIn();
+            bool fSpendsCoinbase = false;
+            for (const CTxIn& txin : tx.vin) {
+                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+                if (coins && coins->IsAvailable(txin.prevout.n)) {
+                    allPrevOutputs.push_back(coins->vout[txin.prevout.n]);
+                    fSpendsCoinbase |= coins->IsCoinBase();
+                } else {
+                    auto itBatch = mapBatchTxs.find(txin.prevout.hash);
+                    if (itBatch == mapBatchTxs.end() || itBatch->second == i ||
+                            txin.prevout.n >= vtx[itBatch->second].vout.size())
+                        break;
+                    allPrevOutputs.push_back(vtx[itBatch->second].vout[txin.prevout.n]);
+                }
+                nValueIn += allPrevOutputs.back().nValue;
+            }
+            if (allPrevOutputs.size() != tx.vin.size())
+                continue;
+
+            // The same sigop, fee, unpaid action and ancestor limits as
+            // AcceptToMemoryPool applies with fLimitFree, which all of the
+            // callers pass. Parents in the batch aren't in the mempool yet, so
+            // they don't count towards the ancestor limits here; that is left
+            // to AcceptToMemoryPool, as are overflowing input values.
+            if (MoneyRange(nValueIn)) {
+                unsigned int nSigOps = GetLegacySigOpCount(tx);
+                for (size_t j = 0; j < tx.vin.size(); j++) {
+                    const CScript& prevScript = allPrevOutputs[j].scriptPubKey;
+                    if (prevScript.IsPayToScriptHash())
+                        nSigOps += prevScript.GetSigOpCount(tx.vin[j].scriptSig);
+                }
+                CAmount nFees = nValueIn - tx.GetValueOut();
+                CAmount nModifiedFees = nFees;
+                pool.ApplyDelta(hash, nModifiedFees);
+                CTxMemPoolEntry entry(tx, nFees, GetTime(), chainActive.Height(), pool.HasNoInputsOf(tx), fSpendsCoinbase, nSigOps, consensusBranchId);
+                CTxMemPool::setEntries setAncestors;
+                if (!CheckMempoolPolicyWithInputs(pool, vState[i], entry, nModifiedFees, true, setAncestors)) {
+                    vResult[i] = PreVerifyResult::Rejected;
+                    continue;
+                }
+            }
+            vAllPrevOutputs[i] = std::move(allPrevOutputs);
+        }
+    }
+
+    int64_t nStart = GetTimeMicros();
+    const Consensus::Params& consensus = chainparams.GetConsensus();
+
+    // Queue the Sapling and Orchard bundles of every transaction that passes
+    // the other checks into one pair of batch validators. Valid bundles are
+    // stored in the bundle validity caches, where AcceptToMemoryPool will find
+    // them.
+    std::vector<std::optional<PrecomputedTransactionData>> vTxData(vtx.size());
+    std::vector<size_t> vBatched;
+    bool fBatchQueued = true;
+    std::optional<rust::Box<sapling::BatchValidator>> saplingAuth = sapling::init_batch_validator(true);
+    std::optional<rust::Box<orchard::BatchValidator>> orchardAuth = orchard::init_batch_validator(true);
+    for (size_t i = 0; i < vtx.size(); i++) {
+        if (!vAllPrevOutputs[i].has_value())
+            continue;
+        const CTransaction& tx = vtx[i];
+        vTxData[i].emplace(tx, vAllPrevOutputs[i].value());
+        vResult[i] = PreVerifyTransactionWithoutBundles(
+            tx, vAllPrevOutputs[i].value(), vTxData[i].value(), consensusBranchId, vState[i]);
+        if (vResult[i] != PreVerifyResult::Verified)
+            continue;
+
+        // A transaction that fails here may have left part of its bundles in
+        // the validators, so the batch result can't be trusted any more.
+        if (CheckShieldedAuthorization(
+                tx, vTxData[i].value(), vState[i], saplingAuth, orchardAuth,
+                consensus, consensusBranchId, false, IsInitialBlockDownload)) {
+            vBatched.push_back(i);
+        } else {
+            vResult[i] = PreVerifyResult::Rejected;
+            fBatchQueued = false;
+        }
+    }
+
+    bool fSaplingValid = saplingAuth.value()->validate();
+    bool fOrchardValid = orchardAuth.value()->validate();
+    if (fBatchQueued && vBatched.size() == 1 && !(fSaplingValid && fOrchardValid)) {
+        // The only transaction in the batch is the invalid one.
+        size_t i = vBatched[0];
+        vState[i].DoS(100, false, REJECT_INVALID,
+            fSaplingValid ? "bad-orchard-bundle-authorization" : "bad-sapling-bundle-authorization");
+        vResult[i] = PreVerifyResult::Rejected;
+    } else if (!(fBatchQueued && fSaplingValid && fOrchardValid)) {
+        // Something in the batch is invalid. Check each transaction on its
+        // own, so that the valid ones are still cached and the invalid ones
+        // are known.
+        for (size_t i : vBatched) {
+            if (!CheckShieldedAuthorizationAlone(vtx[i], vTxData[i].value(), vState[i], consensus, consensusBranchId))
+                vResult[i] = PreVerifyResult::Rejected;
+        }
+    }
+
+    LogPrint("bench", "    - Verified proofs of %u/%u transactions outside cs_main: %.2fms\n",
+        std::count(vResult.begin(), vResult.end(), PreVerifyResult::Verified), vtx.size(), (GetTimeMicros() - nStart) * 0.001);
+    return vResult;
+}
+
+PreVerifyResult PreVerifyTransaction(const CChainParams& chainparams, CTxMemPool& pool, const CTransaction& tx, CValidationState& state)
+{
+    std::vector<CValidationState> vState;
+    PreVerifyResult result = PreVerifyTransactions(chainparams, pool, {tx}, vState)[0];
+    state = vState[0];
+    return result;
+}
+
+bool AcceptToMemoryPoolWithTime(
+        const CChainParams& chainparams,
+        CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+        bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee, bool fJoinSplitProofsVerified)
+{
+    AssertLockHeld(cs_main);
+    LOCK(pool.cs); // mempool "read lock" (held through pool.addUnchecked())
+    if (pfMissingInputs) {
+        *pfMissingInputs = false;
+    }
+
+    int nextBlockHeight = chainActive.Height() + 1;
+
+    // Grab the branch ID we expect this transaction to commit to.
+    auto consensusBranchId = CurrentEpochBranchId(nextBlockHeight, chainparams.GetConsensus());
+
+    if (pool.IsRecentlyEvicted(tx.GetHash())) {
+        LogPrint("mempool", "Dropping txid %s : recently evicted", tx.GetHash().ToString());
+        return false;
+    }
+
+    // JoinSplit proofs don't depend on the chain state, so there's no need to
+    // verify them again if PreVerifyTransaction already has.
+    auto verifier = fJoinSplitProofsVerified ? ProofVerifier::Disabled() : ProofVerifier::Strict();
+    if (!CheckTransaction(tx, state, verifier))
+        return false;
+
+    // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
+    if (!ContextualCheckTransaction(tx, state, chainparams, nextBlockHeight, false)) {
+        return false;
+    }
+
+    if (!CheckMempoolPolicy(chainparams, pool, state, tx, nextBlockHeight))
+        return false;
+    uint256 hash = tx.GetHash();
+
     {
         CCoinsViewDummy dummy;
         CCoinsViewCache view(&dummy);
@@ -1863,16 +2302,8 @@ bool AcceptToMemoryPool(
         if (chainparams.RequireStandard() && !AreInputsStandard(tx, view, consensusBranchId))
             return state.Invalid(false, REJECT_NONSTANDARD, "bad-txns-nonstandard-inputs");
 
-        // Check that the transaction doesn't have an excessive number of
-        // sigops, making it impossible to mine. Since the coinbase transaction
-        // itself can contain sigops MAX_STANDARD_TX_SIGOPS is less than
-        // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
-        // merely non-standard transaction.
         unsigned int nSigOps = GetLegacySigOpCount(tx);
         nSigOps += GetP2SHSigOpCount(tx, view);
-        if (nSigOps > MAX_STANDARD_TX_SIGOPS)
-            return state.DoS(0, false, REJECT_NONSTANDARD, "bad-txns-too-many-sigops", false,
-                strprintf("%d > %d", nSigOps, MAX_STANDARD_TX_SIGOPS));
 
         CAmount nValueOut = tx.GetValueOut();
         CAmount nFees = nValueIn-nValueOut;
@@ -1894,36 +2325,10 @@ bool AcceptToMemoryPool(
         // For v1-v4 transactions, we don't yet know if the transaction commits
         // to consensusBranchId, but if the entry gets added to the mempool, then
         // it has passed ContextualCheckInputs and therefore this is correct.
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), chainActive.Height(), pool.HasNoInputsOf(tx), fSpendsCoinbase, nSigOps, consensusBranchId);
-        unsigned int nSize = entry.GetTxSize();
-
-        // No transactions are allowed with modified fee below the minimum relay fee,
-        // except from disconnected blocks. The minimum relay fee will never be more
-        // than LEGACY_DEFAULT_FEE zatoshis.
-        CAmount minRelayFee = ::minRelayTxFee.GetFeeForRelay(nSize);
-        if (fLimitFree && nModifiedFees < minRelayFee) {
-            LogPrint("mempool",
-                    "Not accepting transaction with txid %s, size %d bytes, effective fee %d " + MINOR_CURRENCY_UNIT +
-                    ", and fee delta %d " + MINOR_CURRENCY_UNIT + " to the mempool due to insufficient fee. " +
-                    " The minimum acceptance/relay fee for this transaction is %d " + MINOR_CURRENCY_UNIT,
-                    tx.GetHash().ToString(), nSize, nModifiedFees, nModifiedFees - nFees, minRelayFee);
-            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "min relay fee not met");
-        }
-
-        // Transactions with more than `-txunpaidactionlimit` unpaid actions (calculated
-        // using the modified fee) are not accepted to the mempool or relayed.
-        // <https://zips.z.cash/zip-0317#transaction-relaying>
-        size_t nUnpaidActionCount = entry.GetUnpaidActionCount();
-        if (nUnpaidActionCount > nTxUnpaidActionLimit) {
-            LogPrint("mempool",
-                    "Not accepting transaction with txid %s, size %d bytes, effective fee %d " + MINOR_CURRENCY_UNIT +
-                    ", and fee delta %d " + MINOR_CURRENCY_UNIT + " to the mempool because it has %d unpaid actions"
-                    ", which is over the limit of %d. The conventional fee for this transaction is %d " + MINOR_CURRENCY_UNIT,
-                    tx.GetHash().ToString(), nSize, nModifiedFees, nModifiedFees - nFees, nUnpaidActionCount,
-                    nTxUnpaidActionLimit, tx.GetConventionalFee());
-            return state.DoS(0, false, REJECT_INSUFFICIENTFEE,
-                             strprintf("tx unpaid action limit exceeded: %d action(s) exceeds limit of %d", nUnpaidActionCount, nTxUnpaidActionLimit));
-        }
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, chainActive.Height(), pool.HasNoInputsOf(tx), fSpendsCoinbase, nSigOps, consensusBranchId);
+        CTxMemPool::setEntries setAncestors;
+        if (!CheckMempoolPolicyWithInputs(pool, state, entry, nModifiedFees, fLimitFree, setAncestors))
+            return false;
 
         if (fRejectAbsurdFee && nFees > maxTxFee) {
             return state.Invalid(false,
@@ -1931,17 +2336,6 @@ bool AcceptToMemoryPool(
                 strprintf("%d > %d", nFees, maxTxFee));
         }
 
-        // Calculate in-mempool ancestors, up to a limit.
-        CTxMemPool::setEntries setAncestors;
-        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
-        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
-        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
-        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
-        std::string errString;
-        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
-            return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
-        }
-
         // Check against previous transactions
         // This is done near the end to help prevent CPU exhaustion denial-of-service attacks.
         std::vector<CTxOut> allPrevOutputs;
@@ -2032,6 +2426,14 @@ bool AcceptToMemoryPool(
     return true;
 }
 
+bool AcceptToMemoryPool(
+        const CChainParams& chainparams,
+        CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fJoinSplitProofsVerified)
+{
+    return AcceptToMemoryPoolWithTime(chainparams, pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectAbsurdFee, fJoinSplitProofsVerified);
+}
+
 bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
     std::vector<std::pair<uint256, unsigned int> > &hashes)
 {
@@ -2491,6 +2893,26 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+bool CShieldedBatchCheck::operator()() {
+    // Record the outcome for each pool separately rather than failing the
+    // queue, so that the other batches queued for the block still run and
+    // ConnectBlock can report the same reject reason as a serial check would.
+    if (saplingAuth.has_value() && !saplingAuth.value()->validate()) {
+        result->fSaplingValid = false;
+    }
+    if (orchardAuth.has_value() && !orchardAuth.value()->validate()) {
+        result->fOrchardValid = false;
+    }
+    return true;
+}
+
+bool CTransactionCheck::operator()() {
+    // Never fail the queue: every transaction is checked, and the caller
+    // picks the first failure in block order from the recorded results.
+    result->fValid = (*check)(*ptx, result->state);
+    return true;
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -2993,11 +3415,15 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+// Worker threads shared by all of the block validation check queues.
+static CCheckQueuePool validationpool;
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, &validationpool);
+static CCheckQueue<CShieldedBatchCheck> shieldedcheckqueue(1, &validationpool);
+static CCheckQueue<CTransactionCheck> txcheckqueue(4, &validationpool);
 
 void ThreadScriptCheck() {
     RenameThread("zc-scriptcheck");
-    scriptcheckqueue.Thread();
+    validationpool.Thread();
 }
 
 static int64_t nTimeVerify = 0;
@@ -3067,6 +3493,30 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::optional<rust::Box<orchard::BatchValidator>> orchardAuth = fExpensiveChecks ?
         std::optional(orchard::init_batch_validator(fCacheResults)) : std::nullopt;
 
+    // If we have worker threads, hand each full batch of Sapling and Orchard
+    // authorizations off to them as soon as it is queued, instead of
+    // validating everything at the end of the block on this thread.
+    bool fPipelineShieldedChecks = fExpensiveChecks && fPipelinedConnect && nScriptCheckThreads;
+    CShieldedBatchCheck::Result shieldedResult;
+    CCheckQueueControl<CShieldedBatchCheck> shieldedControl(fPipelineShieldedChecks ? &shieldedcheckqueue : NULL);
+    size_t nSaplingQueued = 0;
+    size_t nOrchardQueued = 0;
+    auto dispatchShieldedBatch = [&]() {
+        if (nSaplingQueued == 0 && nOrchardQueued == 0) return;
+        std::vector<CShieldedBatchCheck> vShieldedChecks;
+        vShieldedChecks.emplace_back(
+            nSaplingQueued > 0 ?
+                std::exchange(saplingAuth, sapling::init_batch_validator(fCacheResults)) :
+                std::nullopt,
+            nOrchardQueued > 0 ?
+                std::exchange(orchardAuth, orchard::init_batch_validator(fCacheResults)) :
+                std::nullopt,
+            &shieldedResult);
+        shieldedControl.Add(vShieldedChecks);
+        nSaplingQueued = 0;
+        nOrchardQueued = 0;
+    };
+
     // If in initial block download, and this block is an ancestor of a checkpoint,
     // and -ibdskiptxverification is set, disable all transaction checks.
     bool fCheckTransactions = ShouldCheckTransactions(chainparams, pindex);
@@ -3264,12 +3714,17 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             // Which orphan pool entries must we evict?
             for (size_t j = 0; j < tx.vin.size(); j++) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(tx.vin[j].prevout);
-                if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
-                for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
+                auto itByParent = mapOrphanTransactionsByParent.find(tx.vin[j].prevout.hash);
+                if (itByParent == mapOrphanTransactionsByParent.end()) continue;
+                for (auto mi = itByParent->second.begin(); mi != itByParent->second.end(); ++mi) {
+                    // Only the orphans that spend this same output conflict with the block.
                     const CTransaction& orphanTx = (*mi)->second.tx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    vOrphanErase.push_back(orphanHash);
+                    for (const CTxIn& orphanIn : orphanTx.vin) {
+                        if (orphanIn.prevout == tx.vin[j].prevout) {
+                            vOrphanErase.push_back(orphanTx.GetHash());
+                            break;
+                        }
+                    }
                 }
             }
 
@@ -3357,6 +3812,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 FormatStateMessage(state));
         }
 
+        if (fPipelineShieldedChecks) {
+            nSaplingQueued += tx.GetSaplingSpendsCount() + tx.GetSaplingOutputsCount();
+            nOrchardQueued += tx.GetOrchardBundle().GetNumActions();
+            if (nSaplingQueued >= PIPELINED_CONNECT_BATCH_SIZE ||
+                nOrchardQueued >= PIPELINED_CONNECT_BATCH_SIZE)
+            {
+                dispatchShieldedBatch();
+            }
+        }
+
         // insightexplorer
         // https://github.com/bitpay/bitcoin/commit/017f548ea6d89423ef568117447e61dd5707ec42#diff-7ec3c68a81efff79b6ca22ac1f1eabbaR2656
         if (fAddressIndex) {
@@ -3393,8 +3858,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             }
         }
 
-        for (const auto &outputDescription : tx.GetSaplingOutputs()) {
-            sapling_tree.append(uint256::FromRawBytes(outputDescription.cmu()));
+        for (const uint256 &cmu : tx.GetSaplingBundle().GetNoteCommitments()) {
+            sapling_tree.append(cmu);
 
             if (fUpdateSaplingSubtrees) {
                 auto completeSubtreeRoot = sapling_tree.complete_subtree_root();
@@ -3450,6 +3915,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
 
+    // Hand off whatever remains of the last batch, so that it is checked
+    // while we compute the block commitments and history node.
+    if (fPipelineShieldedChecks) {
+        dispatchShieldedBatch();
+    }
+
     // Derive the various block commitments.
     // We only derive them if they will be used for this block.
     std::optional<uint256> hashAuthDataRoot;
@@ -3636,15 +4107,26 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
+    // Join the batches that were handed off to the worker threads. When
+    // pipelining, saplingAuth and orchardAuth are left holding empty
+    // validators, which trivially succeed below.
+    if (fPipelineShieldedChecks) {
+        shieldedControl.Wait();
+    }
+
     // Ensure Sapling authorizations are valid (if we are checking them)
-    if (saplingAuth.has_value() && !saplingAuth.value()->validate()) {
+    if (!shieldedResult.fSaplingValid ||
+        (saplingAuth.has_value() && !saplingAuth.value()->validate()))
+    {
         return state.DoS(100,
             error("%s: a Sapling bundle within the block is invalid", __func__),
             REJECT_INVALID, "bad-sapling-bundle-authorization");
     }
 
     // Ensure Orchard signatures are valid (if we are checking them)
-    if (orchardAuth.has_value() && !orchardAuth.value()->validate()) {
+    if (!shieldedResult.fOrchardValid ||
+        (orchardAuth.has_value() && !orchardAuth.value()->validate()))
+    {
         return state.DoS(100,
             error("%s: an Orchard bundle within the block is invalid", __func__),
             REJECT_INVALID, "bad-orchard-bundle-authorization");
@@ -3759,11 +4241,42 @@ enum FlushStateMode {
  * if they're too large, if it's been a while since the last write,
  * or always and in all cases if we're in prune mode and are deleting files.
  */
+/**
+ * An incremental coins flush writes its snapshot after releasing cs_main. A
+ * full flush must not overtake it, or the older snapshot would be written on
+ * top of the newer state.
+ */
+static Mutex csCoinsWrite;
+static std::condition_variable condCoinsWrite;
+static bool fCoinsWriteInProgress = false; // protected by csCoinsWrite
+//! The last snapshot written, which pcoinsTip has yet to drop; protected by csCoinsWrite
+static std::unique_ptr<CCoinsCacheSnapshot> pCoinsSnapshotWritten;
+
+//! Let pcoinsTip drop what the last incremental flush wrote. Requires cs_main
+//! and csCoinsWrite.
+static void ReleaseWrittenCoinsSnapshot() {
+    if (pCoinsSnapshotWritten) {
+        pcoinsTip->SnapshotWritten(*pCoinsSnapshotWritten);
+        pCoinsSnapshotWritten.reset();
+    }
+}
+
+static void WaitForCoinsWrite() {
+    WAIT_LOCK(csCoinsWrite, lock);
+    condCoinsWrite.wait(lock, []{ return !fCoinsWriteInProgress; });
+}
+
 bool static FlushStateToDisk(
     const CChainParams& chainparams,
     CValidationState &state,
     FlushStateMode mode) {
+    std::unique_ptr<CCoinsCacheSnapshot> pSnapshot;
+    {
     LOCK2(cs_main, cs_LastBlockFile);
+    {
+        LOCK(csCoinsWrite);
+        ReleaseWrittenCoinsSnapshot();
+    }
     static int64_t nLastWrite = 0;
     static int64_t nLastFlush = 0;
     std::set<int> setFilesToPrune;
@@ -3798,9 +4311,11 @@ bool static FlushStateToDisk(
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
     bool fPeriodicFlush = mode == FLUSH_STATE_PERIODIC && nNow > nLastFlush + (int64_t)DATABASE_FLUSH_INTERVAL * 1000000;
     // Combine all conditions that result in a full cache flush.
-    bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune;
+    bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || (fPeriodicFlush && !fIncrementalCoinsFlush) || fFlushForPrune;
+    // Otherwise, write the dirty part of the cache along with the block index, keeping the cache warm.
+    bool fDoPartialFlush = !fDoFullFlush && fIncrementalCoinsFlush && (fPeriodicWrite || fPeriodicFlush);
     // Write blocks and block index to disk.
-    if (fDoFullFlush || fPeriodicWrite) {
+    if (fDoFullFlush || fPeriodicWrite || fDoPartialFlush) {
         // Depend on nMinDiskSpace to ensure we can write block index
         if (!CheckDiskSpace(0))
             return state.Error("out of disk space");
@@ -3844,16 +4359,67 @@ bool static FlushStateToDisk(
         // overwrite one. Still, use a conservative safety factor of 2.
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
+        // Wait for any incremental flush that is still being written.
+        WaitForCoinsWrite();
+        {
+            LOCK(csCoinsWrite);
+            // The full flush writes and empties everything that the last
+            // snapshot held.
+            pCoinsSnapshotWritten.reset();
+        }
         // Flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
+    } else if (fDoPartialFlush) {
+        LOCK(csCoinsWrite);
+        // If the previous incremental flush is still being written, its
+        // successor will pick up the changes.
+        if (!fCoinsWriteInProgress) {
+            // The previous snapshot may have been written since we checked.
+            ReleaseWrittenCoinsSnapshot();
+            // See above; the cache size is an upper bound on what gets written.
+            if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+                return state.Error("out of disk space");
+            pSnapshot.reset(new CCoinsCacheSnapshot());
+            pcoinsTip->Snapshot(*pSnapshot);
+            fCoinsWriteInProgress = true;
+            nLastFlush = nNow;
+        }
     }
     // Don't flush the wallet witness cache (SetBestChain()) here, see #4301
     } catch (const std::runtime_error& e) {
         return AbortNode(state, std::string("System error while flushing: ") + e.what());
     }
-    return true;
+    }
+
+    if (pSnapshot) {
+        // Write the snapshot without holding cs_main. The cache keeps serving
+        // every entry in the snapshot, so nothing reads them from the database
+        // until the write has completed.
+        int64_t nStart = GetTimeMicros();
+        size_t nCoins = pSnapshot->cacheCoins.size();
+        bool fOk = false;
+        std::string strError = "Failed to write to coin database";
+        try {
+            fOk = pcoinsTip->WriteSnapshot(*pSnapshot);
+        } catch (const std::runtime_error& e) {
+            strError = std::string("System error while flushing: ") + e.what();
+        }
+        {
+            LOCK(csCoinsWrite);
+            fCoinsWriteInProgress = false;
+            if (fOk) {
+                pCoinsSnapshotWritten = std::move(pSnapshot);
+            }
+        }
+        pSnapshot.reset();
+        condCoinsWrite.notify_all();
+        if (!fOk)
+            return AbortNode(state, strError);
+        LogPrint("bench", "    - Incremental coins flush: %u transactions in %.2fms\n", (unsigned int)nCoins, (GetTimeMicros() - nStart) * 0.001);
+    }
+    return true;
 }
 
 void FlushStateToDisk() {
@@ -4126,14 +4692,14 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         return false;
     int64_t nTime5 = GetTimeMicros(); nTimeChainState += nTime5 - nTime4;
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
-    // Remove conflicting transactions from the mempool.
-    std::list<CTransaction> txConflicted;
-    mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted);
-
-    // Remove transactions that expire at new block height from mempool
-    auto ids = mempool.removeExpired(pindexNew->nHeight);
-
-    for (auto id : ids) {
+    // Remove the block's transactions from the mempool, together with the
+    // transactions that conflict with them and those that expire at the new
+    // block height.
+    MempoolRemovalsForBlock removals = mempool.removeForBlock(pblock->vtx, pindexNew->nHeight);
+    LogPrint("mempool", "Removed %u confirmed, %u conflicted and %u expired transactions from the mempool\n",
+        removals.nConfirmed, removals.conflicted.size(), removals.expired.size());
+
+    for (const uint256& id : removals.expired) {
         uiInterface.NotifyTxExpiration(id);
     }
 
@@ -4142,7 +4708,7 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
 
     // Cache the conflicted transactions for subsequent notification.
     // Updates to connected wallets are triggered by ThreadNotifyWallets
-    recentlyConflictedTxs.insert(std::make_pair(pindexNew, txConflicted));
+    recentlyConflictedTxs.insert(std::make_pair(pindexNew, std::move(removals.conflicted)));
 
     // Increment the count of `ConnectTip` calls.
     nConnectedSequence += 1;
@@ -4262,6 +4828,215 @@ static void PruneBlockIndexCandidates() {
     assert(!setBlockIndexCandidates.empty());
 }
 
+/**
+ * The shielded components of a transaction, together with the signature hash
+ * they commit to, queued for cross-block batch validation.
+ */
+struct ShieldedAuthItem {
+    const CTransaction* tx;
+    uint256 sighash;
+};
+
+/**
+ * Batch-validates the Sapling and Orchard authorizations of the given blocks,
+ * storing the bundles of every batch that succeeds in the bundle validity
+ * caches. Returns false if either batch fails.
+ */
+static bool BatchValidateShieldedAuth(
+    std::vector<std::vector<ShieldedAuthItem>>::const_iterator begin,
+    std::vector<std::vector<ShieldedAuthItem>>::const_iterator end)
+{
+    auto saplingAuth = sapling::init_batch_validator(true);
+    auto orchardAuth = orchard::init_batch_validator(true);
+    for (auto it = begin; it != end; ++it) {
+        for (const auto& item : *it) {
+            if (!item.tx->GetSaplingBundle().QueueAuthValidation(*saplingAuth, item.sighash)) {
+                return false;
+            }
+            item.tx->GetOrchardBundle().QueueAuthValidation(*orchardAuth, item.sighash);
+        }
+    }
+    // Validate both pools even if the first fails, so that the valid one is
+    // cached and does not need to be re-checked while bisecting.
+    bool fSaplingValid = saplingAuth->validate();
+    bool fOrchardValid = orchardAuth->validate();
+    return fSaplingValid && fOrchardValid;
+}
+
+/**
+ * Bisects the given range of blocks until every batch either succeeds or
+ * consists of a single block. A failing block is left for ConnectBlock to
+ * reject with the usual reject reason and DoS score.
+ */
+static void PrevalidateShieldedAuth(
+    std::vector<std::vector<ShieldedAuthItem>>::const_iterator begin,
+    std::vector<std::vector<ShieldedAuthItem>>::const_iterator end)
+{
+    if (begin == end || BatchValidateShieldedAuth(begin, end) || end - begin == 1) {
+        return;
+    }
+    auto mid = begin + (end - begin) / 2;
+    PrevalidateShieldedAuth(begin, mid);
+    PrevalidateShieldedAuth(mid, end);
+}
+
+std::vector<CBlockIndex*> GetIBDPrevalidationWindow(
+    const CChainParams& chainparams,
+    const std::vector<CBlockIndex*>& vpindexToConnect,
+    const CBlockIndex* pindexBestHeaderIn,
+    const CBlockIndex* pindexPrevalidatedIn)
+{
+    std::vector<CBlockIndex*> vpindexWindow;
+    if (vpindexToConnect.empty()) {
+        return vpindexWindow;
+    }
+
+    // Never delay blocks close to the tip to wait for a batch to fill up.
+    CBlockIndex* pindexLast = vpindexToConnect.front();
+    if (pindexBestHeaderIn == nullptr ||
+        pindexBestHeaderIn->nHeight - pindexLast->nHeight < (int)IBD_BATCH_PROOFS_MIN_TIP_DISTANCE)
+    {
+        return vpindexWindow;
+    }
+
+    // ActivateBestChainStep returns after each block that improves on the
+    // tip, so only start a new window once the previous one has been used up.
+    CBlockIndex* pindexNext = vpindexToConnect.back();
+    if (pindexPrevalidatedIn != nullptr &&
+        pindexPrevalidatedIn->nHeight >= pindexNext->nHeight &&
+        pindexPrevalidatedIn->GetAncestor(pindexNext->nHeight) == pindexNext)
+    {
+        return vpindexWindow;
+    }
+
+    // Blocks that are ancestors of the last checkpoint skip these checks.
+    if (fCheckpointsEnabled && Checkpoints::IsAncestorOfLastCheckpoint(chainparams.Checkpoints(), pindexLast)) {
+        return vpindexWindow;
+    }
+
+    for (auto it = vpindexToConnect.rbegin();
+         it != vpindexToConnect.rend() && vpindexWindow.size() < IBD_BATCH_PROOFS_WINDOW;
+         ++it)
+    {
+        if (fCheckpointsEnabled && Checkpoints::IsAncestorOfLastCheckpoint(chainparams.Checkpoints(), *it)) {
+            continue;
+        }
+        vpindexWindow.push_back(*it);
+    }
+    return vpindexWindow;
+}
+
+/**
+ * During initial block download, validates the Sapling and Orchard
+ * authorizations of the blocks in vpindexToConnect (ordered from highest to
+ * lowest, as built by ActivateBestChainStep) as a single batch, so that the
+ * cost of the batch is spread over more proofs than a single block contains.
+ *
+ * This only populates the bundle validity caches, which ConnectBlock consults
+ * before queueing each bundle; it never causes a block to be accepted or
+ * rejected. Transactions whose signature hash can't be computed yet are
+ * skipped and left for ConnectBlock to check.
+ */
+static void PrevalidateShieldedAuthForIBD(
+    const CChainParams& chainparams,
+    const std::vector<CBlockIndex*>& vpindexToConnect,
+    CBlockIndex* pindexMostWork,
+    const CBlock* pblock)
+{
+    AssertLockHeld(cs_main);
+
+    if (!fIBDBatchProofs || !IsInitialBlockDownload(chainparams.GetConsensus())) {
+        return;
+    }
+
+    std::vector<CBlockIndex*> vpindexCandidates = GetIBDPrevalidationWindow(
+        chainparams, vpindexToConnect, pindexBestHeader, pindexIBDPrevalidated);
+    if (vpindexCandidates.empty()) {
+        return;
+    }
+
+    int64_t nTimeStart = GetTimeMicros();
+    const auto& consensusParams = chainparams.GetConsensus();
+
+    std::vector<CBlock> vBlocks;
+    vBlocks.reserve(vpindexCandidates.size());
+    std::vector<const CBlock*> vpblocks;
+    std::vector<CBlockIndex*> vpindexWindow;
+    for (CBlockIndex* pindex : vpindexCandidates) {
+        if (pblock && pindex == pindexMostWork) {
+            vpblocks.push_back(pblock);
+        } else {
+            vBlocks.emplace_back();
+            if (!ReadBlockFromDisk(vBlocks.back(), pindex, consensusParams)) {
+                // ActivateBestChainStep will report this when it tries to
+                // connect the block.
+                vBlocks.pop_back();
+                break;
+            }
+            vpblocks.push_back(&vBlocks.back());
+        }
+        vpindexWindow.push_back(pindex);
+    }
+    if (vpindexWindow.empty()) {
+        return;
+    }
+
+    // Outputs created by earlier transactions in the window are not yet in
+    // pcoinsTip, so look them up in the window itself first.
+    std::map<uint256, const CTransaction*> mapWindowTx;
+    std::vector<std::unique_ptr<PrecomputedTransactionData>> vTxData;
+    std::vector<std::vector<ShieldedAuthItem>> vItems(vpblocks.size());
+    size_t nQueued = 0;
+    for (size_t i = 0; i < vpblocks.size(); i++) {
+        auto consensusBranchId = CurrentEpochBranchId(vpindexWindow[i]->nHeight, consensusParams);
+        for (const CTransaction& tx : vpblocks[i]->vtx) {
+            mapWindowTx.emplace(tx.GetHash(), &tx);
+            if (!tx.GetSaplingBundle().IsPresent() && !tx.GetOrchardBundle().IsPresent()) {
+                continue;
+            }
+
+            std::vector<CTxOut> allPrevOutputs;
+            bool fHavePrevOutputs = true;
+            if (!tx.IsCoinBase()) {
+                for (const CTxIn& input : tx.vin) {
+                    auto itWindow = mapWindowTx.find(input.prevout.hash);
+                    if (itWindow != mapWindowTx.end() && input.prevout.n < itWindow->second->vout.size()) {
+                        allPrevOutputs.push_back(itWindow->second->vout[input.prevout.n]);
+                        continue;
+                    }
+                    const CCoins* coins = pcoinsTip->AccessCoins(input.prevout.hash);
+                    if (coins == nullptr || !coins->IsAvailable(input.prevout.n)) {
+                        fHavePrevOutputs = false;
+                        break;
+                    }
+                    allPrevOutputs.push_back(coins->vout[input.prevout.n]);
+                }
+            }
+            if (!fHavePrevOutputs) {
+                continue;
+            }
+
+            try {
+                vTxData.push_back(std::make_unique<PrecomputedTransactionData>(tx, allPrevOutputs));
+                CScript scriptCode;
+                uint256 sighash = SignatureHash(
+                    scriptCode, tx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId, *vTxData.back());
+                vItems[i].push_back({&tx, sighash});
+                nQueued++;
+            } catch (const std::exception&) {
+                // Leave malformed transactions for ConnectBlock to reject.
+            }
+        }
+    }
+
+    PrevalidateShieldedAuth(vItems.cbegin(), vItems.cend());
+    pindexIBDPrevalidated = vpindexWindow.back();
+
+    int64_t nTimeEnd = GetTimeMicros();
+    LogPrint("bench", "  - Prevalidate %u shielded txs in %u blocks: %.2fms\n",
+        (unsigned)nQueued, (unsigned)vpindexWindow.size(), (nTimeEnd - nTimeStart) * 0.001);
+}
+
 /**
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
@@ -4322,6 +5097,8 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
         }
         nHeight = nTargetHeight;
 
+        PrevalidateShieldedAuthForIBD(chainparams, vpindexToConnect, pindexMostWork, pblock);
+
         // Connect new blocks.
         for (CBlockIndex *pindexConnect : reverse_iterate(vpindexToConnect)) {
             int64_t nTime1 = GetTimeMicros();
@@ -4723,6 +5500,61 @@ void SetChainPoolValues(
     pindex->nChainLockboxValue = std::nullopt;
 }
 
+/**
+ * Compute the chain transaction count and the chain value pool balances of
+ * `pindex` from those of its parent, which must already be set. The chain
+ * supply and transparent value are set by `ConnectBlock` instead.
+ */
+static void SetChainTotals(const CChainParams& chainparams, CBlockIndex *pindex)
+{
+    pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+
+    if (pindex->pprev) {
+        // Transparent value and chain total supply are added to the
+        // block index only in `ConnectBlock`, because that's the only
+        // place that we have a valid coins view with which to compute
+        // the transparent input value and fees.
+
+        // Calculate the block's effect on the Sprout chain value pool balance.
+        if (pindex->pprev->nChainSproutValue && pindex->nSproutValue) {
+            pindex->nChainSproutValue = *pindex->pprev->nChainSproutValue + *pindex->nSproutValue;
+        } else {
+            pindex->nChainSproutValue = std::nullopt;
+        }
+
+        // Calculate the block's effect on the Sapling chain value pool balance.
+        if (pindex->pprev->nChainSaplingValue) {
+            pindex->nChainSaplingValue = *pindex->pprev->nChainSaplingValue + pindex->nSaplingValue;
+        } else {
+            pindex->nChainSaplingValue = std::nullopt;
+        }
+
+        // Calculate the block's effect on the Orchard chain value pool balance.
+        if (pindex->pprev->nChainOrchardValue) {
+            pindex->nChainOrchardValue = *pindex->pprev->nChainOrchardValue + pindex->nOrchardValue;
+        } else {
+            pindex->nChainOrchardValue = std::nullopt;
+        }
+
+        // Calculate the block's effect on the Lockbox balance
+        if (pindex->pprev->nChainLockboxValue) {
+            pindex->nChainLockboxValue = *pindex->pprev->nChainLockboxValue + pindex->nLockboxValue;
+        } else {
+            pindex->nChainLockboxValue = std::nullopt;
+        }
+    } else {
+        pindex->nChainTotalSupply = pindex->nChainSupplyDelta;
+        pindex->nChainTransparentValue = pindex->nTransparentValue;
+        pindex->nChainSproutValue = pindex->nSproutValue;
+        pindex->nChainSaplingValue = pindex->nSaplingValue;
+        pindex->nChainOrchardValue = pindex->nOrchardValue;
+        pindex->nChainLockboxValue = pindex->nLockboxValue;
+    }
+
+    // Fall back to hardcoded Sprout value pool balance
+    FallbackSproutValuePoolBalance(pindex, chainparams);
+}
+
 /**
  * Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS).
  * The caller is expected to mark `pindexNew` as dirty by adding it to `setDirtyBlockIndex`.
@@ -4752,52 +5584,7 @@ bool ReceivedBlockTransactions(
         while (!queue.empty()) {
             CBlockIndex *pindex = queue.front();
             queue.pop_front();
-            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-
-            if (pindex->pprev) {
-                // Transparent value and chain total supply are added to the
-                // block index only in `ConnectBlock`, because that's the only
-                // place that we have a valid coins view with which to compute
-                // the transparent input value and fees.
-
-                // Calculate the block's effect on the Sprout chain value pool balance.
-                if (pindex->pprev->nChainSproutValue && pindex->nSproutValue) {
-                    pindex->nChainSproutValue = *pindex->pprev->nChainSproutValue + *pindex->nSproutValue;
-                } else {
-                    pindex->nChainSproutValue = std::nullopt;
-                }
-
-                // Calculate the block's effect on the Sapling chain value pool balance.
-                if (pindex->pprev->nChainSaplingValue) {
-                    pindex->nChainSaplingValue = *pindex->pprev->nChainSaplingValue + pindex->nSaplingValue;
-                } else {
-                    pindex->nChainSaplingValue = std::nullopt;
-                }
-
-                // Calculate the block's effect on the Orchard chain value pool balance.
-                if (pindex->pprev->nChainOrchardValue) {
-                    pindex->nChainOrchardValue = *pindex->pprev->nChainOrchardValue + pindex->nOrchardValue;
-                } else {
-                    pindex->nChainOrchardValue = std::nullopt;
-                }
-
-                // Calculate the block's effect on the Lockbox balance
-                if (pindex->pprev->nChainLockboxValue) {
-                    pindex->nChainLockboxValue = *pindex->pprev->nChainLockboxValue + pindex->nLockboxValue;
-                } else {
-                    pindex->nChainLockboxValue = std::nullopt;
-                }
-            } else {
-                pindex->nChainTotalSupply = pindex->nChainSupplyDelta;
-                pindex->nChainTransparentValue = pindex->nTransparentValue;
-                pindex->nChainSproutValue = pindex->nSproutValue;
-                pindex->nChainSaplingValue = pindex->nSaplingValue;
-                pindex->nChainOrchardValue = pindex->nOrchardValue;
-                pindex->nChainLockboxValue = pindex->nLockboxValue;
-            }
-
-            // Fall back to hardcoded Sprout value pool balance
-            FallbackSproutValuePoolBalance(pindex, chainparams);
+            SetChainTotals(chainparams, pindex);
 
             {
                 LOCK(cs_nBlockSequenceId);
@@ -4939,6 +5726,47 @@ bool CheckBlockHeader(
     return true;
 }
 
+/**
+ * Run a transaction-local check over every transaction in the block, on the
+ * validation worker threads if they are available. Returns the index of the
+ * first transaction in the block that failed the check, with its failure
+ * recorded in state, or std::nullopt if all of them passed.
+ */
+static std::optional<size_t> CheckBlockTransactions(
+    const CBlock& block,
+    CValidationState& state,
+    const CTransactionCheck::Function& check)
+{
+    if (!nScriptCheckThreads || !fParallelBlockTxChecks || block.vtx.size() < 2) {
+        for (size_t i = 0; i < block.vtx.size(); i++) {
+            if (!check(block.vtx[i], state)) {
+                return i;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::vector<CTransactionCheck::Result> vResults(block.vtx.size());
+    {
+        CCheckQueueControl<CTransactionCheck> control(&txcheckqueue);
+        std::vector<CTransactionCheck> vChecks;
+        vChecks.reserve(block.vtx.size());
+        for (size_t i = 0; i < block.vtx.size(); i++) {
+            vChecks.emplace_back(&check, &block.vtx[i], &vResults[i]);
+        }
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    for (size_t i = 0; i < vResults.size(); i++) {
+        if (!vResults[i].fValid) {
+            state = vResults[i].state;
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
 bool CheckBlock(const CBlock& block,
                 CValidationState& state,
                 const CChainParams& chainparams,
@@ -4995,11 +5823,14 @@ bool CheckBlock(const CBlock& block,
     if (!fCheckTransactions) return true;
 
     // Check transactions
-    for (const CTransaction& tx : block.vtx)
-        if (!CheckTransaction(tx, state, verifier))
-            return error("CheckBlock(): CheckTransaction of %s failed with %s",
-                tx.GetHash().ToString(),
-                FormatStateMessage(state));
+    auto invalid = CheckBlockTransactions(block, state,
+        [&](const CTransaction& tx, CValidationState& txState) {
+            return CheckTransaction(tx, txState, verifier);
+        });
+    if (invalid.has_value())
+        return error("CheckBlock(): CheckTransaction of %s failed with %s",
+            block.vtx[invalid.value()].GetHash().ToString(),
+            FormatStateMessage(state));
 
     unsigned int nSigOps = 0;
     for (const CTransaction& tx : block.vtx)
@@ -5091,22 +5922,27 @@ bool ContextualCheckBlock(
     const Consensus::Params& consensusParams = chainparams.GetConsensus();
 
     if (fCheckTransactions) {
-        // Check that all transactions are finalized
-        for (const CTransaction& tx : block.vtx) {
+        int nLockTimeFlags = 0;
+        int64_t nLockTimeCutoff = (nLockTimeFlags & LOCKTIME_MEDIAN_TIME_PAST)
+                                ? pindexPrev->GetMedianTimePast()
+                                : block.GetBlockTime();
 
-            // Check transaction contextually against consensus rules at block height
-            if (!ContextualCheckTransaction(tx, state, chainparams, nHeight, true)) {
-                return false; // Failure reason has been set in validation state object
-            }
+        // Check that all transactions are finalized
+        auto invalid = CheckBlockTransactions(block, state,
+            [&](const CTransaction& tx, CValidationState& txState) {
+                // Check transaction contextually against consensus rules at block height
+                if (!ContextualCheckTransaction(tx, txState, chainparams, nHeight, true)) {
+                    return false; // Failure reason has been set in validation state object
+                }
 
-            int nLockTimeFlags = 0;
-            int64_t nLockTimeCutoff = (nLockTimeFlags & LOCKTIME_MEDIAN_TIME_PAST)
-                                    ? pindexPrev->GetMedianTimePast()
-                                    : block.GetBlockTime();
-            if (!IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
-                return state.DoS(10, error("%s: contains a non-final transaction", __func__),
-                                 REJECT_INVALID, "bad-txns-nonfinal");
-            }
+                if (!IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
+                    return txState.DoS(10, error("%s: contains a non-final transaction", __func__),
+                                       REJECT_INVALID, "bad-txns-nonfinal");
+                }
+                return true;
+            });
+        if (invalid.has_value()) {
+            return false;
         }
     }
 
@@ -5226,7 +6062,12 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
     if (!AcceptBlockHeader(block, state, chainparams, &pindex))
         return false;
 
-    SetChainPoolValues(chainparams, block, pindex);
+    // Until the chain below it has been validated, the index entry for the
+    // base of a chain state snapshot holds the snapshot's chain totals, so
+    // its block is only written to disk for ThreadValidateSnapshot to use.
+    bool fSnapshotBase = (pindex == pindexSnapshotBase);
+    if (!fSnapshotBase)
+        SetChainPoolValues(chainparams, block, pindex);
 
     // Try to process all requested blocks that we don't have, but only
     // process an unrequested block if it's new and has enough work to
@@ -5255,6 +6096,11 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
     bool fCheckTransactions = ShouldCheckTransactions(chainparams, pindex);
     if ((!CheckBlock(block, state, chainparams, verifier, true, true, fCheckTransactions)) ||
          !ContextualCheckBlock(block, state, chainparams, pindex->pprev, fCheckTransactions)) {
+        if (state.IsInvalid() && !state.CorruptionPossible() && fSnapshotBase) {
+            // The active chain is built on this block.
+            return AbortNode(state, "The base block of the chain state snapshot is invalid",
+                _("The chain state snapshot is not for a valid block. You need to rebuild the database using -reindex."));
+        }
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
             setDirtyBlockIndex.insert(pindex);
@@ -5279,7 +6125,12 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
             }
         }
         setDirtyBlockIndex.insert(pindex);
-        if (!ReceivedBlockTransactions(block, state, chainparams, pindex, blockPos)) {
+        if (fSnapshotBase) {
+            pindex->nFile = blockPos.nFile;
+            pindex->nDataPos = blockPos.nPos;
+            pindex->nUndoPos = 0;
+            pindex->nStatus |= BLOCK_HAVE_DATA;
+        } else if (!ReceivedBlockTransactions(block, state, chainparams, pindex, blockPos)) {
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
         }
     } catch (const std::runtime_error& e) {
@@ -5439,6 +6290,11 @@ void FindFilesToPrune(std::set<int>& setFilesToPrune, uint64_t nPruneAfterHeight
     if (chainActive.Tip()->nHeight <= nPruneAfterHeight) {
         return;
     }
+    // The blocks below a chain state snapshot are kept until they have been
+    // validated.
+    if (pindexSnapshotBase != NULL) {
+        return;
+    }
 
     unsigned int nLastBlockWeCanPrune = chainActive.Tip()->nHeight - MIN_BLOCKS_TO_KEEP;
     uint64_t nCurrentUsage = CalculateCurrentUsage();
@@ -5565,7 +6421,8 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
         if (pindex->nTx > 0) {
-            if (pindex->pprev) {
+            // The base of a chain state snapshot holds the chain totals itself.
+            if (pindex->pprev && !(pindex->nStatus & BLOCK_SNAPSHOT_BASE)) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
 
@@ -5642,7 +6499,12 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
         // Genesis block has a branch ID of zero by definition, but has no
         // validity status because it is side-loaded into a fresh chain.
         // Activation blocks will have branch IDs set (read from disk).
-        if (pindex->pprev) {
+        // The base of a chain state snapshot has no validated parent to
+        // inherit from.
+        if (pindex->nStatus & BLOCK_SNAPSHOT_BASE) {
+            pindex->nCachedBranchId = CurrentEpochBranchId(pindex->nHeight, chainparams.GetConsensus());
+            pindexSnapshotBase = pindex;
+        } else if (pindex->pprev) {
             if (pindex->IsValid(BLOCK_VALID_CONSENSUS) && !pindex->nCachedBranchId) {
                 pindex->nCachedBranchId = pindex->pprev->nCachedBranchId;
             }
@@ -5739,23 +6601,595 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
         }
     }
 
-    // Load pointer to end of best chain
-    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
-    if (it == mapBlockIndex.end())
-        return true;
-    chainActive.SetTip(it->second);
-    // Set hashFinalSproutRoot for the end of best chain
-    it->second->hashFinalSproutRoot = pcoinsTip->GetBestAnchor(SPROUT);
+    // Load pointer to end of best chain
+    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+    if (it == mapBlockIndex.end())
+        return true;
+    chainActive.SetTip(it->second);
+    // Set hashFinalSproutRoot for the end of best chain
+    it->second->hashFinalSproutRoot = pcoinsTip->GetBestAnchor(SPROUT);
+
+    PruneBlockIndexCandidates();
+
+    LogPrintf("%s: hashBestChain=%s height=%d date=%s progress=%f\n", __func__,
+        chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
+        DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
+        Checkpoints::GuessVerificationProgress(chainparams.Checkpoints(), chainActive.Tip()));
+
+    EnforceNodeDeprecation(chainparams, chainActive.Height(), true);
+
+    return true;
+}
+
+/** Describe the chain state in view, whose best block is pindex, for a snapshot. */
+static void GetChainstateSnapshotMetadata(const CChainParams& chainparams, const CBlockIndex* pindex, const CCoinsView& view, CChainstateSnapshotMetadata& metadata)
+{
+    memcpy(metadata.pchMessageStart, chainparams.MessageStart(), sizeof(metadata.pchMessageStart));
+    metadata.hashBlock = pindex->GetBlockHash();
+    metadata.nHeight = pindex->nHeight;
+    metadata.nChainTx = pindex->nChainTx;
+    metadata.nChainTotalSupply = pindex->nChainTotalSupply;
+    metadata.nChainTransparentValue = pindex->nChainTransparentValue;
+    metadata.nChainSproutValue = pindex->nChainSproutValue;
+    metadata.nChainSaplingValue = pindex->nChainSaplingValue;
+    metadata.nChainOrchardValue = pindex->nChainOrchardValue;
+    metadata.nChainLockboxValue = pindex->nChainLockboxValue;
+    metadata.hashSproutAnchor = view.GetBestAnchor(SPROUT);
+    metadata.hashSaplingAnchor = view.GetBestAnchor(SAPLING);
+    metadata.hashOrchardAnchor = view.GetBestAnchor(ORCHARD);
+    metadata.hashAuthDataRoot = pindex->hashAuthDataRoot;
+    metadata.hashFinalSaplingRoot = pindex->hashFinalSaplingRoot;
+    metadata.hashFinalOrchardRoot = pindex->hashFinalOrchardRoot;
+    metadata.hashChainHistoryRoot = pindex->hashChainHistoryRoot;
+}
+
+bool DumpChainstateSnapshot(const fs::path& path, CChainstateSnapshotMetadata& metadata, uint256& hashSnapshot, uint64_t& nRecords, CValidationState& state)
+{
+    const CChainParams& chainparams = Params();
+
+    // Hold cs_main throughout, so that the coin database stays at the tip
+    // that the metadata describes.
+    LOCK(cs_main);
+    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS))
+        return false;
+
+    CBlockIndex* pindex = chainActive.Tip();
+    if (pindex == NULL)
+        return state.Error("no active chain to take a snapshot of");
+    if (pindexSnapshotBase != NULL)
+        return state.Error("the blocks below the loaded chain state snapshot have not been validated yet");
+    assert(pcoinsdbview->GetBestBlock() == pindex->GetBlockHash());
+
+    GetChainstateSnapshotMetadata(chainparams, pindex, *pcoinsdbview, metadata);
+
+    // Write to a temporary file, so that an interrupted dump doesn't leave
+    // something that looks like a snapshot behind.
+    fs::path pathTmp = path;
+    pathTmp += ".incomplete";
+    CAutoFile file(fsbridge::fopen(pathTmp, "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return state.Error(strprintf("unable to open %s for writing", pathTmp.string()));
+
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    try {
+        file << metadata;
+        hasher << metadata;
+        if (!pcoinsdbview->DumpSnapshot(&file, hasher, nRecords))
+            return state.Error("unable to read the coin database");
+    } catch (const std::ios_base::failure& e) {
+        return state.Error(strprintf("unable to write %s: %s", pathTmp.string(), e.what()));
+    }
+    FileCommit(file.Get());
+    file.fclose();
+    if (!RenameOver(pathTmp, path))
+        return state.Error(strprintf("unable to rename %s to %s", pathTmp.string(), path.string()));
+
+    hashSnapshot = hasher.GetHash();
+    LogPrintf("%s: wrote %u records for block %s at height %d to %s, snapshot hash %s\n", __func__,
+        (unsigned int)nRecords, metadata.hashBlock.ToString(), metadata.nHeight, path.string(), hashSnapshot.ToString());
+    return true;
+}
+
+bool LoadChainstateSnapshot(const fs::path& path, CChainstateSnapshotMetadata& metadata, CValidationState& state)
+{
+    const CChainParams& chainparams = Params();
+
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return state.Error(strprintf("unable to open %s", path.string()));
+    try {
+        file >> metadata;
+    } catch (const std::ios_base::failure& e) {
+        return state.Error(strprintf("unable to read %s: %s", path.string(), e.what()));
+    }
+    if (memcmp(metadata.pchMessageStart, chainparams.MessageStart(), sizeof(metadata.pchMessageStart)) != 0)
+        return state.Error("the snapshot is for a different network");
+
+    // Outside of regtest, only snapshots that the chain parameters commit to
+    // are loaded.
+    std::optional<uint256> hashExpected;
+    const MapAssumeutxo& mapAssumeutxo = chainparams.Assumeutxo();
+    MapAssumeutxo::const_iterator itAssumeutxo = mapAssumeutxo.find(metadata.hashBlock);
+    if (itAssumeutxo != mapAssumeutxo.end()) {
+        if (itAssumeutxo->second.nHeight != metadata.nHeight)
+            return state.Error("the snapshot's height does not match its block");
+        hashExpected = itAssumeutxo->second.hashSnapshot;
+    } else if (!chainparams.MineBlocksOnDemand()) {
+        return state.Error(strprintf("no snapshot is known for block %s", metadata.hashBlock.ToString()));
+    }
+
+    CBlockIndex* pindexBase;
+    {
+        LOCK(cs_main);
+        if (fImporting || fReindex)
+            return state.Error("a snapshot can't be loaded while importing or reindexing blocks");
+        if (fTxIndex || fAddressIndex || fSpentIndex || fTimestampIndex)
+            return state.Error("a snapshot can't be loaded with -txindex or -insightexplorer enabled");
+        if (pindexSnapshotBase != NULL)
+            return state.Error("the chain state was already loaded from a snapshot");
+        if (chainActive.Height() > 0)
+            return state.Error("a snapshot can only be loaded before any blocks have been connected");
+        BlockMap::iterator mi = mapBlockIndex.find(metadata.hashBlock);
+        if (mi == mapBlockIndex.end())
+            return state.Error("the snapshot's block header has not been received yet");
+        pindexBase = mi->second;
+        if (pindexBase->nHeight != metadata.nHeight)
+            return state.Error("the snapshot's height does not match its block");
+        if (!pindexBase->IsValid(BLOCK_VALID_TREE) || (pindexBase->nStatus & BLOCK_FAILED_MASK))
+            return state.Error("the snapshot's block is not valid");
+        for (const std::pair<CBlockIndex* const, CBlockIndex*>& unlinked : mapBlocksUnlinked) {
+            if (unlinked.second->GetAncestor(pindexBase->nHeight) == pindexBase)
+                return state.Error("blocks above the snapshot's block have already been downloaded");
+        }
+    }
+
+    // Check the whole file against its hash before replacing the chain state.
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << metadata;
+    uint64_t nRecords;
+    if (!CCoinsViewDB::HashSnapshot(file, hasher, nRecords))
+        return state.Error(strprintf("unable to read %s", path.string()));
+    uint256 hashSnapshot = hasher.GetHash();
+    if (hashExpected && hashSnapshot != *hashExpected)
+        return state.Error(strprintf("the snapshot's hash %s does not match the expected %s",
+            hashSnapshot.ToString(), hashExpected->ToString()));
+    if (fseek(file.Get(), 0, SEEK_SET) != 0)
+        return state.Error(strprintf("unable to read %s", path.string()));
+    try {
+        file >> metadata;
+    } catch (const std::ios_base::failure& e) {
+        return state.Error(strprintf("unable to read %s: %s", path.string(), e.what()));
+    }
+
+    LOCK(cs_main);
+    if (chainActive.Height() > 0 || pindexSnapshotBase != NULL)
+        return state.Error("the chain state changed while the snapshot was being checked");
+    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS))
+        return false;
+    mempool.clear();
+
+    LogPrintf("%s: loading %u records for block %s at height %d\n", __func__,
+        (unsigned int)nRecords, metadata.hashBlock.ToString(), metadata.nHeight);
+    int64_t nStart = GetTimeMillis();
+    // Past this point the coin database no longer matches the block index,
+    // so a failure can't be recovered from without restarting.
+    if (!pcoinsdbview->LoadSnapshot(file, metadata, hashSnapshot))
+        return AbortNode(state, "Failed to load chain state snapshot");
+    pcoinsTip->ResetBest();
+
+    // Make the base look like a block that was connected on top of a chain
+    // whose totals are those of the snapshot.
+    pindexBase->nTx = metadata.nChainTx;
+    pindexBase->nChainTx = metadata.nChainTx;
+    pindexBase->nChainSupplyDelta = metadata.nChainTotalSupply;
+    pindexBase->nChainTotalSupply = metadata.nChainTotalSupply;
+    pindexBase->nTransparentValue = metadata.nChainTransparentValue;
+    pindexBase->nChainTransparentValue = metadata.nChainTransparentValue;
+    pindexBase->nSproutValue = metadata.nChainSproutValue;
+    pindexBase->nChainSproutValue = metadata.nChainSproutValue;
+    pindexBase->nSaplingValue = metadata.nChainSaplingValue.value_or(0);
+    pindexBase->nChainSaplingValue = metadata.nChainSaplingValue;
+    pindexBase->nOrchardValue = metadata.nChainOrchardValue.value_or(0);
+    pindexBase->nChainOrchardValue = metadata.nChainOrchardValue;
+    pindexBase->nLockboxValue = metadata.nChainLockboxValue.value_or(0);
+    pindexBase->nChainLockboxValue = metadata.nChainLockboxValue;
+    pindexBase->hashFinalSproutRoot = metadata.hashSproutAnchor;
+    pindexBase->hashFinalSaplingRoot = metadata.hashFinalSaplingRoot;
+    pindexBase->hashFinalOrchardRoot = metadata.hashFinalOrchardRoot;
+    pindexBase->hashAuthDataRoot = metadata.hashAuthDataRoot;
+    pindexBase->hashChainHistoryRoot = metadata.hashChainHistoryRoot;
+    pindexBase->nCachedBranchId = CurrentEpochBranchId(pindexBase->nHeight, chainparams.GetConsensus());
+    pindexBase->nStatus |= BLOCK_SNAPSHOT_BASE;
+    pindexBase->RaiseValidity(BLOCK_VALID_SCRIPTS);
+    {
+        LOCK(cs_nBlockSequenceId);
+        pindexBase->nSequenceId = nBlockSequenceId++;
+    }
+    setDirtyBlockIndex.insert(pindexBase);
+
+    pindexSnapshotBase = pindexBase;
+    pindexSnapshotValidated = NULL;
+    setBlockIndexCandidates.insert(pindexBase);
+    UpdateTip(pindexBase, chainparams);
+    PruneBlockIndexCandidates();
+    // Peers may still be walking the chain below the base.
+    for (std::pair<const NodeId, CNodeState>& item : mapNodeState) {
+        item.second.pindexLastCommonBlock = NULL;
+    }
+    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS))
+        return false;
+
+    // Peers can't be served the blocks below the base until they have been
+    // downloaded and validated.
+    LogPrintf("Unsetting NODE_NETWORK until the chain state snapshot is validated\n");
+    nLocalServices &= ~NODE_NETWORK;
+
+    LogPrintf("%s: loaded snapshot in %dms\n", __func__, GetTimeMillis() - nStart);
+    return true;
+}
+
+/**
+ * Connect the base of the chain state snapshot to view, now that the chain
+ * below it has been connected, and check the result against the snapshot.
+ * On success the base becomes an ordinary block.
+ */
+static bool CompleteSnapshotValidation(const CChainParams& chainparams, const CBlock& block, CCoinsViewDB& db, CCoinsViewCache& view, CValidationState& state)
+{
+    AssertLockHeld(cs_main);
+    CBlockIndex* pindex = pindexSnapshotBase;
+    // The base's index entry is only consistent again once this returns.
+    boost::this_thread::disable_interruption noInterruption;
+
+    // Replace the snapshot's totals with those of the block itself.
+    SetChainPoolValues(chainparams, block, pindex);
+    pindex->nTx = block.vtx.size();
+    SetChainTotals(chainparams, pindex);
+    if (!ConnectBlock(block, state, pindex, view, chainparams))
+        return false;
+    if (!view.Flush())
+        return state.Error("unable to write the background chain state");
+
+    CChainstateSnapshotMetadata metadata;
+    GetChainstateSnapshotMetadata(chainparams, pindex, db, metadata);
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << metadata;
+    uint64_t nRecords;
+    if (!db.DumpSnapshot(nullptr, hasher, nRecords))
+        return state.Error("unable to read the background chain state");
+    uint256 hashSnapshot;
+    if (!pcoinsdbview->GetSnapshotHash(hashSnapshot))
+        return state.Error("unable to read the snapshot hash");
+    if (hasher.GetHash() != hashSnapshot) {
+        return state.Error(strprintf("the chain state at block %s has hash %s, but the snapshot loaded for it has hash %s",
+            metadata.hashBlock.ToString(), hasher.GetHash().ToString(), hashSnapshot.ToString()));
+    }
+
+    pindex->nStatus &= ~BLOCK_SNAPSHOT_BASE;
+    setDirtyBlockIndex.insert(pindex);
+    pindexSnapshotBase = NULL;
+    pindexSnapshotValidated = NULL;
+    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS))
+        return false;
+    if (!pcoinsdbview->EraseSnapshotHash())
+        return state.Error("unable to write to the coin database");
+    if (!fPruneMode) {
+        LogPrintf("Setting NODE_NETWORK now that the chain state snapshot is validated\n");
+        nLocalServices |= NODE_NETWORK;
+    }
+    LogPrintf("%s: the chain state snapshot at block %s matches the blocks below it\n", __func__, metadata.hashBlock.ToString());
+    return true;
+}
+
+/**
+ * Write the block index, then the background chain state that relies on it,
+ * so that a restart never finds blocks in the background chain state whose
+ * undo data isn't recorded.
+ */
+static bool FlushSnapshotValidation(const CChainParams& chainparams, CCoinsViewCache& view)
+{
+    AssertLockHeld(cs_main);
+    CValidationState state;
+    if (!FlushStateToDisk(chainparams, state, FLUSH_STATE_ALWAYS))
+        return false;
+    if (!view.Flush())
+        return AbortNode("Failed to write the background chain state");
+    return true;
+}
+
+void ThreadValidateSnapshot(size_t nCoinDBCache)
+{
+    RenameThread("zcash-snapshot");
+    const CChainParams& chainparams = Params();
+    std::unique_ptr<CCoinsViewDB> pdbview;
+    std::unique_ptr<CCoinsViewCache> pview;
+    int64_t nLastFlush = GetTime();
+
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            // Find the next block to connect, opening the background chain
+            // state the first time there is a snapshot to validate.
+            CBlockIndex* pindexNext = NULL;
+            CDiskBlockPos pos;
+            {
+                LOCK(cs_main);
+                if (pindexSnapshotBase != NULL && !pdbview) {
+                    pdbview.reset(new CCoinsViewDB("chainstate_background", nCoinDBCache));
+                    uint256 hashBest = pdbview->GetBestBlock();
+                    BlockMap::iterator mi = mapBlockIndex.find(hashBest);
+                    pindexSnapshotValidated = (mi == mapBlockIndex.end()) ? NULL : mi->second;
+                    // Start over from a chain state that isn't below the
+                    // base. One at the base itself was left by an
+                    // interrupted completion, which can't be resumed.
+                    if (!hashBest.IsNull() && (pindexSnapshotValidated == NULL ||
+                            pindexSnapshotValidated->nHeight >= pindexSnapshotBase->nHeight ||
+                            pindexSnapshotBase->GetAncestor(pindexSnapshotValidated->nHeight) != pindexSnapshotValidated)) {
+                        LogPrintf("%s: the background chain state is not below the snapshot, starting over\n", __func__);
+                        pdbview.reset();
+                        pdbview.reset(new CCoinsViewDB("chainstate_background", nCoinDBCache, false, true));
+                        pindexSnapshotValidated = NULL;
+                    }
+                    if (!pdbview->Upgrade(GetBoolArg("-peroutpointcoins", DEFAULT_PER_OUTPOINT_COINS))) {
+                        AbortNode("Failed to upgrade the background coin database");
+                        return;
+                    }
+                    pview.reset(new CCoinsViewCache(pdbview.get()));
+                    LogPrintf("%s: validating the blocks below the chain state snapshot from height %d\n", __func__,
+                        pindexSnapshotValidated ? pindexSnapshotValidated->nHeight + 1 : 0);
+                }
+                if (pindexSnapshotBase != NULL) {
+                    CBlockIndex* pindex = pindexSnapshotBase->GetAncestor(
+                        pindexSnapshotValidated ? pindexSnapshotValidated->nHeight + 1 : 0);
+                    if (pindex->nStatus & BLOCK_HAVE_DATA) {
+                        pindexNext = pindex;
+                        pos = pindex->GetBlockPos();
+                    }
+                }
+            }
+            if (pindexNext == NULL) {
+                MilliSleep(1000);
+                continue;
+            }
+
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pos, chainparams.GetConsensus()) ||
+                    block.GetHash() != pindexNext->GetBlockHash()) {
+                AbortNode(strprintf("Failed to read block %s", pindexNext->GetBlockHash().ToString()));
+                return;
+            }
+
+            LOCK(cs_main);
+            CValidationState state;
+            if (pindexNext == pindexSnapshotBase) {
+                if (!CompleteSnapshotValidation(chainparams, block, *pdbview, *pview, state)) {
+                    AbortNode("Failed to validate the chain state snapshot: " + FormatStateMessage(state),
+                        _("The chain state snapshot does not match the blocks below it. You need to rebuild the database using -reindex."));
+                    return;
+                }
+                pview.reset();
+                pdbview.reset();
+                fs::remove_all(GetDataDir() / "chainstate_background");
+                continue;
+            }
+            if (!ConnectBlock(block, state, pindexNext, *pview, chainparams)) {
+                AbortNode(strprintf("Failed to connect block %s below the chain state snapshot: %s",
+                        pindexNext->GetBlockHash().ToString(), FormatStateMessage(state)),
+                    _("The blocks below the chain state snapshot are not valid. You need to rebuild the database using -reindex."));
+                return;
+            }
+            pindexSnapshotValidated = pindexNext;
+            if (pview->DynamicMemoryUsage() > nCoinCacheUsage / 2 ||
+                    GetTime() > nLastFlush + (int64_t)DATABASE_WRITE_INTERVAL) {
+                if (!FlushSnapshotValidation(chainparams, *pview))
+                    return;
+                nLastFlush = GetTime();
+            }
+        }
+    } catch (const boost::thread_interrupted&) {
+        if (pview) {
+            LOCK(cs_main);
+            FlushSnapshotValidation(chainparams, *pview);
+        }
+        throw;
+    }
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Number of transactions from mempool.dat that are pre-verified together. */
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 100;
+
+bool LoadMempool(const CChainParams& chainparams)
+{
+    int64_t nStart = GetTimeMillis();
+    CAutoFile file(fsbridge::fopen(GetDataDir() / "mempool.dat", "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t count = 0;
+    int64_t failed = 0;
+    int64_t already_there = 0;
+
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION) {
+            return false;
+        }
+        uint64_t num;
+        file >> num;
+
+        std::vector<CTransaction> vtx;
+        std::vector<int64_t> vTime;
+        while (num > 0 && !ShutdownRequested()) {
+            vtx.clear();
+            vTime.clear();
+            while (num > 0 && vtx.size() < MEMPOOL_LOAD_BATCH_SIZE) {
+                CTransaction tx;
+                int64_t nTime;
+                int64_t nFeeDelta;
+                file >> tx;
+                file >> nTime;
+                file >> nFeeDelta;
+                num--;
+
+                if (nFeeDelta != 0) {
+                    mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), nFeeDelta);
+                }
+                vtx.push_back(tx);
+                vTime.push_back(nTime);
+            }
+
+            // Verify the proofs of the whole batch before taking cs_main, as
+            // for transactions received from peers. The file lists parents
+            // before their children, so a transaction that spends outputs of
+            // others in the same batch is verified together with them.
+            std::vector<PreVerifyResult> vResult(vtx.size(), PreVerifyResult::Unchecked);
+            std::vector<CValidationState> vState(vtx.size());
+            if (fMempoolPreVerify) {
+                vResult = PreVerifyTransactions(chainparams, mempool, vtx, vState);
+            }
+
+            LOCK(cs_main);
+            for (size_t i = 0; i < vtx.size(); i++) {
+                CValidationState& state = vState[i];
+                if (vResult[i] != PreVerifyResult::Rejected &&
+                    AcceptToMemoryPoolWithTime(chainparams, mempool, state, vtx[i], true, nullptr, vTime[i], false,
+                                               vResult[i] == PreVerifyResult::Verified)) {
+                    ++count;
+                } else if (mempool.exists(vtx[i].GetHash())) {
+                    ++already_there;
+                } else {
+                    ++failed;
+                }
+            }
+        }
+
+        if (ShutdownRequested()) {
+            return false;
+        }
+
+        std::map<uint256, CAmount> mapDeltas;
+        file >> mapDeltas;
+
+        for (const auto& i : mapDeltas) {
+            mempool.PrioritiseTransaction(i.first, i.first.ToString(), i.second);
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i already there, in %dms\n",
+        count, failed, already_there, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    // Serialize dumps, so that a periodic dump can't race the one at shutdown
+    // for the temporary file.
+    static Mutex csDumpMempool;
+    LOCK(csDumpMempool);
+
+    int64_t nStart = GetTimeMicros();
+
+    std::map<uint256, CAmount> mapDeltas;
+    std::vector<TxMempoolInfo> vinfo;
+
+    {
+        LOCK(mempool.cs);
+        for (const auto& i : mempool.mapDeltas) {
+            mapDeltas[i.first] = i.second;
+        }
+        vinfo = mempool.infoAll();
+    }
+
+    // infoAll orders transactions by score, which can put a child ahead of
+    // its parent. LoadMempool has to accept parents first, so write each
+    // transaction after all of its in-mempool parents.
+    {
+        std::map<uint256, size_t> mapIndex;
+        for (size_t i = 0; i < vinfo.size(); i++) {
+            mapIndex.emplace(vinfo[i].tx->GetHash(), i);
+        }
+        std::vector<size_t> vParentCount(vinfo.size(), 0);
+        std::vector<std::vector<size_t>> vChildren(vinfo.size());
+        for (size_t i = 0; i < vinfo.size(); i++) {
+            std::set<size_t> setParents;
+            for (const CTxIn& txin : vinfo[i].tx->vin) {
+                auto it = mapIndex.find(txin.prevout.hash);
+                if (it != mapIndex.end()) {
+                    setParents.insert(it->second);
+                }
+            }
+            for (size_t parent : setParents) {
+                vChildren[parent].push_back(i);
+            }
+            vParentCount[i] = setParents.size();
+        }
+        std::deque<size_t> ready;
+        for (size_t i = 0; i < vinfo.size(); i++) {
+            if (vParentCount[i] == 0) {
+                ready.push_back(i);
+            }
+        }
+        std::vector<TxMempoolInfo> vSorted;
+        vSorted.reserve(vinfo.size());
+        while (!ready.empty()) {
+            size_t i = ready.front();
+            ready.pop_front();
+            vSorted.push_back(vinfo[i]);
+            for (size_t child : vChildren[i]) {
+                if (--vParentCount[child] == 0) {
+                    ready.push_back(child);
+                }
+            }
+        }
+        assert(vSorted.size() == vinfo.size());
+        vinfo = std::move(vSorted);
+    }
+
+    int64_t nMid = GetTimeMicros();
 
-    PruneBlockIndexCandidates();
+    try {
+        fs::path pathTmp = GetDataDir() / "mempool.dat.new";
+        CAutoFile file(fsbridge::fopen(pathTmp, "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            return false;
+        }
 
-    LogPrintf("%s: hashBestChain=%s height=%d date=%s progress=%f\n", __func__,
-        chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
-        DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainparams.Checkpoints(), chainActive.Tip()));
+        uint64_t version = MEMPOOL_DUMP_VERSION;
+        file << version;
 
-    EnforceNodeDeprecation(chainparams, chainActive.Height(), true);
+        file << (uint64_t)vinfo.size();
+        for (const auto& i : vinfo) {
+            file << *(i.tx);
+            file << (int64_t)i.nTime;
+            auto it = mapDeltas.find(i.tx->GetHash());
+            if (it != mapDeltas.end()) {
+                file << (int64_t)it->second;
+                mapDeltas.erase(it);
+            } else {
+                file << (int64_t)0;
+            }
+        }
 
+        // Deltas for transactions that aren't in the mempool.
+        file << mapDeltas;
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat")) {
+            throw std::runtime_error("Rename failed");
+        }
+        int64_t nLast = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid - nStart) * 0.000001, (nLast - nMid) * 0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
     return true;
 }
 
@@ -5798,6 +7232,9 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        // Blocks up to the base of a chain state snapshot were never stored.
+        if (pindexSnapshotBase && pindex->nHeight <= pindexSnapshotBase->nHeight)
+            break;
 
         CBlock block;
         // check level 0: read from disk
@@ -6024,8 +7461,8 @@ bool RegenerateSubtrees(ShieldedType type, const Consensus::Params& consensusPar
             SaplingMerkleTree sapling_tree;
             assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, sapling_tree));
             for (const CTransaction &tx : block.vtx) {
-                for (const auto &outputDescription : tx.GetSaplingOutputs()) {
-                    sapling_tree.append(uint256::FromRawBytes(outputDescription.cmu()));
+                for (const uint256 &cmu : tx.GetSaplingBundle().GetNoteCommitments()) {
+                    sapling_tree.append(cmu);
 
                     auto completeSubtreeRoot = sapling_tree.complete_subtree_root();
                     if (completeSubtreeRoot.has_value()) {
@@ -6254,9 +7691,14 @@ void UnloadBlockIndex()
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
+    pindexIBDPrevalidated = NULL;
+    pindexSnapshotBase = NULL;
+    pindexSnapshotValidated = NULL;
     mempool.clear();
     mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    mapOrphanTransactionsByParent.clear();
+    nOrphanTxUsage = 0;
+    mapOrphanTxUsageByPeer.clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -6506,10 +7948,33 @@ void static CheckBlockIndex(const Consensus::Params& consensusParams)
     CBlockIndex* pindexFirstNotTransactionsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_TRANSACTIONS (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
+    // The base of a chain state snapshot stands in for its ancestors, which
+    // are only connected in the background. The base and its descendants are
+    // checked as if the base had been connected with its data on disk; the
+    // state for its ancestors is put back once its subtree is traversed.
+    CBlockIndex* pindexBelowSnapshotMissing = NULL;
+    CBlockIndex* pindexBelowSnapshotNeverProcessed = NULL;
+    CBlockIndex* pindexBelowSnapshotNotTransactionsValid = NULL;
+    CBlockIndex* pindexBelowSnapshotNotChainValid = NULL;
+    CBlockIndex* pindexBelowSnapshotNotScriptsValid = NULL;
     while (pindex != NULL) {
         nNodes++;
+        bool fHaveData = pindex->nStatus & BLOCK_HAVE_DATA;
+        if (pindex == pindexSnapshotBase) {
+            pindexBelowSnapshotMissing = pindexFirstMissing;
+            pindexBelowSnapshotNeverProcessed = pindexFirstNeverProcessed;
+            pindexBelowSnapshotNotTransactionsValid = pindexFirstNotTransactionsValid;
+            pindexBelowSnapshotNotChainValid = pindexFirstNotChainValid;
+            pindexBelowSnapshotNotScriptsValid = pindexFirstNotScriptsValid;
+            pindexFirstMissing = NULL;
+            pindexFirstNeverProcessed = NULL;
+            pindexFirstNotTransactionsValid = NULL;
+            pindexFirstNotChainValid = NULL;
+            pindexFirstNotScriptsValid = NULL;
+            fHaveData = true;
+        }
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
-        if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstMissing == NULL && !fHaveData) pindexFirstMissing = pindex;
         if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTransactionsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TRANSACTIONS) pindexFirstNotTransactionsValid = pindex;
@@ -6527,7 +7992,7 @@ void static CheckBlockIndex(const Consensus::Params& consensusParams)
         // HAVE_DATA is only equivalent to nTx > 0 (or VALID_TRANSACTIONS) if no pruning has occurred.
         if (!fHavePruned) {
             // If we've never pruned, then HAVE_DATA should be equivalent to nTx > 0
-            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(!fHaveData == (pindex->nTx == 0));
             assert(pindexFirstMissing == pindexFirstNeverProcessed);
         } else {
             // If we have pruned, then we can only say that HAVE_DATA implies nTx > 0
@@ -6626,6 +8091,13 @@ void static CheckBlockIndex(const Consensus::Params& consensusParams)
             if (pindex == pindexFirstNotTransactionsValid) pindexFirstNotTransactionsValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
+            if (pindex == pindexSnapshotBase) {
+                pindexFirstMissing = pindexBelowSnapshotMissing;
+                pindexFirstNeverProcessed = pindexBelowSnapshotNeverProcessed;
+                pindexFirstNotTransactionsValid = pindexBelowSnapshotNotTransactionsValid;
+                pindexFirstNotChainValid = pindexBelowSnapshotNotChainValid;
+                pindexFirstNotScriptsValid = pindexBelowSnapshotNotScriptsValid;
+            }
             // Find our parent.
             CBlockIndex* pindexPar = pindex->pprev;
             // Find which child we just visited.
@@ -6725,7 +8197,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -6772,6 +8244,16 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // A peer asking for an old block is unlikely to have
+                        // a mempool that a compact block could be
+                        // reconstructed from, so send the full block instead.
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH)
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        else
+                            pfrom->PushMessage("block", block);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         bool send = false;
@@ -6860,7 +8342,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 }
             }
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -6879,62 +8361,367 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
-void static ProcessOrphanTx(const CChainParams& chainparams, std::set<uint256>& orphan_work_set) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+/**
+ * Try to add the orphans in orphan_work_set to the mempool, together with the
+ * orphans that depend on them, up to MAX_ORPHAN_TX_BATCH transactions at a
+ * time. The whole batch is verified before cs_main is taken, so a chain of
+ * dependent transactions is admitted in one pass rather than one orphan per
+ * message handler pass. Orphans that don't fit in the batch are left in
+ * orphan_work_set.
+ */
+void static ProcessOrphanTx(const CChainParams& chainparams, std::set<uint256>& orphan_work_set)
 {
-    AssertLockHeld(cs_main);
+    AssertLockNotHeld(cs_main);
+
+    // Collect the orphans, parents before their children.
+    std::vector<CTransaction> vtx;
+    {
+        LOCK(cs_main);
+        std::set<uint256> setQueued;
+        std::deque<uint256> queue(orphan_work_set.begin(), orphan_work_set.end());
+        orphan_work_set.clear();
+        while (!queue.empty()) {
+            const uint256 orphanHash = queue.front();
+            queue.pop_front();
+
+            auto orphan_it = mapOrphanTransactions.find(orphanHash);
+            if (orphan_it == mapOrphanTransactions.end() || !setQueued.insert(orphanHash).second) continue;
+            if (vtx.size() >= MAX_ORPHAN_TX_BATCH) {
+                orphan_work_set.insert(orphanHash);
+                continue;
+            }
+            vtx.push_back(orphan_it->second.tx);
+
+            auto it_by_parent = mapOrphanTransactionsByParent.find(orphanHash);
+            if (it_by_parent != mapOrphanTransactionsByParent.end()) {
+                for (const auto& elem : it_by_parent->second) {
+                    queue.push_back(elem->first);
+                }
+            }
+        }
+    }
+    if (vtx.empty())
+        return;
+
+    std::vector<PreVerifyResult> vResult(vtx.size(), PreVerifyResult::Unchecked);
+    std::vector<CValidationState> vState(vtx.size());
+    if (fMempoolPreVerify)
+        vResult = PreVerifyTransactions(chainparams, mempool, vtx, vState);
+
+    LOCK(cs_main);
     set<NodeId> setMisbehaving;
-    bool done = false;
-    while (!done && !orphan_work_set.empty()) {
-        const uint256 orphanHash = *orphan_work_set.begin();
-        orphan_work_set.erase(orphan_work_set.begin());
-
-        auto orphan_it = mapOrphanTransactions.find(orphanHash);
-        if (orphan_it == mapOrphanTransactions.end()) continue;
-
-        const CTransaction& orphanTx = orphan_it->second.tx;
-        NodeId fromPeer = orphan_it->second.fromPeer;
-        bool fMissingInputs2 = false;
-        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-        // anyone relaying LegitTxX banned)
-        CValidationState stateDummy;
-
-        if (setMisbehaving.count(fromPeer)) continue;
-        if (AcceptToMemoryPool(chainparams, mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-        {
-            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-            RelayTransaction(orphanTx);
-            for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                auto it_by_prev = mapOrphanTransactionsByPrev.find(COutPoint(orphanHash, i));
-                if (it_by_prev != mapOrphanTransactionsByPrev.end()) {
-                    for (const auto& elem : it_by_prev->second) {
-                        orphan_work_set.insert(elem->first);
-                    }
+    std::vector<size_t> vRemaining(vtx.size());
+    std::iota(vRemaining.begin(), vRemaining.end(), 0);
+    // An orphan that spends several transactions in the batch may come
+    // before some of them, so retry the ones with missing inputs for as long
+    // as the previous pass accepted something.
+    bool fProgress = true;
+    while (fProgress && !vRemaining.empty()) {
+        fProgress = false;
+        std::vector<size_t> vMissingInputs;
+        for (size_t i : vRemaining) {
+            const CTransaction& orphanTx = vtx[i];
+            const uint256& orphanHash = orphanTx.GetHash();
+
+            // It may have been removed while cs_main was released.
+            auto orphan_it = mapOrphanTransactions.find(orphanHash);
+            if (orphan_it == mapOrphanTransactions.end()) continue;
+
+            NodeId fromPeer = orphan_it->second.fromPeer;
+            bool fMissingInputs2 = false;
+            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+            // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+            // anyone relaying LegitTxX banned)
+            CValidationState stateDummy;
+
+            if (setMisbehaving.count(fromPeer)) continue;
+            // An orphan that was rejected ahead of time has its inputs, and
+            // fails for the same reason AcceptToMemoryPool would give.
+            bool fAccepted = false;
+            if (vResult[i] == PreVerifyResult::Rejected) {
+                stateDummy = vState[i];
+            } else {
+                fAccepted = AcceptToMemoryPool(chainparams, mempool, stateDummy, orphanTx, true, &fMissingInputs2, false,
+                                               vResult[i] == PreVerifyResult::Verified);
+            }
+            if (fAccepted)
+            {
+                LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                RelayTransaction(orphanTx);
+                EraseOrphanTx(orphanHash);
+                fProgress = true;
+            } else if (!fMissingInputs2) {
+                int nDos = 0;
+                if (stateDummy.IsInvalid(nDos) && nDos > 0) {
+                    // Punish peer that gave us an invalid orphan tx
+                    Misbehaving(fromPeer, nDos);
+                    setMisbehaving.insert(fromPeer);
+                    LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
                 }
+                // Has inputs but not accepted to mempool
+                // Probably non-standard or insufficient fee
+                LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                // Add the wtxid of this transaction to our reject filter.
+                // Unlike upstream Bitcoin Core, we can unconditionally add
+                // these, as they are always bound to the entirety of the
+                // transaction regardless of version.
+                assert(recentRejects);
+                recentRejects->insert(orphanTx.GetWTxId().ToBytes());
+                EraseOrphanTx(orphanHash);
+            } else {
+                vMissingInputs.push_back(i);
             }
-            EraseOrphanTx(orphanHash);
-            done = true;
-        } else if (!fMissingInputs2) {
-            int nDos = 0;
-            if (stateDummy.IsInvalid(nDos) && nDos > 0) {
-                // Punish peer that gave us an invalid orphan tx
-                Misbehaving(fromPeer, nDos);
-                setMisbehaving.insert(fromPeer);
-                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-            }
-            // Has inputs but not accepted to mempool
-            // Probably non-standard or insufficient fee
-            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-            // Add the wtxid of this transaction to our reject filter.
-            // Unlike upstream Bitcoin Core, we can unconditionally add
-            // these, as they are always bound to the entirety of the
-            // transaction regardless of version.
-            assert(recentRejects);
-            recentRejects->insert(orphanTx.GetWTxId().ToBytes());
-            EraseOrphanTx(orphanHash);
-            done = true;
         }
+        vRemaining.swap(vMissingInputs);
+    }
+    mempool.check(pcoinsTip);
+}
+
+/**
+ * Try to add a transaction received from a peer to the mempool, relaying it
+ * or keeping it as an orphan as appropriate, and penalizing the peer if it is
+ * invalid.
+ */
+void static ProcessTransaction(
+    const CChainParams& chainparams, CNode* pfrom, const CTransaction& tx,
+    PreVerifyResult preVerifyResult, CValidationState state) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    const uint256& txid = tx.GetHash();
+    const WTxId& wtxid = tx.GetWTxId();
+
+    pfrom->AddKnownWTxId(wtxid);
+
+    bool fMissingInputs = false;
+
+    pfrom->setAskFor.erase(wtxid);
+    mapAlreadyAskedFor.erase(wtxid);
+
+    // We do the AlreadyHave() check using a MSG_WTX inv unconditionally,
+    // because for pre-v5 transactions wtxid.authDigest is set to the same
+    // placeholder as is used for the CInv.hashAux field for MSG_TX.
+    //
+    // A transaction that PreVerifyTransaction rejected goes straight to the
+    // reject handling below, with the state it set.
+    if (preVerifyResult != PreVerifyResult::Rejected &&
+        !AlreadyHave(CInv(MSG_WTX, txid, wtxid.authDigest)) &&
+        AcceptToMemoryPool(chainparams, mempool, state, tx, true, &fMissingInputs, false,
+                           preVerifyResult == PreVerifyResult::Verified))
+    {
         mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        // The caller processes the orphan transactions that depended on this one.
+        auto it_by_parent = mapOrphanTransactionsByParent.find(txid);
+        if (it_by_parent != mapOrphanTransactionsByParent.end()) {
+            for (const auto& elem : it_by_parent->second) {
+                pfrom->orphan_work_set.insert(elem->first);
+            }
+        }
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u txn, %u kB)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.size(), mempool.DynamicMemoryUsage() / 1000);
+    }
+    // TODO: currently, prohibit joinsplits and shielded spends/outputs/actions from entering mapOrphans
+    else if (fMissingInputs &&
+             tx.vJoinSplit.empty() &&
+             !tx.GetSaplingBundle().IsPresent() &&
+             !tx.GetOrchardBundle().IsPresent())
+    {
+        bool fRejectedParents = false; // It may be the case that the orphan's parents have all been rejected
+        for (const CTxIn& txin : tx.vin) {
+            if (recentRejects->contains(txin.prevout.hash)) {
+                fRejectedParents = true;
+                break;
+            }
+        }
+        if (!fRejectedParents) {
+            for (const CTxIn& txin : tx.vin) {
+                CInv inv(MSG_TX, txin.prevout.hash);
+                pfrom->AddKnownTxId(inv.hash);
+                if (!AlreadyHave(inv)) pfrom->AskFor(inv);
+            }
+            AddOrphanTx(tx, pfrom->GetId());
+
+            // DoS prevention: do not allow mapOrphanTransactions and
+            // mapOrphanTransactionsByParent to grow unbounded.
+            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+            size_t nMaxOrphanUsage = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TX_SIZE)) * 1000000;
+            size_t nMaxOrphanPeerUsage = (size_t)std::max((int64_t)0, GetArg("-maxorphantxpeersize", DEFAULT_MAX_ORPHAN_TX_PEER_SIZE)) * 1000000;
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanUsage, nMaxOrphanPeerUsage);
+            if (nEvicted > 0)
+                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+        } else {
+            LogPrint("mempool", "not keeping orphan with rejected parents %s\n",tx.GetHash().ToString());
+        }
+    } else {
+        // Add the wtxid of this transaction to our reject filter.
+        // Unlike upstream Bitcoin Core, we can unconditionally add
+        // these, as they are always bound to the entirety of the
+        // transaction regardless of version.
+        assert(recentRejects);
+        recentRejects->insert(tx.GetWTxId().ToBytes());
+
+        if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
+                    tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
+            }
+        }
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempoolrej", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            FormatStateMessage(state));
+        if (state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
+            pfrom->PushMessage("reject", std::string("tx"), (unsigned char)state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), txid);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+/**
+ * Transactions received during the current message handler pass, with the
+ * peers they came from. Each peer holds a reference that is released once
+ * its transactions have been processed. Only accessed from the message
+ * handler thread.
+ */
+static std::vector<std::pair<CNode*, CTransaction>> vPendingTxs;
+
+void ProcessPendingTransactions(const CChainParams& chainparams)
+{
+    if (vPendingTxs.empty())
+        return;
+    std::vector<std::pair<CNode*, CTransaction>> vPending;
+    vPending.swap(vPendingTxs);
+
+    // Only verify the transactions we don't already have, and each of them
+    // once, however many peers sent it during the pass. The copies share the
+    // result of the first, so a transaction that is rejected is rejected
+    // from every peer that sent it, and one that is accepted is found to be
+    // already known. Copies are matched by wtxid, as v5 transactions with
+    // the same txid can carry different signatures.
+    std::vector<CTransaction> vtx;
+    std::vector<size_t> vIndex(vPending.size(), SIZE_MAX);
+    {
+        LOCK(cs_main);
+        std::map<WTxId, size_t> mapBatchIndex;
+        for (size_t i = 0; i < vPending.size(); i++) {
+            const CTransaction& tx = vPending[i].second;
+            const WTxId& wtxid = tx.GetWTxId();
+            if (AlreadyHave(CInv(MSG_WTX, tx.GetHash(), wtxid.authDigest)))
+                continue;
+            auto inserted = mapBatchIndex.emplace(wtxid, vtx.size());
+            vIndex[i] = inserted.first->second;
+            if (inserted.second)
+                vtx.push_back(tx);
+        }
+    }
+    std::vector<CValidationState> vState;
+    std::vector<PreVerifyResult> vResult = PreVerifyTransactions(chainparams, mempool, vtx, vState);
+
+    for (size_t i = 0; i < vPending.size(); i++) {
+        CNode* pfrom = vPending[i].first;
+        if (pfrom->fDisconnect)
+            continue;
+        LOCK(cs_main);
+        if (vIndex[i] == SIZE_MAX) {
+            ProcessTransaction(chainparams, pfrom, vPending[i].second, PreVerifyResult::Unchecked, CValidationState());
+        } else {
+            ProcessTransaction(chainparams, pfrom, vPending[i].second, vResult[vIndex[i]], vState[vIndex[i]]);
+        }
+    }
+
+    // Process the orphan transactions that depended on the accepted ones.
+    std::set<CNode*> setFrom;
+    for (auto& pending : vPending) {
+        CNode* pfrom = pending.first;
+        if (!pfrom->fDisconnect && !pfrom->orphan_work_set.empty() && setFrom.insert(pfrom).second)
+            ProcessOrphanTx(chainparams, pfrom->orphan_work_set);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        for (auto& pending : vPending)
+            pending.first->Release();
+    }
+}
+
+/**
+ * Finish reconstructing a compact block that is in flight from pfrom, using
+ * the transactions in resp for the ones that were missing, and process it.
+ * If the result doesn't match the block header, the full block is requested
+ * instead.
+ */
+void static ProcessBlockTransactions(const CChainParams& chainparams, CNode* pfrom, const BlockTransactions& resp)
+{
+    CBlock block;
+    {
+        LOCK(cs_main);
+        auto it = mapBlocksInFlight.find(resp.blockhash);
+        if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                it->second.first != pfrom->GetId()) {
+            LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+            return;
+        }
+
+        // From NU5 on, the block also commits to its transactions'
+        // authorizing data, through a commitment that includes the chain
+        // history root. That is known while the block still builds on the tip.
+        std::optional<uint256> hashChainHistoryRoot;
+        const CBlockIndex* pindex = it->second.second->pindex;
+        const Consensus::Params& consensus = chainparams.GetConsensus();
+        if (pindex && pindex->pprev == chainActive.Tip() &&
+                consensus.NetworkUpgradeActive(pindex->nHeight, Consensus::UPGRADE_NU5)) {
+            hashChainHistoryRoot = pcoinsTip->GetHistoryRoot(CurrentEpochBranchId(pindex->pprev->nHeight, consensus));
+        }
+
+        ReadStatus status = it->second.second->partialBlock->FillBlock(block, resp.txn, hashChainHistoryRoot);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+            return;
+        } else if (status == READ_STATUS_FAILED) {
+            // Might have collided, fall back to getdata now.
+            it->second.second->partialBlock.reset();
+            std::vector<CInv> invs;
+            invs.push_back(CInv(MSG_BLOCK, resp.blockhash));
+            pfrom->PushMessage("getdata", invs);
+            return;
+        }
+    }
+
+    LogPrint("net", "reconstructed block %s peer=%d\n", block.GetHash().ToString(), pfrom->id);
+
+    CValidationState state;
+    // Since we requested this block (it was in mapBlocksInFlight), force it to
+    // be processed, even if it would not be a candidate for the new tip.
+    ProcessNewBlock(state, chainparams, pfrom, &block, true, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
+        pfrom->PushMessage("reject", std::string("block"), (unsigned char)state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
     }
 }
 
@@ -7160,6 +8947,13 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         if (pfrom->fNetworkNode) {
             state->fCurrentlyConnected = true;
         }
+
+        if (fCompactBlocks) {
+            // Ask whitelisted peers to announce new blocks with cmpctblock
+            // right away, and the rest to keep announcing them with inv.
+            bool fAnnounceUsingCMPCTBLOCK = pfrom->fWhitelisted;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, CMPCTBLOCKS_VERSION);
+        }
     }
 
 
@@ -7463,113 +9257,21 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         CTransaction tx;
         vRecv >> tx;
 
-        const uint256& txid = tx.GetHash();
-        const WTxId& wtxid = tx.GetWTxId();
-
-        LOCK(cs_main);
-
-        pfrom->AddKnownWTxId(wtxid);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        pfrom->setAskFor.erase(wtxid);
-        mapAlreadyAskedFor.erase(wtxid);
-
-        // We do the AlreadyHave() check using a MSG_WTX inv unconditionally,
-        // because for pre-v5 transactions wtxid.authDigest is set to the same
-        // placeholder as is used for the CInv.hashAux field for MSG_TX.
-        if (!AlreadyHave(CInv(MSG_WTX, txid, wtxid.authDigest)) &&
-            AcceptToMemoryPool(chainparams, mempool, state, tx, true, &fMissingInputs))
-        {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                auto it_by_prev = mapOrphanTransactionsByPrev.find(COutPoint(txid, i));
-                if (it_by_prev != mapOrphanTransactionsByPrev.end()) {
-                    for (const auto& elem : it_by_prev->second) {
-                        pfrom->orphan_work_set.insert(elem->first);
-                    }
-                }
-            }
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u txn, %u kB)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.size(), mempool.DynamicMemoryUsage() / 1000);
-
-            // Recursively process any orphan transactions that depended on this one
-            ProcessOrphanTx(chainparams, pfrom->orphan_work_set);
-        }
-        // TODO: currently, prohibit joinsplits and shielded spends/outputs/actions from entering mapOrphans
-        else if (fMissingInputs &&
-                 tx.vJoinSplit.empty() &&
-                 !tx.GetSaplingBundle().IsPresent() &&
-                 !tx.GetOrchardBundle().IsPresent())
-        {
-            bool fRejectedParents = false; // It may be the case that the orphan's parents have all been rejected
-            for (const CTxIn& txin : tx.vin) {
-                if (recentRejects->contains(txin.prevout.hash)) {
-                    fRejectedParents = true;
-                    break;
-                }
-            }
-            if (!fRejectedParents) {
-                for (const CTxIn& txin : tx.vin) {
-                    CInv inv(MSG_TX, txin.prevout.hash);
-                    pfrom->AddKnownTxId(inv.hash);
-                    if (!AlreadyHave(inv)) pfrom->AskFor(inv);
-                }
-                AddOrphanTx(tx, pfrom->GetId());
-
-                // DoS prevention: do not allow mapOrphanTransactions and
-                // mapOrphanTransactionsByPrev to grow unbounded.
-                unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-                if (nEvicted > 0)
-                    LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-            } else {
-                LogPrint("mempool", "not keeping orphan with rejected parents %s\n",tx.GetHash().ToString());
-            }
-        } else {
-            // Add the wtxid of this transaction to our reject filter.
-            // Unlike upstream Bitcoin Core, we can unconditionally add
-            // these, as they are always bound to the entirety of the
-            // transaction regardless of version.
-            assert(recentRejects);
-            recentRejects->insert(tx.GetWTxId().ToBytes());
-
-            if (pfrom->fWhitelisted && GetBoolArg("-whitelistforcerelay", DEFAULT_WHITELISTFORCERELAY)) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
-                        tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
-                }
-            }
+        if (fMempoolPreVerify) {
+            // Hold on to the transaction until the end of this message handler
+            // pass, so that its proofs can be verified in one batch with the
+            // other transactions received in the pass.
+            pfrom->AddRef();
+            vPendingTxs.emplace_back(pfrom, tx);
+            return true;
         }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
+
         {
-            LogPrint("mempoolrej", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                FormatStateMessage(state));
-            if (state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
-                pfrom->PushMessage("reject", strCommand, (unsigned char)state.GetRejectCode(),
-                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), txid);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+            LOCK(cs_main);
+            ProcessTransaction(chainparams, pfrom, tx, PreVerifyResult::Unchecked, CValidationState());
         }
+        // Process any orphan transactions that depended on this one
+        ProcessOrphanTx(chainparams, pfrom->orphan_work_set);
     }
 
 
@@ -7677,6 +9379,180 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
     }
 
 
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        BlockTransactions txn;
+        {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis); instead of DoSing in
+            // AcceptBlockHeader, request deeper headers.
+            if (!IsInitialBlockDownload(chainparams.GetConsensus()))
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            return true;
+        }
+
+        CBlockIndex *pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                return true;
+            }
+        }
+        // If AcceptBlockHeader returned true, it set pindex.
+        assert(pindex);
+        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+
+        CNodeState *nodestate = State(pfrom->GetId());
+        auto itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+        bool fAlreadyInFlight = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+            return true;
+
+        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                pindex->nTx != 0) { // We had this block at some point, but pruned it
+            if (fAlreadyInFlight) {
+                // We requested this block for some reason, but our mempool
+                // will probably be useless, so we just grab the block via
+                // normal getdata.
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(MSG_BLOCK, pindex->GetBlockHash());
+                pfrom->PushMessage("getdata", vInv);
+            }
+            return true;
+        }
+
+        // Only reconstruct blocks that would become the new tip. Any other
+        // block is left to the usual block download logic, which now knows
+        // its header.
+        if (pindex->pprev != chainActive.Tip() || IsInitialBlockDownload(chainparams.GetConsensus())) {
+            if (fAlreadyInFlight) {
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(MSG_BLOCK, pindex->GetBlockHash());
+                pfrom->PushMessage("getdata", vInv);
+            }
+            return true;
+        }
+
+        if (fAlreadyInFlight && itInFlight->second.second->partialBlock) {
+            LogPrint("net", "Peer %d sent us a compact block we were already syncing!\n", pfrom->id);
+            return true;
+        }
+        if (!fAlreadyInFlight) {
+            if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER)
+                return true;
+            MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex);
+            itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+        }
+
+        QueuedBlock& queuedBlock = *itInFlight->second.second;
+        queuedBlock.partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+        PartiallyDownloadedBlock& partialBlock = *queuedBlock.partialBlock;
+        ReadStatus status = partialBlock.InitData(cmpctblock);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+            return true;
+        } else if (status == READ_STATUS_FAILED) {
+            // Duplicate short IDs; the block is in flight, so just request it.
+            queuedBlock.partialBlock.reset();
+            std::vector<CInv> vInv(1);
+            vInv[0] = CInv(MSG_BLOCK, pindex->GetBlockHash());
+            pfrom->PushMessage("getdata", vInv);
+            return true;
+        }
+
+        BlockTransactionsRequest req;
+        for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+            if (!partialBlock.IsTxAvailable(i))
+                req.indexes.push_back(i);
+        }
+        if (!req.indexes.empty()) {
+            req.blockhash = pindex->GetBlockHash();
+            pfrom->PushMessage("getblocktxn", req);
+            return true;
+        }
+        txn.blockhash = pindex->GetBlockHash();
+        }
+
+        // Every transaction was prefilled or found in the mempool.
+        ProcessBlockTransactions(chainparams, pfrom, txn);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // If an older block is requested, send a block response instead of
+            // a blocktxn response. This makes a peer that sends lots of
+            // getblocktxn requests to trigger expensive disk reads receive all
+            // of the data that is read.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        ProcessBlockTransactions(chainparams, pfrom, resp);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -7929,7 +9805,8 @@ bool static ProcessMessage(const CChainParams& chainparams, CNode* pfrom, string
         // message would be undesirable as we transmit it ourselves.
     }
 
-    else if (!(strCommand == "tx" || strCommand == "block" || strCommand == "headers" || strCommand == "alert")) {
+    else if (!(strCommand == "tx" || strCommand == "block" || strCommand == "cmpctblock" || strCommand == "blocktxn" ||
+               strCommand == "headers" || strCommand == "alert")) {
         // Ignore unknown commands for extensibility
         LogPrint("net", "Unknown command \"%s\" from peer=%d\n", SanitizeString(strCommand), pfrom->id);
     }
@@ -7958,10 +9835,8 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom)
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom, chainparams.GetConsensus());
 
-    if (!pfrom->orphan_work_set.empty()) {
-        LOCK(cs_main);
+    if (!pfrom->orphan_work_set.empty())
         ProcessOrphanTx(chainparams, pfrom->orphan_work_set);
-    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -8221,6 +10096,26 @@ bool SendMessages(const Consensus::Params& params, CNode* pto)
             }
             vInv.reserve(std::max<size_t>(pto->vInventoryBlockToSend.size(), INVENTORY_BROADCAST_MAX));
 
+            // Announce a single new tip as a cmpctblock to peers that asked
+            // for that with sendcmpct, so that they can reconstruct it without
+            // another round trip.
+            if (fCompactBlocks && state.fPreferHeaderAndIDs && pto->vInventoryBlockToSend.size() == 1 &&
+                    pto->vInventoryBlockToSend[0] == chainActive.Tip()->GetBlockHash()) {
+                CBlockIndex* pindexTip = chainActive.Tip();
+                if (!pMostRecentCompactBlock || pMostRecentCompactBlock->header.GetHash() != pindexTip->GetBlockHash()) {
+                    CBlock block;
+                    if ((pindexTip->nStatus & BLOCK_HAVE_DATA) && ReadBlockFromDisk(block, pindexTip, params)) {
+                        pMostRecentCompactBlock = std::make_shared<const CBlockHeaderAndShortTxIDs>(block);
+                    } else {
+                        pMostRecentCompactBlock.reset();
+                    }
+                }
+                if (pMostRecentCompactBlock) {
+                    pto->PushMessage("cmpctblock", *pMostRecentCompactBlock);
+                    pto->vInventoryBlockToSend.clear();
+                }
+            }
+
             // Add blocks
             for (const uint256& hash : pto->vInventoryBlockToSend) {
                 vInv.push_back(CInv(MSG_BLOCK, hash));
@@ -8383,8 +10278,13 @@ bool SendMessages(const Consensus::Params& params, CNode* pto)
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
             FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            FindNextSnapshotBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload);
             for (CBlockIndex *pindex : vToDownload) {
-                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                // A block that would extend our tip can be reconstructed from
+                // the mempool if the peer supports compact blocks.
+                bool fCompact = fCompactBlocks && state.fProvidesHeaderAndIDs &&
+                    pindex->pprev == chainActive.Tip() && !IsInitialBlockDownload(params);
+                vGetData.push_back(CInv(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), params, pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
@@ -8445,7 +10345,9 @@ public:
 
         // orphan transactions
         mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        mapOrphanTransactionsByParent.clear();
+        nOrphanTxUsage = 0;
+        mapOrphanTxUsageByPeer.clear();
     }
 } instance_of_cmaincleanup;
 
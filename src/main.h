@@ -16,6 +16,7 @@
 #include "chainparams.h"
 #include "coins.h"
 #include "consensus/upgrades.h"
+#include "consensus/validation.h"
 #include "fs.h"
 #include "net.h"
 #include "primitives/block.h"
@@ -34,7 +35,9 @@
 #include "timestampindex.h"
 
 #include <algorithm>
+#include <atomic>
 #include <exception>
+#include <functional>
 #include <map>
 #include <optional>
 #include <set>
@@ -79,7 +82,13 @@ static const CAmount HIGH_MAX_TX_FEE = 100 * HIGH_TX_FEE_PER_KB;
 //! -maxtxfee will error if called with a fee that won’t allow tx to have this many actions
 static const unsigned int LOW_LOGICAL_ACTIONS = 10;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
-static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 10000;
+/** Default for -maxorphantxsize, maximum megabytes of memory used by orphan transactions */
+static const unsigned int DEFAULT_MAX_ORPHAN_TX_SIZE = 20;
+/** Default for -maxorphantxpeersize, maximum megabytes of memory used by the orphan transactions from one peer */
+static const unsigned int DEFAULT_MAX_ORPHAN_TX_PEER_SIZE = 5;
+/** Maximum number of orphan transactions that are reprocessed together once a parent is accepted */
+static const unsigned int MAX_ORPHAN_TX_BATCH = 100;
 /** Expiration time for orphan transactions in seconds */
 static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** Minimum time between orphan transactions expire time checks in seconds */
@@ -108,6 +117,41 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Default for -pipelinedconnect */
+static const bool DEFAULT_PIPELINED_CONNECT = true;
+/**
+ * Number of Sapling descriptions or Orchard actions that ConnectBlock
+ * accumulates into a batch before handing it to a proof-checking thread,
+ * when -pipelinedconnect is enabled.
+ */
+static const size_t PIPELINED_CONNECT_BATCH_SIZE = 64;
+/** Default for -ibdbatchproofs */
+static const bool DEFAULT_IBD_BATCH_PROOFS = true;
+/**
+ * Maximum number of consecutive blocks whose Sapling and Orchard
+ * authorizations are validated as a single batch during initial block
+ * download, when -ibdbatchproofs is enabled.
+ */
+static const unsigned int IBD_BATCH_PROOFS_WINDOW = 32;
+/**
+ * Cross-block batching is not used for blocks that are within this many
+ * blocks of the best known header, so that it never delays tip updates.
+ */
+static const unsigned int IBD_BATCH_PROOFS_MIN_TIP_DISTANCE = 2 * IBD_BATCH_PROOFS_WINDOW;
+/** Default for -parallelblocktxchecks */
+static const bool DEFAULT_PARALLEL_BLOCK_TX_CHECKS = true;
+/** Default for -mempoolpreverify */
+static const bool DEFAULT_MEMPOOL_PREVERIFY = true;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Time between periodic dumps of the mempool to disk, in seconds. */
+static const int64_t DUMP_MEMPOOL_INTERVAL = 15 * 60;
+/** Default for -compactblocks */
+static const bool DEFAULT_COMPACT_BLOCKS = true;
+/** Maximum depth of a block that is served as a cmpctblock rather than a full block. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of a block whose transactions are served individually in response to getblocktxn. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -124,6 +168,8 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Default for -incrementalcoinsflush */
+static const bool DEFAULT_INCREMENTAL_COINS_FLUSH = true;
 /** Time to wait (in seconds) between writing wallet witness data to disk. */
 static const unsigned int WITNESS_WRITE_INTERVAL = 10 * 60;
 /** Number of updates between writing wallet witness data to disk. */
@@ -190,6 +236,36 @@ extern uint256 g_best_block;
 extern std::atomic_bool fImporting;
 extern std::atomic_bool fReindex;
 extern int nScriptCheckThreads;
+/**
+ * Whether ConnectBlock hands Sapling and Orchard batch validation off to
+ * worker threads while it updates the UTXO set and commitment trees.
+ */
+extern bool fPipelinedConnect;
+/**
+ * Whether, during initial block download, Sapling and Orchard authorizations
+ * are validated in batches spanning several blocks ahead of connecting them.
+ */
+extern bool fIBDBatchProofs;
+/**
+ * Whether periodic chainstate flushes write the dirty part of the coins cache
+ * without holding cs_main and without emptying the cache.
+ */
+extern bool fIncrementalCoinsFlush;
+/**
+ * Whether CheckBlock and ContextualCheckBlock check the block's transactions
+ * on the validation worker threads rather than one at a time.
+ */
+extern bool fParallelBlockTxChecks;
+/**
+ * Whether transactions received from peers or sendrawtransaction have their
+ * proofs and signatures verified before cs_main is taken to accept them.
+ */
+extern bool fMempoolPreVerify;
+/**
+ * Whether new blocks are requested from and announced to peers that support
+ * it as compact blocks (BIP 152), reconstructed from the mempool.
+ */
+extern bool fCompactBlocks;
 extern bool fTxIndex;
 
 // The following flags enable specific indices (DB tables), but are not exposed as
@@ -228,6 +304,13 @@ extern int64_t nMaxTipAge;
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex *pindexBestHeader;
 
+/**
+ * The block that the chain state was loaded from a snapshot at, if any. Blocks
+ * at or below it have not been validated by this node yet; it is reset once
+ * ThreadValidateSnapshot has validated them. (protected by cs_main)
+ */
+extern CBlockIndex *pindexSnapshotBase;
+
 /** Minimum disk space required - used in CheckDiskSpace() */
 static const uint64_t nMinDiskSpace = 52428800;
 
@@ -295,6 +378,8 @@ bool LoadBlockIndex();
 void UnloadBlockIndex();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom);
+/** Process the transactions received from all nodes during a message handler pass */
+void ProcessPendingTransactions(const CChainParams& chainparams);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
@@ -302,8 +387,21 @@ bool ProcessMessages(const CChainParams& chainparams, CNode* pfrom);
  * @param[in]   pto             The node which we are sending messages to.
  */
 bool SendMessages(const Consensus::Params& params, CNode* pto);
-/** Run an instance of the script checking thread */
+/** Run an instance of the validation worker thread, which serves the script and shielded batch check queues */
 void ThreadScriptCheck();
+/**
+ * Select the blocks from vpindexToConnect (ordered from highest to lowest)
+ * whose Sapling and Orchard authorizations should be batch-validated together
+ * during initial block download, returned from lowest to highest. The result
+ * is empty if the blocks are within IBD_BATCH_PROOFS_MIN_TIP_DISTANCE of
+ * pindexBestHeaderIn, or if the next block to connect is already covered by
+ * the window ending at pindexPrevalidatedIn.
+ */
+std::vector<CBlockIndex*> GetIBDPrevalidationWindow(
+    const CChainParams& chainparams,
+    const std::vector<CBlockIndex*>& vpindexToConnect,
+    const CBlockIndex* pindexBestHeaderIn,
+    const CBlockIndex* pindexPrevalidatedIn);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload(const Consensus::Params& params);
 /** testing-only, set or reset initial block down (IBD) state, return previous */
@@ -348,12 +446,88 @@ void Misbehaving(NodeId nodeid, int howmuch);
 void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
+/**
+ * Write the chain state at the current tip to a snapshot file at path, filling
+ * in its metadata and the hash that chain parameters would commit to.
+ */
+bool DumpChainstateSnapshot(const fs::path& path, CChainstateSnapshotMetadata& metadata, uint256& hashSnapshot, uint64_t& nRecords, CValidationState& state);
+/**
+ * Replace the chain state of a node that hasn't connected any blocks yet with
+ * a snapshot, making the snapshot's block the tip. The snapshot must be one
+ * that the chain parameters commit to, and its block header must be known.
+ */
+bool LoadChainstateSnapshot(const fs::path& path, CChainstateSnapshotMetadata& metadata, CValidationState& state);
+/**
+ * Connect the blocks below the base of a loaded chain state snapshot, as they
+ * are downloaded, to a separate chain state in the chainstate_background
+ * directory. Once the base is reached that chain state must match the
+ * snapshot, and the node stops treating the snapshot specially.
+ */
+void ThreadValidateSnapshot(size_t nCoinDBCache);
+/**
+ * Write the transactions in the mempool, with their entry times and fee
+ * deltas, to mempool.dat in the data directory.
+ */
+bool DumpMempool();
+/**
+ * Read mempool.dat and add its transactions back to the mempool, keeping
+ * their original entry times and fee deltas.
+ */
+bool LoadMempool(const CChainParams& chainparams);
+
+/** The outcome of PreVerifyTransaction. */
+enum class PreVerifyResult {
+    /**
+     * Nothing was concluded, for example because the transaction's inputs
+     * aren't known yet. AcceptToMemoryPool does all of the checks itself.
+     */
+    Unchecked,
+    /**
+     * The JoinSplit proofs are valid, so AcceptToMemoryPool can be told not
+     * to verify them again, and the valid signatures and bundles are cached.
+     */
+    Verified,
+    /**
+     * The transaction would be rejected by AcceptToMemoryPool, for the reason
+     * given in the validation state. It doesn't need to be passed to
+     * AcceptToMemoryPool at all.
+     */
+    Rejected,
+};
+
+/**
+ * Check a transaction that is about to be passed to AcceptToMemoryPool,
+ * holding cs_main only while its inputs are looked up. The mempool policy
+ * checks that don't need any verification run first, so that no proofs are
+ * verified for a transaction that is nonstandard, pays too little, conflicts
+ * with the mempool or is already in it. Valid signatures and bundles are then
+ * recorded in the signature and bundle validity caches, where
+ * AcceptToMemoryPool will find them as long as the transaction's inputs and
+ * the consensus branch haven't changed in between.
+ */
+PreVerifyResult PreVerifyTransaction(const CChainParams& chainparams, CTxMemPool& pool, const CTransaction& tx, CValidationState& state);
+
+/**
+ * PreVerifyTransaction for several transactions at once. The Sapling and
+ * Orchard bundles of all of them are checked in a single batch; if that batch
+ * fails, each transaction is checked again on its own. Returns one result per
+ * transaction, and sets vState to one validation state per transaction.
+ */
+std::vector<PreVerifyResult> PreVerifyTransactions(
+    const CChainParams& chainparams, CTxMemPool& pool,
+    const std::vector<CTransaction>& vtx, std::vector<CValidationState>& vState);
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(
         const CChainParams& chainparams,
         CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fJoinSplitProofsVerified=false);
+
+/** As AcceptToMemoryPool, but with the entry time of the mempool entry given explicitly */
+bool AcceptToMemoryPoolWithTime(
+        const CChainParams& chainparams,
+        CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+        bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee=false, bool fJoinSplitProofsVerified=false);
 
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
@@ -536,6 +710,85 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the validation of a batch of Sapling and Orchard
+ * authorizations (proofs and signatures), so that it can be run by a
+ * CCheckQueue worker while ConnectBlock continues with the rest of the block.
+ */
+class CShieldedBatchCheck
+{
+public:
+    /**
+     * Outcome shared by all of the batches queued for a single block. A
+     * worker that finds an invalid batch clears the corresponding flag.
+     */
+    struct Result {
+        std::atomic<bool> fSaplingValid{true};
+        std::atomic<bool> fOrchardValid{true};
+    };
+
+private:
+    std::optional<rust::Box<sapling::BatchValidator>> saplingAuth;
+    std::optional<rust::Box<orchard::BatchValidator>> orchardAuth;
+    Result *result;
+
+public:
+    CShieldedBatchCheck(): result(nullptr) {}
+    CShieldedBatchCheck(
+        std::optional<rust::Box<sapling::BatchValidator>> saplingAuthIn,
+        std::optional<rust::Box<orchard::BatchValidator>> orchardAuthIn,
+        Result *resultIn) :
+        saplingAuth(std::move(saplingAuthIn)), orchardAuth(std::move(orchardAuthIn)), result(resultIn) { }
+
+    bool operator()();
+
+    void swap(CShieldedBatchCheck &check) {
+        std::swap(saplingAuth, check.saplingAuth);
+        std::swap(orchardAuth, check.orchardAuth);
+        std::swap(result, check.result);
+    }
+};
+
+/**
+ * Closure representing a transaction-local check (one that depends only on
+ * the transaction and the block it is in) of a single transaction in a
+ * block, so that CheckBlock and ContextualCheckBlock can run them on
+ * CCheckQueue workers.
+ */
+class CTransactionCheck
+{
+public:
+    typedef std::function<bool(const CTransaction&, CValidationState&)> Function;
+
+    /**
+     * Outcome of the check of one transaction. Each check records its own
+     * state so that the caller can report the failure of the earliest
+     * invalid transaction, exactly as a serial check would.
+     */
+    struct Result {
+        CValidationState state;
+        bool fValid{true};
+    };
+
+private:
+    const Function *check;
+    const CTransaction *ptx;
+    Result *result;
+
+public:
+    CTransactionCheck(): check(nullptr), ptx(nullptr), result(nullptr) {}
+    CTransactionCheck(const Function *checkIn, const CTransaction *ptxIn, Result *resultIn) :
+        check(checkIn), ptx(ptxIn), result(resultIn) { }
+
+    bool operator()();
+
+    void swap(CTransactionCheck &check) {
+        std::swap(this->check, check.check);
+        std::swap(ptx, check.ptx);
+        std::swap(result, check.result);
+    }
+};
+
 bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
 bool GetAddressIndex(const uint160& addressHash, int type,
         std::vector<CAddressIndexDbEntry> &addressIndex,
@@ -645,6 +898,9 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex);
 /** The currently-connected chain of blocks (protected by cs_main). */
 extern CChain chainActive;
 
+/** Global variable that points to the coin database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
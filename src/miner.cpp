@@ -421,8 +421,8 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(
 
     // Update the Sapling commitment tree.
     for (const CTransaction& tx : pblock->vtx) {
-        for (const auto& odesc : tx.GetSaplingOutputs()) {
-            sapling_tree.append(uint256::FromRawBytes(odesc.cmu()));
+        for (const uint256& cmu : tx.GetSaplingBundle().GetNoteCommitments()) {
+            sapling_tree.append(cmu);
         }
     }
 
@@ -486,19 +486,6 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(
     return pblocktemplate.release();
 }
 
-bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
-{
-    for (CTxMemPool::txiter parent : mempool.GetMemPoolParents(iter))
-    {
-        if (!inBlock.count(parent)) {
-            return true;
-        }
-    }
-    return false;
-}
-
-
-
 bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
 {
     if (nBlockSize + iter->GetTxSize() >= nBlockMaxSize) {
@@ -615,28 +602,21 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
 
 void BlockAssembler::constructZIP317BlockTemplate()
 {
-    CTxMemPool::weightedCandidates candidatesPayingConventionalFee;
-    CTxMemPool::weightedCandidates candidatesNotPayingConventionalFee;
-
-    for (auto mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-    {
-        int128_t weightRatio = mi->GetWeightRatio();
-        if (weightRatio >= WEIGHT_RATIO_SCALE) {
-            candidatesPayingConventionalFee.add(mi->GetTx().GetHash(), mi, weightRatio);
-        } else {
-            candidatesNotPayingConventionalFee.add(mi->GetTx().GetHash(), mi, weightRatio);
-        }
-    }
+    // The mempool keeps the candidate sets up to date, so we only need to
+    // take as many entries from them as we look at; they are put back when
+    // the draws go out of scope.
+    CTxMemPool::CandidateDraw candidatesPayingConventionalFee(mempool.GetBlockCandidates(true));
+    CTxMemPool::CandidateDraw candidatesNotPayingConventionalFee(mempool.GetBlockCandidates(false));
 
-    CTxMemPool::queueEntries waiting;
+    waitingEntries waiting;
     CTxMemPool::queueEntries cleared;
     addTransactions(candidatesPayingConventionalFee, waiting, cleared);
     addTransactions(candidatesNotPayingConventionalFee, waiting, cleared);
 }
 
 void BlockAssembler::addTransactions(
-    CTxMemPool::weightedCandidates& candidates,
-    CTxMemPool::queueEntries& waiting,
+    CTxMemPool::CandidateDraw& candidates,
+    waitingEntries& waiting,
     CTxMemPool::queueEntries& cleared)
 {
     size_t nBlockUnpaidActions = 0;
@@ -649,7 +629,7 @@ void BlockAssembler::addTransactions(
             // again, then select the next transaction randomly by weight ratio
             // from the candidate set.
             assert(!candidates.empty());
-            iter = std::get<1>(candidates.takeRandom().value());
+            iter = candidates.takeRandom();
         } else {
             // If a previously postponed tx is available to try again, then it
             // has already been randomly sampled, so just take it in order.
@@ -668,9 +648,16 @@ void BlockAssembler::addTransactions(
         }
 
         // If tx is dependent on other mempool transactions that haven't yet been
-        // included then put it in the waiting queue.
-        if (isStillDependent(iter)) {
-            waiting.push_back(iter);
+        // included then put it in the waiting set, along with the number of
+        // parents it is waiting for.
+        size_t nMissingParents = 0;
+        for (CTxMemPool::txiter parent : mempool.GetMemPoolParents(iter)) {
+            if (!inBlock.count(parent)) {
+                nMissingParents++;
+            }
+        }
+        if (nMissingParents > 0) {
+            waiting.emplace(iter, nMissingParents);
             continue;
         }
 
@@ -679,24 +666,15 @@ void BlockAssembler::addTransactions(
             AddToBlock(iter);
             nBlockUnpaidActions += txUnpaidActions;
 
-            // This tx was successfully added, so add waiting transactions that
-            // depend on this one to the cleared queue to try again.
-            //
-            // TODO: This makes the overall algorithm O(n^2 log n) in the worst case
-            // of a linear dependency chain. (children is a std::map; its count method
-            // is O(log n) given the maximum number of children at each step, and is
-            // called O(n^2) times.) Daira conjectures that O(n log n) is possible.
-            auto children = mempool.GetMemPoolChildren(iter);
-            CTxMemPool::queueEntries stillWaiting;
-            for (CTxMemPool::txiter maybeChild : waiting)
-            {
-                if (children.count(maybeChild) > 0) {
-                    cleared.push_back(maybeChild);
-                } else {
-                    stillWaiting.push_back(maybeChild);
+            // This tx was successfully added, so move waiting children that
+            // were only waiting for this one to the cleared queue to try again.
+            for (CTxMemPool::txiter child : mempool.GetMemPoolChildren(iter)) {
+                auto it = waiting.find(child);
+                if (it != waiting.end() && --it->second == 0) {
+                    cleared.push_back(child);
+                    waiting.erase(it);
                 }
             }
-            waiting.swap(stillWaiting);
         }
     }
 }
@@ -141,10 +141,14 @@ public:
         const std::optional<CMutableTransaction>& next_coinbase_mtx = std::nullopt);
 
 private:
+    // Transactions postponed until their parents are in the block, with the
+    // number of parents they are still waiting for.
+    typedef std::map<CTxMemPool::txiter, size_t, CTxMemPool::CompareIteratorByHash> waitingEntries;
+
     void constructZIP317BlockTemplate();
     void addTransactions(
-        CTxMemPool::weightedCandidates& candidates,
-        CTxMemPool::queueEntries& waiting,
+        CTxMemPool::CandidateDraw& candidates,
+        waitingEntries& waiting,
         CTxMemPool::queueEntries& cleared);
 
     // utility functions
@@ -160,8 +164,6 @@ private:
     // helper function for addScoreTxs and addPriorityTxs
     /** Test if tx will still "fit" in the block */
     bool TestForBlock(CTxMemPool::txiter iter);
-    /** Test if tx still has unconfirmed parents not yet in block */
-    bool isStillDependent(CTxMemPool::txiter iter);
 };
 
 #ifdef ENABLE_MINING
@@ -8,9 +8,75 @@
 #include "amount.h"
 #include "streams.h"
 #include "streams_rust.h"
+#include "uint256.h"
+
+#include <iterator>
+#include <vector>
 
 #include <rust/bridge.h>
 
+/**
+ * A view of the spends or outputs of a Sapling bundle that borrows them from
+ * Rust, rather than copying them all out as `sapling::Bundle::spends()` and
+ * `sapling::Bundle::outputs()` do. It must not outlive the bundle.
+ */
+template<typename Description>
+class SaplingDescriptions
+{
+private:
+    const sapling::Bundle* bundle;
+    size_t count;
+
+    static const Description& Get(const sapling::Bundle& bundle, size_t index);
+
+public:
+    class const_iterator
+    {
+    private:
+        const sapling::Bundle* bundle;
+        size_t index;
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Description value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Description* pointer;
+        typedef const Description& reference;
+
+        const_iterator(const sapling::Bundle* bundle, size_t index) : bundle(bundle), index(index) {}
+
+        reference operator*() const { return Get(*bundle, index); }
+        pointer operator->() const { return &Get(*bundle, index); }
+        const_iterator& operator++() { ++index; return *this; }
+        const_iterator operator++(int) { const_iterator copy(*this); ++index; return copy; }
+        bool operator==(const const_iterator& other) const { return index == other.index; }
+        bool operator!=(const const_iterator& other) const { return index != other.index; }
+    };
+
+    SaplingDescriptions(const sapling::Bundle& bundle, size_t count) : bundle(&bundle), count(count) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const Description& operator[](size_t index) const { return Get(*bundle, index); }
+    const_iterator begin() const { return const_iterator(bundle, 0); }
+    const_iterator end() const { return const_iterator(bundle, count); }
+};
+
+template<>
+inline const sapling::Spend& SaplingDescriptions<sapling::Spend>::Get(const sapling::Bundle& bundle, size_t index)
+{
+    return bundle.spend(index);
+}
+
+template<>
+inline const sapling::Output& SaplingDescriptions<sapling::Output>::Get(const sapling::Bundle& bundle, size_t index)
+{
+    return bundle.output(index);
+}
+
+typedef SaplingDescriptions<sapling::Spend> SaplingSpends;
+typedef SaplingDescriptions<sapling::Output> SaplingOutputs;
+
 /**
  * The Sapling component of an authorized transaction.
  */
@@ -116,6 +182,38 @@ public:
     const size_t GetOutputsCount() const {
         return inner->num_outputs();
     }
+
+    /// Returns the spends of this bundle, borrowed from Rust.
+    SaplingSpends GetSpends() const {
+        return SaplingSpends(*inner, inner->num_spends());
+    }
+
+    /// Returns the outputs of this bundle, borrowed from Rust.
+    SaplingOutputs GetOutputs() const {
+        return SaplingOutputs(*inner, inner->num_outputs());
+    }
+
+    /// Returns the nullifiers of this bundle's spends, without copying the
+    /// spends themselves.
+    std::vector<uint256> GetNullifiers() const {
+        static_assert(sizeof(uint256) == 32);
+        std::vector<uint256> result(inner->num_spends());
+        if (!result.empty()) {
+            inner->nullifiers({reinterpret_cast<uint8_t*>(result.data()), result.size() * 32});
+        }
+        return result;
+    }
+
+    /// Returns the note commitments of this bundle's outputs, without copying
+    /// the outputs themselves.
+    std::vector<uint256> GetNoteCommitments() const {
+        static_assert(sizeof(uint256) == 32);
+        std::vector<uint256> result(inner->num_outputs());
+        if (!result.empty()) {
+            inner->cmus({reinterpret_cast<uint8_t*>(result.data()), result.size() * 32});
+        }
+        return result;
+    }
 };
 
 /**
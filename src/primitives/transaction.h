@@ -689,12 +689,12 @@ public:
         return saplingBundle.GetOutputsCount();
     }
 
-    const rust::Vec<sapling::Spend> GetSaplingSpends() const {
-        return saplingBundle.GetDetails().spends();
+    SaplingSpends GetSaplingSpends() const {
+        return saplingBundle.GetSpends();
     }
 
-    const rust::Vec<sapling::Output> GetSaplingOutputs() const {
-        return saplingBundle.GetDetails().outputs();
+    SaplingOutputs GetSaplingOutputs() const {
+        return saplingBundle.GetOutputs();
     }
 
     /**
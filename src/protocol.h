@@ -129,6 +129,7 @@ enum GetDataMsg : uint32_t {
     MSG_WTX = 5,             //!< Defined in ZIP 239
     // The following can only occur in getdata. Invs always use TX/WTX or BLOCK.
     MSG_FILTERED_BLOCK = 3,  //!< Defined in BIP37
+    MSG_CMPCT_BLOCK = 4,     //!< Defined in BIP152
 };
 
 /** inv message data */
@@ -160,6 +161,7 @@ public:
         case MSG_TX:
         case MSG_BLOCK:
         case MSG_FILTERED_BLOCK:
+        case MSG_CMPCT_BLOCK:
             break;
         case MSG_WTX:
             if (nVersion < CINV_WTX_VERSION) {
@@ -192,11 +194,11 @@ public:
 public:
     int type;
     // The main hash. This is:
-    // - MSG_BLOCK: the block hash.
+    // - MSG_BLOCK and MSG_CMPCT_BLOCK: the block hash.
     // - MSG_TX and MSG_WTX: the txid.
     uint256 hash;
     // The auxiliary hash. This is:
-    // - MSG_BLOCK: null (all-zeroes) and not parsed or serialized.
+    // - MSG_BLOCK and MSG_CMPCT_BLOCK: null (all-zeroes) and not parsed or serialized.
     // - MSG_TX: legacy auth digest (all-ones) and not parsed or serialized.
     // - MSG_WTX: the auth digest.
     uint256 hashAux;
@@ -18,6 +18,9 @@
 #include "streams.h"
 #include "sync.h"
 #include "util/system.h"
+#ifdef ENABLE_WALLET
+#include "wallet/wallet.h"
+#endif
 
 #include <stdint.h>
 
@@ -358,28 +361,28 @@ UniValue getdifficulty(const UniValue& params, bool fHelp)
 
 UniValue mempoolToJSON(bool fVerbose = false)
 {
+    // Format the result from a snapshot, so that polling doesn't hold
+    // mempool.cs while relay and block connection wait for it.
+    std::shared_ptr<const CTxMemPoolSnapshot> snapshot = mempool.GetSnapshot();
     if (fVerbose)
     {
-        LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        for (const CTxMemPoolEntry& e : mempool.mapTx)
+        for (const CTxMemPoolSnapshot::Entry& e : snapshot->entries)
         {
-            const uint256& hash = e.GetTx().GetHash();
+            const uint256& hash = e.tx->GetHash();
             UniValue info(UniValue::VOBJ);
-            info.pushKV("size", (int)e.GetTxSize());
-            info.pushKV("fee", ValueFromAmount(e.GetFee()));
-            info.pushKV("modifiedfee", ValueFromAmount(e.GetModifiedFee()));
-            info.pushKV("time", e.GetTime());
-            info.pushKV("height", (int)e.GetHeight());
-            info.pushKV("descendantcount", e.GetCountWithDescendants());
-            info.pushKV("descendantsize", e.GetSizeWithDescendants());
-            info.pushKV("descendantfees", e.GetModFeesWithDescendants());
-            const CTransaction& tx = e.GetTx();
+            info.pushKV("size", (int)e.nTxSize);
+            info.pushKV("fee", ValueFromAmount(e.nFee));
+            info.pushKV("modifiedfee", ValueFromAmount(e.nModifiedFee));
+            info.pushKV("time", e.nTime);
+            info.pushKV("height", (int)e.nHeight);
+            info.pushKV("descendantcount", e.nCountWithDescendants);
+            info.pushKV("descendantsize", e.nSizeWithDescendants);
+            info.pushKV("descendantfees", e.nModFeesWithDescendants);
             set<string> setDepends;
-            for (const CTxIn& txin : tx.vin)
+            for (const uint256& dep : e.vDepends)
             {
-                if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
+                setDepends.insert(dep.ToString());
             }
 
             UniValue depends(UniValue::VARR);
@@ -395,12 +398,9 @@ UniValue mempoolToJSON(bool fVerbose = false)
     }
     else
     {
-        vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-
         UniValue a(UniValue::VARR);
-        for (const uint256& hash : vtxid)
-            a.push_back(hash.ToString());
+        for (const CTxMemPoolSnapshot::Entry& e : snapshot->entries)
+            a.push_back(e.tx->GetHash().ToString());
 
         return a;
     }
@@ -440,8 +440,6 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getrawmempool", "true")
         );
 
-    LOCK(cs_main);
-
     bool fVerbose = false;
     if (params.size() > 0)
         fVerbose = params[0].get_bool();
@@ -891,6 +889,99 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrites a snapshot of the chain state at the current tip, which loadtxoutset can\n"
+            "use to bootstrap a new node. The chain is locked while this runs, which may take\n"
+            "some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"     (string, required) Path to the snapshot file, relative to the data directory\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"base_hash\": \"hex\",       (string) the hash of the block the snapshot was taken at\n"
+            "  \"base_height\": n,         (numeric) the height of that block\n"
+            "  \"path\": \"path\",           (string) the absolute path the snapshot was written to\n"
+            "  \"records\": n,             (numeric) the number of chain state records written\n"
+            "  \"snapshot_hash\": \"hex\"    (string) the hash that chain parameters commit to\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    fs::path path = AbsPathForConfigVal(fs::path(params[0].get_str()));
+    if (fs::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    CChainstateSnapshotMetadata metadata;
+    uint256 hashSnapshot;
+    uint64_t nRecords = 0;
+    CValidationState state;
+    if (!DumpChainstateSnapshot(path, metadata, hashSnapshot, nRecords, state))
+        throw JSONRPCError(RPC_DATABASE_ERROR, state.GetRejectReason());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("base_hash", metadata.hashBlock.GetHex());
+    ret.pushKV("base_height", metadata.nHeight);
+    ret.pushKV("path", path.string());
+    ret.pushKV("records", (uint64_t)nRecords);
+    ret.pushKV("snapshot_hash", hashSnapshot.GetHex());
+    return ret;
+}
+
+UniValue loadtxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "loadtxoutset \"path\"\n"
+            "\nReplaces the chain state of a node that has not connected any blocks yet with a\n"
+            "snapshot written by dumptxoutset, and continues syncing from the snapshot's block.\n"
+            "The snapshot's block header must already have been received. Blocks below the\n"
+            "snapshot's block are downloaded and validated in the background, and the node\n"
+            "stops if they don't match the snapshot. Until they have been validated the node\n"
+            "does not advertise NODE_NETWORK to its peers.\n"
+            "Outside regtest the snapshot must match one committed to by this release, and no\n"
+            "snapshots are committed to yet for mainnet or testnet.\n"
+            "\nArguments:\n"
+            "1. \"path\"     (string, required) Path to the snapshot file, relative to the data directory\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"base_hash\": \"hex\",       (string) the hash of the block the snapshot was taken at\n"
+            "  \"base_height\": n,         (numeric) the height of that block\n"
+            "  \"path\": \"path\"            (string) the absolute path the snapshot was read from\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\"")
+        );
+
+#ifdef ENABLE_WALLET
+    // The wallet would never see the transactions below the snapshot's block.
+    if (pwalletMain)
+        throw JSONRPCError(RPC_MISC_ERROR, "loadtxoutset requires the wallet to be disabled (-disablewallet)");
+#endif
+
+    fs::path path = AbsPathForConfigVal(fs::path(params[0].get_str()));
+    CChainstateSnapshotMetadata metadata;
+    CValidationState state;
+    if (!LoadChainstateSnapshot(path, metadata, state))
+        throw JSONRPCError(RPC_DATABASE_ERROR, state.GetRejectReason());
+
+    // Connect any blocks above the snapshot's block that we already have.
+    ActivateBestChain(state, Params());
+    if (!state.IsValid())
+        throw JSONRPCError(RPC_DATABASE_ERROR, state.GetRejectReason());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("base_hash", metadata.hashBlock.GetHex());
+    ret.pushKV("base_height", metadata.nHeight);
+    ret.pushKV("path", path.string());
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -1666,6 +1757,8 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true  },
+    { "blockchain",         "loadtxoutset",           &loadtxoutset,           false },
     { "blockchain",         "verifychain",            &verifychain,            true  },
 
     // insightexplorer
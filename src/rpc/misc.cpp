@@ -1212,6 +1212,15 @@ static UniValue RPCLockedMemoryInfo()
     return obj;
 }
 
+static UniValue RPCNullifierFilterPoolInfo(const CNullifierFilterStats::Pool& pool)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("entries", pool.nEntries);
+    obj.pushKV("capacity", pool.nCapacity);
+    obj.pushKV("usage", pool.nUsage);
+    return obj;
+}
+
 UniValue getmemoryinfo(const UniValue& params, bool fHelp)
 {
     /* Please, avoid using the word "pool" here in the RPC interface or help,
@@ -1230,6 +1239,14 @@ UniValue getmemoryinfo(const UniValue& params, bool fHelp)
             "    \"locked\": xxxxxx,       (numeric) Amount of bytes that succeeded locking. If this number is smaller than total, locking pages failed at some point and key data could be swapped to disk.\n"
             "    \"chunks_used\": xxxxx,   (numeric) Number allocated chunks\n"
             "    \"chunks_free\": xxxxx,   (numeric) Number unused chunks\n"
+            "  },\n"
+            "  \"nullifierfilters\": {     (json object, optional) Filters in front of the on-disk nullifier sets\n"
+            "    \"sprout\": {             (json object) The same fields are present for \"sapling\" and \"orchard\"\n"
+            "      \"entries\": xxxxx,     (numeric) Number of nullifiers inserted into the filter\n"
+            "      \"capacity\": xxxxx,    (numeric) Number of nullifiers the filter is sized for\n"
+            "      \"usage\": xxxxx,       (numeric) Memory used by the filter, in bytes\n"
+            "    },\n"
+            "    ...\n"
             "  }\n"
             "}\n"
             "\nExamples:\n"
@@ -1238,6 +1255,20 @@ UniValue getmemoryinfo(const UniValue& params, bool fHelp)
         );
     UniValue obj(UniValue::VOBJ);
     obj.pushKV("locked", RPCLockedMemoryInfo());
+
+    CNullifierFilterStats nullifierStats;
+    bool fNullifierFilters;
+    {
+        LOCK(cs_main);
+        fNullifierFilters = pcoinsTip && pcoinsTip->GetNullifierFilterStats(nullifierStats);
+    }
+    if (fNullifierFilters) {
+        UniValue filters(UniValue::VOBJ);
+        filters.pushKV("sprout", RPCNullifierFilterPoolInfo(nullifierStats.sprout));
+        filters.pushKV("sapling", RPCNullifierFilterPoolInfo(nullifierStats.sapling));
+        filters.pushKV("orchard", RPCNullifierFilterPoolInfo(nullifierStats.orchard));
+        obj.pushKV("nullifierfilters", filters);
+    }
     return obj;
 }
 
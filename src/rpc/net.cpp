@@ -538,7 +538,7 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
     obj.pushKV("version",       CLIENT_VERSION);
     obj.pushKV("subversion",    strSubVersion);
     obj.pushKV("protocolversion",PROTOCOL_VERSION);
-    obj.pushKV("localservices",       strprintf("%016x", nLocalServices));
+    obj.pushKV("localservices",       strprintf("%016x", (uint64_t)nLocalServices));
     obj.pushKV("timeoffset",    0);
     obj.pushKV("connections",   (int)vNodes.size());
     obj.pushKV("networks",      GetNetworksInfo());
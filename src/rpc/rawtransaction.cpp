@@ -1259,7 +1259,6 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
             + HelpExampleRpc("sendrawtransaction", "\"signedhex\"")
         );
 
-    LOCK(cs_main);
     RPCTypeCheck(params, boost::assign::list_of(UniValue::VSTR)(UniValue::VBOOL));
 
     // parse hex string from parameter
@@ -1270,6 +1269,14 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
 
     auto chainparams = Params();
 
+    // Verify the transaction's proofs and signatures before taking cs_main.
+    CValidationState state;
+    PreVerifyResult preVerifyResult = PreVerifyResult::Unchecked;
+    if (fMempoolPreVerify)
+        preVerifyResult = PreVerifyTransaction(chainparams, mempool, tx, state);
+
+    LOCK(cs_main);
+
     // DoS mitigation: reject transactions expiring soon
     if (tx.nExpiryHeight > 0) {
         int nextBlockHeight = chainActive.Height() + 1;
@@ -1293,9 +1300,12 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
     bool fHaveChain = existingCoins && existingCoins->nHeight < 1000000000;
     if (!fHaveMempool && !fHaveChain) {
         // push to local node and sync with wallets
-        CValidationState state;
+        if (preVerifyResult == PreVerifyResult::Rejected) {
+            throw JSONRPCError(RPC_TRANSACTION_REJECTED, strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason()));
+        }
         bool fMissingInputs;
-        if (!AcceptToMemoryPool(chainparams, mempool, state, tx, true, &fMissingInputs, !fOverrideFees)) {
+        if (!AcceptToMemoryPool(chainparams, mempool, state, tx, true, &fMissingInputs, !fOverrideFees,
+                                preVerifyResult == PreVerifyResult::Verified)) {
             if (state.IsInvalid()) {
                 throw JSONRPCError(RPC_TRANSACTION_REJECTED, strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason()));
             } else {
@@ -9,7 +9,12 @@
 // This file can't use a module comment (`//! comment`) because it causes compilation issues in zcash_script.
 use crate::{
     builder_ffi::shielded_signature_digest,
-    bundlecache::init as bundlecache_init,
+    bundlecache::{
+        init as bundlecache_init, restore_orchard as bundlecache_restore_orchard,
+        restore_sapling as bundlecache_restore_sapling,
+        snapshot_orchard as bundlecache_snapshot_orchard,
+        snapshot_sapling as bundlecache_snapshot_sapling,
+    },
     merkle_frontier::{new_orchard, orchard_empty_root, parse_orchard, Orchard, OrchardWallet},
     note_encryption::{
         try_sapling_note_decryption, try_sapling_output_recovery, DecryptedSaplingOutput,
@@ -92,11 +97,21 @@ pub(crate) mod ffi {
         fn NewBundleValidityCache(kind: &str, bytes: usize) -> UniquePtr<BundleValidityCache>;
         fn insert(self: Pin<&mut BundleValidityCache>, entry: [u8; 32]);
         fn contains(&self, entry: &[u8; 32], erase: bool) -> bool;
+        fn clear(self: Pin<&mut BundleValidityCache>);
+        fn CopyBundleCacheEntries(cache: &BundleValidityCache, entries: &mut Vec<u8>);
     }
     #[namespace = "bundlecache"]
     extern "Rust" {
         #[rust_name = "bundlecache_init"]
         fn init(cache_bytes: usize);
+        #[rust_name = "bundlecache_snapshot_sapling"]
+        fn snapshot_sapling(nonce: &mut [u8; 32], entries: &mut Vec<u8>);
+        #[rust_name = "bundlecache_snapshot_orchard"]
+        fn snapshot_orchard(nonce: &mut [u8; 32], entries: &mut Vec<u8>);
+        #[rust_name = "bundlecache_restore_sapling"]
+        fn restore_sapling(nonce: &[u8; 32], entries: &[u8]);
+        #[rust_name = "bundlecache_restore_orchard"]
+        fn restore_orchard(nonce: &[u8; 32], entries: &[u8]);
     }
 
     #[namespace = "sapling"]
@@ -142,6 +157,10 @@ pub(crate) mod ffi {
         fn is_present(self: &SaplingBundle) -> bool;
         fn spends(self: &SaplingBundle) -> Vec<Spend>;
         fn outputs(self: &SaplingBundle) -> Vec<Output>;
+        fn spend(self: &SaplingBundle, index: usize) -> &Spend;
+        fn output(self: &SaplingBundle, index: usize) -> &Output;
+        fn nullifiers(self: &SaplingBundle, nullifiers: &mut [u8]);
+        fn cmus(self: &SaplingBundle, cmus: &mut [u8]);
         fn num_spends(self: &SaplingBundle) -> usize;
         fn num_outputs(self: &SaplingBundle) -> usize;
         fn value_balance_zat(self: &SaplingBundle) -> i64;
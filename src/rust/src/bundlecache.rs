@@ -7,6 +7,10 @@ use rand_core::{OsRng, RngCore};
 
 use crate::bridge::ffi;
 
+const METRIC_CACHE_HITS: &str = "zcash.sigcache.hits";
+const METRIC_CACHE_MISSES: &str = "zcash.sigcache.misses";
+const METRIC_LABEL_KIND: &str = "kind";
+
 pub(crate) struct CacheEntry([u8; 32]);
 
 pub(crate) enum CacheEntries {
@@ -25,34 +29,68 @@ impl CacheEntries {
 }
 
 pub(crate) struct BundleValidityCache {
+    label: &'static str,
+    personalization: [u8; 16],
+    nonce: [u8; 32],
     hasher: blake2b_simd::State,
     cache: cxx::UniquePtr<ffi::BundleValidityCache>,
 }
 
+fn new_hasher(personalization: &[u8; 16], nonce: &[u8; 32]) -> blake2b_simd::State {
+    let mut hasher = blake2b_simd::Params::new()
+        .hash_length(32)
+        .personal(personalization)
+        .to_state();
+    hasher.update(nonce);
+    hasher
+}
+
 impl BundleValidityCache {
-    fn new(kind: &'static str, personalization: &[u8; 16], cache_bytes: usize) -> Self {
+    fn new(
+        kind: &'static str,
+        label: &'static str,
+        personalization: &[u8; 16],
+        cache_bytes: usize,
+    ) -> Self {
         // Use BLAKE2b to produce entries from bundles. It has a block size of 128 bytes,
         // into which we put:
         // - 32 byte nonce
         // - 64 bytes of bundle commitments
         // - 32 byte sighash
-        let mut hasher = blake2b_simd::Params::new()
-            .hash_length(32)
-            .personal(personalization)
-            .to_state();
-
+        //
         // Pre-load the hasher with a per-instance nonce. This ensures that cache entries
         // are deterministic but also unique per node.
         let mut nonce = [0; 32];
         OsRng.fill_bytes(&mut nonce);
-        hasher.update(&nonce);
 
         Self {
-            hasher,
+            label,
+            personalization: *personalization,
+            nonce,
+            hasher: new_hasher(personalization, &nonce),
             cache: ffi::NewBundleValidityCache(kind, cache_bytes),
         }
     }
 
+    /// Returns the nonce of this cache, and appends its entries to `entries`.
+    fn snapshot(&self, nonce: &mut [u8; 32], entries: &mut Vec<u8>) {
+        *nonce = self.nonce;
+        ffi::CopyBundleCacheEntries(&self.cache, entries);
+    }
+
+    /// Replaces the contents of this cache, including its nonce, with a snapshot. Entries
+    /// computed with the previous nonce would no longer match, so they are dropped.
+    fn restore(&mut self, nonce: &[u8; 32], entries: &[u8]) {
+        self.nonce = *nonce;
+        self.hasher = new_hasher(&self.personalization, nonce);
+        self.cache.pin_mut().clear();
+        for entry in entries.chunks_exact(32) {
+            self.cache
+                .pin_mut()
+                .insert(entry.try_into().expect("chunks are 32 bytes"));
+        }
+    }
+
     pub(crate) fn compute_entry(
         &self,
         bundle_commitment: &[u8; 32],
@@ -84,8 +122,10 @@ impl BundleValidityCache {
             .cache
             .contains(&entry.0, matches!(queued_entries, CacheEntries::NotStoring))
         {
+            metrics::increment_counter!(METRIC_CACHE_HITS, METRIC_LABEL_KIND => self.label);
             true
         } else {
+            metrics::increment_counter!(METRIC_CACHE_MISSES, METRIC_LABEL_KIND => self.label);
             if let CacheEntries::Storing(cache_entries) = queued_entries {
                 cache_entries.push(entry);
             }
@@ -102,11 +142,13 @@ pub(crate) fn init(cache_bytes: usize) {
     BUNDLE_CACHES_LOADED.call_once(|| unsafe {
         SAPLING_BUNDLE_VALIDITY_CACHE = Some(RwLock::new(BundleValidityCache::new(
             "Sapling",
+            "sapling",
             b"SaplingVeriCache",
             cache_bytes,
         )));
         ORCHARD_BUNDLE_VALIDITY_CACHE = Some(RwLock::new(BundleValidityCache::new(
             "Orchard",
+            "orchard",
             b"OrchardVeriCache",
             cache_bytes,
         )));
@@ -142,3 +184,19 @@ pub(crate) fn orchard_bundle_validity_cache_mut() -> RwLockWriteGuard<'static, B
         .write()
         .unwrap()
 }
+
+pub(crate) fn snapshot_sapling(nonce: &mut [u8; 32], entries: &mut Vec<u8>) {
+    sapling_bundle_validity_cache().snapshot(nonce, entries)
+}
+
+pub(crate) fn snapshot_orchard(nonce: &mut [u8; 32], entries: &mut Vec<u8>) {
+    orchard_bundle_validity_cache().snapshot(nonce, entries)
+}
+
+pub(crate) fn restore_sapling(nonce: &[u8; 32], entries: &[u8]) {
+    sapling_bundle_validity_cache_mut().restore(nonce, entries)
+}
+
+pub(crate) fn restore_orchard(nonce: &[u8; 32], entries: &[u8]) {
+    orchard_bundle_validity_cache_mut().restore(nonce, entries)
+}
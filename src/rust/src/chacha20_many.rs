@@ -0,0 +1,187 @@
+//! Single ChaCha20 keystream blocks for many keys at once.
+//!
+//! Trial decryption derives a different symmetric key for every (output, IVK) pair, and
+//! then only needs a single block of keystream under each key to decrypt the compact
+//! prefix of the note ciphertext. The `chacha20` crate vectorizes across consecutive
+//! blocks of one keystream, which doesn't help with that; this module instead computes
+//! the same block under up to eight keys in parallel, with one key per AVX2 lane, and
+//! falls back to the `chacha20` crate on CPUs without AVX2.
+
+use chacha20::{
+    cipher::{KeyIvInit, StreamCipher, StreamCipherSeek},
+    ChaCha20,
+};
+
+/// The size of a ChaCha20 block.
+pub(crate) const BLOCK_SIZE: usize = 64;
+
+/// Returns keystream block `counter` of ChaCha20 under each of `keys`, with the all-zeros
+/// nonce used by note encryption.
+pub(crate) fn keystream_blocks(keys: &[[u8; 32]], counter: u32) -> Vec<[u8; BLOCK_SIZE]> {
+    #[cfg(target_arch = "x86_64")]
+    if is_x86_feature_detected!("avx2") {
+        let mut blocks = Vec::with_capacity(keys.len());
+        for chunk in keys.chunks(avx2::LANES) {
+            // A partial chunk is padded out with zero keys, whose blocks are discarded;
+            // this is still cheaper than computing the chunk's blocks one at a time.
+            let mut lanes = [[0; 32]; avx2::LANES];
+            lanes[..chunk.len()].copy_from_slice(chunk);
+            // Safety: we have just checked that the CPU supports AVX2.
+            let lane_blocks = unsafe { avx2::keystream_blocks(&lanes, counter) };
+            blocks.extend_from_slice(&lane_blocks[..chunk.len()]);
+        }
+        return blocks;
+    }
+
+    keys.iter()
+        .map(|key| scalar_keystream_block(key, counter))
+        .collect()
+}
+
+/// Returns keystream block `counter` of ChaCha20 under `key`, with the all-zeros nonce.
+fn scalar_keystream_block(key: &[u8; 32], counter: u32) -> [u8; BLOCK_SIZE] {
+    let mut block = [0; BLOCK_SIZE];
+    let mut keystream = ChaCha20::new(key.into(), [0u8; 12][..].into());
+    keystream.seek(u64::from(counter) * BLOCK_SIZE as u64);
+    keystream.apply_keystream(&mut block);
+    block
+}
+
+#[cfg(target_arch = "x86_64")]
+mod avx2 {
+    use std::arch::x86_64::*;
+    use std::convert::TryInto;
+
+    use super::BLOCK_SIZE;
+
+    /// The number of keys that are processed together, one per 32-bit lane.
+    pub(super) const LANES: usize = 8;
+
+    /// Rotates each 32-bit lane of `$v` left by `$n` bits.
+    macro_rules! rotl {
+        ($v:expr, 16) => {
+            _mm256_shuffle_epi8(
+                $v,
+                _mm256_setr_epi8(
+                    2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13, 2, 3, 0, 1, 6, 7, 4, 5,
+                    10, 11, 8, 9, 14, 15, 12, 13,
+                ),
+            )
+        };
+        ($v:expr, 8) => {
+            _mm256_shuffle_epi8(
+                $v,
+                _mm256_setr_epi8(
+                    3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14, 3, 0, 1, 2, 7, 4, 5, 6,
+                    11, 8, 9, 10, 15, 12, 13, 14,
+                ),
+            )
+        };
+        ($v:expr, $n:literal) => {{
+            let v = $v;
+            _mm256_or_si256(_mm256_slli_epi32(v, $n), _mm256_srli_epi32(v, 32 - $n))
+        }};
+    }
+
+    macro_rules! quarter_round {
+        ($x:ident, $a:literal, $b:literal, $c:literal, $d:literal) => {
+            $x[$a] = _mm256_add_epi32($x[$a], $x[$b]);
+            $x[$d] = rotl!(_mm256_xor_si256($x[$d], $x[$a]), 16);
+            $x[$c] = _mm256_add_epi32($x[$c], $x[$d]);
+            $x[$b] = rotl!(_mm256_xor_si256($x[$b], $x[$c]), 12);
+            $x[$a] = _mm256_add_epi32($x[$a], $x[$b]);
+            $x[$d] = rotl!(_mm256_xor_si256($x[$d], $x[$a]), 8);
+            $x[$c] = _mm256_add_epi32($x[$c], $x[$d]);
+            $x[$b] = rotl!(_mm256_xor_si256($x[$b], $x[$c]), 7);
+        };
+    }
+
+    /// Returns keystream block `counter` of ChaCha20 under each of `keys`, with the
+    /// all-zeros nonce.
+    ///
+    /// # Safety
+    ///
+    /// The caller must ensure that the CPU supports AVX2.
+    #[target_feature(enable = "avx2")]
+    pub(super) unsafe fn keystream_blocks(
+        keys: &[[u8; 32]; LANES],
+        counter: u32,
+    ) -> [[u8; BLOCK_SIZE]; LANES] {
+        // The state is held transposed: `state[i]` holds word `i` of the state for every
+        // key. Words 13 to 15 are the nonce, which is all zeros.
+        let mut state = [_mm256_setzero_si256(); 16];
+        state[0] = _mm256_set1_epi32(0x6170_7865);
+        state[1] = _mm256_set1_epi32(0x3320_646e);
+        state[2] = _mm256_set1_epi32(0x7962_2d32);
+        state[3] = _mm256_set1_epi32(0x6b20_6574);
+        for i in 0..8 {
+            let mut words = [0u32; LANES];
+            for (word, key) in words.iter_mut().zip(keys) {
+                *word = u32::from_le_bytes(key[4 * i..4 * (i + 1)].try_into().unwrap());
+            }
+            state[4 + i] = _mm256_loadu_si256(words.as_ptr() as *const __m256i);
+        }
+        state[12] = _mm256_set1_epi32(counter as i32);
+
+        let mut x = state;
+        for _ in 0..10 {
+            quarter_round!(x, 0, 4, 8, 12);
+            quarter_round!(x, 1, 5, 9, 13);
+            quarter_round!(x, 2, 6, 10, 14);
+            quarter_round!(x, 3, 7, 11, 15);
+            quarter_round!(x, 0, 5, 10, 15);
+            quarter_round!(x, 1, 6, 11, 12);
+            quarter_round!(x, 2, 7, 8, 13);
+            quarter_round!(x, 3, 4, 9, 14);
+        }
+
+        let mut blocks = [[0; BLOCK_SIZE]; LANES];
+        for i in 0..16 {
+            let mut words = [0u32; LANES];
+            _mm256_storeu_si256(
+                words.as_mut_ptr() as *mut __m256i,
+                _mm256_add_epi32(x[i], state[i]),
+            );
+            for (block, word) in blocks.iter_mut().zip(&words) {
+                block[4 * i..4 * (i + 1)].copy_from_slice(&word.to_le_bytes());
+            }
+        }
+        blocks
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn keystream_blocks_match_chacha20() {
+        // RFC 8439 appendix A.1, test vector #2: the all-zeros key, at block 1.
+        let blocks = keystream_blocks(&[[0; 32]], 1);
+        assert_eq!(
+            blocks[0][..16],
+            [
+                0x9f, 0x07, 0xe7, 0xbe, 0x55, 0x51, 0x38, 0x7a, 0x98, 0xba, 0x97, 0x7c, 0x73, 0x2d,
+                0x08, 0x0d,
+            ]
+        );
+
+        // Enough distinct keys to fill two full sets of lanes and a partial one.
+        let keys: Vec<[u8; 32]> = (0..19u8)
+            .map(|i| {
+                let mut key = [0; 32];
+                for (j, b) in key.iter_mut().enumerate() {
+                    *b = i.wrapping_mul(31).wrapping_add(j as u8);
+                }
+                key
+            })
+            .collect();
+        for counter in [0, 1, 7] {
+            let blocks = keystream_blocks(&keys, counter);
+            assert_eq!(blocks.len(), keys.len());
+            for (key, block) in keys.iter().zip(&blocks) {
+                assert_eq!(block, &scalar_keystream_block(key, counter));
+            }
+        }
+    }
+}
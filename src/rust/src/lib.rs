@@ -28,6 +28,7 @@ use std::path::PathBuf;
 use subtle::CtOption;
 
 mod blake2b;
+mod chacha20_many;
 mod ed25519;
 mod equihash;
 mod metrics_ffi;
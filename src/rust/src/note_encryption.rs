@@ -1,19 +1,26 @@
 use std::convert::TryInto;
 
+use chacha20::{
+    cipher::{KeyIvInit, StreamCipher, StreamCipherSeek},
+    ChaCha20,
+};
+use chacha20poly1305::{aead::AeadInPlace, ChaCha20Poly1305, KeyInit};
 use sapling::{
     keys::OutgoingViewingKey,
     note_encryption::{PreparedIncomingViewingKey, SaplingDomain},
     value::ValueCommitment,
     SaplingIvk,
 };
+use subtle::ConstantTimeEq;
 use zcash_note_encryption::{
-    try_output_recovery_with_ovk, Domain, EphemeralKeyBytes, ShieldedOutput, ENC_CIPHERTEXT_SIZE,
+    try_output_recovery_with_ovk, Domain, EphemeralKeyBytes, NotePlaintextBytes, ShieldedOutput,
+    COMPACT_NOTE_SIZE, ENC_CIPHERTEXT_SIZE, NOTE_PLAINTEXT_SIZE,
 };
 use zcash_primitives::{
     consensus::BlockHeight, transaction::components::sapling as sapling_serialization,
 };
 
-use crate::{bridge::ffi::SaplingShieldedOutput, params::Network};
+use crate::{bridge::ffi::SaplingShieldedOutput, chacha20_many, params::Network};
 
 /// Trial decryption of the full note plaintext by the recipient.
 ///
@@ -31,13 +38,20 @@ pub(crate) fn try_sapling_note_decryption(
 ) -> Result<Box<DecryptedSaplingOutput>, &'static str> {
     let ivk = parse_and_prepare_sapling_ivk(raw_ivk)
         .ok_or("Invalid Sapling ivk passed to wallet::try_sapling_note_decryption()")?;
+    let domain = SaplingDomain::new(sapling_serialization::zip212_enforcement(
+        network,
+        BlockHeight::from_u32(height),
+    ));
 
-    let (note, recipient, memo) = sapling::note_encryption::try_sapling_note_decryption(
-        &ivk,
-        &output,
-        sapling_serialization::zip212_enforcement(network, BlockHeight::from_u32(height)),
-    )
-    .ok_or("Decryption failed")?;
+    let ephemeral_key = output.ephemeral_key();
+    let epk = SaplingDomain::epk(&ephemeral_key).ok_or("Decryption failed")?;
+    let key = SaplingDomain::kdf(
+        SaplingDomain::ka_agree_dec(&ivk, &SaplingDomain::prepare_epk(epk)),
+        &ephemeral_key,
+    );
+
+    let (note, recipient, memo) =
+        try_note_decryption_with_key(&domain, &ivk, &output, &key).ok_or("Decryption failed")?;
 
     Ok(Box::new(DecryptedSaplingOutput {
         note,
@@ -108,6 +122,138 @@ impl ShieldedOutput<SaplingDomain, ENC_CIPHERTEXT_SIZE> for SaplingShieldedOutpu
     }
 }
 
+/// Trial decryption of an output with a symmetric key that the caller has already
+/// derived from `ivk` and the output's ephemeral key.
+///
+/// Only the leading [`COMPACT_NOTE_SIZE`] bytes of the note ciphertext (the [ZIP 307]
+/// compact format) are decrypted at first, which is enough to rule out almost every
+/// output that is not for `ivk`. If they hold a valid note, the full ciphertext is then
+/// authenticated and decrypted with the same key.
+///
+/// [ZIP 307]: https://zips.z.cash/zip-0307
+pub(crate) fn try_note_decryption_with_key<
+    D: Domain,
+    Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE>,
+>(
+    domain: &D,
+    ivk: &D::IncomingViewingKey,
+    output: &Output,
+    key: &D::SymmetricKey,
+) -> Option<(D::Note, D::Recipient, D::Memo)> {
+    let enc_ciphertext = output.enc_ciphertext();
+
+    // The keystream for the note plaintext starts at block 1, after the block that
+    // keys Poly1305.
+    let mut compact_plaintext: [u8; COMPACT_NOTE_SIZE] =
+        enc_ciphertext[..COMPACT_NOTE_SIZE].try_into().unwrap();
+    let mut keystream = ChaCha20::new(key.as_ref().into(), [0u8; 12][..].into());
+    keystream.seek(64);
+    keystream.apply_keystream(&mut compact_plaintext);
+
+    try_note_decryption_with_compact_plaintext(domain, ivk, output, key, &compact_plaintext)
+}
+
+/// Trial decryption of an output with each of `ivks`, given the symmetric keys that the
+/// caller has already derived from them and the output's ephemeral key.
+///
+/// This is [`try_note_decryption_with_key`] for many keys at once: the compact prefixes
+/// are decrypted with keystream for all of the keys computed together, and the result for
+/// the first IVK that decrypts the output is returned along with its index in `ivks`.
+pub(crate) fn batch_try_note_decryption_with_keys<
+    D: Domain,
+    Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE>,
+>(
+    domain: &D,
+    ivks: &[D::IncomingViewingKey],
+    output: &Output,
+    keys: &[Option<D::SymmetricKey>],
+) -> Option<((D::Note, D::Recipient, D::Memo), usize)> {
+    assert_eq!(ivks.len(), keys.len());
+
+    let (ivk_indices, raw_keys): (Vec<_>, Vec<[u8; 32]>) = keys
+        .iter()
+        .enumerate()
+        .filter_map(|(ivk_idx, key)| {
+            key.as_ref().map(|key| {
+                let key: &[u8] = key.as_ref();
+                (ivk_idx, key.try_into().unwrap())
+            })
+        })
+        .unzip();
+
+    // The keystream for the note plaintext starts at block 1, after the block that
+    // keys Poly1305, and the compact prefix lies entirely within that block.
+    let keystreams = chacha20_many::keystream_blocks(&raw_keys, 1);
+
+    let compact_ciphertext = &output.enc_ciphertext()[..COMPACT_NOTE_SIZE];
+    ivk_indices
+        .into_iter()
+        .zip(keystreams)
+        .find_map(|(ivk_idx, keystream)| {
+            let mut compact_plaintext = [0; COMPACT_NOTE_SIZE];
+            for ((p, c), k) in compact_plaintext
+                .iter_mut()
+                .zip(compact_ciphertext)
+                .zip(&keystream)
+            {
+                *p = c ^ k;
+            }
+
+            try_note_decryption_with_compact_plaintext(
+                domain,
+                &ivks[ivk_idx],
+                output,
+                keys[ivk_idx].as_ref().unwrap(),
+                &compact_plaintext,
+            )
+            .map(|decrypted| (decrypted, ivk_idx))
+        })
+}
+
+/// Completes trial decryption of an output whose compact prefix has been decrypted to
+/// `compact_plaintext` with `key`.
+fn try_note_decryption_with_compact_plaintext<
+    D: Domain,
+    Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE>,
+>(
+    domain: &D,
+    ivk: &D::IncomingViewingKey,
+    output: &Output,
+    key: &D::SymmetricKey,
+    compact_plaintext: &[u8; COMPACT_NOTE_SIZE],
+) -> Option<(D::Note, D::Recipient, D::Memo)> {
+    let ephemeral_key = output.ephemeral_key();
+    let enc_ciphertext = output.enc_ciphertext();
+
+    let (note, recipient) = domain.parse_note_plaintext_without_memo_ivk(ivk, compact_plaintext)?;
+
+    // The note must match the output's note commitment and, where the note determines
+    // the ephemeral secret key, its ephemeral key.
+    if D::ExtractedCommitmentBytes::from(&D::cmstar(&note)) != output.cmstar_bytes() {
+        return None;
+    }
+    if let Some(derived_esk) = D::derive_esk(&note) {
+        let derived_ephemeral_key = D::epk_bytes(&D::ka_derive_public(&note, &derived_esk));
+        if !bool::from(derived_ephemeral_key.ct_eq(&ephemeral_key)) {
+            return None;
+        }
+    }
+
+    let mut plaintext =
+        NotePlaintextBytes(enc_ciphertext[..NOTE_PLAINTEXT_SIZE].try_into().unwrap());
+    ChaCha20Poly1305::new(key.as_ref().into())
+        .decrypt_in_place_detached(
+            [0u8; 12][..].into(),
+            &[],
+            &mut plaintext.0,
+            enc_ciphertext[NOTE_PLAINTEXT_SIZE..].into(),
+        )
+        .ok()?;
+    let memo = domain.extract_memo(&plaintext);
+
+    Some((note, recipient, memo))
+}
+
 /// A Sapling output that we successfully decrypted with an `ivk`.
 pub(crate) struct DecryptedSaplingOutput {
     note: sapling::Note,
@@ -143,3 +289,89 @@ impl DecryptedSaplingOutput {
         self.memo
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use rand::rngs::OsRng;
+    use sapling::{
+        note_encryption::sapling_note_encryption, value::NoteValue, zip32::ExtendedSpendingKey,
+        Note, Rseed,
+    };
+    use zcash_protocol::consensus;
+
+    use super::*;
+
+    // A mainnet height at which ZIP 212 is enforced.
+    const HEIGHT: u32 = 2_000_000;
+
+    #[test]
+    fn sapling_note_decryption() {
+        let network = Network::Consensus(consensus::Network::MainNetwork);
+        let dfvk = ExtendedSpendingKey::master(&[1; 32]).to_diversifiable_full_viewing_key();
+        let other_dfvk = ExtendedSpendingKey::master(&[2; 32]).to_diversifiable_full_viewing_key();
+        let raw_ivk = dfvk.fvk().vk.ivk().0.to_bytes();
+        let other_raw_ivk = other_dfvk.fvk().vk.ivk().0.to_bytes();
+
+        let (_, recipient) = dfvk.default_address();
+        let note = Note::from_parts(
+            recipient,
+            NoteValue::from_raw(1000),
+            Rseed::AfterZip212([7; 32]),
+        );
+        let mut memo = [0; 512];
+        memo[..5].copy_from_slice(b"hello");
+        let cmu = note.cmu().to_bytes();
+        let encryptor = sapling_note_encryption(None, note, memo, &mut OsRng);
+        let ephemeral_key = SaplingDomain::epk_bytes(encryptor.epk()).0;
+        let enc_ciphertext = encryptor.encrypt_note_plaintext();
+        let output = |cmu, enc_ciphertext| SaplingShieldedOutput {
+            cv: [0; 32],
+            cmu,
+            ephemeral_key,
+            enc_ciphertext,
+            out_ciphertext: [0; 80],
+        };
+
+        // The output is decrypted with the recipient's ivk.
+        let decrypted =
+            try_sapling_note_decryption(&network, HEIGHT, &raw_ivk, output(cmu, enc_ciphertext))
+                .unwrap();
+        assert_eq!(decrypted.note_value(), 1000);
+        assert_eq!(decrypted.note_rseed(), [7; 32]);
+        assert!(decrypted.zip_212_enabled());
+        assert_eq!(decrypted.recipient_d(), recipient.diversifier().0);
+        assert_eq!(decrypted.recipient_pk_d()[..], recipient.to_bytes()[11..]);
+        assert_eq!(decrypted.memo(), memo);
+
+        // It is rejected by the compact prefix with any other ivk.
+        assert!(try_sapling_note_decryption(
+            &network,
+            HEIGHT,
+            &other_raw_ivk,
+            output(cmu, enc_ciphertext)
+        )
+        .is_err());
+
+        // A note that does not match the note commitment is rejected.
+        let mut wrong_cmu = cmu;
+        wrong_cmu[0] ^= 1;
+        assert!(try_sapling_note_decryption(
+            &network,
+            HEIGHT,
+            &raw_ivk,
+            output(wrong_cmu, enc_ciphertext)
+        )
+        .is_err());
+
+        // The compact prefix decrypts, but the full ciphertext does not authenticate.
+        let mut tampered_ciphertext = enc_ciphertext;
+        tampered_ciphertext[ENC_CIPHERTEXT_SIZE - 1] ^= 1;
+        assert!(try_sapling_note_decryption(
+            &network,
+            HEIGHT,
+            &raw_ivk,
+            output(cmu, tampered_ciphertext)
+        )
+        .is_err());
+    }
+}
@@ -47,6 +47,7 @@ mod zip32;
 
 const SAPLING_TREE_DEPTH: usize = 32;
 
+#[repr(transparent)]
 pub(crate) struct Spend(sapling::bundle::SpendDescription<sapling::bundle::Authorized>);
 
 pub(crate) fn parse_v4_sapling_spend(bytes: &[u8]) -> Result<Box<Spend>, String> {
@@ -57,6 +58,14 @@ pub(crate) fn parse_v4_sapling_spend(bytes: &[u8]) -> Result<Box<Spend>, String>
 }
 
 impl Spend {
+    /// Borrows a spend description in place, without cloning it.
+    fn from_ref(
+        spend: &sapling::bundle::SpendDescription<sapling::bundle::Authorized>,
+    ) -> &Self {
+        // SAFETY: `Spend` is a `#[repr(transparent)]` wrapper around `SpendDescription`.
+        unsafe { &*(spend as *const sapling::bundle::SpendDescription<_> as *const Spend) }
+    }
+
     pub(crate) fn cv(&self) -> [u8; 32] {
         self.0.cv().to_bytes()
     }
@@ -82,6 +91,7 @@ impl Spend {
     }
 }
 
+#[repr(transparent)]
 pub(crate) struct Output(sapling::bundle::OutputDescription<[u8; 192]>);
 
 pub(crate) fn parse_v4_sapling_output(bytes: &[u8]) -> Result<Box<Output>, String> {
@@ -92,6 +102,12 @@ pub(crate) fn parse_v4_sapling_output(bytes: &[u8]) -> Result<Box<Output>, Strin
 }
 
 impl Output {
+    /// Borrows an output description in place, without cloning it.
+    fn from_ref(output: &sapling::bundle::OutputDescription<[u8; 192]>) -> &Self {
+        // SAFETY: `Output` is a `#[repr(transparent)]` wrapper around `OutputDescription`.
+        unsafe { &*(output as *const sapling::bundle::OutputDescription<_> as *const Output) }
+    }
+
     pub(crate) fn cv(&self) -> [u8; 32] {
         self.0.cv().to_bytes()
     }
@@ -206,6 +222,64 @@ impl Bundle {
             .collect()
     }
 
+    /// Returns the spend at `index` without copying it.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `index` is not less than `self.num_spends()`.
+    pub(crate) fn spend(&self, index: usize) -> &Spend {
+        Spend::from_ref(
+            &self
+                .inner()
+                .expect("Bundle should have been checked to contain spends")
+                .shielded_spends()[index],
+        )
+    }
+
+    /// Returns the output at `index` without copying it.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `index` is not less than `self.num_outputs()`.
+    pub(crate) fn output(&self, index: usize) -> &Output {
+        Output::from_ref(
+            &self
+                .inner()
+                .expect("Bundle should have been checked to contain outputs")
+                .shielded_outputs()[index],
+        )
+    }
+
+    /// Writes the nullifier of each spend to consecutive 32-byte chunks of `nullifiers`.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `nullifiers` is not exactly 32 bytes per spend.
+    pub(crate) fn nullifiers(&self, nullifiers: &mut [u8]) {
+        assert_eq!(nullifiers.len(), 32 * self.num_spends());
+        for (chunk, spend) in nullifiers
+            .chunks_exact_mut(32)
+            .zip(self.0.iter().flat_map(|b| b.shielded_spends().iter()))
+        {
+            chunk.copy_from_slice(&spend.nullifier().0);
+        }
+    }
+
+    /// Writes the note commitment of each output to consecutive 32-byte chunks of `cmus`.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `cmus` is not exactly 32 bytes per output.
+    pub(crate) fn cmus(&self, cmus: &mut [u8]) {
+        assert_eq!(cmus.len(), 32 * self.num_outputs());
+        for (chunk, output) in cmus
+            .chunks_exact_mut(32)
+            .zip(self.0.iter().flat_map(|b| b.shielded_outputs().iter()))
+        {
+            chunk.copy_from_slice(&output.cmu().to_bytes());
+        }
+    }
+
     pub(crate) fn num_spends(&self) -> usize {
         self.inner().map(|b| b.shielded_spends().len()).unwrap_or(0)
     }
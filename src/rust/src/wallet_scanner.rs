@@ -8,10 +8,22 @@ use std::sync::{
     Arc,
 };
 
+use blake2b_simd::{
+    many::{hash_many, HashManyJob},
+    Params as Blake2bParams,
+};
 use crossbeam_channel as channel;
+use group::{Curve, GroupEncoding, WnafBase, WnafScalar};
 use memuse::DynamicUsage;
-use sapling::{bundle::GrothProofBytes, note_encryption::SaplingDomain};
-use zcash_note_encryption::{batch, BatchDomain, Domain, ShieldedOutput, ENC_CIPHERTEXT_SIZE};
+use rayon::prelude::*;
+use sapling::{
+    bundle::GrothProofBytes,
+    note_encryption::{PreparedIncomingViewingKey, SaplingDomain},
+    SaplingIvk,
+};
+use zcash_note_encryption::{
+    BatchDomain, Domain, EphemeralKeyBytes, ShieldedOutput, ENC_CIPHERTEXT_SIZE,
+};
 use zcash_primitives::{
     block::BlockHash,
     consensus,
@@ -21,13 +33,29 @@ use zcash_primitives::{
     },
 };
 
-use crate::{bridge::ffi, note_encryption::parse_and_prepare_sapling_ivk, params::Network};
+use crate::{bridge::ffi, note_encryption::batch_try_note_decryption_with_keys, params::Network};
 
 /// The minimum number of outputs to trial decrypt in a batch.
 ///
 /// TODO: Tune this.
 const BATCH_SIZE_THRESHOLD: usize = 20;
 
+/// The maximum number of incoming viewing keys that a batch trial decrypts with on a
+/// single thread.
+///
+/// The cost of trial decrypting an output is linear in the number of IVKs, and is
+/// dominated by the key agreement for each (IVK, output) pair. A batch therefore splits
+/// its IVKs into chunks of this size, and trial decrypts its outputs with each chunk in
+/// parallel, so that the work for even a single transaction is spread across the global
+/// threadpool.
+///
+/// Each chunk derives its symmetric keys four at a time with `blake2b_simd::many`, and
+/// computes their ChaCha20 keystream eight at a time, so this is a multiple of both.
+/// Wallets rarely hold more than a handful of IVKs, so in practice a batch has a single
+/// chunk, and larger wallets still get one chunk per thread long before the per-chunk
+/// overhead (preparing the chunk's IVKs, and collecting its results) matters.
+const IVK_CHUNK_SIZE: usize = 32;
+
 const METRIC_OUTPUTS_SCANNED: &str = "zcashd.wallet.batchscanner.outputs.scanned";
 const METRIC_LABEL_KIND: &str = "kind";
 
@@ -36,10 +64,102 @@ const METRIC_SIZE_TXS: &str = "zcashd.wallet.batchscanner.size.transactions";
 trait OutputDomain: BatchDomain {
     // The kind of output, for metrics labelling.
     const KIND: &'static str;
+
+    /// An incoming viewing key, before it is prepared for trial decryption.
+    type RawIvk: Copy + Send + Sync;
+
+    /// Prepares an incoming viewing key for parsing note plaintexts.
+    fn prepare_ivk(ivk: &Self::RawIvk) -> Self::IncomingViewingKey;
+
+    /// Derives the symmetric key for every pair of one of `ephemeral_keys` with one of
+    /// `ivks`, ordered by ephemeral key and then by IVK.
+    ///
+    /// The key for an invalid ephemeral key is `None`.
+    fn batch_kdf_with_ivks(
+        ivks: &[Self::RawIvk],
+        ephemeral_keys: &[EphemeralKeyBytes],
+    ) -> Vec<Option<Self::SymmetricKey>>;
 }
 
+/// The window size of the wNAF tables that Sapling key agreement uses, matching the one
+/// used by `sapling-crypto`.
+const SAPLING_WNAF_WINDOW_SIZE: usize = 4;
+
+/// The BLAKE2b personalization for the Sapling KDF.
+const KDF_SAPLING_PERSONALIZATION: &[u8; 16] = b"Zcash_SaplingKDF";
+
 impl OutputDomain for SaplingDomain {
     const KIND: &'static str = "sapling";
+
+    type RawIvk = jubjub::Fr;
+
+    fn prepare_ivk(ivk: &jubjub::Fr) -> PreparedIncomingViewingKey {
+        PreparedIncomingViewingKey::new(&SaplingIvk(*ivk))
+    }
+
+    /// `sapling-crypto` only applies the Sapling KDF one key at a time, and doesn't expose
+    /// the shared secrets that it hashes, so we perform Sapling key agreement
+    /// (`[8 * ivk] epk`) here in the same way that it does, and then hash the shared
+    /// secrets with as many BLAKE2b instances in parallel as the CPU supports.
+    ///
+    /// See the [Zcash Protocol Specification](https://zips.z.cash/protocol/protocol.pdf#concretesaplingkdf).
+    fn batch_kdf_with_ivks(
+        ivks: &[jubjub::Fr],
+        ephemeral_keys: &[EphemeralKeyBytes],
+    ) -> Vec<Option<Self::SymmetricKey>> {
+        let ivks: Vec<_> = ivks
+            .iter()
+            .map(WnafScalar::<_, SAPLING_WNAF_WINDOW_SIZE>::new)
+            .collect();
+
+        // ZIP 216: non-canonical encodings of the ephemeral key are rejected, as in
+        // `SaplingDomain::epk`.
+        let shared_secrets: Vec<Option<jubjub::ExtendedPoint>> = ephemeral_keys
+            .iter()
+            .flat_map(|ephemeral_key| {
+                let epk = Option::<jubjub::ExtendedPoint>::from(jubjub::ExtendedPoint::from_bytes(
+                    &ephemeral_key.0,
+                ))
+                .map(WnafBase::<_, SAPLING_WNAF_WINDOW_SIZE>::new);
+                let ivks = &ivks;
+                ivks.iter()
+                    .map(move |ivk| epk.as_ref().map(|epk| (epk * ivk).mul_by_cofactor()))
+            })
+            .collect();
+
+        let points: Vec<_> = shared_secrets.iter().flatten().copied().collect();
+        let mut affine_points = vec![jubjub::AffinePoint::identity(); points.len()];
+        jubjub::ExtendedPoint::batch_normalize(&points, &mut affine_points);
+
+        let inputs: Vec<[u8; 64]> = shared_secrets
+            .chunks(ivks.len())
+            .zip(ephemeral_keys)
+            .flat_map(|(secrets, ephemeral_key)| {
+                secrets.iter().flatten().map(move |_| ephemeral_key)
+            })
+            .zip(&affine_points)
+            .map(|(ephemeral_key, secret)| {
+                let mut input = [0; 64];
+                input[..32].copy_from_slice(&secret.to_bytes());
+                input[32..].copy_from_slice(&ephemeral_key.0);
+                input
+            })
+            .collect();
+
+        let mut params = Blake2bParams::new();
+        params.hash_length(32).personal(KDF_SAPLING_PERSONALIZATION);
+        let mut jobs: Vec<_> = inputs
+            .iter()
+            .map(|input| HashManyJob::new(&params, input))
+            .collect();
+        hash_many(jobs.iter_mut());
+
+        let mut keys = jobs.iter().map(HashManyJob::to_hash);
+        shared_secrets
+            .iter()
+            .map(|secret| secret.as_ref().map(|_| keys.next().unwrap()))
+            .collect()
+    }
 }
 
 /// A decrypted note.
@@ -209,11 +329,13 @@ impl<Item: Task> Task for WithUsageTask<Item> {
 }
 
 /// A batch of outputs to trial decrypt.
-struct Batch<A, D: BatchDomain, Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE>> {
+struct Batch<A, D: OutputDomain, Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE>> {
     tags: Vec<A>,
+    /// The IVKs that key agreement is performed with, in parallel with `ivks`.
+    raw_ivks: Vec<D::RawIvk>,
     ivks: Vec<D::IncomingViewingKey>,
     /// We currently store outputs and repliers as parallel vectors, because
-    /// [`batch::try_note_decryption`] accepts a slice of domain/output pairs
+    /// [`zcash_note_encryption::batch::try_note_decryption`] accepts a slice of domain/output pairs
     /// rather than a value that implements `IntoIterator`, and therefore we
     /// can't just use `map` to select the parts we need in order to perform
     /// batch decryption. Ideally the domain, output, and output replier would
@@ -226,12 +348,14 @@ struct Batch<A, D: BatchDomain, Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE>>
 impl<A, D, Output> DynamicUsage for Batch<A, D, Output>
 where
     A: DynamicUsage,
-    D: BatchDomain + DynamicUsage,
+    D: OutputDomain + DynamicUsage,
     D::IncomingViewingKey: DynamicUsage,
     Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE> + DynamicUsage,
 {
     fn dynamic_usage(&self) -> usize {
+        // Raw IVKs are `Copy`, and so do not themselves hold any heap memory.
         self.tags.dynamic_usage()
+            + self.raw_ivks.capacity() * mem::size_of::<D::RawIvk>()
             + self.ivks.dynamic_usage()
             + self.outputs.dynamic_usage()
             + self.repliers.dynamic_usage()
@@ -239,17 +363,18 @@ where
 
     fn dynamic_usage_bounds(&self) -> (usize, Option<usize>) {
         let (tags_lower, tags_upper) = self.tags.dynamic_usage_bounds();
+        let raw_ivks_usage = self.raw_ivks.capacity() * mem::size_of::<D::RawIvk>();
         let (ivks_lower, ivks_upper) = self.ivks.dynamic_usage_bounds();
         let (outputs_lower, outputs_upper) = self.outputs.dynamic_usage_bounds();
         let (repliers_lower, repliers_upper) = self.repliers.dynamic_usage_bounds();
 
         (
-            tags_lower + ivks_lower + outputs_lower + repliers_lower,
+            tags_lower + raw_ivks_usage + ivks_lower + outputs_lower + repliers_lower,
             tags_upper
                 .zip(ivks_upper)
                 .zip(outputs_upper)
                 .zip(repliers_upper)
-                .map(|(((a, b), c), d)| a + b + c + d),
+                .map(|(((a, b), c), d)| a + raw_ivks_usage + b + c + d),
         )
     }
 }
@@ -261,10 +386,12 @@ where
     Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE>,
 {
     /// Constructs a new batch.
-    fn new(tags: Vec<A>, ivks: Vec<D::IncomingViewingKey>) -> Self {
+    fn new(tags: Vec<A>, raw_ivks: Vec<D::RawIvk>, ivks: Vec<D::IncomingViewingKey>) -> Self {
+        assert_eq!(tags.len(), raw_ivks.len());
         assert_eq!(tags.len(), ivks.len());
         Self {
             tags,
+            raw_ivks,
             ivks,
             outputs: vec![],
             repliers: vec![],
@@ -280,25 +407,63 @@ where
 impl<A, D, Output> Task for Batch<A, D, Output>
 where
     A: Clone + Send + 'static,
-    D: OutputDomain + Send + 'static,
-    D::IncomingViewingKey: Send,
+    D: OutputDomain + Send + Sync + 'static,
+    D::IncomingViewingKey: Send + Sync,
     D::Memo: Send,
     D::Note: Send,
     D::Recipient: Send,
-    Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE> + Send + 'static,
+    Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE> + Send + Sync + 'static,
 {
     /// Runs the batch of trial decryptions, and reports the results.
     fn run(self) {
         // Deconstruct self so we can consume the pieces individually.
         let Self {
             tags,
+            raw_ivks,
             ivks,
             outputs,
             repliers,
         } = self;
 
         assert_eq!(outputs.len(), repliers.len());
-        let decryption_results = batch::try_note_decryption(&ivks, &outputs);
+
+        let ephemeral_keys: Vec<_> = outputs
+            .iter()
+            .map(|(_, output)| output.ephemeral_key())
+            .collect();
+
+        // Trial decrypt with each chunk of IVKs in parallel. Every chunk borrows the same
+        // outputs, and reports for each one the note it decrypted and the index into
+        // `ivks` of the key that decrypted it.
+        let mut chunk_results: Vec<Vec<_>> = raw_ivks
+            .par_chunks(IVK_CHUNK_SIZE)
+            .zip(ivks.par_chunks(IVK_CHUNK_SIZE))
+            .enumerate()
+            .map(|(chunk_idx, (chunk_raw_ivks, chunk_ivks))| {
+                // Derive the symmetric key for every (output, IVK) pair in the chunk.
+                let keys = D::batch_kdf_with_ivks(chunk_raw_ivks, &ephemeral_keys);
+
+                // Each key is used both to decrypt the compact prefix of the note
+                // ciphertext, which rules out almost every output that is not for us,
+                // and then to decrypt the full ciphertext of the outputs that are.
+                keys.chunks(chunk_ivks.len())
+                    .zip(outputs.iter())
+                    .map(|(output_keys, (domain, output))| {
+                        batch_try_note_decryption_with_keys(domain, chunk_ivks, output, output_keys)
+                            .map(|(decrypted, ivk_idx)| {
+                                (decrypted, chunk_idx * IVK_CHUNK_SIZE + ivk_idx)
+                            })
+                    })
+                    .collect()
+            })
+            .collect();
+
+        // As in an unchunked batch, each output is decrypted with the first IVK it matched.
+        let decryption_results = (0..outputs.len()).map(|output_idx| {
+            chunk_results
+                .iter_mut()
+                .find_map(|results| results[output_idx].take())
+        });
         metrics::counter!(
             METRIC_OUTPUTS_SCANNED,
             outputs.len() as u64,
@@ -330,7 +495,7 @@ where
     }
 }
 
-impl<A, D: BatchDomain, Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE> + Clone>
+impl<A, D: OutputDomain, Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE> + Clone>
     Batch<A, D, Output>
 {
     /// Adds the given outputs to this batch.
@@ -405,7 +570,7 @@ impl<A, D: Domain> DynamicUsage for BatchReceiver<A, D> {
 /// Logic to run batches of trial decryptions on the global threadpool.
 struct BatchRunner<A, D, Output, T>
 where
-    D: BatchDomain,
+    D: OutputDomain,
     Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE>,
     T: Tasks<Batch<A, D, Output>>,
 {
@@ -420,7 +585,7 @@ where
 impl<A, D, Output, T> DynamicUsage for BatchRunner<A, D, Output, T>
 where
     A: DynamicUsage,
-    D: BatchDomain + DynamicUsage,
+    D: OutputDomain + DynamicUsage,
     D::IncomingViewingKey: DynamicUsage,
     Output: ShieldedOutput<D, ENC_CIPHERTEXT_SIZE> + DynamicUsage,
     T: Tasks<Batch<A, D, Output>> + DynamicUsage,
@@ -457,10 +622,11 @@ where
     T: Tasks<Batch<A, D, Output>>,
 {
     /// Constructs a new batch runner for the given incoming viewing keys.
-    fn new(ivks: impl Iterator<Item = (A, D::IncomingViewingKey)>) -> Self {
-        let (tags, ivks) = ivks.unzip();
+    fn new(ivks: impl Iterator<Item = (A, D::RawIvk)>) -> Self {
+        let (tags, raw_ivks): (Vec<_>, Vec<_>) = ivks.unzip();
+        let ivks = raw_ivks.iter().map(D::prepare_ivk).collect();
         Self {
-            acc: Batch::new(tags, ivks),
+            acc: Batch::new(tags, raw_ivks, ivks),
             running_tasks: T::new(),
             pending_results: HashMap::default(),
         }
@@ -509,7 +675,11 @@ where
     /// Subsequent calls to `Self::add_outputs` will be accumulated into a new batch.
     fn flush(&mut self) {
         if !self.acc.is_empty() {
-            let mut batch = Batch::new(self.acc.tags.clone(), self.acc.ivks.clone());
+            let mut batch = Batch::new(
+                self.acc.tags.clone(),
+                self.acc.raw_ivks.clone(),
+                self.acc.ivks.clone(),
+            );
             mem::swap(&mut batch, &mut self.acc);
             self.running_tasks.run_task(batch);
         }
@@ -578,8 +748,8 @@ pub(crate) fn init_batch_scanner(
         let ivks: Vec<(_, _)> = sapling_ivks
             .iter()
             .map(|raw_ivk| {
-                parse_and_prepare_sapling_ivk(raw_ivk)
-                    .map(|prepared_ivk| (*raw_ivk, prepared_ivk))
+                Option::<jubjub::Fr>::from(jubjub::Fr::from_bytes(raw_ivk))
+                    .map(|ivk| (*raw_ivk, ivk))
                     .ok_or("Invalid Sapling ivk passed to wallet::init_batch_scanner()")
             })
             .collect::<Result<_, _>>()?;
@@ -692,3 +862,133 @@ impl BatchResult {
             .collect()
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use rand::rngs::OsRng;
+    use sapling::{
+        note_encryption::{sapling_note_encryption, PreparedIncomingViewingKey, Zip212Enforcement},
+        value::NoteValue,
+        zip32::ExtendedSpendingKey,
+        Note, PaymentAddress, Rseed,
+    };
+    use zcash_note_encryption::EphemeralKeyBytes;
+
+    use super::*;
+
+    /// A Sapling output with just the fields that trial decryption reads.
+    #[derive(Clone)]
+    struct TestOutput {
+        cmu: [u8; 32],
+        ephemeral_key: [u8; 32],
+        enc_ciphertext: [u8; ENC_CIPHERTEXT_SIZE],
+    }
+
+    impl ShieldedOutput<SaplingDomain, ENC_CIPHERTEXT_SIZE> for TestOutput {
+        fn ephemeral_key(&self) -> EphemeralKeyBytes {
+            EphemeralKeyBytes(self.ephemeral_key)
+        }
+
+        fn cmstar_bytes(&self) -> <SaplingDomain as Domain>::ExtractedCommitmentBytes {
+            self.cmu
+        }
+
+        fn enc_ciphertext(&self) -> &[u8; ENC_CIPHERTEXT_SIZE] {
+            &self.enc_ciphertext
+        }
+    }
+
+    fn output_to(recipient: PaymentAddress, value: u64) -> TestOutput {
+        let note = Note::from_parts(
+            recipient,
+            NoteValue::from_raw(value),
+            Rseed::AfterZip212([7; 32]),
+        );
+        let cmu = note.cmu().to_bytes();
+        let encryptor = sapling_note_encryption(None, note, [0; 512], &mut OsRng);
+        TestOutput {
+            cmu,
+            ephemeral_key: SaplingDomain::epk_bytes(encryptor.epk()).0,
+            enc_ciphertext: encryptor.encrypt_note_plaintext(),
+        }
+    }
+
+    #[test]
+    fn sapling_batch_kdf_with_ivks_matches_batch_kdf() {
+        let ivks: Vec<_> = (0..5u8)
+            .map(|i| {
+                ExtendedSpendingKey::master(&[i; 32])
+                    .to_diversifiable_full_viewing_key()
+                    .fvk()
+                    .vk
+                    .ivk()
+            })
+            .collect();
+        let recipient = ExtendedSpendingKey::master(&[0xff; 32])
+            .to_diversifiable_full_viewing_key()
+            .default_address()
+            .1;
+        // The last ephemeral key is not a canonical point encoding.
+        let ephemeral_keys: Vec<_> = (1..4)
+            .map(|value| EphemeralKeyBytes(output_to(recipient, value).ephemeral_key))
+            .chain(Some(EphemeralKeyBytes([0xff; 32])))
+            .collect();
+
+        let raw_ivks: Vec<_> = ivks.iter().map(|ivk| ivk.0).collect();
+        let prepared_ivks: Vec<_> = ivks.iter().map(PreparedIncomingViewingKey::new).collect();
+        let epks = SaplingDomain::batch_epk(ephemeral_keys.iter().cloned());
+        let expected = SaplingDomain::batch_kdf(epks.iter().flat_map(|(epk, ephemeral_key)| {
+            prepared_ivks.iter().map(move |ivk| {
+                (
+                    epk.as_ref()
+                        .map(|epk| SaplingDomain::ka_agree_dec(ivk, epk)),
+                    ephemeral_key,
+                )
+            })
+        }));
+
+        let keys = SaplingDomain::batch_kdf_with_ivks(&raw_ivks, &ephemeral_keys);
+        assert_eq!(keys.len(), ephemeral_keys.len() * ivks.len());
+        assert!(keys[..keys.len() - ivks.len()].iter().all(Option::is_some));
+        assert!(keys[keys.len() - ivks.len()..].iter().all(Option::is_none));
+        assert_eq!(keys, expected);
+    }
+
+    #[test]
+    fn batch_runner_matches_ivk_in_later_chunk() {
+        // Enough keys for the batch to split them across three chunks.
+        let keys: Vec<_> = (0..(2 * IVK_CHUNK_SIZE + 5) as u8)
+            .map(|i| ExtendedSpendingKey::master(&[i; 32]).to_diversifiable_full_viewing_key())
+            .collect();
+        let mut runner = BatchRunner::<_, _, _, ()>::new(
+            keys.iter()
+                .enumerate()
+                .map(|(i, dfvk)| (i, dfvk.fvk().vk.ivk().0)),
+        );
+
+        // The recipient's key is in the last chunk.
+        let ours = keys.len() - 2;
+        let not_ours = ExtendedSpendingKey::master(&[0xff; 32]).to_diversifiable_full_viewing_key();
+        let outputs = [
+            output_to(not_ours.default_address().1, 1),
+            output_to(keys[ours].default_address().1, 2),
+        ];
+
+        let block_tag = BlockHash([0; 32]);
+        let txid = TxId::from_bytes([1; 32]);
+        runner.add_outputs(
+            block_tag,
+            txid,
+            || SaplingDomain::new(Zip212Enforcement::On),
+            &outputs,
+        );
+        runner.flush();
+
+        let results = runner.collect_results(block_tag, txid);
+        assert_eq!(results.len(), 1);
+        let decrypted = &results[&(txid, 1)];
+        assert_eq!(decrypted.ivk_tag, ours);
+        assert_eq!(decrypted.recipient, keys[ours].default_address().1);
+        assert_eq!(decrypted.note.value().inner(), 2);
+    }
+}
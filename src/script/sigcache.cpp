@@ -6,15 +6,22 @@
 
 #include "sigcache.h"
 
+#include "clientversion.h"
+#include "crypto/hmac_sha256.h"
 #include "memusage.h"
 #include "pubkey.h"
 #include "random.h"
+#include "streams.h"
 #include "uint256.h"
 #include "util/system.h"
+#include "util/time.h"
 
 #include "cuckoocache.h"
 #include <boost/thread.hpp>
 
+#include <rust/bridge.h>
+#include <rust/metrics.h>
+
 namespace {
 /**
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
@@ -58,6 +65,26 @@ public:
     {
         return setValid.setup_bytes(n);
     }
+
+    void Snapshot(uint256& nonceOut, std::vector<uint256>& entries)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        nonceOut = nonce;
+        setValid.for_each([&](const uint256& entry) { entries.push_back(entry); });
+    }
+
+    //! Replaces the contents of the cache with a snapshot. Only valid before
+    //! the cache is first used, as ComputeEntry reads the nonce without
+    //! taking the lock.
+    void Restore(const uint256& nonceIn, const std::vector<uint256>& entries)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        nonce = nonceIn;
+        setValid.clear();
+        for (uint256 entry : entries) {
+            setValid.insert(entry);
+        }
+    }
 };
 
 /* In previous versions of this code, signatureCache was a local static variable
@@ -82,11 +109,156 @@ bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsig
 {
     uint256 entry;
     signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
-    if (signatureCache.Get(entry, !store))
+    if (signatureCache.Get(entry, !store)) {
+        MetricsIncrementCounter("zcash.sigcache.hits", "kind", "transparent");
         return true;
+    }
+    MetricsIncrementCounter("zcash.sigcache.misses", "kind", "transparent");
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
     if (store)
         signatureCache.Set(entry);
     return true;
 }
+
+static const uint64_t SIG_CACHE_DUMP_VERSION = 1;
+
+/**
+ * Read the key that sigcache.dat is authenticated with, creating it if it
+ * doesn't exist yet and fCreate is set.
+ */
+static bool GetSigCacheKey(uint256& key, bool fCreate)
+{
+    fs::path path = GetDataDir() / "sigcache.key";
+    CAutoFile filein(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein.IsNull()) {
+        filein >> key;
+        return true;
+    }
+    if (!fCreate) {
+        return false;
+    }
+
+    /** the umask determines what permissions are used to create this file -
+     * these are set to 077 in init.cpp unless overridden with -sysperms.
+     */
+    GetRandBytes(key.begin(), 32);
+    CAutoFile fileout(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull()) {
+        return false;
+    }
+    fileout << key;
+    FileCommit(fileout.Get());
+    return true;
+}
+
+static uint256 SigCacheMAC(const uint256& key, const char* data, size_t len)
+{
+    uint256 mac;
+    CHMAC_SHA256(key.begin(), key.size()).Write((const unsigned char*)data, len).Finalize(mac.begin());
+    return mac;
+}
+
+static void SerializeBundleCache(CDataStream& ss, void (*snapshot)(std::array<uint8_t, 32>&, rust::Vec<uint8_t>&))
+{
+    std::array<uint8_t, 32> nonce;
+    rust::Vec<uint8_t> entries;
+    snapshot(nonce, entries);
+    ss << nonce;
+    ss << std::vector<unsigned char>(entries.begin(), entries.end());
+}
+
+bool DumpSignatureCaches()
+{
+    int64_t nStart = GetTimeMillis();
+    try {
+        uint256 key;
+        if (!GetSigCacheKey(key, true)) {
+            LogPrintf("%s: unable to create the signature cache key\n", __func__);
+            return false;
+        }
+
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << SIG_CACHE_DUMP_VERSION;
+        uint256 nonce;
+        std::vector<uint256> entries;
+        signatureCache.Snapshot(nonce, entries);
+        ss << nonce << entries;
+        SerializeBundleCache(ss, bundlecache::snapshot_sapling);
+        SerializeBundleCache(ss, bundlecache::snapshot_orchard);
+        ss << SigCacheMAC(key, ss.data(), ss.size());
+
+        fs::path pathTmp = GetDataDir() / "sigcache.dat.new";
+        CAutoFile file(fsbridge::fopen(pathTmp, "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            return false;
+        }
+        file.write(ss.data(), ss.size());
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "sigcache.dat")) {
+            throw std::runtime_error("Rename failed");
+        }
+        LogPrintf("Dumped signature caches (%u bytes) in %dms\n", ss.size(), GetTimeMillis() - nStart);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump signature caches: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+bool LoadSignatureCaches()
+{
+    int64_t nStart = GetTimeMillis();
+    fs::path path = GetDataDir() / "sigcache.dat";
+    CAutoFile file(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return false;
+    }
+
+    try {
+        uint256 key;
+        if (!GetSigCacheKey(key, false)) {
+            LogPrintf("%s: no signature cache key, ignoring %s\n", __func__, path.string());
+            return false;
+        }
+
+        std::vector<char> data(fs::file_size(path));
+        if (data.size() < sizeof(uint256)) {
+            throw std::runtime_error("file too short");
+        }
+        file.read(data.data(), data.size());
+        size_t nPayload = data.size() - sizeof(uint256);
+        uint256 mac;
+        memcpy(mac.begin(), data.data() + nPayload, sizeof(uint256));
+        if (mac != SigCacheMAC(key, data.data(), nPayload)) {
+            LogPrintf("%s: %s was not written with this node's key, ignoring it\n", __func__, path.string());
+            return false;
+        }
+
+        CDataStream ss(data.data(), data.data() + nPayload, SER_DISK, CLIENT_VERSION);
+        uint64_t version;
+        ss >> version;
+        if (version != SIG_CACHE_DUMP_VERSION) {
+            return false;
+        }
+        uint256 nonce;
+        std::vector<uint256> entries;
+        std::array<uint8_t, 32> saplingNonce, orchardNonce;
+        std::vector<unsigned char> saplingEntries, orchardEntries;
+        ss >> nonce >> entries;
+        ss >> saplingNonce >> saplingEntries;
+        ss >> orchardNonce >> orchardEntries;
+
+        signatureCache.Restore(nonce, entries);
+        bundlecache::restore_sapling(saplingNonce, {saplingEntries.data(), saplingEntries.size()});
+        bundlecache::restore_orchard(orchardNonce, {orchardEntries.data(), orchardEntries.size()});
+
+        LogPrintf("Loaded signature caches: %u script, %u Sapling and %u Orchard entries in %dms\n",
+            entries.size(), saplingEntries.size() / 32, orchardEntries.size() / 32, GetTimeMillis() - nStart);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to load signature caches: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
@@ -15,6 +15,8 @@
 // systems). Due to how we count cache size, actual memory usage is slightly
 // more (~32.25 MB)
 static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+/** Default for -persistsigcache */
+static const bool DEFAULT_PERSIST_SIG_CACHE = false;
 
 class CPubKey;
 
@@ -52,4 +54,18 @@ public:
 
 void InitSignatureCache(size_t nMaxCacheSize);
 
+/**
+ * Write the script signature cache and the Sapling and Orchard bundle
+ * validity caches, with their nonces, to sigcache.dat in the data directory.
+ * The file is authenticated with a MAC keyed by sigcache.key, which is
+ * created on the first dump.
+ */
+bool DumpSignatureCaches();
+/**
+ * Restore the caches from sigcache.dat, if its MAC is valid under
+ * sigcache.key. Must be called after the caches are set up and before they
+ * are first used.
+ */
+bool LoadSignatureCaches();
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -35,6 +35,10 @@ struct CSpentIndexKey {
         txid.SetNull();
         outputIndex = 0;
     }
+
+    friend bool operator==(const CSpentIndexKey& a, const CSpentIndexKey& b) {
+        return a.txid == b.txid && a.outputIndex == b.outputIndex;
+    }
 };
 
 struct CSpentIndexValue {
@@ -30,13 +30,18 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanUsage, size_t nMaxOrphanPeerUsage);
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    int64_t nTimeAdded;
+    size_t nUsage;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByParent;
+extern size_t nOrphanTxUsage;
+extern std::map<NodeId, size_t> mapOrphanTxUsageByPeer;
 
 CService ip(uint32_t i)
 {
@@ -205,13 +210,76 @@ BOOST_DATA_TEST_CASE(DoS_mapOrphans, boost::unit_test::data::xrange(static_cast<
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, SIZE_MAX, SIZE_MAX);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, SIZE_MAX, SIZE_MAX);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, SIZE_MAX, SIZE_MAX);
     BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanTransactionsByParent.empty());
+    BOOST_CHECK_EQUAL(nOrphanTxUsage, 0);
+    BOOST_CHECK(mapOrphanTxUsageByPeer.empty());
+}
+
+static CTransaction OrphanWithInputs(size_t nInputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(nInputs);
+    for (size_t i = 0; i < nInputs; i++) {
+        tx.vin[i].prevout.n = 0;
+        tx.vin[i].prevout.hash = InsecureRand256();
+        tx.vin[i].scriptSig << OP_1;
+    }
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_budgets)
+{
+    std::chrono::seconds nStartTime(GetTime());
+    FixedClock::Instance()->Set(nStartTime);
+
+    // Orphans are indexed by each of their parents.
+    CTransaction txSmall = OrphanWithInputs(1);
+    BOOST_CHECK(AddOrphanTx(txSmall, 0));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByParent.count(txSmall.vin[0].prevout.hash), 1);
+
+    // Among orphans of the same age, larger ones are evicted first.
+    CTransaction txLarge = OrphanWithInputs(50);
+    BOOST_CHECK(AddOrphanTx(txLarge, 0));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByParent.size(), 51);
+    LimitOrphanTxSize(1, SIZE_MAX, SIZE_MAX);
+    BOOST_CHECK(mapOrphanTransactions.count(txSmall.GetHash()));
+    BOOST_CHECK(!mapOrphanTransactions.count(txLarge.GetHash()));
+    BOOST_CHECK_EQUAL(mapOrphanTransactionsByParent.size(), 1);
+
+    // Among orphans of the same size, older ones are evicted first.
+    FixedClock::Instance()->Set(nStartTime + std::chrono::seconds(60));
+    CTransaction txNewer = OrphanWithInputs(1);
+    BOOST_CHECK(AddOrphanTx(txNewer, 1));
+    LimitOrphanTxSize(1, SIZE_MAX, SIZE_MAX);
+    BOOST_CHECK(!mapOrphanTransactions.count(txSmall.GetHash()));
+    BOOST_CHECK(mapOrphanTransactions.count(txNewer.GetHash()));
+
+    // A peer over its own budget only loses its own orphans.
+    for (int i = 0; i < 20; i++) {
+        BOOST_CHECK(AddOrphanTx(OrphanWithInputs(1), 2));
+    }
+    size_t nPeerUsage = mapOrphanTxUsageByPeer[2];
+    LimitOrphanTxSize(10000, SIZE_MAX, nPeerUsage / 2);
+    BOOST_CHECK(mapOrphanTxUsageByPeer[2] <= nPeerUsage / 2);
+    BOOST_CHECK(mapOrphanTxUsageByPeer[2] > 0);
+    BOOST_CHECK(mapOrphanTransactions.count(txNewer.GetHash()));
+
+    // The total budget applies to every peer's orphans.
+    LimitOrphanTxSize(10000, 0, SIZE_MAX);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByParent.empty());
+    BOOST_CHECK_EQUAL(nOrphanTxUsage, 0);
+
+    SystemClock::SetGlobal();
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -564,4 +564,47 @@ BOOST_AUTO_TEST_CASE(rolling_bloom_reset)
     BOOST_CHECK(rb.contains(d));
 }
 
+BOOST_AUTO_TEST_CASE(blocked_bloom)
+{
+    CBlockedBloomFilter filter;
+    BOOST_CHECK(!filter.contains(GetRandHash()));
+
+    static const unsigned int DATASIZE = 10000;
+    filter.Reset(DATASIZE);
+    std::vector<uint256> data;
+    for (unsigned int i = 0; i < DATASIZE; i++) {
+        data.push_back(GetRandHash());
+        filter.insert(data.back());
+    }
+    BOOST_CHECK_EQUAL(filter.size(), DATASIZE);
+    BOOST_CHECK(!filter.IsFull());
+    // No false negatives:
+    for (const uint256& hash : data) {
+        BOOST_CHECK(filter.contains(hash));
+    }
+
+    // At capacity the false positive rate is around 0.1%, so we should get
+    // about 100 hits when testing 100,000 random keys.
+    unsigned int nHits = 0;
+    for (int i = 0; i < 100000; i++) {
+        if (filter.contains(GetRandHash()))
+            ++nHits;
+    }
+    BOOST_TEST_MESSAGE("BlockedBloomFilter got " << nHits << " false positives (~100 expected)");
+    BOOST_CHECK(nHits < 500);
+
+    filter.insert(GetRandHash());
+    BOOST_CHECK(filter.IsFull());
+
+    // Resetting forgets everything (and picks a new salt).
+    filter.Reset(DATASIZE);
+    BOOST_CHECK_EQUAL(filter.size(), 0U);
+    nHits = 0;
+    for (const uint256& hash : data) {
+        if (filter.contains(hash))
+            ++nHits;
+    }
+    BOOST_CHECK_EQUAL(nHits, 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -379,6 +379,49 @@ BOOST_AUTO_TEST_CASE(test_CheckQueue_FrozenCleanup)
 }
 
 
+// Test that queues sharing a worker pool each see all of their own checks,
+// and that a failure in one queue does not affect the other.
+BOOST_AUTO_TEST_CASE(test_CheckQueue_SharedPool)
+{
+    CCheckQueuePool pool;
+    auto unique_queue = std::unique_ptr<Unique_Queue>(new Unique_Queue {QUEUE_BATCH_SIZE, &pool});
+    auto fail_queue = std::unique_ptr<Failing_Queue>(new Failing_Queue {QUEUE_BATCH_SIZE, &pool});
+    boost::thread_group tg;
+    for (auto x = 0; x < nScriptCheckThreads; ++x) {
+       tg.create_thread([&]{pool.Thread();});
+    }
+
+    UniqueCheck::results.clear();
+    size_t COUNT = 100000;
+    size_t total = COUNT;
+    bool first = true;
+    {
+        CCheckQueueControl<UniqueCheck> control(unique_queue.get());
+        CCheckQueueControl<FailingCheck> fail_control(fail_queue.get());
+        while (total) {
+            size_t r = InsecureRandRange(10);
+            std::vector<UniqueCheck> vChecks;
+            for (size_t k = 0; k < r && total; k++)
+                vChecks.emplace_back(--total);
+            control.Add(vChecks);
+
+            std::vector<FailingCheck> vFailing;
+            vFailing.emplace_back(first);
+            fail_control.Add(vFailing);
+            first = false;
+        }
+        BOOST_REQUIRE(!fail_control.Wait());
+        BOOST_REQUIRE(control.Wait());
+    }
+    BOOST_REQUIRE_EQUAL(UniqueCheck::results.size(), COUNT);
+    bool r = true;
+    for (size_t i = 0; i < COUNT; ++i)
+        r = r && UniqueCheck::results.count(i) == 1;
+    BOOST_REQUIRE(r);
+    tg.interrupt_all();
+    tg.join_all();
+}
+
 /** Test that CCheckQueueControl is threadsafe */
 BOOST_AUTO_TEST_CASE(test_CheckQueueControl_Locks)
 {
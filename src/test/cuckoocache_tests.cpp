@@ -2,10 +2,17 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/test/unit_test.hpp>
+#include "clientversion.h"
+#include "crypto/sha256.h"
 #include "cuckoocache.h"
+#include "key.h"
 #include "script/sigcache.h"
+#include "streams.h"
 #include "test/test_bitcoin.h"
 #include "random.h"
+#include <rust/bridge.h>
+#include <algorithm>
+#include <set>
 #include <thread>
 #include <boost/thread.hpp>
 
@@ -379,4 +386,156 @@ BOOST_AUTO_TEST_CASE(cuckoocache_generations)
     test_cache_generations<CuckooCache::cache<uint256, SignatureCacheHasher>>();
 }
 
+/* Test that for_each visits exactly the entries that haven't been erased.
+ */
+BOOST_AUTO_TEST_CASE(cuckoocache_for_each)
+{
+    local_rand_ctx = FastRandomContext(true);
+    CuckooCache::cache<uint256, SignatureCacheHasher> cc{};
+    cc.setup_bytes(1 << 20);
+    std::vector<uint256> hashes(1000);
+    for (uint256& h : hashes) {
+        insecure_GetRandHash(h);
+        cc.insert(h);
+    }
+    for (size_t i = 0; i < hashes.size(); i += 2) {
+        cc.contains(hashes[i], true);
+    }
+
+    std::set<uint256> visited;
+    cc.for_each([&](const uint256& h) { visited.insert(h); });
+    BOOST_CHECK_EQUAL(visited.size(), hashes.size() / 2);
+    for (size_t i = 0; i < hashes.size(); ++i) {
+        BOOST_CHECK_EQUAL(visited.count(hashes[i]), i % 2);
+    }
+}
+
+/* Test that the signature caches survive a dump and reload, and that a
+ * snapshot that fails its MAC check is ignored.
+ */
+BOOST_FIXTURE_TEST_CASE(sigcache_persistence, TestingSetup)
+{
+    BOOST_CHECK(!LoadSignatureCaches());
+    BOOST_CHECK(DumpSignatureCaches());
+    BOOST_CHECK(fs::exists(GetDataDir() / "sigcache.key"));
+    BOOST_CHECK(LoadSignatureCaches());
+
+    fs::path path = GetDataDir() / "sigcache.dat";
+    {
+        FILE* file = fsbridge::fopen(path, "rb+");
+        BOOST_REQUIRE(file != nullptr);
+        fseek(file, 8, SEEK_SET);
+        int c = fgetc(file);
+        fseek(file, 8, SEEK_SET);
+        fputc(c ^ 1, file);
+        fclose(file);
+    }
+    BOOST_CHECK(!LoadSignatureCaches());
+}
+
+/* Read the script signature cache's nonce and live entries back from what
+ * DumpSignatureCaches wrote.
+ */
+static void ReadScriptSigCacheDump(uint256& nonce, std::vector<uint256>& entries)
+{
+    CAutoFile file(fsbridge::fopen(GetDataDir() / "sigcache.dat", "rb"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    uint64_t version;
+    file >> version >> nonce >> entries;
+}
+
+static bool HasBundleCacheEntry(const rust::Vec<uint8_t>& entries, const std::array<uint8_t, 32>& entry)
+{
+    for (size_t i = 0; i + 32 <= entries.size(); i += 32) {
+        if (std::equal(entry.begin(), entry.end(), entries.data() + i))
+            return true;
+    }
+    return false;
+}
+
+/* Test that entries inserted into each of the caches are still there after
+ * a dump and reload, and that the reloaded transparent entry is hit.
+ */
+BOOST_FIXTURE_TEST_CASE(sigcache_round_trip, TestingSetup)
+{
+    fs::path path = GetDataDir() / "sigcache.dat";
+    fs::path pathBefore = GetDataDir() / "sigcache.dat.before";
+    fs::path pathAfter = GetDataDir() / "sigcache.dat.after";
+
+    // A snapshot from before the insertions, to reset the caches with.
+    BOOST_REQUIRE(DumpSignatureCaches());
+    fs::copy_file(path, pathBefore, fs::copy_options::overwrite_existing);
+
+    // Insert a verified signature into the script signature cache.
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 sighash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    BOOST_REQUIRE(key.Sign(sighash, vchSig));
+    CTransaction tx;
+    PrecomputedTransactionData txdata(tx, {});
+    BOOST_CHECK(CachingTransactionSignatureChecker(&tx, txdata, 0, 0, true).VerifySignature(vchSig, pubkey, sighash));
+
+    // Insert an entry into each of the bundle caches, under their nonces.
+    std::array<uint8_t, 32> saplingNonce, orchardNonce, saplingEntry, orchardEntry;
+    rust::Vec<uint8_t> saplingEntries, orchardEntries;
+    GetRandBytes(saplingEntry.data(), saplingEntry.size());
+    GetRandBytes(orchardEntry.data(), orchardEntry.size());
+    bundlecache::snapshot_sapling(saplingNonce, saplingEntries);
+    bundlecache::snapshot_orchard(orchardNonce, orchardEntries);
+    for (size_t i = 0; i < 32; i++) {
+        saplingEntries.push_back(saplingEntry[i]);
+        orchardEntries.push_back(orchardEntry[i]);
+    }
+    bundlecache::restore_sapling(saplingNonce, {saplingEntries.data(), saplingEntries.size()});
+    bundlecache::restore_orchard(orchardNonce, {orchardEntries.data(), orchardEntries.size()});
+
+    BOOST_REQUIRE(DumpSignatureCaches());
+    fs::copy_file(path, pathAfter, fs::copy_options::overwrite_existing);
+    uint256 nonce;
+    std::vector<uint256> entries;
+    ReadScriptSigCacheDump(nonce, entries);
+    uint256 entry;
+    CSHA256().Write(nonce.begin(), 32).Write(sighash.begin(), 32).Write(pubkey.begin(), pubkey.size()).Write(vchSig.data(), vchSig.size()).Finalize(entry.begin());
+    BOOST_CHECK(std::count(entries.begin(), entries.end(), entry) == 1);
+
+    // Reloading the earlier snapshot drops the new entries.
+    fs::copy_file(pathBefore, path, fs::copy_options::overwrite_existing);
+    BOOST_REQUIRE(LoadSignatureCaches());
+    BOOST_REQUIRE(DumpSignatureCaches());
+    entries.clear();
+    ReadScriptSigCacheDump(nonce, entries);
+    BOOST_CHECK(std::count(entries.begin(), entries.end(), entry) == 0);
+    rust::Vec<uint8_t> reloaded;
+    bundlecache::snapshot_sapling(saplingNonce, reloaded);
+    BOOST_CHECK(!HasBundleCacheEntry(reloaded, saplingEntry));
+    reloaded.clear();
+    bundlecache::snapshot_orchard(orchardNonce, reloaded);
+    BOOST_CHECK(!HasBundleCacheEntry(reloaded, orchardEntry));
+
+    // Reloading the later one brings them back.
+    fs::copy_file(pathAfter, path, fs::copy_options::overwrite_existing);
+    BOOST_REQUIRE(LoadSignatureCaches());
+    BOOST_REQUIRE(DumpSignatureCaches());
+    entries.clear();
+    ReadScriptSigCacheDump(nonce, entries);
+    BOOST_CHECK(std::count(entries.begin(), entries.end(), entry) == 1);
+    reloaded.clear();
+    bundlecache::snapshot_sapling(saplingNonce, reloaded);
+    BOOST_CHECK(HasBundleCacheEntry(reloaded, saplingEntry));
+    reloaded.clear();
+    bundlecache::snapshot_orchard(orchardNonce, reloaded);
+    BOOST_CHECK(HasBundleCacheEntry(reloaded, orchardEntry));
+
+    // A check that doesn't store its result marks the entry it hits for
+    // erasure, so the entry is missing from the next dump only if the
+    // signature was found in the reloaded cache.
+    BOOST_CHECK(CachingTransactionSignatureChecker(&tx, txdata, 0, 0, false).VerifySignature(vchSig, pubkey, sighash));
+    BOOST_REQUIRE(DumpSignatureCaches());
+    entries.clear();
+    ReadScriptSigCacheDump(nonce, entries);
+    BOOST_CHECK(std::count(entries.begin(), entries.end(), entry) == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
@@ -3,7 +3,9 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or https://www.opensource.org/licenses/mit-license.php .
 
+#include "crypto/common.h"
 #include "hash.h"
+#include "random.h"
 #include "util/strencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -123,6 +125,21 @@ BOOST_AUTO_TEST_CASE(siphash)
         hasher3.Write(uint64_t(x)|(uint64_t(x+1)<<8)|(uint64_t(x+2)<<16)|(uint64_t(x+3)<<24)|
                      (uint64_t(x+4)<<32)|(uint64_t(x+5)<<40)|(uint64_t(x+6)<<48)|(uint64_t(x+7)<<56));
     }
+
+    // Check that SipHashUint256Extra matches the generic hasher on the
+    // 36-byte encoding of the value followed by the extra word.
+    for (int i = 0; i < 16; ++i) {
+        uint64_t k0 = InsecureRand32() | ((uint64_t)InsecureRand32() << 32);
+        uint64_t k1 = InsecureRand32() | ((uint64_t)InsecureRand32() << 32);
+        uint256 x = GetRandHash();
+        uint32_t n = InsecureRand32();
+        unsigned char nb[4];
+        WriteLE32(nb, n);
+        CSipHasher sip288(k0, k1);
+        sip288.Write(x.begin(), 32);
+        sip288.Write(nb, 4);
+        BOOST_CHECK_EQUAL(SipHashUint256Extra(k0, k1, x, n), sip288.Finalize());
+    }
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,7 +4,13 @@
 // file COPYING or https://www.opensource.org/licenses/mit-license.php .
 
 #include "consensus/upgrades.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "keystore.h"
 #include "main.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "util/system.h"
 
@@ -105,6 +111,126 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolRemoveForBlockTest)
+{
+    TestMemPoolEntryHelper entry;
+    CTxMemPool testPool(CFeeRate(0));
+
+    auto makeTx = [](const uint256& prevHash, uint32_t prevN, CAmount nValue) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << OP_11;
+        tx.vin[0].prevout.hash = prevHash;
+        tx.vin[0].prevout.n = prevN;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = nValue;
+        return tx;
+    };
+
+    // A chain that the block confirms, except for its last transaction.
+    CMutableTransaction txParent = makeTx(GetRandHash(), 0, 33000LL);
+    CMutableTransaction txChild = makeTx(txParent.GetHash(), 0, 22000LL);
+    CMutableTransaction txGrandChild = makeTx(txChild.GetHash(), 0, 11000LL);
+    // A transaction that conflicts with one in the block, and its child.
+    uint256 spentHash = GetRandHash();
+    CMutableTransaction txConflict = makeTx(spentHash, 0, 33000LL);
+    CMutableTransaction txConflictChild = makeTx(txConflict.GetHash(), 0, 22000LL);
+    CMutableTransaction txInBlock = makeTx(spentHash, 0, 32000LL);
+    // A transaction that expires before the block's height, and its child.
+    CMutableTransaction txExpiring = makeTx(GetRandHash(), 0, 33000LL);
+    txExpiring.fOverwintered = true;
+    txExpiring.nVersion = OVERWINTER_TX_VERSION;
+    txExpiring.nVersionGroupId = OVERWINTER_VERSION_GROUP_ID;
+    txExpiring.nExpiryHeight = 99;
+    CMutableTransaction txExpiringChild = makeTx(txExpiring.GetHash(), 0, 22000LL);
+    // A transaction that expires after the block's height.
+    CMutableTransaction txNotExpiring = txExpiring;
+    txNotExpiring.vin[0].prevout.hash = GetRandHash();
+    txNotExpiring.nExpiryHeight = 100;
+
+    for (CMutableTransaction* tx : {&txParent, &txChild, &txGrandChild, &txConflict, &txConflictChild,
+                                    &txExpiring, &txExpiringChild, &txNotExpiring}) {
+        testPool.addUnchecked(tx->GetHash(), entry.FromTx(*tx));
+    }
+    BOOST_CHECK_EQUAL(testPool.size(), 8);
+
+    std::vector<CTransaction> vtx = {txParent, txChild, txInBlock};
+    MempoolRemovalsForBlock removals = testPool.removeForBlock(vtx, 100);
+
+    BOOST_CHECK_EQUAL(removals.nConfirmed, 2);
+    BOOST_CHECK_EQUAL(removals.conflicted.size(), 2);
+    for (const CTransaction& tx : removals.conflicted) {
+        BOOST_CHECK(tx.GetHash() == txConflict.GetHash() || tx.GetHash() == txConflictChild.GetHash());
+    }
+    BOOST_CHECK_EQUAL(removals.expired.size(), 1);
+    BOOST_CHECK(removals.expired[0] == txExpiring.GetHash());
+
+    // Only the unconfirmed descendant of the block's transactions and the
+    // transaction that hasn't expired yet are left.
+    BOOST_CHECK_EQUAL(testPool.size(), 2);
+    BOOST_CHECK(testPool.exists(txGrandChild.GetHash()));
+    BOOST_CHECK(testPool.exists(txNotExpiring.GetHash()));
+
+    // The remaining descendant no longer has in-mempool parents.
+    LOCK(testPool.cs);
+    auto it = testPool.mapTx.find(txGrandChild.GetHash());
+    BOOST_CHECK(testPool.GetMemPoolParents(it).empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolRemoveForBlockAncestorsTest)
+{
+    TestMemPoolEntryHelper entry;
+    CTxMemPool testPool(CFeeRate(0));
+
+    // A transaction that stays in the mempool.
+    CMutableTransaction txStays;
+    txStays.vin.resize(1);
+    txStays.vin[0].scriptSig = CScript() << OP_11;
+    txStays.vin[0].prevout.hash = GetRandHash();
+    txStays.vin[0].prevout.n = 0;
+    txStays.vout.resize(1);
+    txStays.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txStays.vout[0].nValue = 33000LL;
+
+    // A conflict with the block, a child that spends both it and txStays,
+    // and a grandchild whose only parent is being removed, but which still
+    // has txStays as an ancestor.
+    uint256 spentHash = GetRandHash();
+    CMutableTransaction txConflict = txStays;
+    txConflict.vin[0].prevout.hash = spentHash;
+    CMutableTransaction txChild = txStays;
+    txChild.vin.resize(2);
+    txChild.vin[0].prevout.hash = txConflict.GetHash();
+    txChild.vin[1].scriptSig = CScript() << OP_11;
+    txChild.vin[1].prevout.hash = txStays.GetHash();
+    txChild.vin[1].prevout.n = 0;
+    txChild.vout[0].nValue = 22000LL;
+    CMutableTransaction txGrandChild = txStays;
+    txGrandChild.vin[0].prevout.hash = txChild.GetHash();
+    txGrandChild.vout[0].nValue = 11000LL;
+    CMutableTransaction txInBlock = txConflict;
+    txInBlock.vout[0].nValue = 32000LL;
+
+    for (CMutableTransaction* tx : {&txStays, &txConflict, &txChild, &txGrandChild}) {
+        testPool.addUnchecked(tx->GetHash(), entry.FromTx(*tx));
+    }
+
+    MempoolRemovalsForBlock removals = testPool.removeForBlock({txInBlock}, 100);
+    BOOST_CHECK_EQUAL(removals.nConfirmed, 0);
+    BOOST_CHECK_EQUAL(removals.conflicted.size(), 3);
+    BOOST_CHECK_EQUAL(testPool.size(), 1);
+
+    // txStays no longer counts any of the removed transactions among its
+    // descendants.
+    LOCK(testPool.cs);
+    auto it = testPool.mapTx.find(txStays.GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(it->GetSizeWithDescendants(), it->GetTxSize());
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), it->GetModifiedFee());
+    BOOST_CHECK(testPool.GetMemPoolChildren(it).empty());
+}
+
 template<typename name>
 void CheckSort(CTxMemPool &pool, std::vector<std::string> &sortedOrder)
 {
@@ -374,6 +500,199 @@ BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     BOOST_CHECK_EQUAL(pool.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(BlockCandidatesTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    std::vector<CMutableTransaction> txs(3);
+    for (int i = 0; i < 3; i++) {
+        txs[i].vin.resize(1);
+        txs[i].vin[0].scriptSig = CScript() << OP_11;
+        txs[i].vin[0].prevout.hash = GetRandHash();
+        txs[i].vout.resize(1);
+        txs[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txs[i].vout[0].nValue = 10000LL;
+    }
+    CAmount conventionalFee = CTransaction(txs[0]).GetConventionalFee();
+    pool.addUnchecked(txs[0].GetHash(), entry.Fee(conventionalFee).FromTx(txs[0]));
+    pool.addUnchecked(txs[1].GetHash(), entry.Fee(0).FromTx(txs[1]));
+    pool.addUnchecked(txs[2].GetHash(), entry.Fee(0).FromTx(txs[2]));
+    BOOST_CHECK_EQUAL(pool.GetBlockCandidates(true).size(), 1);
+    BOOST_CHECK_EQUAL(pool.GetBlockCandidates(false).size(), 2);
+
+    // Prioritising a transaction moves it to the set matching its modified fee.
+    pool.PrioritiseTransaction(txs[1].GetHash(), txs[1].GetHash().ToString(), conventionalFee);
+    BOOST_CHECK_EQUAL(pool.GetBlockCandidates(true).size(), 2);
+    BOOST_CHECK_EQUAL(pool.GetBlockCandidates(false).size(), 1);
+
+    // Entries taken by a draw are put back when it is destroyed.
+    {
+        CTxMemPool::CandidateDraw draw(pool.GetBlockCandidates(true));
+        draw.takeRandom();
+        draw.takeRandom();
+        BOOST_CHECK(draw.empty());
+    }
+    BOOST_CHECK_EQUAL(pool.GetBlockCandidates(true).size(), 2);
+
+    std::list<CTransaction> removed;
+    pool.remove(txs[1], removed);
+    pool.remove(txs[2], removed);
+    BOOST_CHECK_EQUAL(pool.GetBlockCandidates(true).size(), 1);
+    BOOST_CHECK_EQUAL(pool.GetBlockCandidates(false).size(), 0);
+    pool.GetBlockCandidates(true).checkInvariants();
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSnapshotTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 10000LL;
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 10000LL;
+
+    auto empty = pool.GetSnapshot();
+    BOOST_CHECK(empty->entries.empty());
+    // An unchanged mempool reuses the published snapshot.
+    BOOST_CHECK(pool.GetSnapshot() == empty);
+
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000LL).FromTx(txParent));
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(2000LL).FromTx(txChild));
+
+    auto snapshot = pool.GetSnapshot();
+    BOOST_CHECK(snapshot != empty);
+    BOOST_CHECK(snapshot->nSequence != empty->nSequence);
+    // Readers holding the old snapshot still see the mempool as it was.
+    BOOST_CHECK(empty->entries.empty());
+
+    // Entries are ordered by score, and the child pays the higher fee.
+    BOOST_REQUIRE_EQUAL(snapshot->entries.size(), 2);
+    const auto& child = snapshot->entries[0];
+    const auto& parent = snapshot->entries[1];
+    BOOST_CHECK(child.tx->GetHash() == txChild.GetHash());
+    BOOST_CHECK(parent.tx->GetHash() == txParent.GetHash());
+    BOOST_CHECK(parent.vDepends.empty());
+    BOOST_REQUIRE_EQUAL(child.vDepends.size(), 1);
+    BOOST_CHECK(child.vDepends[0] == txParent.GetHash());
+    BOOST_CHECK_EQUAL(parent.nFee, 1000LL);
+    BOOST_CHECK_EQUAL(parent.nCountWithDescendants, 2);
+    BOOST_CHECK_EQUAL(parent.nModFeesWithDescendants, 3000LL);
+    BOOST_CHECK(pool.GetSnapshot() == snapshot);
+
+    // Prioritisation changes entries in place, and is reflected as well.
+    pool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 500LL);
+    auto prioritised = pool.GetSnapshot();
+    BOOST_CHECK(prioritised != snapshot);
+    BOOST_CHECK_EQUAL(prioritised->entries[0].nModifiedFee, 2500LL);
+    BOOST_CHECK_EQUAL(prioritised->entries[1].nModFeesWithDescendants, 3500LL);
+
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed, true);
+    BOOST_CHECK(pool.GetSnapshot()->entries.empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPersistTest)
+{
+    // Without a mempool.dat there is nothing to load.
+    BOOST_CHECK(!LoadMempool(Params()));
+
+    // Fee deltas for transactions that aren't in the mempool survive a
+    // dump and reload.
+    uint256 hash = GetRandHash();
+    mempool.PrioritiseTransaction(hash, hash.ToString(), 12345);
+    BOOST_CHECK(DumpMempool());
+    BOOST_CHECK(fs::exists(GetDataDir() / "mempool.dat"));
+    BOOST_CHECK(!fs::exists(GetDataDir() / "mempool.dat.new"));
+
+    mempool.ClearPrioritisation(hash);
+    BOOST_CHECK_EQUAL(mempool.mapDeltas.count(hash), 0);
+
+    BOOST_CHECK(LoadMempool(Params()));
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas.count(hash), 1);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas[hash], 12345);
+    }
+    mempool.ClearPrioritisation(hash);
+}
+
+// A child that pays a higher fee rate than its parent is sorted ahead of it
+// by score, but must still be written after it for both to be reloaded.
+BOOST_AUTO_TEST_CASE(MempoolPersistParentAndChildTest)
+{
+    uint32_t consensusBranchId = SPROUT_BRANCH_ID;
+    CBasicKeyStore keystore;
+    CKey key = CKey::TestOnlyRandomKey(true);
+    keystore.AddKey(key);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // Fake a confirmed coin for the parent to spend.
+    CMutableTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.hash = GetRandHash();
+    txFund.vout.resize(1);
+    txFund.vout[0].nValue = COIN;
+    txFund.vout[0].scriptPubKey = scriptPubKey;
+    {
+        LOCK(cs_main);
+        *pcoinsTip->ModifyCoins(txFund.GetHash()) = CCoins(txFund, chainActive.Height());
+    }
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(txFund.GetHash(), 0);
+    txParent.vout.resize(1);
+    txParent.vout[0].nValue = COIN - 1000;
+    txParent.vout[0].scriptPubKey = scriptPubKey;
+    {
+        const PrecomputedTransactionData txdata(txParent, {txFund.vout[0]});
+        BOOST_CHECK(SignSignature(keystore, CTransaction(txFund), txParent, txdata, 0, SIGHASH_ALL, consensusBranchId));
+    }
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = COIN - 1000 - 10000;
+    txChild.vout[0].scriptPubKey = scriptPubKey;
+    {
+        const PrecomputedTransactionData txdata(txChild, {txParent.vout[0]});
+        BOOST_CHECK(SignSignature(keystore, CTransaction(txParent), txChild, txdata, 0, SIGHASH_ALL, consensusBranchId));
+    }
+
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(Params(), mempool, state, txParent, true, nullptr));
+        BOOST_CHECK(AcceptToMemoryPool(Params(), mempool, state, txChild, true, nullptr));
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+
+    BOOST_CHECK(DumpMempool());
+    mempool.clear();
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    BOOST_CHECK(LoadMempool(Params()));
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+    BOOST_CHECK(mempool.exists(txParent.GetHash()));
+    BOOST_CHECK(mempool.exists(txChild.GetHash()));
+    mempool.clear();
+}
+
 // Test that nCheckFrequency is set correctly when calling setSanityCheck().
 // https://github.com/zcash/zcash/issues/3134
 BOOST_AUTO_TEST_CASE(SetSanityCheck) {
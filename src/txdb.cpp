@@ -13,6 +13,8 @@
 #include "uint256.h"
 #include "zcash/History.hpp"
 
+#include <algorithm>
+#include <functional>
 #include <stdint.h>
 
 #include <boost/thread.hpp>
@@ -26,10 +28,13 @@ using namespace std;
 static const char DB_SPROUT_ANCHOR = 'A';
 static const char DB_SAPLING_ANCHOR = 'Z';
 static const char DB_ORCHARD_ANCHOR = 'Y';
+static const char DB_SPROUT_ANCHOR_DELTA = 'D';
+static const char DB_SAPLING_ANCHOR_DELTA = 'E';
 static const char DB_NULLIFIER = 's';
 static const char DB_SAPLING_NULLIFIER = 'S';
 static const char DB_ORCHARD_NULLIFIER = 'O';
 static const char DB_COINS = 'c';
+static const char DB_COIN = 'C';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
@@ -39,6 +44,9 @@ static const char DB_BEST_SPROUT_ANCHOR = 'a';
 static const char DB_BEST_SAPLING_ANCHOR = 'z';
 static const char DB_BEST_ORCHARD_ANCHOR = 'y';
 static const char DB_FLAG = 'F';
+static const char DB_COINS_FORMAT = 'V';
+static const char DB_SNAPSHOT_LOADING = 'L';
+static const char DB_SNAPSHOT_HASH = 'H';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
@@ -56,11 +64,133 @@ static const char DB_SPENTINDEX = 'p';
 static const char DB_TIMESTAMPINDEX = 'T';
 static const char DB_BLOCKHASHINDEX = 'h';
 
-CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
+//! Nullifier filters are sized for at least this many entries.
+static const size_t NULLIFIER_FILTER_MIN_CAPACITY = 1 << 20;
+
+//! Prefixes of the records in a chain state snapshot, in the order they are
+//! written. Coins and Sprout and Sapling anchors are converted to a canonical
+//! form; the others are copied as they are.
+static const char SNAPSHOT_PREFIXES[] = {
+    DB_COINS, DB_SPROUT_ANCHOR, DB_SAPLING_ANCHOR, DB_ORCHARD_ANCHOR,
+    DB_NULLIFIER, DB_SAPLING_NULLIFIER, DB_ORCHARD_NULLIFIER,
+    DB_MMR_LENGTH, DB_MMR_NODE, DB_MMR_ROOT,
+    DB_SUBTREE_LATEST, DB_SUBTREE_DATA,
+};
+
+static char NullifierKey(ShieldedType type) {
+    switch (type) {
+        case SPROUT:
+            return DB_NULLIFIER;
+        case SAPLING:
+            return DB_SAPLING_NULLIFIER;
+        case ORCHARD:
+            return DB_ORCHARD_NULLIFIER;
+        default:
+            throw runtime_error("Unknown shielded type");
+    }
+}
+
+namespace {
+
+/** Key of a per-outpoint Coin record: DB_COIN, txid, VARINT(n). As VARINT
+ *  encoding preserves ordering, all outputs of a transaction are adjacent
+ *  and sorted by index. */
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    explicit CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
+
+/** A Sprout or Sapling tree stored as the difference from an earlier tree on
+ *  the same chain. nDistance counts the deltas, including this one, between
+ *  the tree and the nearest full tree stored under DB_*_ANCHOR. */
+template<typename Tree>
+struct CAnchorDelta {
+    uint256 baseRoot;
+    uint32_t nDistance;
+    typename Tree::Delta delta;
+
+    CAnchorDelta() : nDistance(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(baseRoot);
+        READWRITE(VARINT(nDistance));
+        READWRITE(delta);
+    }
+};
+
+}
+
+CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe), fNullifierFiltersLoaded(false) {
+    fPerOutpoint = db.Exists(DB_COINS_FORMAT);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), fNullifierFiltersLoaded(false)
 {
+    fPerOutpoint = db.Exists(DB_COINS_FORMAT);
+}
+
+template<typename Tree>
+bool CCoinsViewDB::ReadAnchorTree(char chFull, char chDelta, CAnchorTreeCache<Tree> &cache,
+                                  const uint256 &rt, Tree &tree, uint32_t &nDistance) const {
+    AssertLockHeld(cs_anchorTrees);
+
+    // Walk back to a tree we already have, collecting the deltas on the way.
+    std::vector<CAnchorDelta<Tree>> deltas;
+    uint256 current = rt;
+    Tree base;
+    uint32_t nBaseDistance = 0;
+    while (true) {
+        if (current == Tree::empty_root()) {
+            base = Tree();
+            nBaseDistance = 0;
+            break;
+        }
+        if (cache.Get(current, base, nBaseDistance))
+            break;
+        if (db.Read(make_pair(chFull, current), base)) {
+            nBaseDistance = 0;
+            break;
+        }
+        CAnchorDelta<Tree> delta;
+        if (!db.Read(make_pair(chDelta, current), delta))
+            return false;
+        if (deltas.size() >= ANCHOR_CHECKPOINT_INTERVAL)
+            return error("%s: too many deltas before a full tree for anchor %s", __func__, rt.GetHex());
+        current = delta.baseRoot;
+        deltas.push_back(std::move(delta));
+    }
+
+    try {
+        for (auto it = deltas.rbegin(); it != deltas.rend(); ++it) {
+            base.apply_delta(it->delta);
+            nBaseDistance = it->nDistance;
+        }
+    } catch (const std::exception& e) {
+        return error("%s: unable to rebuild tree for anchor %s: %s", __func__, rt.GetHex(), e.what());
+    }
+
+    cache.Put(rt, base, nBaseDistance);
+    tree = base;
+    nDistance = nBaseDistance;
+    return true;
 }
 
 bool CCoinsViewDB::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
@@ -70,9 +200,9 @@ bool CCoinsViewDB::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree)
         return true;
     }
 
-    bool read = db.Read(make_pair(DB_SPROUT_ANCHOR, rt), tree);
-
-    return read;
+    LOCK(cs_anchorTrees);
+    uint32_t nDistance;
+    return ReadAnchorTree(DB_SPROUT_ANCHOR, DB_SPROUT_ANCHOR_DELTA, sproutAnchorTrees, rt, tree, nDistance);
 }
 
 bool CCoinsViewDB::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const {
@@ -82,9 +212,9 @@ bool CCoinsViewDB::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree
         return true;
     }
 
-    bool read = db.Read(make_pair(DB_SAPLING_ANCHOR, rt), tree);
-
-    return read;
+    LOCK(cs_anchorTrees);
+    uint32_t nDistance;
+    return ReadAnchorTree(DB_SAPLING_ANCHOR, DB_SAPLING_ANCHOR_DELTA, saplingAnchorTrees, rt, tree, nDistance);
 }
 
 bool CCoinsViewDB::GetOrchardAnchorAt(const uint256 &rt, OrchardMerkleFrontier &tree) const {
@@ -94,36 +224,145 @@ bool CCoinsViewDB::GetOrchardAnchorAt(const uint256 &rt, OrchardMerkleFrontier &
         return true;
     }
 
-    bool read = db.Read(make_pair(DB_ORCHARD_ANCHOR, rt), tree);
-
-    return read;
+    // Orchard frontiers are opaque to us, so they are always stored whole;
+    // the cache still saves deserializing them again.
+    LOCK(cs_anchorTrees);
+    uint32_t nDistance;
+    if (orchardAnchorTrees.Get(rt, tree, nDistance))
+        return true;
+    if (!db.Read(make_pair(DB_ORCHARD_ANCHOR, rt), tree))
+        return false;
+    orchardAnchorTrees.Put(rt, tree, 0);
+    return true;
 }
 
 bool CCoinsViewDB::GetNullifier(const uint256 &nf, ShieldedType type) const {
     bool spent = false;
-    char dbChar;
+    char dbChar = NullifierKey(type);
+    {
+        LOCK(cs_nullifierFilters);
+        if (fNullifierFiltersLoaded && !NullifierFilter(type).contains(nf)) {
+            // Definitely not in the database.
+            return false;
+        }
+    }
+    return db.Read(make_pair(dbChar, nf), spent);
+}
+
+CBlockedBloomFilter &CCoinsViewDB::NullifierFilter(ShieldedType type) {
     switch (type) {
         case SPROUT:
-            dbChar = DB_NULLIFIER;
-            break;
+            return sproutNullifierFilter;
         case SAPLING:
-            dbChar = DB_SAPLING_NULLIFIER;
-            break;
+            return saplingNullifierFilter;
         case ORCHARD:
-            dbChar = DB_ORCHARD_NULLIFIER;
-            break;
+            return orchardNullifierFilter;
         default:
             throw runtime_error("Unknown shielded type");
     }
-    return db.Read(make_pair(dbChar, nf), spent);
+}
+
+const CBlockedBloomFilter &CCoinsViewDB::NullifierFilter(ShieldedType type) const {
+    return const_cast<CCoinsViewDB*>(this)->NullifierFilter(type);
+}
+
+bool CCoinsViewDB::LoadNullifierFilter(ShieldedType type) {
+    AssertLockHeld(cs_nullifierFilters);
+    char dbChar = NullifierKey(type);
+    CBlockedBloomFilter &filter = NullifierFilter(type);
+
+    // Count the nullifiers first, so that the filter can be sized with room
+    // to grow.
+    size_t nCount = 0;
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (pcursor->Seek(dbChar); pcursor->Valid(); pcursor->Next()) {
+        std::pair<char, uint256> key;
+        if (!pcursor->GetKey(key) || key.first != dbChar)
+            break;
+        nCount++;
+    }
+
+    filter.Reset(std::max(2 * nCount, NULLIFIER_FILTER_MIN_CAPACITY));
+    for (pcursor->Seek(dbChar); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, uint256> key;
+        if (!pcursor->GetKey(key) || key.first != dbChar)
+            break;
+        filter.insert(key.second);
+    }
+    if (filter.size() != nCount)
+        return error("%s: nullifier set changed while loading", __func__);
+    LogPrint("coindb", "Loaded %u nullifiers of pool %d into a %u-byte filter\n",
+             (unsigned int)nCount, (int)type, (unsigned int)filter.DynamicMemoryUsage());
+    return true;
+}
+
+bool CCoinsViewDB::LoadNullifierFilters() {
+    LOCK(cs_nullifierFilters);
+    int64_t nStart = GetTimeMillis();
+    fNullifierFiltersLoaded = false;
+    for (ShieldedType type : {SPROUT, SAPLING, ORCHARD}) {
+        if (!LoadNullifierFilter(type))
+            return false;
+    }
+    fNullifierFiltersLoaded = true;
+    LogPrintf("Loaded nullifier filters (%u Sprout, %u Sapling, %u Orchard nullifiers) in %dms\n",
+              (unsigned int)sproutNullifierFilter.size(),
+              (unsigned int)saplingNullifierFilter.size(),
+              (unsigned int)orchardNullifierFilter.size(),
+              GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CCoinsViewDB::GetNullifierFilterStats(CNullifierFilterStats &stats) const {
+    LOCK(cs_nullifierFilters);
+    if (!fNullifierFiltersLoaded)
+        return false;
+    auto fill = [](const CBlockedBloomFilter &filter, CNullifierFilterStats::Pool &pool) {
+        pool.nEntries = filter.size();
+        pool.nCapacity = filter.capacity();
+        pool.nUsage = filter.DynamicMemoryUsage();
+    };
+    fill(sproutNullifierFilter, stats.sprout);
+    fill(saplingNullifierFilter, stats.sapling);
+    fill(orchardNullifierFilter, stats.orchard);
+    return true;
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+    if (!fPerOutpoint)
+        return db.Read(make_pair(DB_COINS, txid), coins);
+
+    // The CCoinsView interface is keyed by txid, so every unspent output of
+    // the transaction has to be read; only writes are per outpoint.
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper&>(db).NewIterator());
+    pcursor->Seek(make_pair(DB_COIN, txid));
+    COutPoint outpoint;
+    CoinEntry entry(&outpoint);
+    bool fFound = false;
+    coins.Clear();
+    while (pcursor->Valid()) {
+        if (!pcursor->GetKey(entry) || entry.key != DB_COIN || outpoint.hash != txid)
+            break;
+        Coin coin;
+        if (!pcursor->GetValue(coin))
+            return error("%s: unable to read value", __func__);
+        coin.ApplyTo(coins, outpoint.n);
+        fFound = true;
+        pcursor->Next();
+    }
+    return fFound;
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+    if (!fPerOutpoint)
+        return db.Exists(make_pair(DB_COINS, txid));
+
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper&>(db).NewIterator());
+    pcursor->Seek(make_pair(DB_COIN, txid));
+    COutPoint outpoint;
+    CoinEntry entry(&outpoint);
+    return pcursor->Valid() && pcursor->GetKey(entry) && entry.key == DB_COIN && outpoint.hash == txid;
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -225,14 +464,18 @@ std::optional<libzcash::SubtreeData> CCoinsViewDB::GetSubtreeData(
     return subtreeData;
 }
 
-void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar)
+void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar, CBlockedBloomFilter* filter)
 {
     for (CNullifiersMap::iterator it = mapToUse.begin(); it != mapToUse.end();) {
         if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
-            if (!it->second.entered)
+            if (!it->second.entered) {
+                // Bloom filters can't forget; this becomes a false positive.
                 batch.Erase(make_pair(dbChar, it->first));
-            else
+            } else {
                 batch.Write(make_pair(dbChar, it->first), true);
+                if (filter)
+                    filter->insert(it->first);
+            }
             // TODO: changed++? ... See comment in CCoinsViewDB::BatchWrite. If this is needed we could return an int
         }
         it = mapToUse.erase(it);
@@ -240,13 +483,14 @@ void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char&
 }
 
 template<typename Map, typename MapIterator, typename MapEntry, typename Tree>
-void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
+void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar, std::vector<uint256>& erased)
 {
     for (MapIterator it = mapToUse.begin(); it != mapToUse.end();) {
         if (it->second.flags & MapEntry::DIRTY) {
-            if (!it->second.entered)
+            if (!it->second.entered) {
                 batch.Erase(make_pair(dbChar, it->first));
-            else {
+                erased.push_back(it->first);
+            } else {
                 if (it->first != Tree::empty_root()) {
                     batch.Write(make_pair(dbChar, it->first), it->second.tree);
                 }
@@ -340,6 +584,66 @@ void WriteSubtrees(
     }
 }
 
+template<typename Map, typename MapEntry, typename Tree>
+std::vector<uint256> CCoinsViewDB::BatchWriteAnchorDeltas(CDBBatch &batch, Map &mapAnchors,
+                                                          char chFull, char chDelta,
+                                                          CAnchorTreeCache<Tree> &cache,
+                                                          ShieldedType type) const {
+    std::vector<uint256> erased;
+    std::vector<std::pair<size_t, typename Map::iterator>> written;
+    for (auto it = mapAnchors.begin(); it != mapAnchors.end(); ++it) {
+        if (!(it->second.flags & MapEntry::DIRTY))
+            continue;
+        if (!it->second.entered) {
+            batch.Erase(make_pair(chFull, it->first));
+            batch.Erase(make_pair(chDelta, it->first));
+            erased.push_back(it->first);
+        } else if (it->first != Tree::empty_root()) {
+            written.emplace_back(it->second.tree.size(), it);
+        }
+    }
+
+    // Every anchor still entered is on the active chain, where each tree is
+    // larger than the one before it, so ordering them by size puts each tree
+    // right after the one it was built from.
+    std::sort(written.begin(), written.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    // The first tree is stored against the best tree already on disk, unless
+    // this batch removes it.
+    uint256 baseRoot = GetBestAnchor(type);
+    Tree base;
+    uint32_t nBaseDistance = 0;
+    bool fBase = false;
+    if (!written.empty() && !baseRoot.IsNull() && baseRoot != Tree::empty_root() &&
+        std::find(erased.begin(), erased.end(), baseRoot) == erased.end()) {
+        LOCK(cs_anchorTrees);
+        fBase = ReadAnchorTree(chFull, chDelta, cache, baseRoot, base, nBaseDistance);
+    }
+
+    for (const auto& [nSize, it] : written) {
+        const Tree &tree = it->second.tree;
+        if (fBase && base.size() < nSize && nBaseDistance + 1 < ANCHOR_CHECKPOINT_INTERVAL) {
+            CAnchorDelta<Tree> delta;
+            delta.baseRoot = baseRoot;
+            delta.nDistance = nBaseDistance + 1;
+            delta.delta = tree.delta_from(base);
+            batch.Erase(make_pair(chFull, it->first));
+            batch.Write(make_pair(chDelta, it->first), delta);
+            nBaseDistance = delta.nDistance;
+        } else {
+            batch.Erase(make_pair(chDelta, it->first));
+            batch.Write(make_pair(chFull, it->first), tree);
+            nBaseDistance = 0;
+        }
+        baseRoot = it->first;
+        base = tree;
+        fBase = true;
+    }
+
+    mapAnchors.clear();
+    return erased;
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
                               const uint256 &hashBlock,
                               const uint256 &hashSproutAnchor,
@@ -360,25 +664,38 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
+    size_t outputsChanged = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
+            if (fPerOutpoint) {
+                outputsChanged += BatchWriteCoin(batch, it->first, it->second);
+            } else if (it->second.coins.IsPruned()) {
                 batch.Erase(make_pair(DB_COINS, it->first));
-            else
+            } else {
                 batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+            }
             changed++;
         }
         count++;
         it = mapCoins.erase(it);
     }
 
-    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsOrchardMap, CAnchorsOrchardMap::iterator, CAnchorsOrchardCacheEntry, OrchardMerkleFrontier>(batch, mapOrchardAnchors, DB_ORCHARD_ANCHOR);
+    auto erasedSproutAnchors = BatchWriteAnchorDeltas<CAnchorsSproutMap, CAnchorsSproutCacheEntry>(
+        batch, mapSproutAnchors, DB_SPROUT_ANCHOR, DB_SPROUT_ANCHOR_DELTA, sproutAnchorTrees, SPROUT);
+    auto erasedSaplingAnchors = BatchWriteAnchorDeltas<CAnchorsSaplingMap, CAnchorsSaplingCacheEntry>(
+        batch, mapSaplingAnchors, DB_SAPLING_ANCHOR, DB_SAPLING_ANCHOR_DELTA, saplingAnchorTrees, SAPLING);
+    std::vector<uint256> erasedOrchardAnchors;
+    ::BatchWriteAnchors<CAnchorsOrchardMap, CAnchorsOrchardMap::iterator, CAnchorsOrchardCacheEntry, OrchardMerkleFrontier>(batch, mapOrchardAnchors, DB_ORCHARD_ANCHOR, erasedOrchardAnchors);
 
-    ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER);
-    ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER);
-    ::BatchWriteNullifiers(batch, mapOrchardNullifiers, DB_ORCHARD_NULLIFIER);
+    {
+        // The filters are updated before the batch is written, so that they
+        // never miss a nullifier that is in the database.
+        LOCK(cs_nullifierFilters);
+        bool fFilters = fNullifierFiltersLoaded;
+        ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER, fFilters ? &sproutNullifierFilter : nullptr);
+        ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER, fFilters ? &saplingNullifierFilter : nullptr);
+        ::BatchWriteNullifiers(batch, mapOrchardNullifiers, DB_ORCHARD_NULLIFIER, fFilters ? &orchardNullifierFilter : nullptr);
+    }
 
     ::BatchWriteHistory(batch, historyCacheMap);
 
@@ -397,8 +714,146 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     if (!hashOrchardAnchor.IsNull())
         batch.Write(DB_BEST_ORCHARD_ANCHOR, hashOrchardAnchor);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    if (fPerOutpoint) {
+        LogPrint("coindb", "Committing %u changed outputs of %u changed transactions (out of %u) to coin database...\n",
+                 (unsigned int)outputsChanged, (unsigned int)changed, (unsigned int)count);
+    } else {
+        LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    }
+    if (!db.WriteBatch(batch))
+        return false;
+
+    {
+        // Forget removed anchors only now, so that a concurrent reader can't
+        // put them back in the cache from the old state of the database.
+        LOCK(cs_anchorTrees);
+        for (const uint256 &rt : erasedSproutAnchors)
+            sproutAnchorTrees.Erase(rt);
+        for (const uint256 &rt : erasedSaplingAnchors)
+            saplingAnchorTrees.Erase(rt);
+        for (const uint256 &rt : erasedOrchardAnchors)
+            orchardAnchorTrees.Erase(rt);
+    }
+
+    // Rebuild any filter that has outgrown its capacity, now that the
+    // database has all of its nullifiers.
+    LOCK(cs_nullifierFilters);
+    if (fNullifierFiltersLoaded) {
+        for (ShieldedType type : {SPROUT, SAPLING, ORCHARD}) {
+            if (NullifierFilter(type).IsFull() && !LoadNullifierFilter(type)) {
+                // Fall back to reading every nullifier from disk.
+                LogPrintf("%s: unable to rebuild nullifier filter, disabling nullifier filters\n", __func__);
+                fNullifierFiltersLoaded = false;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+size_t CCoinsViewDB::BatchWriteCoin(CDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry) const {
+    const CCoins &coins = entry.coins;
+    size_t nWritten = 0;
+    COutPoint outpoint(txid, 0);
+    CoinEntry key(&outpoint);
+
+    if (entry.flags & CCoinsCacheEntry::FRESH) {
+        // There are no records for this txid in the database yet.
+        for (outpoint.n = 0; outpoint.n < coins.vout.size(); outpoint.n++) {
+            if (coins.IsAvailable(outpoint.n)) {
+                batch.Write(key, Coin(coins, outpoint.n));
+                nWritten++;
+            }
+        }
+    } else if (entry.fOutputsTracked) {
+        // Only touch the outputs that were spent or unspent in the cache.
+        for (outpoint.n = 0; outpoint.n < entry.vDirtyOutputs.size(); outpoint.n++) {
+            if (!entry.vDirtyOutputs[outpoint.n])
+                continue;
+            if (coins.IsAvailable(outpoint.n))
+                batch.Write(key, Coin(coins, outpoint.n));
+            else
+                batch.Erase(key);
+            nWritten++;
+        }
+    } else {
+        // We don't know what changed; erase the stale records and rewrite
+        // the rest.
+        boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper&>(db).NewIterator());
+        pcursor->Seek(make_pair(DB_COIN, txid));
+        COutPoint stale;
+        CoinEntry staleKey(&stale);
+        while (pcursor->Valid()) {
+            if (!pcursor->GetKey(staleKey) || staleKey.key != DB_COIN || stale.hash != txid)
+                break;
+            if (!coins.IsAvailable(stale.n)) {
+                batch.Erase(staleKey);
+                nWritten++;
+            }
+            pcursor->Next();
+        }
+        for (outpoint.n = 0; outpoint.n < coins.vout.size(); outpoint.n++) {
+            if (coins.IsAvailable(outpoint.n)) {
+                batch.Write(key, Coin(coins, outpoint.n));
+                nWritten++;
+            }
+        }
+    }
+    return nWritten;
+}
+
+bool CCoinsViewDB::Upgrade(bool fEnable) {
+    if (!fPerOutpoint) {
+        if (!fEnable)
+            return true;
+        // Record the format first, so that an interrupted migration is
+        // resumed at the next startup even if -peroutpointcoins is dropped.
+        if (!db.Write(DB_COINS_FORMAT, '1', true))
+            return error("%s: unable to write coins format flag", __func__);
+        fPerOutpoint = true;
+    } else if (!fEnable) {
+        LogPrintf("Coin database uses the per-outpoint format; -peroutpointcoins=0 has no effect without -reindex-chainstate\n");
+    }
+
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid())
+        return true;
+
+    LogPrintf("Upgrading coin database to the per-outpoint format...\n");
+    int64_t nStart = GetTimeMillis();
+    size_t nTransactions = 0, nOutputs = 0;
+    while (pcursor->Valid()) {
+        CDBBatch batch(db);
+        size_t nBatchTransactions = 0;
+        for (; pcursor->Valid() && nBatchTransactions < 100000; pcursor->Next()) {
+            std::pair<char, uint256> key;
+            if (!pcursor->GetKey(key) || key.first != DB_COINS)
+                break;
+            CCoins coins;
+            if (!pcursor->GetValue(coins))
+                return error("%s: unable to read value", __func__);
+            COutPoint outpoint(key.second, 0);
+            CoinEntry entry(&outpoint);
+            for (outpoint.n = 0; outpoint.n < coins.vout.size(); outpoint.n++) {
+                if (coins.IsAvailable(outpoint.n)) {
+                    batch.Write(entry, Coin(coins, outpoint.n));
+                    nOutputs++;
+                }
+            }
+            batch.Erase(key);
+            nBatchTransactions++;
+        }
+        if (nBatchTransactions == 0)
+            break;
+        if (!db.WriteBatch(batch))
+            return error("%s: unable to write batch", __func__);
+        nTransactions += nBatchTransactions;
+        LogPrint("coindb", "Upgraded %u transactions (%u outputs) so far\n", (unsigned int)nTransactions, (unsigned int)nOutputs);
+    }
+    LogPrintf("Upgraded %u transactions (%u outputs) to the per-outpoint format in %dms\n",
+              (unsigned int)nTransactions, (unsigned int)nOutputs, GetTimeMillis() - nStart);
+    return true;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
@@ -428,12 +883,21 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
-
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
+    if (fPerOutpoint) {
+        if (!GetStatsPerOutpoint(stats, ss))
+            return false;
+        LOCK(cs_main);
+        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+        stats.hashSerialized = ss.GetHash();
+        return true;
+    }
+
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
+    pcursor->Seek(DB_COINS);
+
     CAmount nTotalAmount = 0;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
@@ -470,6 +934,325 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     return true;
 }
 
+bool CCoinsViewDB::GetStatsPerOutpoint(CCoinsStats &stats, CHashWriter &ss) const {
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
+    pcursor->Seek(DB_COIN);
+
+    // Outputs of the same transaction are adjacent, so hash them in the same
+    // way as the per-txid format does to keep hash_serialized comparable.
+    CAmount nTotalAmount = 0;
+    uint256 prevTxid;
+    bool fFirst = true;
+    COutPoint outpoint;
+    CoinEntry entry(&outpoint);
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (!pcursor->GetKey(entry) || entry.key != DB_COIN)
+            break;
+        Coin coin;
+        if (!pcursor->GetValue(coin))
+            return error("CCoinsViewDB::GetStats() : unable to read value");
+        if (fFirst || outpoint.hash != prevTxid) {
+            if (!fFirst)
+                ss << VARINT(0);
+            stats.nTransactions++;
+            prevTxid = outpoint.hash;
+            fFirst = false;
+        }
+        stats.nTransactionOutputs++;
+        ss << VARINT(outpoint.n + 1);
+        ss << coin.out;
+        nTotalAmount += coin.out.nValue;
+        stats.nSerializedSize += 32 + 4 + pcursor->GetValueSize();
+        pcursor->Next();
+    }
+    if (!fFirst)
+        ss << VARINT(0);
+    stats.nTotalAmount = nTotalAmount;
+    return true;
+}
+
+namespace {
+
+/**
+ * Writes chain state records to a snapshot file, hashing them as it goes. If
+ * there is no file the records are only hashed.
+ */
+class CSnapshotWriter
+{
+private:
+    CAutoFile *file;
+    CHashWriter &hasher;
+
+public:
+    uint64_t nRecords;
+
+    CSnapshotWriter(CAutoFile *fileIn, CHashWriter &hasherIn) : file(fileIn), hasher(hasherIn), nRecords(0) {}
+
+    void WriteRaw(const std::vector<unsigned char> &key, const std::vector<unsigned char> &value) {
+        if (file)
+            *file << key << value;
+        hasher << key << value;
+        nRecords++;
+    }
+
+    template<typename K, typename V>
+    void Write(const K &key, const V &value) {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssKey << key;
+        ssValue << value;
+        WriteRaw(std::vector<unsigned char>(ssKey.begin(), ssKey.end()),
+                 std::vector<unsigned char>(ssValue.begin(), ssValue.end()));
+    }
+
+    void Finish() {
+        // An empty key marks the end of the records.
+        std::vector<unsigned char> end;
+        if (file)
+            *file << end;
+        hasher << end;
+    }
+};
+
+/**
+ * Write the Sprout or Sapling anchors in the database, whether they are stored
+ * whole or as deltas, as full trees in order of root.
+ */
+template<typename Tree>
+bool DumpAnchorTrees(CDBIterator &cursor, CSnapshotWriter &writer, char chFull, char chDelta,
+                     std::function<bool(const uint256&, Tree&)> getTree)
+{
+    std::vector<uint256> roots;
+    for (char ch : {chFull, chDelta}) {
+        for (cursor.Seek(ch); cursor.Valid(); cursor.Next()) {
+            std::pair<char, uint256> key;
+            if (!cursor.GetKey(key) || key.first != ch)
+                break;
+            roots.push_back(key.second);
+        }
+    }
+    std::sort(roots.begin(), roots.end());
+    for (const uint256 &rt : roots) {
+        boost::this_thread::interruption_point();
+        Tree tree;
+        if (!getTree(rt, tree))
+            return error("DumpSnapshot(): unable to read anchor %s", rt.GetHex());
+        writer.Write(make_pair(chFull, rt), tree);
+    }
+    return true;
+}
+
+/** Reads the next record of a snapshot, returning false at the end marker. */
+bool ReadSnapshotRecord(CAutoFile &file, CHashWriter &hasher,
+                        std::vector<unsigned char> &key, std::vector<unsigned char> &value)
+{
+    file >> key;
+    hasher << key;
+    if (key.empty())
+        return false;
+    file >> value;
+    hasher << value;
+    return true;
+}
+
+}
+
+bool CCoinsViewDB::DumpSnapshot(CAutoFile *file, CHashWriter &hasher, uint64_t &nRecords) const {
+    CSnapshotWriter writer(file, hasher);
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
+
+    // Coins, one CCoins record per txid whichever format the database uses.
+    if (fPerOutpoint) {
+        pcursor->Seek(DB_COIN);
+        COutPoint outpoint;
+        CoinEntry entry(&outpoint);
+        CCoins coins;
+        uint256 txid;
+        bool fFirst = true;
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            if (!pcursor->GetKey(entry) || entry.key != DB_COIN)
+                break;
+            Coin coin;
+            if (!pcursor->GetValue(coin))
+                return error("%s: unable to read coin", __func__);
+            if (fFirst || outpoint.hash != txid) {
+                if (!fFirst)
+                    writer.Write(make_pair(DB_COINS, txid), coins);
+                coins.Clear();
+                txid = outpoint.hash;
+                fFirst = false;
+            }
+            coin.ApplyTo(coins, outpoint.n);
+            pcursor->Next();
+        }
+        if (!fFirst)
+            writer.Write(make_pair(DB_COINS, txid), coins);
+    } else {
+        for (pcursor->Seek(DB_COINS); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            std::pair<char, uint256> key;
+            CCoins coins;
+            if (!pcursor->GetKey(key) || key.first != DB_COINS)
+                break;
+            if (!pcursor->GetValue(coins))
+                return error("%s: unable to read coins", __func__);
+            writer.Write(key, coins);
+        }
+    }
+
+    // Sprout and Sapling anchors, as full trees.
+    if (!DumpAnchorTrees<SproutMerkleTree>(*pcursor, writer, DB_SPROUT_ANCHOR, DB_SPROUT_ANCHOR_DELTA,
+            [this](const uint256 &rt, SproutMerkleTree &tree) { return GetSproutAnchorAt(rt, tree); }))
+        return false;
+    if (!DumpAnchorTrees<SaplingMerkleTree>(*pcursor, writer, DB_SAPLING_ANCHOR, DB_SAPLING_ANCHOR_DELTA,
+            [this](const uint256 &rt, SaplingMerkleTree &tree) { return GetSaplingAnchorAt(rt, tree); }))
+        return false;
+
+    // Everything else is copied as it is stored.
+    for (char ch : SNAPSHOT_PREFIXES) {
+        if (ch == DB_COINS || ch == DB_SPROUT_ANCHOR || ch == DB_SAPLING_ANCHOR)
+            continue;
+        for (pcursor->Seek(ch); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            std::vector<unsigned char> key = pcursor->GetKeyBytes();
+            if (key.empty() || key[0] != (unsigned char)ch)
+                break;
+            writer.WriteRaw(key, pcursor->GetValueBytes());
+        }
+    }
+
+    writer.Finish();
+    nRecords = writer.nRecords;
+    return true;
+}
+
+bool CCoinsViewDB::HashSnapshot(CAutoFile &file, CHashWriter &hasher, uint64_t &nRecords) {
+    std::vector<unsigned char> key, value;
+    nRecords = 0;
+    try {
+        while (ReadSnapshotRecord(file, hasher, key, value)) {
+            boost::this_thread::interruption_point();
+            nRecords++;
+        }
+    } catch (const std::ios_base::failure &e) {
+        return error("%s: unable to read snapshot: %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool CCoinsViewDB::LoadSnapshot(CAutoFile &file, const CChainstateSnapshotMetadata &metadata, const uint256 &hashSnapshot) {
+    // Stop consulting the nullifier filters until they are rebuilt from the
+    // snapshot's nullifiers.
+    bool fFilters;
+    {
+        LOCK(cs_nullifierFilters);
+        fFilters = fNullifierFiltersLoaded;
+        fNullifierFiltersLoaded = false;
+    }
+
+    // Mark the database as incomplete before touching anything, so that an
+    // interrupted load is noticed at the next startup.
+    {
+        CDBBatch batch(db);
+        batch.Write(DB_SNAPSHOT_LOADING, metadata.hashBlock);
+        batch.Erase(DB_BEST_BLOCK);
+        if (!db.WriteBatch(batch, true))
+            return error("%s: unable to mark the coin database", __func__);
+    }
+
+    // Remove whatever chain state the database held before.
+    std::vector<char> vPrefixes(std::begin(SNAPSHOT_PREFIXES), std::end(SNAPSHOT_PREFIXES));
+    vPrefixes.insert(vPrefixes.end(), {DB_COIN, DB_SPROUT_ANCHOR_DELTA, DB_SAPLING_ANCHOR_DELTA});
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (char ch : vPrefixes) {
+        pcursor->Seek(ch);
+        while (pcursor->Valid()) {
+            CDBBatch batch(db);
+            size_t nErased = 0;
+            for (; pcursor->Valid() && nErased < CHAINSTATE_SNAPSHOT_BATCH_SIZE; pcursor->Next()) {
+                std::vector<unsigned char> key = pcursor->GetKeyBytes();
+                if (key.empty() || key[0] != (unsigned char)ch)
+                    break;
+                batch.Erase(CFlatData(key));
+                nErased++;
+            }
+            if (nErased == 0)
+                break;
+            if (!db.WriteBatch(batch))
+                return error("%s: unable to clear the coin database", __func__);
+        }
+    }
+
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << metadata;
+    std::vector<unsigned char> key, value;
+    size_t nRecords = 0;
+    bool fMore = true;
+    try {
+        while (fMore) {
+            boost::this_thread::interruption_point();
+            CDBBatch batch(db);
+            size_t nBatchRecords = 0;
+            while (nBatchRecords < CHAINSTATE_SNAPSHOT_BATCH_SIZE) {
+                fMore = ReadSnapshotRecord(file, hasher, key, value);
+                if (!fMore)
+                    break;
+                if (std::find(std::begin(SNAPSHOT_PREFIXES), std::end(SNAPSHOT_PREFIXES), (char)key[0]) == std::end(SNAPSHOT_PREFIXES))
+                    return error("%s: unexpected record in snapshot", __func__);
+                batch.Write(CFlatData(key), CFlatData(value));
+                nBatchRecords++;
+            }
+            if (!fMore) {
+                if (hasher.GetHash() != hashSnapshot)
+                    return error("%s: snapshot does not match its hash", __func__);
+                batch.Write(DB_BEST_BLOCK, metadata.hashBlock);
+                batch.Write(DB_BEST_SPROUT_ANCHOR, metadata.hashSproutAnchor);
+                batch.Write(DB_BEST_SAPLING_ANCHOR, metadata.hashSaplingAnchor);
+                batch.Write(DB_BEST_ORCHARD_ANCHOR, metadata.hashOrchardAnchor);
+                batch.Write(DB_SNAPSHOT_HASH, hashSnapshot);
+                batch.Erase(DB_SNAPSHOT_LOADING);
+            }
+            if (!db.WriteBatch(batch, !fMore))
+                return error("%s: unable to write to the coin database", __func__);
+            nRecords += nBatchRecords;
+            LogPrint("coindb", "Loaded %u snapshot records so far\n", (unsigned int)nRecords);
+        }
+    } catch (const std::ios_base::failure &e) {
+        return error("%s: unable to read snapshot: %s", __func__, e.what());
+    }
+
+    {
+        LOCK(cs_anchorTrees);
+        sproutAnchorTrees.Clear();
+        saplingAnchorTrees.Clear();
+        orchardAnchorTrees.Clear();
+    }
+
+    // The snapshot stores coins per txid.
+    if (!Upgrade(fPerOutpoint))
+        return false;
+
+    if (fFilters && !LoadNullifierFilters()) {
+        // Fall back to reading every nullifier from disk.
+        LogPrintf("%s: unable to rebuild nullifier filters, disabling nullifier filters\n", __func__);
+    }
+    return true;
+}
+
+bool CCoinsViewDB::IsSnapshotLoadIncomplete() const {
+    return db.Exists(DB_SNAPSHOT_LOADING);
+}
+
+bool CCoinsViewDB::GetSnapshotHash(uint256 &hashSnapshot) const {
+    return db.Read(DB_SNAPSHOT_HASH, hashSnapshot);
+}
+
+bool CCoinsViewDB::EraseSnapshotHash() {
+    return db.Erase(DB_SNAPSHOT_HASH, true);
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<CBlockIndex*>& blockinfo) {
     MetricsIncrementCounter("zcashd.debug.blocktree.write_batch");
     CDBBatch batch(*this);
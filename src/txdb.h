@@ -7,12 +7,18 @@
 #ifndef BITCOIN_TXDB_H
 #define BITCOIN_TXDB_H
 
+#include "bloom.h"
 #include "coins.h"
 #include "dbwrapper.h"
 #include "chain.h"
+#include "protocol.h"
+#include "sync.h"
 
+#include <list>
 #include <map>
+#include <optional>
 #include <string>
+#include <string.h>
 #include <utility>
 #include <vector>
 
@@ -47,6 +53,17 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -peroutpointcoins default
+static const bool DEFAULT_PER_OUTPOINT_COINS = false;
+//! A full Sprout or Sapling tree is stored at least once in this many anchors;
+//! the anchors in between are stored as deltas against an earlier tree.
+static const unsigned int ANCHOR_CHECKPOINT_INTERVAL = 64;
+//! Number of recently read commitment trees kept per shielded pool.
+static const size_t ANCHOR_TREE_CACHE_SIZE = 128;
+//! Version of the chain state snapshot format written by dumptxoutset.
+static const uint32_t CHAINSTATE_SNAPSHOT_VERSION = 1;
+//! Number of snapshot records written to the coin database per batch.
+static const size_t CHAINSTATE_SNAPSHOT_BATCH_SIZE = 100000;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -73,16 +90,174 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
+/**
+ * Header of a chain state snapshot. Besides identifying the block that the
+ * snapshot was taken at, it carries the block index data for that block that
+ * can't be recomputed without the blocks below it. The snapshot hash, which
+ * chain parameters commit to, covers this header as well as the records.
+ */
+class CChainstateSnapshotMetadata
+{
+public:
+    static constexpr unsigned char MAGIC[4] = {'z', 's', 'n', 'p'};
+
+    uint32_t nVersion;
+    CMessageHeader::MessageStartChars pchMessageStart;
+    uint256 hashBlock;
+    int nHeight;
+    unsigned int nChainTx;
+    std::optional<CAmount> nChainTotalSupply;
+    std::optional<CAmount> nChainTransparentValue;
+    std::optional<CAmount> nChainSproutValue;
+    std::optional<CAmount> nChainSaplingValue;
+    std::optional<CAmount> nChainOrchardValue;
+    std::optional<CAmount> nChainLockboxValue;
+    uint256 hashSproutAnchor;
+    uint256 hashSaplingAnchor;
+    uint256 hashOrchardAnchor;
+    uint256 hashAuthDataRoot;
+    uint256 hashFinalSaplingRoot;
+    uint256 hashFinalOrchardRoot;
+    uint256 hashChainHistoryRoot;
+
+    CChainstateSnapshotMetadata() : nVersion(CHAINSTATE_SNAPSHOT_VERSION), nHeight(0), nChainTx(0) {
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        unsigned char magic[4];
+        memcpy(magic, MAGIC, sizeof(magic));
+        READWRITE(FLATDATA(magic));
+        if (memcmp(magic, MAGIC, sizeof(magic)) != 0)
+            throw std::ios_base::failure("not a chain state snapshot");
+        READWRITE(nVersion);
+        if (nVersion != CHAINSTATE_SNAPSHOT_VERSION)
+            throw std::ios_base::failure("unsupported chain state snapshot version");
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nChainTx);
+        READWRITE(nChainTotalSupply);
+        READWRITE(nChainTransparentValue);
+        READWRITE(nChainSproutValue);
+        READWRITE(nChainSaplingValue);
+        READWRITE(nChainOrchardValue);
+        READWRITE(nChainLockboxValue);
+        READWRITE(hashSproutAnchor);
+        READWRITE(hashSaplingAnchor);
+        READWRITE(hashOrchardAnchor);
+        READWRITE(hashAuthDataRoot);
+        READWRITE(hashFinalSaplingRoot);
+        READWRITE(hashFinalOrchardRoot);
+        READWRITE(hashChainHistoryRoot);
+    }
+};
+
+/**
+ * A least-recently-used cache of commitment trees read from the coin
+ * database, keyed by root. For Sprout and Sapling trees, nDistance is the
+ * number of deltas between the tree and the full tree it was rebuilt from.
+ */
+template<typename Tree>
+class CAnchorTreeCache
+{
+private:
+    struct Entry {
+        uint256 rt;
+        Tree tree;
+        uint32_t nDistance;
+    };
+    typedef std::list<Entry> EntryList;
+
+    EntryList entries;
+    boost::unordered_map<uint256, typename EntryList::iterator, SaltedTxidHasher> index;
+
+public:
+    bool Get(const uint256 &rt, Tree &tree, uint32_t &nDistance) {
+        auto it = index.find(rt);
+        if (it == index.end())
+            return false;
+        entries.splice(entries.begin(), entries, it->second);
+        tree = it->second->tree;
+        nDistance = it->second->nDistance;
+        return true;
+    }
+
+    void Put(const uint256 &rt, const Tree &tree, uint32_t nDistance) {
+        auto it = index.find(rt);
+        if (it != index.end()) {
+            entries.splice(entries.begin(), entries, it->second);
+            return;
+        }
+        entries.push_front(Entry{rt, tree, nDistance});
+        index.emplace(rt, entries.begin());
+        if (entries.size() > ANCHOR_TREE_CACHE_SIZE) {
+            index.erase(entries.back().rt);
+            entries.pop_back();
+        }
+    }
+
+    void Erase(const uint256 &rt) {
+        auto it = index.find(rt);
+        if (it != index.end()) {
+            entries.erase(it->second);
+            index.erase(it);
+        }
+    }
+
+    void Clear() {
+        entries.clear();
+        index.clear();
+    }
+};
+
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+    //! Whether coins are stored as one Coin record per outpoint, rather than
+    //! one CCoins record per txid.
+    bool fPerOutpoint;
+
+    //! Filters over the nullifiers of each pool in the database, so that
+    //! looking up an unspent nullifier usually avoids a disk read. They are
+    //! only consulted once LoadNullifierFilters has succeeded.
+    mutable CCriticalSection cs_nullifierFilters;
+    CBlockedBloomFilter sproutNullifierFilter;
+    CBlockedBloomFilter saplingNullifierFilter;
+    CBlockedBloomFilter orchardNullifierFilter;
+    bool fNullifierFiltersLoaded;
+
+    //! Trees recently rebuilt or read for GetSproutAnchorAt,
+    //! GetSaplingAnchorAt and GetOrchardAnchorAt.
+    mutable CCriticalSection cs_anchorTrees;
+    mutable CAnchorTreeCache<SproutMerkleTree> sproutAnchorTrees;
+    mutable CAnchorTreeCache<SaplingMerkleTree> saplingAnchorTrees;
+    mutable CAnchorTreeCache<OrchardMerkleFrontier> orchardAnchorTrees;
+
     CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
     ~CCoinsViewDB() {}
 
+    bool IsPerOutpoint() const { return fPerOutpoint; }
+
+    /**
+     * Switch the database to the per-outpoint format if fEnable is set, and
+     * finish any previously interrupted migration. The migration happens in
+     * place, in batches that each leave the database consistent, so it may be
+     * interrupted and resumed at the next startup. There is no way back to the
+     * per-txid format other than -reindex-chainstate.
+     */
+    bool Upgrade(bool fEnable);
+
+    //! Build the nullifier filters from the nullifiers in the database.
+    bool LoadNullifierFilters();
+
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
     bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
     bool GetOrchardAnchorAt(const uint256 &rt, OrchardMerkleFrontier &tree) const;
@@ -113,6 +288,54 @@ public:
                     SubtreeCache &cacheSaplingSubtrees,
                     SubtreeCache &cacheOrchardSubtrees);
     bool GetStats(CCoinsStats &stats) const;
+    bool GetNullifierFilterStats(CNullifierFilterStats &stats) const;
+
+    /**
+     * Write every record of the chain state, other than the best block and
+     * anchors, to a snapshot file and to hasher. Records are written in the
+     * per-txid coins format and with full commitment trees, in a fixed
+     * order, so that the snapshot of a given chain state is the same however
+     * the database stores it. If file is null the records are only hashed.
+     * The caller must keep the database from changing while this runs.
+     */
+    bool DumpSnapshot(CAutoFile *file, CHashWriter &hasher, uint64_t &nRecords) const;
+
+    /** Read the records of a snapshot into hasher, without loading them. */
+    static bool HashSnapshot(CAutoFile &file, CHashWriter &hasher, uint64_t &nRecords);
+
+    /**
+     * Replace the chain state with the records of a snapshot, and set the
+     * best block and anchors from its metadata. The database stays marked as
+     * incomplete unless every record was written and the snapshot matched
+     * hashSnapshot, which is then kept until EraseSnapshotHash.
+     */
+    bool LoadSnapshot(CAutoFile &file, const CChainstateSnapshotMetadata &metadata, const uint256 &hashSnapshot);
+
+    //! Whether a previous LoadSnapshot was interrupted before it completed.
+    bool IsSnapshotLoadIncomplete() const;
+
+    //! The hash of the snapshot this chain state was loaded from, if any.
+    bool GetSnapshotHash(uint256 &hashSnapshot) const;
+    //! Forget the snapshot hash, once the snapshot has been validated.
+    bool EraseSnapshotHash();
+
+private:
+    //! Queue the per-outpoint records of a dirty cache entry, returning how many were touched.
+    size_t BatchWriteCoin(CDBBatch &batch, const uint256 &txid, const CCoinsCacheEntry &entry) const;
+    bool GetStatsPerOutpoint(CCoinsStats &stats, CHashWriter &ss) const;
+    CBlockedBloomFilter &NullifierFilter(ShieldedType type);
+    const CBlockedBloomFilter &NullifierFilter(ShieldedType type) const;
+    bool LoadNullifierFilter(ShieldedType type);
+    //! Read a Sprout or Sapling tree, rebuilding it from its deltas if needed.
+    template<typename Tree>
+    bool ReadAnchorTree(char chFull, char chDelta, CAnchorTreeCache<Tree> &cache,
+                        const uint256 &rt, Tree &tree, uint32_t &nDistance) const;
+    //! Queue the dirty Sprout or Sapling anchors, returning the roots erased.
+    template<typename Map, typename MapEntry, typename Tree>
+    std::vector<uint256> BatchWriteAnchorDeltas(CDBBatch &batch, Map &mapAnchors,
+                                                char chFull, char chDelta,
+                                                CAnchorTreeCache<Tree> &cache,
+                                                ShieldedType type) const;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -21,6 +21,7 @@
 
 #include <rust/metrics.h>
 
+#include <algorithm>
 #include <optional>
 
 using namespace std;
@@ -63,8 +64,8 @@ bool CTxMemPool::UpdateForDescendants(txiter updateIt, int maxDescendantsToVisit
     // (will bail out if it exceeds maxDescendantsToVisit)
     int nChildrenToVisit = 0;
 
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    const vecEntries &directChildren = GetMemPoolChildren(updateIt);
+    setEntries stageEntries(directChildren.begin(), directChildren.end()), setAllDescendants;
 
     while (!stageEntries.empty()) {
         const txiter cit = *stageEntries.begin();
@@ -74,8 +75,8 @@ bool CTxMemPool::UpdateForDescendants(txiter updateIt, int maxDescendantsToVisit
         }
         setAllDescendants.insert(cit);
         stageEntries.erase(cit);
-        const setEntries &setChildren = GetMemPoolChildren(cit);
-        for (const txiter childEntry : setChildren) {
+        const vecEntries &children = GetMemPoolChildren(cit);
+        for (const txiter childEntry : children) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
             if (cacheIt != cachedDescendants.end()) {
                 // We've already calculated this one, just add the entries for this set
@@ -124,6 +125,7 @@ bool CTxMemPool::UpdateForDescendants(txiter updateIt, int maxDescendantsToVisit
 void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate)
 {
     LOCK(cs);
+    nSnapshotSequence++;
     // For each entry in vHashesToUpdate, store the set of in-mempool, but not
     // in-vHashesToUpdate transactions, so that we don't have to recalculate
     // descendants when we come across a previously seen entry.
@@ -146,10 +148,13 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
         if (it == mapTx.end()) {
             continue;
         }
-        std::map<COutPoint, CInPoint>::iterator iter = mapNextTx.lower_bound(COutPoint(hash, 0));
         // First calculate the children, and update setMemPoolChildren to
         // include them, and update their setMemPoolParents to include this tx.
-        for (; iter != mapNextTx.end() && iter->first.hash == hash; ++iter) {
+        for (unsigned int i = 0; i < it->GetTx().vout.size(); i++) {
+            auto iter = mapNextTx.find(COutPoint(hash, i));
+            if (iter == mapNextTx.end()) {
+                continue;
+            }
             const uint256 &childHash = iter->second.ptx->GetHash();
             txiter childIter = mapTx.find(childHash);
             assert(childIter != mapTx.end());
@@ -190,7 +195,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        const vecEntries &parents = GetMemPoolParents(it);
+        parentHashes.insert(parents.begin(), parents.end());
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
@@ -213,8 +219,8 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
-        for (const txiter &phash : setMemPoolParents) {
+        const vecEntries & memPoolParents = GetMemPoolParents(stageit);
+        for (const txiter &phash : memPoolParents) {
             // If this is a new ancestor, add it.
             if (setAncestors.count(phash) == 0) {
                 parentHashes.insert(phash);
@@ -231,7 +237,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
 
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
+    const vecEntries &parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
     for (txiter piter : parentIters) {
         UpdateChild(piter, it, add);
@@ -246,19 +252,65 @@ void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries &setMemPoolChildren = GetMemPoolChildren(it);
-    for (txiter updateIt : setMemPoolChildren) {
+    const vecEntries &memPoolChildren = GetMemPoolChildren(it);
+    for (txiter updateIt : memPoolChildren) {
         UpdateParent(updateIt, it, false);
     }
 }
 
+bool CTxMemPool::AncestorsAllStaged(txiter it, const setEntries &entriesToRemove,
+        std::map<txiter, bool, CompareIteratorByHash> &cachedStaged) const
+{
+    // Walk the parents depth first, deciding each entry once all of its
+    // parents have been decided.
+    std::vector<txiter> vStack {it};
+    while (!vStack.empty()) {
+        txiter stageit = vStack.back();
+        if (cachedStaged.count(stageit)) {
+            vStack.pop_back();
+            continue;
+        }
+        bool fStaged = true;
+        bool fDecided = true;
+        for (txiter parentIt : GetMemPoolParents(stageit)) {
+            if (!entriesToRemove.count(parentIt)) {
+                fStaged = false;
+                break;
+            }
+            auto cached = cachedStaged.find(parentIt);
+            if (cached == cachedStaged.end()) {
+                vStack.push_back(parentIt);
+                fDecided = false;
+            } else if (!cached->second) {
+                fStaged = false;
+                break;
+            }
+        }
+        if (!fStaged || fDecided) {
+            cachedStaged[stageit] = fStaged;
+            vStack.pop_back();
+        }
+    }
+    return cachedStaged.at(it);
+}
+
 void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove)
 {
     // For each entry, walk back all ancestors and decrement size associated with this
     // transaction
     const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::map<txiter, bool, CompareIteratorByHash> cachedStaged;
     for (txiter removeIt : entriesToRemove) {
         setEntries setAncestors;
+        // Ancestors that are being removed as well don't need their
+        // descendant state updated, so there is nothing to walk for an entry
+        // whose ancestors are all being removed. That covers every
+        // transaction of a connected block, and keeps removing a long
+        // confirmed chain linear.
+        if (AncestorsAllStaged(removeIt, entriesToRemove, cachedStaged)) {
+            UpdateAncestorsOf(false, removeIt, setAncestors);
+            continue;
+        }
         const CTxMemPoolEntry &entry = *removeIt;
         std::string dummy;
         // Since this is a tx that is already in the mempool, we can call CMPA
@@ -279,6 +331,14 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove)
         // and it's important that we use the mapLinks[] notion of ancestor
         // transactions as the set of things to update for removal.
         CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        // As above, only the ancestors that stay need their state updated.
+        for (auto ancestorIt = setAncestors.begin(); ancestorIt != setAncestors.end(); ) {
+            if (entriesToRemove.count(*ancestorIt)) {
+                ancestorIt = setAncestors.erase(ancestorIt);
+            } else {
+                ++ancestorIt;
+            }
+        }
         // Note that UpdateAncestorsOf severs the child links that point to
         // removeIt in the entries for the parents of removeIt.  This is
         // fine since we don't need to use the mempool children of any entries
@@ -356,12 +416,11 @@ void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
 {
     LOCK(cs);
 
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
-
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
+    // remove the outputs of hashTx that are spent in mapNextTx from coins
+    for (unsigned int n = 0; n < coins.vout.size(); n++) {
+        if (mapNextTx.count(COutPoint(hashTx, n))) {
+            coins.Spend(n);
+        }
     }
 }
 
@@ -391,13 +450,14 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // Update transaction for any feeDelta created by PrioritiseTransaction
     // TODO: refactor so that the fee delta is calculated before inserting
     // into mapTx.
-    std::map<uint256, CAmount>::const_iterator pos = mapDeltas.find(hash);
+    auto pos = mapDeltas.find(hash);
     if (pos != mapDeltas.end()) {
         const CAmount &delta = pos->second;
         if (delta) {
             mapTx.modify(newit, update_fee_delta(delta));
         }
     }
+    AddBlockCandidate(newit);
 
     // Update cachedInnerUsage to include contained transaction's usage.
     // (When we update the entry for in-mempool parents, memory usage will be
@@ -441,6 +501,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     }
 
     nTransactionsUpdated++;
+    nSnapshotSequence++;
     totalTxSize += entry.GetTxSize();
 
     return true;
@@ -530,7 +591,7 @@ void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCac
 bool CTxMemPool::getSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value)
 {
     LOCK(cs);
-    std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare>::iterator it = mapSpent.find(key);
+    auto it = mapSpent.find(key);
     if (it != mapSpent.end()) {
         value = it->second;
         return true;
@@ -574,9 +635,11 @@ void CTxMemPool::removeUnchecked(txiter it)
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
     cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
+    RemoveBlockCandidate(it);
     mapLinks.erase(it);
     mapTx.erase(it);
     nTransactionsUpdated++;
+    nSnapshotSequence++;
 
     // insightexplorer
     if (fAddressIndex)
@@ -605,8 +668,8 @@ void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants
         setDescendants.insert(it);
         stage.erase(it);
 
-        const setEntries &setChildren = GetMemPoolChildren(it);
-        for (const txiter &childiter : setChildren) {
+        const vecEntries &children = GetMemPoolChildren(it);
+        for (const txiter &childiter : children) {
             if (!setDescendants.count(childiter)) {
                 stage.insert(childiter);
             }
@@ -629,7 +692,7 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
             // happen during chain re-orgs if origTx isn't re-accepted into
             // the mempool for any reason.
             for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+                auto it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
                 txiter nextit = mapTx.find(it->second.ptx->GetHash());
@@ -733,98 +796,103 @@ void CTxMemPool::removeWithAnchor(const uint256 &invalidRoot, ShieldedType type)
     }
 }
 
-void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed)
+/**
+ * Called when a block is connected. Removes the block's transactions from the
+ * mempool, along with the transactions that conflict with them and those that
+ * expire at nBlockHeight, in one pass.
+ */
+MempoolRemovalsForBlock CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight)
 {
-    // Remove transactions which depend on inputs of tx, recursively
-    list<CTransaction> result;
     LOCK(cs);
-    for (const CTxIn &txin : tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
-        if (it != mapNextTx.end()) {
-            const CTransaction &txConflict = *it->second.ptx;
-            if (txConflict != tx)
-            {
-                remove(txConflict, removed, true);
-            }
-        }
+    MempoolRemovalsForBlock removals;
+
+    // The block's transactions leave the mempool without their descendants,
+    // which now spend confirmed outputs.
+    setEntries setConfirmed;
+    for (const CTransaction& tx : vtx) {
+        txiter it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
+            setConfirmed.insert(it);
     }
 
-    for (const JSDescription &joinsplit : tx.vJoinSplit) {
-        for (const uint256 &nf : joinsplit.nullifiers) {
-            std::map<uint256, const CTransaction*>::iterator it = mapSproutNullifiers.find(nf);
-            if (it != mapSproutNullifiers.end()) {
-                const CTransaction &txConflict = *it->second;
-                if (txConflict != tx) {
-                    remove(txConflict, removed, true);
-                }
-            }
+    // Transactions that spend the same outputs or reveal the same nullifiers
+    // as the block's transactions are removed with their descendants. A
+    // descendant shared by several conflicts is only walked once.
+    setEntries setConflicts;
+    auto addConflict = [&](const uint256& conflictHash, const uint256& hash) {
+        if (conflictHash == hash)
+            return;
+        txiter it = mapTx.find(conflictHash);
+        if (it != mapTx.end() && !setConfirmed.count(it))
+            CalculateDescendants(it, setConflicts);
+    };
+    for (const CTransaction& tx : vtx) {
+        const uint256& hash = tx.GetHash();
+        for (const CTxIn& txin : tx.vin) {
+            auto it = mapNextTx.find(txin.prevout);
+            if (it != mapNextTx.end())
+                addConflict(it->second.ptx->GetHash(), hash);
         }
-    }
-    for (const auto& spendDescription : tx.GetSaplingSpends()) {
-        auto it = mapSaplingNullifiers.find(spendDescription.nullifier());
-        if (it != mapSaplingNullifiers.end()) {
-            const CTransaction &txConflict = *it->second;
-            if (txConflict != tx) {
-                remove(txConflict, removed, true);
+        for (const JSDescription& joinsplit : tx.vJoinSplit) {
+            for (const uint256& nf : joinsplit.nullifiers) {
+                auto it = mapSproutNullifiers.find(nf);
+                if (it != mapSproutNullifiers.end())
+                    addConflict(it->second->GetHash(), hash);
             }
         }
-    }
-    for (const uint256 &orchardNullifier : tx.GetOrchardBundle().GetNullifiers()) {
-        std::map<uint256, const CTransaction*>::iterator it = mapOrchardNullifiers.find(orchardNullifier);
-        if (it != mapOrchardNullifiers.end()) {
-            const CTransaction &txConflict = *it->second;
-            if (txConflict != tx) {
-                remove(txConflict, removed, true);
-            }
+        for (const auto& spendDescription : tx.GetSaplingSpends()) {
+            auto it = mapSaplingNullifiers.find(spendDescription.nullifier());
+            if (it != mapSaplingNullifiers.end())
+                addConflict(it->second->GetHash(), hash);
         }
-    }
-}
-
-std::vector<uint256> CTxMemPool::removeExpired(unsigned int nBlockHeight)
-{
-    // Remove expired txs from the mempool
-    LOCK(cs);
-    list<CTransaction> transactionsToRemove;
-    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++)
-    {
-        const CTransaction& tx = it->GetTx();
-        if (IsExpiredTx(tx, nBlockHeight)) {
-            transactionsToRemove.push_back(tx);
+        for (const uint256& orchardNullifier : tx.GetOrchardBundle().GetNullifiers()) {
+            auto it = mapOrchardNullifiers.find(orchardNullifier);
+            if (it != mapOrchardNullifiers.end())
+                addConflict(it->second->GetHash(), hash);
         }
     }
-    std::vector<uint256> ids;
-    for (const CTransaction& tx : transactionsToRemove) {
-        list<CTransaction> removed;
-        remove(tx, removed, true);
-        ids.push_back(tx.GetHash());
-        LogPrint("mempool", "Removing expired txid: %s\n", tx.GetHash().ToString());
+    // A valid block can't confirm a descendant of a conflict, but make sure
+    // that a confirmed transaction is never reported as conflicted.
+    for (txiter it : setConfirmed) {
+        setConflicts.erase(it);
     }
-    return ids;
-}
 
-/**
- * Called when a block is connected. Removes from mempool.
- */
-void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
-                                std::list<CTransaction>& conflicts)
-{
-    LOCK(cs);
-    std::vector<CTxMemPoolEntry> entries;
-    for (const CTransaction& tx : vtx)
-    {
-        uint256 hash = tx.GetHash();
+    // Transactions that expire at this height are removed with their
+    // descendants. See IsExpiredTx.
+    setEntries setExpired;
+    const auto& byExpiry = mapTx.get<expiry_height>();
+    for (auto it = byExpiry.lower_bound(1); it != byExpiry.end() && it->GetTx().nExpiryHeight < nBlockHeight; ++it) {
+        txiter txit = mapTx.project<0>(it);
+        if (setConfirmed.count(txit) || setConflicts.count(txit))
+            continue;
+        removals.expired.push_back(txit->GetTx().GetHash());
+        LogPrint("mempool", "Removing expired txid: %s\n", txit->GetTx().GetHash().ToString());
+        CalculateDescendants(txit, setExpired);
+    }
 
-        indexed_transaction_set::iterator i = mapTx.find(hash);
-        if (i != mapTx.end())
-            entries.push_back(*i);
+    removals.nConfirmed = setConfirmed.size();
+    for (txiter it : setConflicts) {
+        removals.conflicted.push_back(it->GetTx());
     }
-    for (const CTransaction& tx : vtx)
-    {
-        std::list<CTransaction> dummy;
-        remove(tx, dummy, false);
-        removeConflicts(tx, conflicts);
+
+    setEntries setAllRemoves;
+    setAllRemoves.swap(setConfirmed);
+    setAllRemoves.insert(setConflicts.begin(), setConflicts.end());
+    setAllRemoves.insert(setExpired.begin(), setExpired.end());
+    std::vector<uint256> vRemoved;
+    vRemoved.reserve(setAllRemoves.size());
+    for (txiter it : setAllRemoves) {
+        vRemoved.push_back(it->GetTx().GetHash());
+    }
+    RemoveStaged(setAllRemoves);
+    for (const uint256& hash : vRemoved) {
+        limitSet->remove(hash);
+    }
+    for (const CTransaction& tx : vtx) {
         ClearPrioritisation(tx.GetHash());
     }
+
+    return removals;
 }
 
 /**
@@ -851,12 +919,15 @@ void CTxMemPool::removeWithoutBranchId(uint32_t nMemPoolBranchId)
 
 void CTxMemPool::_clear()
 {
+    candidatesPayingConventionalFee = weightedCandidates();
+    candidatesNotPayingConventionalFee = weightedCandidates();
     mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
     ++nTransactionsUpdated;
+    ++nSnapshotSequence;
 }
 
 void CTxMemPool::clear()
@@ -907,19 +978,23 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 assert(coins && coins->IsAvailable(txin.prevout.n));
             }
             // Check whether its inputs are marked in mapNextTx.
-            std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
+            auto it3 = mapNextTx.find(txin.prevout);
             assert(it3 != mapNextTx.end());
             assert(it3->second.ptx == &tx);
             assert(it3->second.n == i);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        assert(setParentCheck.size() == links.parents.size());
+        assert(setParentCheck == setEntries(links.parents.begin(), links.parents.end()));
         // Check children against mapNextTx
         CTxMemPool::setEntries setChildrenCheck;
-        std::map<COutPoint, CInPoint>::const_iterator iter = mapNextTx.lower_bound(COutPoint(it->GetTx().GetHash(), 0));
         int64_t childSizes = 0;
         CAmount childModFee = 0;
-        for (; iter != mapNextTx.end() && iter->first.hash == it->GetTx().GetHash(); ++iter) {
+        for (unsigned int n = 0; n < tx.vout.size(); n++) {
+            auto iter = mapNextTx.find(COutPoint(tx.GetHash(), n));
+            if (iter == mapNextTx.end()) {
+                continue;
+            }
             txiter childit = mapTx.find(iter->second.ptx->GetHash());
             assert(childit != mapTx.end()); // mapNextTx points to in-mempool transactions
             if (setChildrenCheck.insert(childit).second) {
@@ -927,7 +1002,8 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
                 childModFee += childit->GetModifiedFee();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        assert(setChildrenCheck.size() == links.children.size());
+        assert(setChildrenCheck == setEntries(links.children.begin(), links.children.end()));
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         if (!it->IsDirty()) {
@@ -966,7 +1042,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             stepsSinceLastRemove = 0;
         }
     }
-    for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
+    for (auto it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
         indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         const CTransaction& tx = it2->GetTx();
@@ -982,10 +1058,14 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+
+    candidatesPayingConventionalFee.checkInvariants();
+    candidatesNotPayingConventionalFee.checkInvariants();
+    assert(candidatesPayingConventionalFee.size() + candidatesNotPayingConventionalFee.size() == mapTx.size());
 }
 
-template<typename T>
-void CTxMemPool::checkNullifiers(const std::map<T, const CTransaction*>& mapToUse) const
+template<typename Map>
+void CTxMemPool::checkNullifiers(const Map& mapToUse) const
 {
     for (const auto& entry : mapToUse) {
         uint256 hash = entry.second->GetHash();
@@ -1067,6 +1147,53 @@ std::vector<TxMempoolInfo> CTxMemPool::infoAll() const
     return ret;
 }
 
+std::shared_ptr<const CTxMemPoolSnapshot> CTxMemPool::GetSnapshot() const
+{
+    {
+        LOCK(cs_snapshot);
+        if (pSnapshot && pSnapshot->nSequence == nSnapshotSequence.load()) {
+            return pSnapshot;
+        }
+    }
+
+    LOCK(cs);
+    // Another reader may have rebuilt the snapshot while we waited for cs.
+    {
+        LOCK(cs_snapshot);
+        if (pSnapshot && pSnapshot->nSequence == nSnapshotSequence.load()) {
+            return pSnapshot;
+        }
+    }
+
+    auto snapshot = std::make_shared<CTxMemPoolSnapshot>();
+    snapshot->nSequence = nSnapshotSequence.load();
+
+    auto iters = GetSortedDepthAndScore();
+    snapshot->entries.reserve(iters.size());
+    for (auto it : iters) {
+        CTxMemPoolSnapshot::Entry entry;
+        entry.tx = it->GetSharedTx();
+        entry.nTxSize = it->GetTxSize();
+        entry.nFee = it->GetFee();
+        entry.nModifiedFee = it->GetModifiedFee();
+        entry.nTime = it->GetTime();
+        entry.nHeight = it->GetHeight();
+        entry.nCountWithDescendants = it->GetCountWithDescendants();
+        entry.nSizeWithDescendants = it->GetSizeWithDescendants();
+        entry.nModFeesWithDescendants = it->GetModFeesWithDescendants();
+        const vecEntries& parents = GetMemPoolParents(it);
+        entry.vDepends.reserve(parents.size());
+        for (txiter parent : parents) {
+            entry.vDepends.push_back(parent->GetTx().GetHash());
+        }
+        snapshot->entries.push_back(std::move(entry));
+    }
+
+    LOCK(cs_snapshot);
+    pSnapshot = snapshot;
+    return pSnapshot;
+}
+
 std::shared_ptr<const CTransaction> CTxMemPool::get(const uint256& hash) const
 {
     LOCK(cs);
@@ -1093,7 +1220,11 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const std::string str
         delta += nFeeDelta;
         txiter it = mapTx.find(hash);
         if (it != mapTx.end()) {
+            nSnapshotSequence++;
+            // The modified fee determines the weight ratio.
+            RemoveBlockCandidate(it);
             mapTx.modify(it, update_fee_delta(delta));
+            AddBlockCandidate(it);
             // Now update all ancestors' modified fees with descendants
             setEntries setAncestors;
             uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -1110,7 +1241,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const std::string str
 void CTxMemPool::ApplyDelta(const uint256 hash, CAmount &nFeeDelta) const
 {
     LOCK(cs);
-    std::map<uint256, CAmount>::const_iterator pos = mapDeltas.find(hash);
+    auto pos = mapDeltas.find(hash);
     if (pos == mapDeltas.end())
         return;
     const CAmount &delta = pos->second;
@@ -1201,9 +1332,9 @@ size_t CTxMemPool::DynamicMemoryUsage() const {
 
     size_t total = 0;
 
-    // Estimate the overhead of mapTx to be 9 pointers + an allocation, as no exact formula for
+    // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for
     // boost::multi_index_contained is implemented.
-    total += memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 9 * sizeof(void*)) * mapTx.size();
+    total += memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size();
 
     // Three metadata maps inherited from Bitcoin Core
     total += memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks);
@@ -1222,6 +1353,10 @@ size_t CTxMemPool::DynamicMemoryUsage() const {
     // DoS mitigation
     total += memusage::DynamicUsage(recentlyEvicted) + memusage::DynamicUsage(limitSet);
 
+    // ZIP 317 block template candidates
+    total += candidatesPayingConventionalFee.DynamicMemoryUsage() +
+             candidatesNotPayingConventionalFee.DynamicMemoryUsage();
+
     // Insight-related structures
     size_t insight = 0;
     insight += memusage::DynamicUsage(mapAddress);
@@ -1349,27 +1484,48 @@ bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry)
     return addUnchecked(hash, entry, setAncestors);
 }
 
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+void CTxMemPool::AddBlockCandidate(txiter entry)
+{
+    int128_t weightRatio = entry->GetWeightRatio();
+    GetBlockCandidates(weightRatio >= WEIGHT_RATIO_SCALE).add(entry->GetTx().GetHash(), entry, weightRatio);
+}
+
+void CTxMemPool::RemoveBlockCandidate(txiter entry)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    const uint256& hash = entry->GetTx().GetHash();
+    if (!candidatesPayingConventionalFee.remove(hash).has_value()) {
+        candidatesNotPayingConventionalFee.remove(hash);
     }
 }
 
-void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+void CTxMemPool::UpdateLink(vecEntries &links, txiter link, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    auto pos = std::find(links.begin(), links.end(), link);
+    cachedInnerUsage -= memusage::DynamicUsage(links);
+    if (add && pos == links.end()) {
+        links.push_back(link);
+    } else if (!add && pos != links.end()) {
+        *pos = links.back();
+        links.pop_back();
     }
+    cachedInnerUsage += memusage::DynamicUsage(links);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    txlinksMap::iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    UpdateLink(it->second.children, child, add);
+}
+
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+{
+    txlinksMap::iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    UpdateLink(it->second.parents, parent, add);
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -1377,7 +1533,7 @@ const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
     return it->second.parents;
 }
 
-const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPool::vecEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
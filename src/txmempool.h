@@ -7,7 +7,9 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <atomic>
 #include <list>
+#include <map>
 #include <memory>
 #include <set>
 
@@ -28,6 +30,7 @@
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
+#include <boost/unordered/unordered_flat_map.hpp>
 
 class CAutoFile;
 
@@ -167,6 +170,15 @@ struct mempoolentry_txid
     }
 };
 
+struct mempoolentry_expiry_height
+{
+    typedef uint32_t result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().nExpiryHeight;
+    }
+};
+
 /** \class CompareTxMemPoolEntryByDescendantScore
  *
  *  Sort an entry by max(score/size of entry's tx, score/size with all descendants).
@@ -234,6 +246,7 @@ public:
 // Multi_index tag names
 struct descendant_score {};
 struct mining_score {};
+struct expiry_height {};
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
@@ -249,6 +262,26 @@ public:
     size_t DynamicMemoryUsage() const { return 0; }
 };
 
+/** Salted hasher for Sapling nullifiers, which aren't stored as uint256. */
+class SaltedNullifierHasher : private SaltedTxidHasher
+{
+public:
+    size_t operator()(const libzcash::nullifier_t& nf) const {
+        uint256 hash;
+        std::copy(nf.begin(), nf.end(), hash.begin());
+        return SaltedTxidHasher::operator()(hash);
+    }
+};
+
+/** Salted hasher for keys of the mempool's spent index. */
+class SaltedSpentIndexKeyHasher : private SaltedOutpointHasher
+{
+public:
+    size_t operator()(const CSpentIndexKey& key) const {
+        return SaltedOutpointHasher::operator()(COutPoint(key.txid, key.outputIndex));
+    }
+};
+
 /**
  * Information about a mempool transaction.
  */
@@ -264,6 +297,58 @@ struct TxMempoolInfo
     CFeeRate feeRate;
 };
 
+/**
+ * The transactions that CTxMemPool::removeForBlock removed from the mempool
+ * when a block was connected, other than the block's own transactions.
+ */
+struct MempoolRemovalsForBlock
+{
+    /** Number of the block's transactions that were in the mempool. */
+    size_t nConfirmed = 0;
+
+    /** Transactions that conflicted with the block, and their descendants. */
+    std::list<CTransaction> conflicted;
+
+    /**
+     * Transactions that expired at the block's height. Their descendants
+     * were removed as well, but are not listed.
+     */
+    std::vector<uint256> expired;
+};
+
+/**
+ * An immutable copy of the mempool's entries, for readers that walk the whole
+ * mempool (getrawmempool and the REST mempool contents endpoint).
+ *
+ * Snapshots are shared between readers and are only rebuilt, under
+ * CTxMemPool::cs, once the mempool has changed since the last one was taken.
+ * Readers format their results from the snapshot without holding any lock, so
+ * frequent polling doesn't hold up transaction relay or block connection.
+ */
+struct CTxMemPoolSnapshot
+{
+    struct Entry
+    {
+        std::shared_ptr<const CTransaction> tx;
+        size_t nTxSize;
+        CAmount nFee;
+        CAmount nModifiedFee;
+        int64_t nTime;
+        unsigned int nHeight;
+        uint64_t nCountWithDescendants;
+        uint64_t nSizeWithDescendants;
+        CAmount nModFeesWithDescendants;
+        /** Txids of the transaction's in-mempool parents. */
+        std::vector<uint256> vDepends;
+    };
+
+    /** Value of the mempool's change counter when the snapshot was taken. */
+    uint64_t nSequence = 0;
+
+    /** Entries in the order returned by queryHashes. */
+    std::vector<Entry> entries;
+};
+
 /**
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -353,14 +438,20 @@ private:
     uint64_t nRecentlyAddedSequence = 0;
     uint64_t nNotifiedSequence = 0;
 
-    std::map<uint256, const CTransaction*> mapSproutNullifiers;
-    std::map<libzcash::nullifier_t, const CTransaction*> mapSaplingNullifiers;
-    std::map<uint256, const CTransaction*> mapOrchardNullifiers;
+    //! Incremented under cs whenever mapTx or an entry in it changes.
+    std::atomic<uint64_t> nSnapshotSequence{0};
+    //! Guards pSnapshot only; may be locked while holding cs, but not the reverse.
+    mutable CCriticalSection cs_snapshot;
+    mutable std::shared_ptr<const CTxMemPoolSnapshot> pSnapshot;
+
+    boost::unordered_flat_map<uint256, const CTransaction*, SaltedTxidHasher> mapSproutNullifiers;
+    boost::unordered_flat_map<libzcash::nullifier_t, const CTransaction*, SaltedNullifierHasher> mapSaplingNullifiers;
+    boost::unordered_flat_map<uint256, const CTransaction*, SaltedTxidHasher> mapOrchardNullifiers;
     RecentlyEvictedList* recentlyEvicted = new RecentlyEvictedList(GetNodeClock(), DEFAULT_MEMPOOL_EVICTION_MEMORY_MINUTES * 60);
     MempoolLimitTxSet* limitSet = new MempoolLimitTxSet(DEFAULT_MEMPOOL_TOTAL_COST_LIMIT);
 
-    template<typename T>
-    void checkNullifiers(const std::map<T, const CTransaction*>& mapToUse) const;
+    template<typename Map>
+    void checkNullifiers(const Map& mapToUse) const;
 
     CFeeRate minReasonableRelayFee;
 
@@ -381,6 +472,11 @@ public:
                 boost::multi_index::tag<mining_score>,
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByScore
+            >,
+            // sorted by expiry height (for removing expired transactions)
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<expiry_height>,
+                mempoolentry_expiry_height
             >
         >
     > indexed_transaction_set;
@@ -429,38 +525,93 @@ public:
             return a->GetTx().GetHash() < b->GetTx().GetHash();
         }
     };
+    struct SaltedTxiterHasher : private SaltedTxidHasher {
+        size_t operator()(const txiter &it) const {
+            return SaltedTxidHasher::operator()(it->GetTx().GetHash());
+        }
+    };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
+    // Direct parents or children of an entry. These are usually few enough
+    // that a linear search beats a tree lookup.
+    typedef std::vector<txiter> vecEntries;
     typedef std::deque<txiter> queueEntries;
     // Type of a set of candidate transactions to be added to a block template.
     typedef WeightedMap<uint256, txiter, int128_t, GetRandInt128> weightedCandidates;
 
-    const setEntries & GetMemPoolParents(txiter entry) const;
-    const setEntries & GetMemPoolChildren(txiter entry) const;
+    /**
+     * Takes random entries from one of the ZIP 317 candidate sets, and puts
+     * them back when it is destroyed. cs must be held for its whole lifetime.
+     */
+    class CandidateDraw
+    {
+        weightedCandidates& candidates;
+        std::vector<std::tuple<uint256, txiter, int128_t>> taken;
+
+    public:
+        CandidateDraw(weightedCandidates& candidatesIn) : candidates(candidatesIn) {}
+        ~CandidateDraw()
+        {
+            for (const auto& [hash, it, weight] : taken) {
+                candidates.add(hash, it, weight);
+            }
+        }
+
+        bool empty() const { return candidates.empty(); }
+
+        txiter takeRandom()
+        {
+            taken.push_back(candidates.takeRandom().value());
+            return std::get<1>(taken.back());
+        }
+    };
+
+    const vecEntries & GetMemPoolParents(txiter entry) const;
+    const vecEntries & GetMemPoolChildren(txiter entry) const;
+
+    /**
+     * Return the ZIP 317 block template candidates that pay at least the
+     * conventional fee, or those that don't. These are updated as entries are
+     * added, removed and prioritised, so that block templates don't have to
+     * rebuild them from mapTx.
+     */
+    weightedCandidates& GetBlockCandidates(bool fPaysConventionalFee) EXCLUSIVE_LOCKS_REQUIRED(cs)
+    {
+        AssertLockHeld(cs);
+        return fPaysConventionalFee ? candidatesPayingConventionalFee : candidatesNotPayingConventionalFee;
+    }
 private:
-    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    weightedCandidates candidatesPayingConventionalFee;
+    weightedCandidates candidatesNotPayingConventionalFee;
+
+    void AddBlockCandidate(txiter entry);
+    void RemoveBlockCandidate(txiter entry);
+
+    typedef boost::unordered_flat_map<txiter, setEntries, SaltedTxiterHasher> cacheMap;
 
     struct TxLinks {
-        setEntries parents;
-        setEntries children;
+        vecEntries parents;
+        vecEntries children;
     };
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    typedef boost::unordered_flat_map<txiter, TxLinks, SaltedTxiterHasher> txlinksMap;
     txlinksMap mapLinks;
 
+    void UpdateLink(vecEntries &links, txiter link, bool add);
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
     // insightexplorer
+    // mapAddress stays ordered, as getAddressIndex looks up ranges of it.
     std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare> mapAddress;
-    std::map<uint256, std::vector<CMempoolAddressDeltaKey> > mapAddressInserted;
-    std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare> mapSpent;
-    std::map<uint256, std::vector<CSpentIndexKey>> mapSpentInserted;
+    boost::unordered_flat_map<uint256, std::vector<CMempoolAddressDeltaKey>, SaltedTxidHasher> mapAddressInserted;
+    boost::unordered_flat_map<CSpentIndexKey, CSpentIndexValue, SaltedSpentIndexKeyHasher> mapSpent;
+    boost::unordered_flat_map<uint256, std::vector<CSpentIndexKey>, SaltedTxidHasher> mapSpentInserted;
 
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
 public:
-    std::map<COutPoint, CInPoint> mapNextTx;
-    std::map<uint256, CAmount> mapDeltas;
+    boost::unordered_flat_map<COutPoint, CInPoint, SaltedOutpointHasher> mapNextTx;
+    boost::unordered_flat_map<uint256, CAmount, SaltedTxidHasher> mapDeltas;
 
     /** Create a new CTxMemPool.
      *  minReasonableRelayFee should be a feerate which is, roughly, somewhere
@@ -500,10 +651,7 @@ public:
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeWithAnchor(const uint256 &invalidRoot, ShieldedType type);
     void removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight, int flags);
-    void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
-    std::vector<uint256> removeExpired(unsigned int nBlockHeight);
-    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
-                        std::list<CTransaction>& conflicts);
+    MempoolRemovalsForBlock removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight);
     void removeWithoutBranchId(uint32_t nMemPoolBranchId);
     void clear();
     void _clear(); // unlocked
@@ -580,6 +728,13 @@ public:
     TxMempoolInfo info(const uint256& hash) const;
     std::vector<TxMempoolInfo> infoAll() const;
 
+    /**
+     * Return a snapshot of the mempool's entries. This only takes cs, to
+     * rebuild the snapshot, if the mempool has changed since the last one
+     * was taken.
+     */
+    std::shared_ptr<const CTxMemPoolSnapshot> GetSnapshot() const;
+
     size_t DynamicMemoryUsage() const;
 
     void UpdateMetrics() const;
@@ -620,6 +775,11 @@ private:
     void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors);
     /** For each transaction being removed, update ancestors and any direct children. */
     void UpdateForRemoveFromMempool(const setEntries &entriesToRemove);
+    /** Whether all of the in-mempool ancestors of it are in entriesToRemove.
+     *  Results are memoized in cachedStaged, for it and for the ancestors
+     *  walked to find out. */
+    bool AncestorsAllStaged(txiter it, const setEntries &entriesToRemove,
+            std::map<txiter, bool, CompareIteratorByHash> &cachedStaged) const;
     /** Sever link between specified transaction and direct children. */
     void UpdateChildrenForRemoval(txiter entry);
     /** Populate setDescendants with all in-mempool descendants of hash.
@@ -23,6 +23,9 @@ using namespace boost::placeholders;
 
 static CMainSignals g_signals;
 
+CCriticalSection cs_walletNotify;
+CBlockIndex* pindexWalletNotified = nullptr;
+
 static constexpr const char* METRIC_WALLET_SYNCED_HEIGHT = "zcashd.wallet.synced.block.height";
 
 CMainSignals& GetMainSignals()
@@ -123,6 +126,11 @@ void ThreadNotifyWallets(CBlockIndex *pindexLastTip)
         MilliSleep(50);
     }
 
+    {
+        LOCK(cs_walletNotify);
+        pindexWalletNotified = pindexLastTip;
+    }
+
     while (true) {
         // Run the notifier on an integer second in the steady clock.
         auto now = std::chrono::steady_clock::now().time_since_epoch();
@@ -133,6 +141,10 @@ void ThreadNotifyWallets(CBlockIndex *pindexLastTip)
 
         boost::this_thread::interruption_point();
 
+        // Wait for any wallet rescan to finish. A rescan stops at
+        // pindexWalletNotified, so we carry on from where we left off.
+        LOCK(cs_walletNotify);
+
         auto chainParams = Params();
 
         //
@@ -157,6 +169,13 @@ void ThreadNotifyWallets(CBlockIndex *pindexLastTip)
             // Figure out the path from the last block we notified to the
             // current chain tip.
             CBlockIndex *pindex = chainActive.Tip();
+            // Blocks below the base of a chain state snapshot are never
+            // connected to the active chain, so there is nothing to notify
+            // for them.
+            if (pindexSnapshotBase && pindexLastTip->nHeight < pindexSnapshotBase->nHeight &&
+                pindexSnapshotBase->GetAncestor(pindexLastTip->nHeight) == pindexLastTip) {
+                pindexLastTip = pindexSnapshotBase;
+            }
             pindexFork = chainActive.FindFork(pindexLastTip);
 
             // Iterate backwards over the connected blocks until we have at
@@ -549,5 +568,7 @@ void ThreadNotifyWallets(CBlockIndex *pindexLastTip)
                 mempool.SetNotifiedSequence(recentlyAdded.second);
             }
         }
+
+        pindexWalletNotified = pindexLastTip;
     }
 }
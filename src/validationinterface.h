@@ -13,6 +13,7 @@
 #include <boost/shared_ptr.hpp>
 
 #include "miner.h"
+#include "sync.h"
 #include "zcash/IncrementalMerkleTree.hpp"
 
 /**
@@ -166,6 +167,18 @@ struct CMainSignals {
 
 CMainSignals& GetMainSignals();
 
+/**
+ * Held by ThreadNotifyWallets while it notifies wallets of a set of chain
+ * and mempool changes, and by wallet rescans for their whole duration, so
+ * that a block is never applied to a wallet by both. Lock it before cs_main.
+ */
+extern CCriticalSection cs_walletNotify;
+/**
+ * The last block that ThreadNotifyWallets has notified wallets of, or null
+ * if it has not started yet. Guarded by cs_walletNotify.
+ */
+extern CBlockIndex* pindexWalletNotified;
+
 void ThreadNotifyWallets(CBlockIndex *pindexLastTip);
 
 #endif // BITCOIN_VALIDATIONINTERFACE_H
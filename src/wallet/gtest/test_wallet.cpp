@@ -382,6 +382,291 @@ TEST(WalletTests, FindUnspentSproutNotes) {
 }
 
 
+TEST(WalletTests, UnspentTxsIndex) {
+    SelectParams(CBaseChainParams::REGTEST);
+
+    CWallet wallet(Params());
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    ASSERT_TRUE(wallet.AddKeyPubKey(key, key.GetPubKey()));
+
+    // A transaction that pays to the wallet, and one that spends that output
+    // to someone else.
+    CMutableTransaction mtxReceive;
+    mtxReceive.vin.resize(1);
+    mtxReceive.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtxReceive.vout.resize(1);
+    mtxReceive.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    mtxReceive.vout[0].nValue = 5000;
+    CWalletTx wtxReceive(&wallet, mtxReceive);
+
+    CMutableTransaction mtxSpend;
+    mtxSpend.vin.resize(1);
+    mtxSpend.vin[0].prevout = COutPoint(wtxReceive.GetHash(), 0);
+    mtxSpend.vout.resize(1);
+    mtxSpend.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    mtxSpend.vout[0].nValue = 4000;
+    CWalletTx wtxSpend(&wallet, mtxSpend);
+
+    // The spend is mined at height 1.
+    std::vector<CBlockIndex> indices(MAX_REORG_LENGTH + 2);
+    for (size_t i = 0; i < indices.size(); i++) {
+        indices[i].nHeight = i;
+        indices[i].pprev = i > 0 ? &indices[i - 1] : nullptr;
+    }
+    CBlock block;
+    block.vtx.push_back(wtxSpend);
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    auto blockHash = block.GetHash();
+    indices[1].phashBlock = &blockHash;
+    mapBlockIndex.insert(std::make_pair(blockHash, &indices[1]));
+    wtxSpend.SetMerkleBranch(block);
+
+    // The index is built when the wallet is first queried, after both
+    // transactions have been loaded.
+    wallet.LoadWalletTx(wtxReceive);
+    wallet.LoadWalletTx(wtxSpend);
+    chainActive.SetTip(&indices[1]);
+    EXPECT_TRUE(wallet.IsSpent(wtxReceive.GetHash(), 0, std::nullopt));
+    auto vwtx = wallet.GetTxsWithUnspentOutputs(std::nullopt);
+    ASSERT_EQ(1, vwtx.size());
+    EXPECT_EQ(wtxReceive.GetHash(), vwtx[0]->GetHash());
+
+    // Connecting the block queues the spend. While it can still be reorged
+    // out, the transaction it spends is kept.
+    MerkleFrontiers frontiers;
+    wallet.ChainTip(&indices[1], &block, frontiers);
+    chainActive.SetTip(&indices[MAX_REORG_LENGTH]);
+    vwtx = wallet.GetTxsWithUnspentOutputs(std::nullopt);
+    ASSERT_EQ(1, vwtx.size());
+    EXPECT_EQ(wtxReceive.GetHash(), vwtx[0]->GetHash());
+
+    // Once the spend is more than MAX_REORG_LENGTH blocks deep, the queued
+    // spend prunes the received transaction.
+    chainActive.SetTip(&indices[MAX_REORG_LENGTH + 1]);
+    EXPECT_TRUE(wallet.GetTxsWithUnspentOutputs(std::nullopt).empty());
+
+    // As of a height before the spend, the received output was unspent.
+    EXPECT_EQ(2, wallet.GetTxsWithUnspentOutputs(0).size());
+
+    // Disconnecting the block below the pruned height makes the index stale,
+    // and the received output is found again when it is rebuilt.
+    chainActive.SetTip(&indices[0]);
+    wallet.ChainTip(&indices[1], &block, std::nullopt);
+    vwtx = wallet.GetTxsWithUnspentOutputs(std::nullopt);
+    ASSERT_EQ(1, vwtx.size());
+    EXPECT_EQ(wtxReceive.GetHash(), vwtx[0]->GetHash());
+
+    // Tear down
+    chainActive.SetTip(NULL);
+    mapBlockIndex.erase(blockHash);
+}
+
+TEST(WalletTests, BalanceLedger) {
+    SelectParams(CBaseChainParams::REGTEST);
+
+    CWallet wallet(Params());
+    LOCK2(cs_main, wallet.cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    ASSERT_TRUE(wallet.AddKeyPubKey(key, key.GetPubKey()));
+
+    // Two transactions that pay to the wallet, and one that spends the output
+    // of the first to someone else.
+    auto receive = [&](CAmount nValue) {
+        CMutableTransaction mtx;
+        mtx.vin.resize(1);
+        mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        mtx.vout.resize(1);
+        mtx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+        mtx.vout[0].nValue = nValue;
+        return CWalletTx(&wallet, mtx);
+    };
+    CWalletTx wtxSpent = receive(5000);
+    CWalletTx wtxUnspent = receive(3000);
+
+    CMutableTransaction mtxSpend;
+    mtxSpend.vin.resize(1);
+    mtxSpend.vin[0].prevout = COutPoint(wtxSpent.GetHash(), 0);
+    mtxSpend.vout.resize(1);
+    mtxSpend.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    mtxSpend.vout[0].nValue = 4000;
+    CWalletTx wtxSpend(&wallet, mtxSpend);
+
+    // The received transactions are mined at height 1, and the spend at
+    // height 2.
+    std::vector<CBlockIndex> indices(MAX_REORG_LENGTH + COINBASE_MATURITY + 3);
+    for (size_t i = 0; i < indices.size(); i++) {
+        indices[i].nHeight = i;
+        indices[i].pprev = i > 0 ? &indices[i - 1] : nullptr;
+    }
+    CBlock block1;
+    block1.vtx.push_back(wtxSpent);
+    block1.vtx.push_back(wtxUnspent);
+    block1.hashMerkleRoot = BlockMerkleRoot(block1);
+    auto blockHash1 = block1.GetHash();
+    indices[1].phashBlock = &blockHash1;
+    mapBlockIndex.insert(std::make_pair(blockHash1, &indices[1]));
+    wtxSpent.SetMerkleBranch(block1);
+    wtxUnspent.SetMerkleBranch(block1);
+
+    CBlock block2;
+    block2.vtx.push_back(wtxSpend);
+    block2.hashPrevBlock = blockHash1;
+    block2.hashMerkleRoot = BlockMerkleRoot(block2);
+    auto blockHash2 = block2.GetHash();
+    indices[2].phashBlock = &blockHash2;
+    mapBlockIndex.insert(std::make_pair(blockHash2, &indices[2]));
+    wtxSpend.SetMerkleBranch(block2);
+
+    wallet.LoadWalletTx(wtxSpent);
+    wallet.LoadWalletTx(wtxUnspent);
+    wallet.LoadWalletTx(wtxSpend);
+    chainActive.SetTip(&indices[2]);
+
+    // Only the unspent output is counted, and only at depths it has reached.
+    EXPECT_EQ(3000, wallet.GetBalance(std::nullopt));
+    EXPECT_EQ(3000, wallet.GetBalance(std::nullopt, ISMINE_SPENDABLE, 2));
+    EXPECT_EQ(0, wallet.GetBalance(std::nullopt, ISMINE_SPENDABLE, 3));
+    EXPECT_EQ(3000, wallet.GetAvailableTransparentBalance(1, false));
+    EXPECT_EQ(0, wallet.GetAvailableTransparentBalance(3, false));
+
+    // Once the spend is more than MAX_REORG_LENGTH blocks deep, the spent
+    // transaction leaves the unspent index, and the totals are unchanged.
+    MerkleFrontiers frontiers;
+    wallet.ChainTip(&indices[2], &block2, frontiers);
+    chainActive.SetTip(&indices[MAX_REORG_LENGTH + 2]);
+    auto vwtx = wallet.GetTxsWithUnspentOutputs(std::nullopt);
+    ASSERT_EQ(1, vwtx.size());
+    EXPECT_EQ(wtxUnspent.GetHash(), vwtx[0]->GetHash());
+    EXPECT_EQ(3000, wallet.GetBalance(std::nullopt));
+    EXPECT_EQ(3000, wallet.GetAvailableTransparentBalance(1, false));
+
+    // Adding a key makes the ledger stale, and rebuilding it from the unspent
+    // index gives the same totals.
+    CKey key2;
+    key2.MakeNewKey(true);
+    ASSERT_TRUE(wallet.AddKeyPubKey(key2, key2.GetPubKey()));
+    EXPECT_EQ(3000, wallet.GetBalance(std::nullopt));
+    EXPECT_EQ(3000, wallet.GetAvailableTransparentBalance(1, false));
+    EXPECT_EQ(1, wallet.GetTxsWithUnspentOutputs(std::nullopt).size());
+
+    // Locked coins are only left out of the available balance.
+    COutPoint outpoint(wtxUnspent.GetHash(), 0);
+    wallet.LockCoin(outpoint);
+    EXPECT_EQ(3000, wallet.GetBalance(std::nullopt));
+    EXPECT_EQ(0, wallet.GetAvailableTransparentBalance(1, false));
+    wallet.UnlockCoin(outpoint);
+    EXPECT_EQ(3000, wallet.GetAvailableTransparentBalance(1, false));
+
+    // In each of the cases below, the balances from the ledger match those
+    // from scanning the wallet's transactions, as GetBalance and the
+    // available balance were computed before the ledger.
+    auto scanBalance = [&](int nMinDepth) {
+        CAmount nTotal = 0;
+        for (const auto& [_, wtx] : wallet.mapWallet) {
+            if (wtx.IsTrusted(std::nullopt) && wtx.GetDepthInMainChain(std::nullopt) >= nMinDepth)
+                nTotal += wtx.GetAvailableCredit(std::nullopt, true, ISMINE_SPENDABLE);
+        }
+        return nTotal;
+    };
+    auto scanAvailable = [&](int nMinDepth) {
+        std::vector<COutput> vecOutputs;
+        wallet.AvailableCoins(vecOutputs, std::nullopt, false, NULL, true);
+        CAmount nTotal = 0;
+        for (const COutput& out : vecOutputs) {
+            if (out.nDepth >= nMinDepth && out.fSpendable)
+                nTotal += out.Value();
+        }
+        return nTotal;
+    };
+    auto expectMatchesScan = [&]() {
+        for (int nMinDepth : {0, 1, 2}) {
+            EXPECT_EQ(scanBalance(nMinDepth), wallet.GetBalance(std::nullopt, ISMINE_SPENDABLE, nMinDepth))
+                << "minimum depth " << nMinDepth;
+            EXPECT_EQ(scanAvailable(nMinDepth), wallet.GetAvailableTransparentBalance(nMinDepth, false))
+                << "minimum depth " << nMinDepth;
+        }
+    };
+    expectMatchesScan();
+
+    // A spend of the settled output that is still in the mempool, with
+    // change back to the wallet.
+    CMutableTransaction mtxMempool;
+    mtxMempool.vin.resize(1);
+    mtxMempool.vin[0].prevout = outpoint;
+    mtxMempool.vout.resize(2);
+    mtxMempool.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    mtxMempool.vout[0].nValue = 1000;
+    mtxMempool.vout[1].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    mtxMempool.vout[1].nValue = 1500;
+    CWalletTx wtxMempool(&wallet, mtxMempool);
+    mempool.addUnchecked(wtxMempool.GetHash(), CTxMemPoolEntry(wtxMempool, 500, 0, 0, false, false, 0, 0));
+    wallet.LoadWalletTx(wtxMempool);
+    expectMatchesScan();
+    EXPECT_EQ(1500, wallet.GetBalance(std::nullopt, ISMINE_SPENDABLE, 0));
+    EXPECT_EQ(0, wallet.GetBalance(std::nullopt));
+
+    // A locked coin, here the unconfirmed change.
+    COutPoint changeOutpoint(wtxMempool.GetHash(), 1);
+    wallet.LockCoin(changeOutpoint);
+    expectMatchesScan();
+    EXPECT_EQ(0, wallet.GetAvailableTransparentBalance(0, false));
+    wallet.UnlockCoin(changeOutpoint);
+
+    // Once the spend leaves the mempool, the settled output is available
+    // again.
+    mempool.clear();
+    expectMatchesScan();
+    EXPECT_EQ(3000, wallet.GetBalance(std::nullopt));
+
+    // An immature coinbase output is counted once it matures.
+    int nCoinbaseHeight = MAX_REORG_LENGTH + 2;
+    CMutableTransaction mtxCoinbase;
+    mtxCoinbase.vin.resize(1);
+    mtxCoinbase.vin[0].prevout.SetNull();
+    mtxCoinbase.vin[0].scriptSig = CScript() << nCoinbaseHeight << OP_0;
+    mtxCoinbase.vout.resize(1);
+    mtxCoinbase.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    mtxCoinbase.vout[0].nValue = 7000;
+    CWalletTx wtxCoinbase(&wallet, mtxCoinbase);
+    ASSERT_TRUE(wtxCoinbase.IsCoinBase());
+    CBlock blockCoinbase;
+    blockCoinbase.vtx.push_back(wtxCoinbase);
+    blockCoinbase.hashMerkleRoot = BlockMerkleRoot(blockCoinbase);
+    auto blockHashCoinbase = blockCoinbase.GetHash();
+    indices[nCoinbaseHeight].phashBlock = &blockHashCoinbase;
+    mapBlockIndex.insert(std::make_pair(blockHashCoinbase, &indices[nCoinbaseHeight]));
+    wtxCoinbase.SetMerkleBranch(blockCoinbase);
+    wallet.LoadWalletTx(wtxCoinbase);
+    expectMatchesScan();
+    EXPECT_EQ(3000, wallet.GetBalance(std::nullopt));
+    EXPECT_EQ(7000, wallet.GetImmatureBalance(std::nullopt));
+
+    chainActive.SetTip(&indices[nCoinbaseHeight + COINBASE_MATURITY]);
+    expectMatchesScan();
+    EXPECT_EQ(10000, wallet.GetBalance(std::nullopt));
+    EXPECT_EQ(0, wallet.GetImmatureBalance(std::nullopt));
+
+    // A reorg below the block that the ledger was last brought up to date at
+    // leaves nothing mined, and reconnecting the blocks restores the totals.
+    chainActive.SetTip(&indices[0]);
+    expectMatchesScan();
+    EXPECT_EQ(0, wallet.GetBalance(std::nullopt, ISMINE_SPENDABLE, 0));
+    chainActive.SetTip(&indices[nCoinbaseHeight + COINBASE_MATURITY]);
+    expectMatchesScan();
+    EXPECT_EQ(10000, wallet.GetBalance(std::nullopt));
+
+    // Tear down
+    chainActive.SetTip(NULL);
+    mapBlockIndex.erase(blockHash1);
+    mapBlockIndex.erase(blockHash2);
+    mapBlockIndex.erase(blockHashCoinbase);
+}
+
 TEST(WalletTests, SetSproutNoteAddrsInCWalletTx) {
     auto sk = libzcash::SproutSpendingKey::random();
     auto wtx = GetValidSproutReceive(sk, 10, true);
@@ -3131,6 +3131,9 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
         } else if (benchmarktype == "trydecryptsaplingnotes") {
             int nKeys = params[2].get_int();
             sample_times.push_back(benchmark_try_decrypt_sapling_notes(nKeys));
+        } else if (benchmarktype == "batchscansaplingnotes") {
+            int nKeys = params[2].get_int();
+            sample_times.push_back(benchmark_batch_scan_sapling_notes(nKeys));
         } else if (benchmarktype == "incnotewitnesses") {
             int nTxs = params[2].get_int();
             sample_times.push_back(benchmark_increment_sprout_note_witnesses(nTxs));
@@ -3634,6 +3637,10 @@ CAmount getBalanceTaddr(const std::optional<CTxDestination>& taddr, const std::o
 
     LOCK2(cs_main, pwalletMain->cs_wallet);
 
+    if (!taddr.has_value() && !asOfHeight.has_value()) {
+        return pwalletMain->GetAvailableTransparentBalance(minDepth, !ignoreUnspendable);
+    }
+
     pwalletMain->AvailableCoins(vecOutputs, asOfHeight, false, NULL, true);
     for (const COutput& out : vecOutputs) {
         if (out.nDepth < minDepth) {
@@ -3668,6 +3675,10 @@ CAmount getBalanceZaddr(std::optional<libzcash::PaymentAddress> address, const s
     std::vector<OrchardNoteMetadata> orchardEntries;
     LOCK2(cs_main, pwalletMain->cs_wallet);
 
+    if (!address.has_value() && !asOfHeight.has_value() && maxDepth == INT_MAX) {
+        return pwalletMain->GetAvailableShieldedBalance(minDepth, !ignoreUnspendable);
+    }
+
     std::optional<NoteFilter> noteFilter = std::nullopt;
     if (address.has_value()) {
         noteFilter = NoteFilter::ForPaymentAddresses(std::vector({address.value()}));
@@ -4205,21 +4216,28 @@ UniValue z_getbalanceforaccount(const UniValue& params, bool fHelp)
             tfm::format("Error: account %d has not been generated by z_getnewaccount.", account));
     }
 
-    auto spendableInputs = pwalletMain->FindSpendableInputs(selector.value(), minconf, asOfHeight);
-    // Accounts never contain Sprout notes.
-    assert(spendableInputs.sproutNoteEntries.empty());
-
     CAmount transparentBalance = 0;
     CAmount saplingBalance = 0;
     CAmount orchardBalance = 0;
-    for (const auto& t : spendableInputs.utxos) {
-        transparentBalance += t.Value();
-    }
-    for (const auto& t : spendableInputs.saplingNoteEntries) {
-        saplingBalance += t.note.value();
-    }
-    for (const auto& t : spendableInputs.orchardNoteMetadata) {
-        orchardBalance += t.GetNoteValue();
+    if (!asOfHeight.has_value()) {
+        auto balances = pwalletMain->GetBalanceForAccount(selector.value(), minconf);
+        transparentBalance = balances[libzcash::OutputPool::Transparent];
+        saplingBalance = balances[libzcash::OutputPool::Sapling];
+        orchardBalance = balances[libzcash::OutputPool::Orchard];
+    } else {
+        auto spendableInputs = pwalletMain->FindSpendableInputs(selector.value(), minconf, asOfHeight);
+        // Accounts never contain Sprout notes.
+        assert(spendableInputs.sproutNoteEntries.empty());
+
+        for (const auto& t : spendableInputs.utxos) {
+            transparentBalance += t.Value();
+        }
+        for (const auto& t : spendableInputs.saplingNoteEntries) {
+            saplingBalance += t.note.value();
+        }
+        for (const auto& t : spendableInputs.orchardNoteMetadata) {
+            orchardBalance += t.GetNoteValue();
+        }
     }
 
     UniValue pools(UniValue::VOBJ);
@@ -36,7 +36,11 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <numeric>
+#include <thread>
 #include <variant>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -193,6 +197,7 @@ bool CWallet::AddSaplingZKey(const libzcash::SaplingExtendedSpendingKey &sk)
     if (!CCryptoKeyStore::AddSaplingSpendingKey(sk)) {
         return false;
     }
+    fBalanceLedgerStale = true;
 
     if (!fFileBacked) {
         return true;
@@ -213,6 +218,7 @@ bool CWallet::AddSaplingFullViewingKey(const libzcash::SaplingExtendedFullViewin
     if (!CCryptoKeyStore::AddSaplingFullViewingKey(extfvk)) {
         return false;
     }
+    fBalanceLedgerStale = true;
 
     if (!fFileBacked) {
         return true;
@@ -231,6 +237,7 @@ bool CWallet::AddSaplingPaymentAddress(
     if (!CCryptoKeyStore::AddSaplingPaymentAddress(ivk, addr)) {
         return false;
     }
+    fBalanceLedgerStale = true;
 
     if (!fFileBacked) {
         return true;
@@ -313,6 +320,7 @@ bool CWallet::AddSproutZKey(const libzcash::SproutSpendingKey &key)
 
     if (!CCryptoKeyStore::AddSproutSpendingKey(key))
         return false;
+    fBalanceLedgerStale = true;
 
     // check if we need to remove from viewing keys
     if (HaveSproutViewingKey(addr))
@@ -393,6 +401,7 @@ bool CWallet::AddKeyPubKey(
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    fUnspentTxsStale = true;
 
     // check if we need to remove from watch-only
     CScript script;
@@ -421,6 +430,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    fUnspentTxsStale = true;
     if (!fFileBacked)
         return true;
     {
@@ -445,6 +455,7 @@ bool CWallet::AddCryptedSproutSpendingKey(
 {
     if (!CCryptoKeyStore::AddCryptedSproutSpendingKey(address, rk, vchCryptedSecret))
         return false;
+    fBalanceLedgerStale = true;
     if (!fFileBacked)
         return true;
     {
@@ -469,6 +480,7 @@ bool CWallet::AddCryptedSaplingSpendingKey(const libzcash::SaplingExtendedFullVi
 {
     if (!CCryptoKeyStore::AddCryptedSaplingSpendingKey(extfvk, vchCryptedSecret))
         return false;
+    fBalanceLedgerStale = true;
     if (!fFileBacked)
         return true;
     {
@@ -624,6 +636,7 @@ std::optional<libzcash::ZcashdUnifiedSpendingKey>
         if (!CCryptoKeyStore::AddUnifiedFullViewingKey(zufvk)) {
             throw std::runtime_error("CWalletDB::GenerateUnifiedSpendingKeyForAccount(): Failed to add UFVK to the keystore.");
         }
+        fBalanceLedgerStale = true;
 
         if (fFileBacked) {
             auto walletdb = CWalletDB(strWalletFile);
@@ -649,6 +662,7 @@ bool CWallet::AddUnifiedFullViewingKey(const libzcash::UnifiedFullViewingKey &uf
     if (!CCryptoKeyStore::AddUnifiedFullViewingKey(zufvk)) {
         return false;
     }
+    fBalanceLedgerStale = true;
 
     if (!fFileBacked) {
         return true;
@@ -794,6 +808,7 @@ WalletUAGenerationResult CWallet::GenerateUnifiedAddress(
                     ufvkid, address.second, address.first
                 )
             );
+            fBalanceLedgerStale = true;
         }
 
         // If the address has a Sapling component, add an association between
@@ -1185,6 +1200,7 @@ void CWallet::LoadZKeyMetadata(const SproutPaymentAddress &addr, const CKeyMetad
 
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
+    fUnspentTxsStale = true;
     return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
 }
 
@@ -1264,6 +1280,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    fUnspentTxsStale = true;
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -1283,6 +1300,7 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
         return true;
     }
 
+    fUnspentTxsStale = true;
     return CCryptoKeyStore::AddCScript(redeemScript);
 }
 
@@ -1290,6 +1308,7 @@ bool CWallet::AddWatchOnly(const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    fUnspentTxsStale = true;
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
@@ -1313,6 +1332,7 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
 
 bool CWallet::LoadWatchOnly(const CScript &dest)
 {
+    fUnspentTxsStale = true;
     return CCryptoKeyStore::AddWatchOnly(dest);
 }
 
@@ -1448,6 +1468,7 @@ void CWallet::ChainTip(const CBlockIndex *pindex,
         DecrementNoteWitnesses(consensus, pindex);
         UpdateSaplingNullifierNoteMapForBlock(pblock);
     }
+    UpdateUnspentTxsForBlock(pindex, pblock, added.has_value());
 
     auto hash = tfm::format("%s", pindex->GetBlockHash().ToString());
     auto height = tfm::format("%d", pindex->nHeight);
@@ -2250,7 +2271,9 @@ SpendableInputs CWallet::FindSpendableInputs(
     bool selectOrchard{selector.SelectsOrchard()};
 
     SpendableInputs unspent;
-    for (auto const& [wtxid, wtx] : mapWallet) {
+    for (const CWalletTx* pwtx : GetTxsWithUnspentOutputs(asOfHeight)) {
+        const CWalletTx& wtx = *pwtx;
+        const uint256& wtxid = wtx.GetHash();
         bool isCoinbase = wtx.IsCoinBase();
         auto nDepth = wtx.GetDepthInMainChain(asOfHeight);
 
@@ -2387,70 +2410,88 @@ SpendableInputs CWallet::FindSpendableInputs(
     }
 
     if (selectOrchard) {
-        // for Orchard, we select both the internal and external IVKs.
-        auto orchardIvks = examine(selector.GetPattern(), match {
-            [&](const libzcash::UnifiedAddress& selectorUA) -> std::vector<OrchardIncomingViewingKey> {
-                auto orchardReceiver = selectorUA.GetOrchardReceiver();
-                if (orchardReceiver.has_value()) {
-                    auto meta = GetUFVKMetadataForReceiver(orchardReceiver.value());
-                    if (meta.has_value()) {
-                        auto ufvk = GetUnifiedFullViewingKey(meta.value().GetUFVKId());
-                        if (ufvk.has_value()) {
-                            auto fvk = ufvk->GetOrchardKey();
-                            if (fvk.has_value()) {
-                                return {fvk->ToIncomingViewingKey(), fvk->ToInternalIncomingViewingKey()};
-                            }
+        unspent.orchardNoteMetadata = FindSpendableOrchardNotes(selector, minDepth, asOfHeight);
+    }
+
+    return unspent;
+}
+
+/**
+ * The Orchard part of FindSpendableInputs. Orchard notes are found through
+ * the Orchard wallet, rather than by visiting wallet transactions.
+ */
+std::vector<OrchardNoteMetadata> CWallet::FindSpendableOrchardNotes(
+        const ZTXOSelector& selector,
+        uint32_t minDepth,
+        const std::optional<int>& asOfHeight) const {
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    std::vector<OrchardNoteMetadata> orchardNotes;
+
+    // for Orchard, we select both the internal and external IVKs.
+    auto orchardIvks = examine(selector.GetPattern(), match {
+        [&](const libzcash::UnifiedAddress& selectorUA) -> std::vector<OrchardIncomingViewingKey> {
+            auto orchardReceiver = selectorUA.GetOrchardReceiver();
+            if (orchardReceiver.has_value()) {
+                auto meta = GetUFVKMetadataForReceiver(orchardReceiver.value());
+                if (meta.has_value()) {
+                    auto ufvk = GetUnifiedFullViewingKey(meta.value().GetUFVKId());
+                    if (ufvk.has_value()) {
+                        auto fvk = ufvk->GetOrchardKey();
+                        if (fvk.has_value()) {
+                            return {fvk->ToIncomingViewingKey(), fvk->ToInternalIncomingViewingKey()};
                         }
                     }
                 }
-                return {};
-            },
-            [&](const libzcash::UnifiedFullViewingKey& ufvk) -> std::vector<OrchardIncomingViewingKey> {
-                auto fvk = ufvk.GetOrchardKey();
+            }
+            return {};
+        },
+        [&](const libzcash::UnifiedFullViewingKey& ufvk) -> std::vector<OrchardIncomingViewingKey> {
+            auto fvk = ufvk.GetOrchardKey();
+            if (fvk.has_value()) {
+                return {fvk->ToIncomingViewingKey(), fvk->ToInternalIncomingViewingKey()};
+            }
+            return {};
+        },
+        [&](const AccountZTXOPattern& acct) -> std::vector<OrchardIncomingViewingKey> {
+            auto ufvk = GetUnifiedFullViewingKeyByAccount(acct.GetAccountId());
+            if (ufvk.has_value()) {
+                auto fvk = ufvk->GetOrchardKey();
                 if (fvk.has_value()) {
                     return {fvk->ToIncomingViewingKey(), fvk->ToInternalIncomingViewingKey()};
                 }
-                return {};
-            },
-            [&](const AccountZTXOPattern& acct) -> std::vector<OrchardIncomingViewingKey> {
-                auto ufvk = GetUnifiedFullViewingKeyByAccount(acct.GetAccountId());
-                if (ufvk.has_value()) {
-                    auto fvk = ufvk->GetOrchardKey();
-                    if (fvk.has_value()) {
-                        return {fvk->ToIncomingViewingKey(), fvk->ToInternalIncomingViewingKey()};
-                    }
-                }
-                return {};
-            },
-            [&](const auto& addr) -> std::vector<OrchardIncomingViewingKey> { return {}; }
-        });
+            }
+            return {};
+        },
+        [&](const auto& addr) -> std::vector<OrchardIncomingViewingKey> { return {}; }
+    });
 
-        for (const auto& ivk : orchardIvks) {
-            std::vector<OrchardNoteMetadata> incomingNotes;
-            orchardWallet.GetFilteredNotes(incomingNotes, ivk, true, true);
+    for (const auto& ivk : orchardIvks) {
+        std::vector<OrchardNoteMetadata> incomingNotes;
+        orchardWallet.GetFilteredNotes(incomingNotes, ivk, true, true);
 
-            for (auto& noteMeta : incomingNotes) {
-                if (IsOrchardSpent(noteMeta.GetOutPoint(), asOfHeight)) {
-                    continue;
-                }
+        for (auto& noteMeta : incomingNotes) {
+            if (IsOrchardSpent(noteMeta.GetOutPoint(), asOfHeight)) {
+                continue;
+            }
 
-                auto mit = mapWallet.find(noteMeta.GetOutPoint().hash);
+            auto mit = mapWallet.find(noteMeta.GetOutPoint().hash);
 
-                // We should never get an outpoint from the Orchard wallet where
-                // the transaction does not exist in the main wallet.
-                assert(mit != mapWallet.end());
+            // We should never get an outpoint from the Orchard wallet where
+            // the transaction does not exist in the main wallet.
+            assert(mit != mapWallet.end());
 
-                int confirmations = mit->second.GetDepthInMainChain(asOfHeight);
-                if (confirmations < 0) continue;
-                if (confirmations >= minDepth) {
-                    noteMeta.SetConfirmations(confirmations);
-                    unspent.orchardNoteMetadata.push_back(noteMeta);
-                }
+            int confirmations = mit->second.GetDepthInMainChain(asOfHeight);
+            if (confirmations < 0) continue;
+            if (confirmations >= minDepth) {
+                noteMeta.SetConfirmations(confirmations);
+                orchardNotes.push_back(noteMeta);
             }
         }
     }
 
-    return unspent;
+    return orchardNotes;
 }
 
 /**
@@ -2518,6 +2559,536 @@ bool CWallet::IsOrchardSpent(const OrchardOutPoint& outpoint, const std::optiona
     return false;
 }
 
+/**
+ * Returns the height of a wallet transaction that spends `spent` and is too
+ * deep in the main chain to be reorged out, if there is one.
+ */
+template <class T>
+std::optional<int> CWallet::GetIrreversibleSpendHeight(const TxSpendMap<T>& spends, const T& spent) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    auto range = spends.equal_range(spent);
+    for (auto it = range.first; it != range.second; ++it) {
+        auto mit = mapWallet.find(it->second);
+        if (mit == mapWallet.end()) continue;
+        const CBlockIndex* pindex = nullptr;
+        if (mit->second.GetDepthInMainChain(pindex, std::nullopt) > (int)MAX_REORG_LENGTH) {
+            return pindex->nHeight;
+        }
+    }
+    return std::nullopt;
+}
+
+/**
+ * Returns true if every transparent output, Sprout note and Sapling note
+ * that the transaction pays to the wallet has been irreversibly spent, and
+ * sets nSpendHeightRet to the height of the last of those spends.
+ */
+bool CWallet::IsIrreversiblySpent(const CWalletTx& wtx, int& nSpendHeightRet) const
+{
+    nSpendHeightRet = 0;
+    auto spentAt = [&](std::optional<int> nHeight) {
+        if (!nHeight.has_value()) return false;
+        nSpendHeightRet = std::max(nSpendHeightRet, nHeight.value());
+        return true;
+    };
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO) continue;
+        if (!spentAt(GetIrreversibleSpendHeight(mapTxSpends, COutPoint(wtx.GetHash(), i)))) return false;
+    }
+    // Notes whose nullifiers we don't know can't be shown to be spent.
+    for (const auto& [jsop, nd] : wtx.mapSproutNoteData) {
+        if (!nd.nullifier.has_value()) return false;
+        if (!spentAt(GetIrreversibleSpendHeight(mapTxSproutNullifiers, nd.nullifier.value()))) return false;
+    }
+    for (const auto& [op, nd] : wtx.mapSaplingNoteData) {
+        if (!nd.nullifier.has_value()) return false;
+        if (!spentAt(GetIrreversibleSpendHeight(mapTxSaplingNullifiers, nd.nullifier.value()))) return false;
+    }
+    return true;
+}
+
+void CWallet::RebuildUnspentTxs() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    int64_t nStart = GetTimeMillis();
+    setUnspentTxs.clear();
+    setUnspentTxsToRecheck.clear();
+    nUnspentTxsPrunedHeight = 0;
+    for (const auto& [wtxid, wtx] : mapWallet) {
+        int nSpendHeight;
+        if (IsIrreversiblySpent(wtx, nSpendHeight)) {
+            nUnspentTxsPrunedHeight = std::max(nUnspentTxsPrunedHeight, nSpendHeight);
+        } else {
+            setUnspentTxs.insert(setUnspentTxs.end(), wtxid);
+        }
+    }
+    fUnspentTxsStale = false;
+    // Whatever made the index stale may also have changed which outputs
+    // belong to the wallet.
+    fBalanceLedgerStale = true;
+
+    LogPrint("wallet", "Indexed %u of %u wallet transactions as possibly unspent in %dms\n",
+        setUnspentTxs.size(), mapWallet.size(), GetTimeMillis() - nStart);
+}
+
+void CWallet::UpdateUnspentTxsForBlock(const CBlockIndex* pindex, const CBlock* pblock, bool fConnected)
+{
+    // This doesn't take cs_main, so that the time taken to sync the wallet
+    // isn't observable by peers; the transactions are checked for spends in
+    // PruneUnspentTxs instead, which runs as part of wallet queries.
+    LOCK(cs_wallet);
+
+    if (!fConnected) {
+        // The wallet transactions in the disconnected block no longer spend
+        // anything, and if an irreversible spend has been disconnected after
+        // all, the transactions it spent have to be found again.
+        mapUnspentTxsPruneQueue.erase(
+            mapUnspentTxsPruneQueue.lower_bound(pindex->nHeight),
+            mapUnspentTxsPruneQueue.end());
+        if (pindex->nHeight <= nUnspentTxsPrunedHeight) {
+            fUnspentTxsStale = true;
+        }
+        return;
+    }
+
+    for (const CTransaction& tx : pblock->vtx) {
+        if (mapWallet.count(tx.GetHash())) {
+            mapUnspentTxsPruneQueue.emplace(pindex->nHeight, tx.GetHash());
+        }
+    }
+}
+
+/**
+ * Adds the wallet transactions whose transparent outputs, Sprout notes or
+ * Sapling notes wtx spends to setTxidsRet.
+ */
+void CWallet::GetTxsSpentBy(const CWalletTx& wtx, std::set<uint256>& setTxidsRet) const
+{
+    for (const CTxIn& txin : wtx.vin) {
+        setTxidsRet.insert(txin.prevout.hash);
+    }
+    for (const JSDescription& jsdesc : wtx.vJoinSplit) {
+        for (const uint256& nullifier : jsdesc.nullifiers) {
+            auto nit = mapSproutNullifiersToNotes.find(nullifier);
+            if (nit != mapSproutNullifiersToNotes.end()) {
+                setTxidsRet.insert(nit->second.hash);
+            }
+        }
+    }
+    for (const auto& spend : wtx.GetSaplingSpends()) {
+        auto nit = mapSaplingNullifiersToNotes.find(spend.nullifier());
+        if (nit != mapSaplingNullifiersToNotes.end()) {
+            setTxidsRet.insert(nit->second.hash);
+        }
+    }
+}
+
+void CWallet::PruneUnspentTxs() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    std::set<uint256> setSpentTxs;
+
+    // Wallet transactions that are now too deep to be reorged out may have
+    // spent the last unspent outputs of the transactions they spend.
+    auto itEnd = mapUnspentTxsPruneQueue.upper_bound(chainActive.Height() - (int)MAX_REORG_LENGTH - 1);
+    for (auto it = mapUnspentTxsPruneQueue.begin(); it != itEnd; ++it) {
+        auto mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end()) {
+            GetTxsSpentBy(mit->second, setSpentTxs);
+        }
+    }
+    mapUnspentTxsPruneQueue.erase(mapUnspentTxsPruneQueue.begin(), itEnd);
+
+    // Transactions that AddToWallet put back into the set may have been
+    // spent already, as may the ones they spend.
+    for (const uint256& txid : setUnspentTxsToRecheck) {
+        auto mit = mapWallet.find(txid);
+        if (mit != mapWallet.end()) {
+            setSpentTxs.insert(txid);
+            GetTxsSpentBy(mit->second, setSpentTxs);
+        }
+    }
+    setUnspentTxsToRecheck.clear();
+
+    for (const uint256& txid : setSpentTxs) {
+        auto sit = setUnspentTxs.find(txid);
+        if (sit == setUnspentTxs.end()) continue;
+        auto mit = mapWallet.find(txid);
+        int nSpendHeight;
+        if (mit == mapWallet.end()) {
+            setUnspentTxs.erase(sit);
+        } else if (IsIrreversiblySpent(mit->second, nSpendHeight)) {
+            setUnspentTxs.erase(sit);
+            nUnspentTxsPrunedHeight = std::max(nUnspentTxsPrunedHeight, nSpendHeight);
+        }
+    }
+}
+
+std::vector<const CWalletTx*> CWallet::GetTxsWithUnspentOutputs(const std::optional<int>& asOfHeight) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (fUnspentTxsStale) {
+        RebuildUnspentTxs();
+    }
+    PruneUnspentTxs();
+
+    std::vector<const CWalletTx*> vwtx;
+    if (asOfHeight.has_value() && asOfHeight.value() < nUnspentTxsPrunedHeight) {
+        // Some of the transactions that have been dropped were unspent as of
+        // asOfHeight.
+        vwtx.reserve(mapWallet.size());
+        for (const auto& [wtxid, wtx] : mapWallet) {
+            vwtx.push_back(&wtx);
+        }
+        return vwtx;
+    }
+
+    vwtx.reserve(setUnspentTxs.size());
+    for (const uint256& wtxid : setUnspentTxs) {
+        auto mit = mapWallet.find(wtxid);
+        if (mit != mapWallet.end()) {
+            vwtx.push_back(&mit->second);
+        }
+    }
+    return vwtx;
+}
+
+/**
+ * Returns true if a wallet transaction in the main chain spends `spent`.
+ */
+template <class T>
+bool CWallet::IsSpentInMainChain(const TxSpendMap<T>& spends, const T& spent) const
+{
+    auto range = spends.equal_range(spent);
+    for (auto it = range.first; it != range.second; ++it) {
+        auto mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain(std::nullopt) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Returns the height that wtx was mined at if it is settled, in the sense of
+ * mapBalanceLedgerTxs.
+ */
+std::optional<int> CWallet::GetSettledHeight(const CWalletTx& wtx) const
+{
+    const CBlockIndex* pindex = nullptr;
+    if (wtx.GetDepthInMainChain(pindex, std::nullopt) <= 0 ||
+        !CheckFinalTx(wtx) ||
+        wtx.GetBlocksToMaturity(std::nullopt) > 0) {
+        return std::nullopt;
+    }
+    return pindex->nHeight;
+}
+
+/**
+ * Returns the unspent transparent outputs, Sprout notes and Sapling notes
+ * that wtx pays to the wallet. If fMainChainSpendsOnly is set, only spends
+ * in the main chain are taken into account; otherwise spends in the mempool
+ * are too, as they are by IsSpent. Zero-valued outputs are left out, as they
+ * don't change any balance.
+ */
+std::vector<BalanceLedgerOutput> CWallet::GetBalanceLedgerOutputs(const CWalletTx& wtx, bool fMainChainSpendsOnly) const
+{
+    const uint256& txid = wtx.GetHash();
+    std::vector<BalanceLedgerOutput> vOutputs;
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        const CTxOut& txout = wtx.vout[i];
+        isminetype mine = IsMine(txout);
+        if (mine == ISMINE_NO || txout.nValue == 0) continue;
+        if (fMainChainSpendsOnly ?
+                IsSpentInMainChain(mapTxSpends, COutPoint(txid, i)) :
+                IsSpent(txid, i, std::nullopt)) {
+            continue;
+        }
+
+        // The account that SelectorMatchesAddress assigns the output to.
+        std::optional<libzcash::AccountId> account;
+        CTxDestination address;
+        if (ExtractDestination(txout.scriptPubKey, address)) {
+            auto meta = GetUFVKMetadataForAddress(address);
+            if (meta.has_value()) {
+                account = GetUnifiedAccountId(meta.value().GetUFVKId());
+            } else {
+                account = ZCASH_LEGACY_ACCOUNT;
+            }
+        }
+
+        vOutputs.push_back({COutPoint(txid, i), {BalancePool::Transparent, mine, account}, txout.nValue});
+    }
+
+    for (const auto& [jsop, nd] : wtx.mapSproutNoteData) {
+        if (nd.nullifier.has_value() && (fMainChainSpendsOnly ?
+                IsSpentInMainChain(mapTxSproutNullifiers, nd.nullifier.value()) :
+                IsSproutSpent(nd.nullifier.value(), std::nullopt))) {
+            continue;
+        }
+
+        auto [plaintext, pa] = wtx.DecryptSproutNote(jsop);
+        if (plaintext.value() == 0) continue;
+        isminetype mine = HaveSproutSpendingKey(pa) ? ISMINE_SPENDABLE : ISMINE_WATCH_ONLY;
+        vOutputs.push_back({jsop, {BalancePool::Sprout, mine, std::nullopt}, CAmount(plaintext.value())});
+    }
+
+    for (const auto& [op, nd] : wtx.mapSaplingNoteData) {
+        if (nd.nullifier.has_value() && (fMainChainSpendsOnly ?
+                IsSpentInMainChain(mapTxSaplingNullifiers, nd.nullifier.value()) :
+                IsSaplingSpent(nd.nullifier.value(), std::nullopt))) {
+            continue;
+        }
+
+        auto optDecrypted = wtx.DecryptSaplingNote(Params(), op);
+
+        // The transaction would not have entered the wallet unless
+        // its plaintext had been successfully decrypted previously.
+        assert(optDecrypted != std::nullopt);
+        auto [notePt, pa] = optDecrypted.value();
+        if (notePt.value() == 0) continue;
+        isminetype mine = HaveSaplingSpendingKeyForAddress(pa) ? ISMINE_SPENDABLE : ISMINE_WATCH_ONLY;
+        std::optional<libzcash::AccountId> account;
+        auto meta = GetUFVKMetadataForReceiver(pa);
+        if (meta.has_value()) {
+            account = GetUnifiedAccountId(meta.value().GetUFVKId());
+        }
+        vOutputs.push_back({op, {BalancePool::Sapling, mine, account}, CAmount(notePt.value())});
+    }
+
+    return vOutputs;
+}
+
+bool CWallet::IsLockedOutput(const BalanceLedgerOutPoint& outpoint) const
+{
+    return examine(outpoint, match {
+        [&](const COutPoint& op) { return IsLockedCoin(op.hash, op.n); },
+        [&](const JSOutPoint& jsop) { return IsLockedNote(jsop); },
+        [&](const SaplingOutPoint& op) { return IsLockedNote(op); },
+    });
+}
+
+void CWallet::AddToBalanceLedger(const CWalletTx& wtx) const
+{
+    auto nHeight = GetSettledHeight(wtx);
+    if (!nHeight.has_value()) {
+        setBalanceLedgerPending.insert(wtx.GetHash());
+        return;
+    }
+
+    auto vOutputs = GetBalanceLedgerOutputs(wtx, true);
+    if (vOutputs.empty()) {
+        return;
+    }
+    auto& mapHeightTotals = mapBalanceLedgerHeights[nHeight.value()];
+    for (const BalanceLedgerOutput& output : vOutputs) {
+        mapHeightTotals[output.key] += output.nValue;
+        mapBalanceLedgerTotals[output.key] += output.nValue;
+    }
+    mapBalanceLedgerTxs.emplace(wtx.GetHash(), BalanceLedgerTx {nHeight.value(), std::move(vOutputs)});
+}
+
+void CWallet::RemoveFromBalanceLedger(const uint256& txid) const
+{
+    setBalanceLedgerPending.erase(txid);
+
+    auto it = mapBalanceLedgerTxs.find(txid);
+    if (it == mapBalanceLedgerTxs.end()) {
+        return;
+    }
+    auto subtract = [](std::map<BalanceLedgerKey, CAmount>& mapTotals, const BalanceLedgerOutput& output) {
+        auto kit = mapTotals.find(output.key);
+        assert(kit != mapTotals.end());
+        kit->second -= output.nValue;
+        if (kit->second == 0) {
+            mapTotals.erase(kit);
+        }
+    };
+    auto hit = mapBalanceLedgerHeights.find(it->second.nHeight);
+    assert(hit != mapBalanceLedgerHeights.end());
+    for (const BalanceLedgerOutput& output : it->second.vOutputs) {
+        subtract(hit->second, output);
+        subtract(mapBalanceLedgerTotals, output);
+    }
+    if (hit->second.empty()) {
+        mapBalanceLedgerHeights.erase(hit);
+    }
+    mapBalanceLedgerTxs.erase(it);
+}
+
+void CWallet::RebuildBalanceLedger() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    int64_t nStart = GetTimeMillis();
+    mapBalanceLedgerTxs.clear();
+    mapBalanceLedgerTotals.clear();
+    mapBalanceLedgerHeights.clear();
+    setBalanceLedgerPending.clear();
+    setBalanceLedgerDirty.clear();
+    for (const auto& [wtxid, wtx] : mapWallet) {
+        // Settled transactions outside the unspent index have nothing left
+        // to count, but every pending transaction has to be tracked.
+        if (setUnspentTxs.count(wtxid) == 0 && GetSettledHeight(wtx).has_value()) {
+            continue;
+        }
+        AddToBalanceLedger(wtx);
+    }
+    fBalanceLedgerStale = false;
+
+    LogPrint("wallet", "Rebuilt the balance ledger with %u settled and %u pending transactions in %dms\n",
+        mapBalanceLedgerTxs.size(), setBalanceLedgerPending.size(), GetTimeMillis() - nStart);
+}
+
+void CWallet::UpdateBalanceLedger() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (fUnspentTxsStale) {
+        RebuildUnspentTxs();
+    }
+    PruneUnspentTxs();
+
+    if (fBalanceLedgerStale ||
+        pBalanceLedgerTip == nullptr ||
+        !chainActive.Contains(pBalanceLedgerTip)) {
+        RebuildBalanceLedger();
+        pBalanceLedgerTip = chainActive.Tip();
+        return;
+    }
+    pBalanceLedgerTip = chainActive.Tip();
+
+    // Pending transactions that have been mined, or have matured, since the
+    // last query are now settled.
+    for (const uint256& txid : setBalanceLedgerPending) {
+        auto mit = mapWallet.find(txid);
+        if (mit == mapWallet.end() || GetSettledHeight(mit->second).has_value()) {
+            setBalanceLedgerDirty.insert(txid);
+        }
+    }
+
+    // A changed transaction may also have started or stopped spending the
+    // outputs of the transactions it spends.
+    std::set<uint256> setTxsToUpdate;
+    for (const uint256& txid : setBalanceLedgerDirty) {
+        setTxsToUpdate.insert(txid);
+        auto mit = mapWallet.find(txid);
+        if (mit != mapWallet.end()) {
+            GetTxsSpentBy(mit->second, setTxsToUpdate);
+        }
+    }
+    setBalanceLedgerDirty.clear();
+
+    for (const uint256& txid : setTxsToUpdate) {
+        RemoveFromBalanceLedger(txid);
+        auto mit = mapWallet.find(txid);
+        if (mit != mapWallet.end()) {
+            AddToBalanceLedger(mit->second);
+        }
+    }
+}
+
+/**
+ * Returns the balance in each pool of the outputs whose keys pass keyFilter,
+ * with at least nMinDepth confirmations and asOfHeight unset.
+ *
+ * Settled outputs are counted from the ledger. Each output of a pending
+ * transaction that is in the main chain or the mempool is counted if
+ * pendingFilter, given the transaction and its depth, accepts it; pending
+ * transactions that are neither never count. If fIgnoreLocked is set,
+ * locked outputs are left out.
+ */
+std::map<BalancePool, CAmount> CWallet::GetBalanceFromLedger(
+        int nMinDepth,
+        const std::function<bool(const BalanceLedgerKey&)>& keyFilter,
+        const std::function<bool(const CWalletTx&, int, const BalanceLedgerKey&)>& pendingFilter,
+        bool fIgnoreLocked) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    UpdateBalanceLedger();
+
+    std::map<BalancePool, CAmount> balances;
+    for (const auto& [key, nValue] : mapBalanceLedgerTotals) {
+        if (keyFilter(key)) balances[key.pool] += nValue;
+    }
+    // Settled transactions mined above nMaxHeight have too few confirmations.
+    int nMaxHeight = chainActive.Height() + 1 - nMinDepth;
+    for (auto it = mapBalanceLedgerHeights.rbegin(); it != mapBalanceLedgerHeights.rend() && it->first > nMaxHeight; ++it) {
+        for (const auto& [key, nValue] : it->second) {
+            if (keyFilter(key)) balances[key.pool] -= nValue;
+        }
+    }
+
+    std::set<BalanceLedgerOutPoint> setExcluded;
+    for (const uint256& txid : setBalanceLedgerPending) {
+        const CWalletTx& wtx = mapWallet.at(txid);
+        int nDepth = wtx.GetDepthInMainChain(std::nullopt);
+        if (nDepth < 0) continue;
+
+        if (nDepth == 0) {
+            // The outputs that this transaction spends are spent as far as
+            // IsSpent is concerned, even if they are settled.
+            for (const CTxIn& txin : wtx.vin) {
+                setExcluded.insert(txin.prevout);
+            }
+            for (const JSDescription& jsdesc : wtx.vJoinSplit) {
+                for (const uint256& nullifier : jsdesc.nullifiers) {
+                    auto nit = mapSproutNullifiersToNotes.find(nullifier);
+                    if (nit != mapSproutNullifiersToNotes.end()) {
+                        setExcluded.insert(nit->second);
+                    }
+                }
+            }
+            for (const auto& spend : wtx.GetSaplingSpends()) {
+                auto nit = mapSaplingNullifiersToNotes.find(spend.nullifier());
+                if (nit != mapSaplingNullifiersToNotes.end()) {
+                    setExcluded.insert(nit->second);
+                }
+            }
+        }
+
+        for (const BalanceLedgerOutput& output : GetBalanceLedgerOutputs(wtx, false)) {
+            if (!keyFilter(output.key) || !pendingFilter(wtx, nDepth, output.key)) continue;
+            if (fIgnoreLocked && IsLockedOutput(output.outpoint)) continue;
+            balances[output.key.pool] += output.nValue;
+        }
+    }
+
+    if (fIgnoreLocked) {
+        setExcluded.insert(setLockedCoins.begin(), setLockedCoins.end());
+        setExcluded.insert(setLockedSproutNotes.begin(), setLockedSproutNotes.end());
+        setExcluded.insert(setLockedSaplingNotes.begin(), setLockedSaplingNotes.end());
+    }
+    for (const BalanceLedgerOutPoint& outpoint : setExcluded) {
+        const uint256 txid = examine(outpoint, match {
+            [](const auto& op) { return op.hash; },
+        });
+        auto it = mapBalanceLedgerTxs.find(txid);
+        if (it == mapBalanceLedgerTxs.end() || it->second.nHeight > nMaxHeight) continue;
+        for (const BalanceLedgerOutput& output : it->second.vOutputs) {
+            if (output.outpoint == outpoint && keyFilter(output.key)) {
+                balances[output.key.pool] -= output.nValue;
+            }
+        }
+    }
+
+    return balances;
+}
+
 void CWallet::AddToTransparentSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
@@ -2824,12 +3395,11 @@ void CWallet::IncrementNoteWitnesses(
             }
         }
         // Sapling
-        for (const auto& spend : tx.GetSaplingSpends()) {
-            nullifiersSapling.emplace_back(uint256::FromRawBytes(spend.nullifier()));
+        for (const uint256& nf : tx.GetSaplingBundle().GetNullifiers()) {
+            nullifiersSapling.emplace_back(nf);
         }
         uint32_t i = 0;
-        for (const auto& output : tx.GetSaplingOutputs()) {
-            const uint256& note_commitment = uint256::FromRawBytes(output.cmu());
+        for (const uint256& note_commitment : tx.GetSaplingBundle().GetNoteCommitments()) {
             frontiers.sapling.append(note_commitment);
             noteCommitmentsSapling.emplace_back(note_commitment);
 
@@ -3225,6 +3795,8 @@ void CWallet::UpdateNullifierNoteMapWithTx(const CWalletTx& wtx)
 {
     {
         LOCK(cs_wallet);
+        // Spends of the notes may only now be recognised.
+        setBalanceLedgerDirty.insert(wtx.GetHash());
         for (const mapSproutNoteData_t::value_type& item : wtx.mapSproutNoteData) {
             if (item.second.nullifier) {
                 mapSproutNullifiersToNotes[*item.second.nullifier] = item.first;
@@ -3244,6 +3816,7 @@ void CWallet::UpdateNullifierNoteMapWithTx(const CWalletTx& wtx)
  */
 void CWallet::UpdateSaplingNullifierNoteMapWithTx(CWalletTx& wtx) {
     LOCK(cs_wallet);
+    setBalanceLedgerDirty.insert(wtx.GetHash());
 
     for (mapSaplingNoteData_t::value_type &item : wtx.mapSaplingNoteData) {
         SaplingOutPoint op = item.first;
@@ -3308,6 +3881,7 @@ void CWallet::LoadWalletTx(const CWalletTx& wtxIn) {
     wtxOrdered.insert(make_pair(wtx.nOrderPos, &wtx));
     UpdateNullifierNoteMapWithTx(mapWallet[hash]);
     AddToSpends(hash);
+    fUnspentTxsStale = true;
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, CWalletDB* pwalletdb)
@@ -3396,6 +3970,14 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, CWalletDB* pwalletdb)
         //// debug print
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
+        // New or updated outputs and notes may be unspent. PruneUnspentTxs
+        // checks whether they were in fact spent already.
+        if (fInsertedNew || fUpdated) {
+            setUnspentTxs.insert(hash);
+            setUnspentTxsToRecheck.insert(hash);
+            setBalanceLedgerDirty.insert(hash);
+        }
+
         // Write to disk
         if (fInsertedNew || fUpdated)
             if (!pwalletdb->WriteTx(wtx))
@@ -3714,8 +4296,12 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        if (mapWallet.erase(hash)) {
             CWalletDB(strWalletFile).EraseTx(hash);
+            // The transaction may have been the only irreversible spend of
+            // others, so they may be unspent again.
+            fUnspentTxsStale = true;
+        }
     }
     return;
 }
@@ -4615,22 +5201,42 @@ void CWallet::WitnessNoteCommitment(std::vector<uint256> commitments,
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * The caller must not hold cs_main or cs_wallet; they are only held while
+ * each batch of blocks is applied to the wallet. ThreadNotifyWallets is held
+ * off for the duration of the scan, which ends at exactly the last block it
+ * notified the wallet of (or at the chain tip if it is not running yet), even
+ * if that block is reorged out before or during the scan. The notifier then
+ * carries on from the block the wallet is at, so that no block is applied to
+ * the wallet by both, and none is disconnected that was not applied. If
+ * pindexScannedRet is not null, it is set to the last block that was applied.
  */
 std::optional<int> CWallet::ScanForWalletTransactions(
         CBlockIndex* pindexStart,
         bool fUpdate,
-        bool isInitScan)
+        bool isInitScan,
+        CBlockIndex** pindexScannedRet)
 {
     assert(pindexStart != nullptr);
+    AssertLockNotHeld(cs_main);
+    AssertLockNotHeld(cs_wallet);
     int myTransactionsFound = 0;
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
     const auto& consensus = chainParams.GetConsensus();
 
     CBlockIndex* pindex = pindexStart;
+    CBlockIndex* pindexEnd = nullptr;
+    CBlockIndex* pindexScanned = nullptr;
+    int nStartHeight = 0;
+    MerkleFrontiers frontiers;
+    bool performOrchardWalletUpdates{false};
+    double dProgressStart = 0.0;
+    double dProgressTip = 0.0;
 
     std::vector<uint256> myTxHashes;
 
+    LOCK(cs_walletNotify);
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -4649,7 +5255,6 @@ std::optional<int> CWallet::ScanForWalletTransactions(
         // and then the call to `ChainTipAdded` that later occurs for each block will restore
         // the witness data that is being removed in the rewind here.
         auto nu5_height = chainParams.GetConsensus().GetActivationHeight(Consensus::UPGRADE_NU5);
-        bool performOrchardWalletUpdates{false};
         if (optOrchardCheckpointHeight.has_value()) {
             // We have a checkpoint, so attempt to rewind the Orchard wallet at most as
             // far as the NU5 activation block.
@@ -4685,56 +5290,194 @@ std::optional<int> CWallet::ScanForWalletTransactions(
             performOrchardWalletUpdates = true;
         }
 
-        // Create a rescan-specific batch scanner for the wallet.
-        auto batchScanner = WalletBatchScanner(this);
+        // Blocks after the last one that ThreadNotifyWallets has notified us
+        // of are left for it to deliver once the scan is done. If that block
+        // is no longer in the active chain, the notifier will disconnect it,
+        // so we scan the blocks leading to it rather than the active chain.
+        if (pindexWalletNotified != nullptr) {
+            pindexEnd = pindexWalletNotified;
+        } else {
+            pindexEnd = chainActive.Tip();
+        }
+        if (pindexEnd->GetAncestor(pindex->nHeight) != pindex) {
+            // Either there is nothing to scan, or we are starting above the
+            // fork between pindexEnd and the active chain.
+            pindex = pindexEnd->GetAncestor(chainActive.FindFork(pindexEnd)->nHeight + 1);
+        }
+
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindexEnd, false);
+        dProgressStart = dProgressTip;
+        nStartHeight = pindexEnd->nHeight + 1;
+        if (pindex != nullptr) {
+            dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
+            nStartHeight = pindex->nHeight;
+
+            // The frontiers as of the start of the first block. The parent of
+            // that block is in the active chain, but later blocks may be
+            // disconnected during the scan, taking their anchors out of
+            // pcoinsTip, so the frontiers are carried forward from here.
+            // This should never fail: we should always be able to get the
+            // tree state on the path to the tip of our chain
+            assert(pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, frontiers.sprout));
+            if (pindex->pprev) {
+                if (consensus.NetworkUpgradeActive(pindex->pprev->nHeight,  Consensus::UPGRADE_SAPLING)) {
+                    assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, frontiers.sapling));
+                }
+                if (consensus.NetworkUpgradeActive(pindex->pprev->nHeight,  Consensus::UPGRADE_NU5)) {
+                    assert(pcoinsTip->GetOrchardAnchorAt(pindex->pprev->hashFinalOrchardRoot, frontiers.orchard));
+                }
+            }
+        }
+    }
+
+    // Blocks are read from disk and queued for trial decryption in batches by
+    // a separate reader thread, each batch with its own rescan-specific batch
+    // scanner. Up to WALLET_RESCAN_QUEUED_BATCHES batches are read ahead of
+    // the one being applied to the wallet, so that reading blocks and trial
+    // decryption (which runs on the Rust thread pool) overlap with updating
+    // the wallet. The reader only needs the block index entries, which it
+    // finds from pindexEnd without taking cs_main.
+    struct RescanBatch {
+        std::unique_ptr<WalletBatchScanner> batchScanner;
+        std::vector<std::pair<CBlockIndex*, CBlock>> blocks;
+    };
+    std::mutex csRescanQueue;
+    std::condition_variable condRescanQueue;
+    std::deque<RescanBatch> rescanQueue;
+    bool fReaderDone = false;
+    bool fStopReader = false;
+    bool fReaderInterrupted = false;
+    std::exception_ptr readerError;
+
+    auto readBatches = [&]() {
+        try {
+            int nReadHeight = nStartHeight;
+            while (nReadHeight <= pindexEnd->nHeight) {
+                RescanBatch batch;
+                batch.batchScanner.reset(new WalletBatchScanner(this));
+                size_t nBatchBytes = 0;
+                while (nReadHeight <= pindexEnd->nHeight &&
+                       batch.blocks.size() < WALLET_RESCAN_BATCH_BLOCKS &&
+                       nBatchBytes < WALLET_RESCAN_BATCH_BYTES)
+                {
+                    if (ShutdownRequested()) {
+                        std::lock_guard<std::mutex> lock(csRescanQueue);
+                        fReaderInterrupted = true;
+                        break;
+                    }
+
+                    CBlockIndex* pindexRead = pindexEnd->GetAncestor(nReadHeight);
+                    CBlock block;
+                    if (!ReadBlockFromDisk(block, pindexRead, consensus)) {
+                        throw std::runtime_error(
+                            strprintf("Can't read block %d from disk (%s)", pindexRead->nHeight, pindexRead->GetBlockHash().GetHex()));
+                    }
+                    for (const CTransaction& tx : block.vtx) {
+                        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+                        ssTx << tx;
+                        std::vector<unsigned char> txBytes(ssTx.begin(), ssTx.end());
+                        nBatchBytes += txBytes.size();
+                        batch.batchScanner->AddTransaction(tx, txBytes, pindexRead->GetBlockHash(), pindexRead->nHeight);
+                    }
+                    batch.blocks.emplace_back(pindexRead, std::move(block));
+                    nReadHeight++;
+                }
+                batch.batchScanner->Flush();
+
+                std::unique_lock<std::mutex> lock(csRescanQueue);
+                condRescanQueue.wait(lock, [&]() {
+                    return rescanQueue.size() < WALLET_RESCAN_QUEUED_BATCHES || fStopReader;
+                });
+                if (fStopReader || batch.blocks.empty()) break;
+                rescanQueue.push_back(std::move(batch));
+                condRescanQueue.notify_all();
+                if (fReaderInterrupted) break;
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(csRescanQueue);
+            readerError = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(csRescanQueue);
+        fReaderDone = true;
+        condRescanQueue.notify_all();
+    };
+
+    // The reader is stopped and joined however this function exits.
+    struct RescanReader {
+        std::thread thread;
+        std::function<void()> stop;
+        ~RescanReader() {
+            stop();
+            thread.join();
+        }
+    } reader {
+        std::thread(readBatches),
+        [&]() {
+            std::lock_guard<std::mutex> lock(csRescanQueue);
+            fStopReader = true;
+            condRescanQueue.notify_all();
+        },
+    };
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+    bool fInterrupted = false;
+    while (!fInterrupted)
+    {
+        RescanBatch batch;
         {
+            std::unique_lock<std::mutex> lock(csRescanQueue);
+            condRescanQueue.wait(lock, [&]() { return !rescanQueue.empty() || fReaderDone; });
+            if (rescanQueue.empty()) {
+                if (readerError) std::rethrow_exception(readerError);
+                fInterrupted = fReaderInterrupted;
+                break;
+            }
+            batch = std::move(rescanQueue.front());
+            rescanQueue.pop_front();
+            condRescanQueue.notify_all();
+        }
+
+        // cs_main is released between batches, so that block connection and
+        // the network message handlers are not stalled for the whole rescan.
+        LOCK2(cs_main, cs_wallet);
+        for (auto& [pindexBlock, block] : batch.blocks) {
             // Allow the rescan to be interrupted on a block boundary.
-            if (ShutdownRequested()) return std::nullopt;
+            if (ShutdownRequested()) {
+                fInterrupted = true;
+                break;
+            }
+            pindex = pindexBlock;
 
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            if (!ReadBlockFromDisk(block, pindex, consensus)) {
-                throw std::runtime_error(
-                    strprintf("Can't read block %d from disk (%s)", pindex->nHeight, pindex->GetBlockHash().GetHex()));
-            }
-            for (CTransaction& tx : block.vtx) {
-                CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-                ssTx << tx;
-                std::vector<unsigned char> txBytes(ssTx.begin(), ssTx.end());
-                batchScanner.AddTransaction(tx, txBytes, pindex->GetBlockHash(), pindex->nHeight);
-            }
-            batchScanner.Flush();
-            for (CTransaction& tx : block.vtx)
+            for (const CTransaction& tx : block.vtx)
             {
-                if (batchScanner.AddToWalletIfInvolvingMe(consensus, tx, &block, pindex->nHeight, fUpdate)) {
+                if (batch.batchScanner->AddToWalletIfInvolvingMe(consensus, tx, &block, pindex->nHeight, fUpdate)) {
                     myTxHashes.push_back(tx.GetHash());
                     myTransactionsFound++;
                 }
             }
 
-            MerkleFrontiers frontiers;
-            // This should never fail: we should always be able to get the tree
-            // state on the path to the tip of our chain
-            assert(pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, frontiers.sprout));
-            if (pindex->pprev) {
-                if (consensus.NetworkUpgradeActive(pindex->pprev->nHeight,  Consensus::UPGRADE_SAPLING)) {
-                    assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, frontiers.sapling));
+            // Increment note witness caches
+            ChainTipAdded(pindex, &block, frontiers, performOrchardWalletUpdates);
+            pindexScanned = pindex;
+
+            // Move the frontiers on to the start of the next block.
+            for (const CTransaction& tx : block.vtx) {
+                for (const JSDescription& jsdesc : tx.vJoinSplit) {
+                    for (const uint256& note_commitment : jsdesc.commitments) {
+                        frontiers.sprout.append(note_commitment);
+                    }
                 }
-                if (consensus.NetworkUpgradeActive(pindex->pprev->nHeight,  Consensus::UPGRADE_NU5)) {
-                    assert(pcoinsTip->GetOrchardAnchorAt(pindex->pprev->hashFinalOrchardRoot, frontiers.orchard));
+                for (const uint256& cmu : tx.GetSaplingBundle().GetNoteCommitments()) {
+                    frontiers.sapling.append(cmu);
+                }
+                if (tx.GetOrchardBundle().IsPresent()) {
+                    frontiers.orchard.AppendBundle(tx.GetOrchardBundle());
                 }
             }
-            // Increment note witness caches
-            ChainTipAdded(pindex, &block, frontiers, performOrchardWalletUpdates);
 
-            pindex = chainActive.Next(pindex);
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf(
@@ -4743,6 +5486,12 @@ std::optional<int> CWallet::ScanForWalletTransactions(
                         Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
             }
         }
+    }
+
+    if (fInterrupted) return std::nullopt;
+
+    {
+        LOCK2(cs_main, cs_wallet);
 
         // After rescanning, persist Sapling & Orchard note data that might have changed,
         // e.g. nullifiers. Do not flush the wallet here for performance reasons.
@@ -4757,8 +5506,11 @@ std::optional<int> CWallet::ScanForWalletTransactions(
                 }
             }
         }
+    }
 
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    if (pindexScannedRet != nullptr) {
+        *pindexScannedRet = pindexScanned;
     }
     return myTransactionsFound;
 }
@@ -5077,9 +5829,24 @@ CAmount CWallet::GetBalance(const std::optional<int>& asOfHeight, const isminefi
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (const auto& entry : mapWallet)
+        if (!asOfHeight.has_value()) {
+            auto balances = GetBalanceFromLedger(
+                min_depth,
+                [&](const BalanceLedgerKey& key) {
+                    return key.pool == BalancePool::Transparent && (key.mine & filter) != ISMINE_NO;
+                },
+                [&](const CWalletTx& wtx, int nDepth, const BalanceLedgerKey& key) {
+                    return nDepth >= min_depth && wtx.IsTrusted(std::nullopt) &&
+                        wtx.GetBlocksToMaturity(std::nullopt) <= 0;
+                },
+                false);
+            return balances[BalancePool::Transparent];
+        }
+
+        // Transactions whose outputs have all been irreversibly spent have no
+        // available credit, so we only need to visit the unspent index.
+        for (const CWalletTx* pcoin : GetTxsWithUnspentOutputs(asOfHeight))
         {
-            const CWalletTx* pcoin = &entry.second;
             if (pcoin->IsTrusted(asOfHeight) && pcoin->GetDepthInMainChain(asOfHeight) >= min_depth) {
                 nTotal += pcoin->GetAvailableCredit(asOfHeight, true, filter);
             }
@@ -5094,9 +5861,8 @@ CAmount CWallet::GetUnconfirmedTransparentBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (const auto& entry : mapWallet)
+        for (const CWalletTx* pcoin : GetTxsWithUnspentOutputs(std::nullopt))
         {
-            const CWalletTx* pcoin = &entry.second;
             if (!CheckFinalTx(*pcoin) || (!pcoin->IsTrusted(std::nullopt) && pcoin->GetDepthInMainChain(std::nullopt) == 0))
                 nTotal += pcoin->GetAvailableCredit(std::nullopt);
         }
@@ -5109,9 +5875,10 @@ CAmount CWallet::GetImmatureBalance(const std::optional<int>& asOfHeight) const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (const auto& entry : mapWallet)
+        // Immature coinbase outputs cannot have been spent, so their
+        // transactions are always in the unspent index.
+        for (const CWalletTx* pcoin : GetTxsWithUnspentOutputs(asOfHeight))
         {
-            const CWalletTx* pcoin = &entry.second;
             nTotal += pcoin->GetImmatureCredit(asOfHeight);
         }
     }
@@ -5157,6 +5924,93 @@ CAmount CWallet::GetLegacyBalance(const isminefilter& filter, int minDepth) cons
     return balance;
 }
 
+CAmount CWallet::GetAvailableTransparentBalance(int minDepth, bool fIncludeWatchOnly) const
+{
+    LOCK2(cs_main, cs_wallet);
+
+    auto balances = GetBalanceFromLedger(
+        minDepth,
+        [&](const BalanceLedgerKey& key) {
+            return key.pool == BalancePool::Transparent &&
+                (fIncludeWatchOnly || (key.mine & ISMINE_SPENDABLE) != ISMINE_NO);
+        },
+        [&](const CWalletTx& wtx, int nDepth, const BalanceLedgerKey& key) {
+            return nDepth >= minDepth && CheckFinalTx(wtx) && wtx.GetBlocksToMaturity(std::nullopt) <= 0;
+        },
+        true);
+    return balances[BalancePool::Transparent];
+}
+
+CAmount CWallet::GetAvailableShieldedBalance(int minDepth, bool fIncludeWatchOnly) const
+{
+    LOCK2(cs_main, cs_wallet);
+
+    auto balances = GetBalanceFromLedger(
+        minDepth,
+        [&](const BalanceLedgerKey& key) {
+            return key.pool != BalancePool::Transparent &&
+                (fIncludeWatchOnly || key.mine == ISMINE_SPENDABLE);
+        },
+        [&](const CWalletTx& wtx, int nDepth, const BalanceLedgerKey& key) {
+            // GetFilteredNotes skips coinbase transactions without Sapling outputs.
+            return nDepth >= minDepth && CheckFinalTx(wtx) &&
+                !(wtx.IsCoinBase() && wtx.mapSaplingNoteData.empty());
+        },
+        true);
+
+    std::vector<OrchardNoteMetadata> orchardNotes;
+    GetFilteredOrchardNotes(orchardNotes, std::nullopt, std::nullopt, minDepth, INT_MAX, true, !fIncludeWatchOnly);
+    CAmount nOrchardBalance = 0;
+    for (const auto& noteMeta : orchardNotes) {
+        nOrchardBalance += noteMeta.GetNoteValue();
+    }
+
+    return balances[BalancePool::Sprout] + balances[BalancePool::Sapling] + nOrchardBalance;
+}
+
+std::map<libzcash::OutputPool, CAmount> CWallet::GetBalanceForAccount(
+        const ZTXOSelector& selector,
+        int minDepth) const
+{
+    assert(!selector.RequireSpendingKeys());
+    assert(selector.TransparentCoinbasePolicy() == TransparentCoinbasePolicy::Allow);
+    const auto& acct = std::get<AccountZTXOPattern>(selector.GetPattern());
+    const libzcash::AccountId accountId = acct.GetAccountId();
+    const bool selectTransparent{selector.SelectsTransparent()};
+    const bool selectSapling{selector.SelectsSapling()};
+
+    LOCK2(cs_main, cs_wallet);
+
+    auto balances = GetBalanceFromLedger(
+        minDepth,
+        [&](const BalanceLedgerKey& key) {
+            return key.account == accountId &&
+                ((key.pool == BalancePool::Transparent && selectTransparent) ||
+                 (key.pool == BalancePool::Sapling && selectSapling));
+        },
+        [&](const CWalletTx& wtx, int nDepth, const BalanceLedgerKey& key) {
+            return nDepth >= minDepth && CheckFinalTx(wtx) &&
+                (key.pool != BalancePool::Transparent || wtx.GetBlocksToMaturity(std::nullopt) <= 0);
+        },
+        true);
+
+    std::map<libzcash::OutputPool, CAmount> result;
+    if (selectTransparent) {
+        result[libzcash::OutputPool::Transparent] = balances[BalancePool::Transparent];
+    }
+    if (selectSapling) {
+        result[libzcash::OutputPool::Sapling] = balances[BalancePool::Sapling];
+    }
+    if (selector.SelectsOrchard()) {
+        CAmount nOrchardBalance = 0;
+        for (const auto& noteMeta : FindSpendableOrchardNotes(selector, minDepth, std::nullopt)) {
+            nOrchardBalance += noteMeta.GetNoteValue();
+        }
+        result[libzcash::OutputPool::Orchard] = nOrchardBalance;
+    }
+    return result;
+}
+
 void CWallet::AvailableCoins(vector<COutput>& vCoins,
                              const std::optional<int>& asOfHeight,
                              bool fOnlyConfirmed,
@@ -5175,7 +6029,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins,
     vCoins.clear();
 
     {
-        for (const auto& [wtxid, pcoin] : mapWallet) {
+        for (const CWalletTx* pwtx : GetTxsWithUnspentOutputs(asOfHeight)) {
+            const CWalletTx& pcoin = *pwtx;
+            const uint256& wtxid = pcoin.GetHash();
             if (!CheckFinalTx(pcoin))
                 continue;
 
@@ -6104,9 +6960,11 @@ std::map<CTxDestination, CAmount> CWallet::GetAddressBalances(const std::optiona
 
     {
         LOCK(cs_wallet);
-        for (std::pair<uint256, CWalletTx> walletEntry : mapWallet)
+        // This must visit fully spent transactions too, because callers rely
+        // on every address that has ever received funds having an entry.
+        for (const auto& walletEntry : mapWallet)
         {
-            CWalletTx *pcoin = &walletEntry.second;
+            const CWalletTx *pcoin = &walletEntry.second;
 
             if (!CheckFinalTx(*pcoin) || !pcoin->IsTrusted(asOfHeight))
                 continue;
@@ -6718,12 +7576,18 @@ bool CWallet::InitLoadWallet(const CChainParams& params, bool clearWitnessCaches
                 chainActive.Height() - pindexRescan->nHeight,
                 pindexRescan->nHeight);
         nStart = GetTimeMillis();
-        if (!walletInstance->ScanForWalletTransactions(pindexRescan, true, true).has_value()) {
+        CBlockIndex* pindexScanned = nullptr;
+        if (!walletInstance->ScanForWalletTransactions(pindexRescan, true, true, &pindexScanned).has_value()) {
             return UIError(_("CWallet::InitLoadWallet: rescan interrupted due to shutdown request."));
         }
 
         LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
-        walletInstance->SetBestChain(chainActive.GetLocator());
+        // Blocks connected while we were rescanning are applied by the wallet
+        // notifier, which starts from the wallet's best block.
+        {
+            LOCK(cs_main);
+            walletInstance->SetBestChain(chainActive.GetLocator(pindexScanned ? pindexScanned : pindexRescan));
+        }
         CWalletDB::IncrementUpdateCounter();
 
         // Restore wallet transaction metadata after -zapwallettxes=1
@@ -7011,14 +7875,27 @@ void CWallet::GetFilteredNotes(
 
     LOCK2(cs_main, cs_wallet);
 
+    // Spent notes can only be skipped using the index of unspent outputs.
+    std::vector<const CWalletTx*> vwtx;
+    if (ignoreSpent) {
+        vwtx = GetTxsWithUnspentOutputs(asOfHeight);
+    } else {
+        vwtx.reserve(mapWallet.size());
+        for (const auto& [wtxid, wtx] : mapWallet) {
+            vwtx.push_back(&wtx);
+        }
+    }
+
     KeyIO keyIO(Params());
-    for (auto & p : mapWallet) {
-        CWalletTx wtx = p.second;
+    for (const CWalletTx* pwtx : vwtx) {
+        const CWalletTx& wtx = *pwtx;
 
         // Filter the transactions before checking for notes
-        if (!CheckFinalTx(wtx) ||
-            wtx.GetDepthInMainChain(asOfHeight) < minDepth ||
-            wtx.GetDepthInMainChain(asOfHeight) > maxDepth) {
+        if (!CheckFinalTx(wtx)) {
+            continue;
+        }
+        int nDepth = wtx.GetDepthInMainChain(asOfHeight);
+        if (nDepth < minDepth || nDepth > maxDepth) {
             continue;
         }
 
@@ -7027,10 +7904,10 @@ void CWallet::GetFilteredNotes(
             continue;
         }
 
-        for (auto & pair : wtx.mapSproutNoteData) {
-            JSOutPoint jsop = pair.first;
-            SproutNoteData nd = pair.second;
-            SproutPaymentAddress pa = nd.address;
+        for (const auto& pair : wtx.mapSproutNoteData) {
+            const JSOutPoint& jsop = pair.first;
+            const SproutNoteData& nd = pair.second;
+            const SproutPaymentAddress& pa = nd.address;
 
             // skip notes which do not conform to the filter, if supplied
             if (noteFilter.has_value() && !noteFilter.value().HasSproutAddress(pa)) {
@@ -7076,7 +7953,7 @@ void CWallet::GetFilteredNotes(
                         (unsigned char) j);
 
                 sproutEntriesRet.push_back(SproutNoteEntry {
-                    jsop, pa, plaintext.note(pa), plaintext.memo(), wtx.GetDepthInMainChain(asOfHeight) });
+                    jsop, pa, plaintext.note(pa), plaintext.memo(), nDepth });
 
             } catch (const note_decryption_failed &err) {
                 // Couldn't decrypt with this spending key
@@ -7087,9 +7964,9 @@ void CWallet::GetFilteredNotes(
             }
         }
 
-        for (auto & pair : wtx.mapSaplingNoteData) {
-            SaplingOutPoint op = pair.first;
-            SaplingNoteData nd = pair.second;
+        for (const auto& pair : wtx.mapSaplingNoteData) {
+            const SaplingOutPoint& op = pair.first;
+            const SaplingNoteData& nd = pair.second;
 
             auto optDecrypted = wtx.DecryptSaplingNote(Params(), op);
 
@@ -7121,10 +7998,30 @@ void CWallet::GetFilteredNotes(
 
             auto note = notePt.note(nd.ivk).value();
             saplingEntriesRet.push_back(SaplingNoteEntry {
-                op, pa, note, notePt.memo(), wtx.GetDepthInMainChain(asOfHeight) });
+                op, pa, note, notePt.memo(), nDepth });
         }
     }
 
+    GetFilteredOrchardNotes(
+            orchardNotesRet, noteFilter, asOfHeight, minDepth, maxDepth, ignoreSpent, requireSpendingKey);
+}
+
+/**
+ * The Orchard part of GetFilteredNotes. Orchard notes are found through the
+ * Orchard wallet, rather than by visiting wallet transactions.
+ */
+void CWallet::GetFilteredOrchardNotes(
+    std::vector<OrchardNoteMetadata>& orchardNotesRet,
+    const std::optional<NoteFilter>& noteFilter,
+    const std::optional<int>& asOfHeight,
+    int minDepth,
+    int maxDepth,
+    bool ignoreSpent,
+    bool requireSpendingKey) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
     std::vector<OrchardNoteMetadata> orchardNotes;
     if (noteFilter.has_value()) {
         for (const OrchardRawAddress& addr: noteFilter.value().GetOrchardAddresses()) {
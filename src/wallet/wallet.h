@@ -33,12 +33,15 @@
 #include "base58.h"
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <map>
 #include <optional>
 #include <set>
 #include <stdexcept>
 #include <stdint.h>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -71,6 +74,12 @@ static const bool DEFAULT_WALLETBROADCAST = true;
 //  Should be large enough that we can expect not to reorg beyond our cache
 //  unless there is some exceptional network disruption.
 static const unsigned int WITNESS_CACHE_SIZE = MAX_REORG_LENGTH + 1;
+//! Maximum number of blocks, and of serialized transaction bytes, that a
+//  rescan reads and queues for trial decryption as a single batch
+static const size_t WALLET_RESCAN_BATCH_BLOCKS = 100;
+static const size_t WALLET_RESCAN_BATCH_BYTES = 32 * 1024 * 1024;
+//! Number of batches that a rescan reads ahead of the batch it is applying
+static const size_t WALLET_RESCAN_QUEUED_BATCHES = 2;
 
 //! Amount of entropy used in generation of the mnemonic seed, in bytes.
 static const size_t WALLET_MNEMONIC_ENTROPY_LENGTH = 32;
@@ -385,6 +394,49 @@ struct SaplingNoteEntry
     int confirmations;
 };
 
+/** The value pools that the wallet's balance ledger keeps totals for. */
+enum class BalancePool {
+    Transparent,
+    Sprout,
+    Sapling,
+};
+
+/**
+ * What the balance ledger totals a wallet output's value under.
+ *
+ * For transparent outputs, `mine` is the output's IsMine value. For notes it
+ * is ISMINE_SPENDABLE if the wallet has the spending key for the note's
+ * address, and ISMINE_WATCH_ONLY otherwise. `account` is the account whose
+ * selector (see ZTXOSelectorForAccount) matches the output's address, if any.
+ */
+struct BalanceLedgerKey
+{
+    BalancePool pool;
+    isminetype mine;
+    std::optional<libzcash::AccountId> account;
+
+    friend bool operator<(const BalanceLedgerKey& a, const BalanceLedgerKey& b) {
+        return std::tie(a.pool, a.mine, a.account) < std::tie(b.pool, b.mine, b.account);
+    }
+};
+
+typedef std::variant<COutPoint, JSOutPoint, SaplingOutPoint> BalanceLedgerOutPoint;
+
+/** A transparent output, Sprout note or Sapling note that the balance ledger counts. */
+struct BalanceLedgerOutput
+{
+    BalanceLedgerOutPoint outpoint;
+    BalanceLedgerKey key;
+    CAmount nValue;
+};
+
+/** The counted outputs of a wallet transaction, and the height it was mined at. */
+struct BalanceLedgerTx
+{
+    int nHeight;
+    std::vector<BalanceLedgerOutput> vOutputs;
+};
+
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
 {
@@ -1266,6 +1318,69 @@ private:
     TxNullifiers mapTxSproutNullifiers;
     TxNullifiers mapTxSaplingNullifiers;
 
+    /**
+     * Transactions in mapWallet that may have transparent outputs, Sprout
+     * notes or Sapling notes that belong to the wallet and are unspent.
+     * AvailableCoins, FindSpendableInputs and GetFilteredNotes only visit
+     * these, rather than every transaction in the wallet.
+     *
+     * A transaction is dropped once everything it pays to the wallet has been
+     * spent by wallet transactions more than MAX_REORG_LENGTH blocks deep,
+     * which can no longer be reorged out. nUnspentTxsPrunedHeight is the
+     * highest such spend; queries as of an earlier height scan mapWallet.
+     * The set is rebuilt from mapWallet whenever it may be missing
+     * transactions, for example after keys or scripts have been added.
+     */
+    mutable std::set<uint256> setUnspentTxs;
+    mutable int nUnspentTxsPrunedHeight = 0;
+    mutable std::atomic<bool> fUnspentTxsStale{true};
+    /**
+     * Wallet transactions in recently connected blocks, by height. Once they
+     * are deep enough, the transactions that they spend are checked again to
+     * see whether they can be dropped from setUnspentTxs.
+     */
+    mutable std::multimap<int, uint256> mapUnspentTxsPruneQueue;
+    /**
+     * Wallet transactions that AddToWallet has inserted or updated, and so
+     * put back into setUnspentTxs, since it was last pruned. A rescan can
+     * update a transaction whose outputs were irreversibly spent long ago,
+     * so these are checked again, together with the transactions that they
+     * spend, the next time the set is pruned.
+     */
+    mutable std::set<uint256> setUnspentTxsToRecheck;
+
+    /**
+     * The balance ledger keeps running totals of the unspent transparent
+     * outputs, Sprout notes and Sapling notes of settled wallet transactions,
+     * by BalanceLedgerKey and by the height that each transaction was mined
+     * at. Balances that are not as of a specific height are then computed in
+     * time proportional to the number of recent heights that are too shallow
+     * for the requested minimum depth, rather than to the number of unspent
+     * transactions.
+     *
+     * A transaction is settled once it is final, mined in the main chain
+     * and, if it is a coinbase transaction, mature. Its outputs are counted
+     * unless they have been spent by a wallet transaction that is also in
+     * the main chain. Every other wallet transaction is pending, and is
+     * checked by each query using the same rules as the scanning code.
+     * Settled outputs that are spent by pending transactions in the mempool,
+     * or that are locked, are subtracted at query time too.
+     *
+     * Transactions that AddToWallet changes are evaluated again, together
+     * with the transactions that they spend, on the next query, as are
+     * pending transactions that have become settled. The ledger is rebuilt
+     * when the block that it was last brought up to date at has been
+     * disconnected, or when keys, addresses or accounts have been added that
+     * change how outputs are classified.
+     */
+    mutable std::map<uint256, BalanceLedgerTx> mapBalanceLedgerTxs;
+    mutable std::map<BalanceLedgerKey, CAmount> mapBalanceLedgerTotals;
+    mutable std::map<int, std::map<BalanceLedgerKey, CAmount>> mapBalanceLedgerHeights;
+    mutable std::set<uint256> setBalanceLedgerPending;
+    mutable std::set<uint256> setBalanceLedgerDirty;
+    mutable const CBlockIndex* pBalanceLedgerTip = nullptr;
+    mutable std::atomic<bool> fBalanceLedgerStale{true};
+
     std::vector<CTransaction> pendingSaplingMigrationTxs;
     AsyncRPCOperationId saplingMigrationOperationId;
 
@@ -1274,6 +1389,42 @@ private:
     void AddToSaplingSpends(const uint256& nullifier, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
 
+    template <class T>
+    std::optional<int> GetIrreversibleSpendHeight(const TxSpendMap<T>& spends, const T& spent) const;
+    bool IsIrreversiblySpent(const CWalletTx& wtx, int& nSpendHeightRet) const;
+    void RebuildUnspentTxs() const;
+    void PruneUnspentTxs() const;
+    void UpdateUnspentTxsForBlock(const CBlockIndex* pindex, const CBlock* pblock, bool fConnected);
+    void GetTxsSpentBy(const CWalletTx& wtx, std::set<uint256>& setTxidsRet) const;
+
+    template <class T>
+    bool IsSpentInMainChain(const TxSpendMap<T>& spends, const T& spent) const;
+    std::optional<int> GetSettledHeight(const CWalletTx& wtx) const;
+    std::vector<BalanceLedgerOutput> GetBalanceLedgerOutputs(const CWalletTx& wtx, bool fMainChainSpendsOnly) const;
+    bool IsLockedOutput(const BalanceLedgerOutPoint& outpoint) const;
+    void AddToBalanceLedger(const CWalletTx& wtx) const;
+    void RemoveFromBalanceLedger(const uint256& txid) const;
+    void RebuildBalanceLedger() const;
+    void UpdateBalanceLedger() const;
+    std::map<BalancePool, CAmount> GetBalanceFromLedger(
+            int nMinDepth,
+            const std::function<bool(const BalanceLedgerKey&)>& keyFilter,
+            const std::function<bool(const CWalletTx&, int, const BalanceLedgerKey&)>& pendingFilter,
+            bool fIgnoreLocked) const;
+
+    void GetFilteredOrchardNotes(
+            std::vector<OrchardNoteMetadata>& orchardNotesRet,
+            const std::optional<NoteFilter>& noteFilter,
+            const std::optional<int>& asOfHeight,
+            int minDepth,
+            int maxDepth,
+            bool ignoreSpent,
+            bool requireSpendingKey) const;
+    std::vector<OrchardNoteMetadata> FindSpendableOrchardNotes(
+            const ZTXOSelector& selector,
+            uint32_t minDepth,
+            const std::optional<int>& asOfHeight) const;
+
 public:
     /*
      * Size of the incremental witness cache for the notes in our wallet.
@@ -1644,6 +1795,14 @@ public:
             uint32_t minDepth,
             const std::optional<int>& asOfHeight) const;
 
+    /**
+     * Return the wallet transactions that may have unspent transparent
+     * outputs, Sprout notes or Sapling notes belonging to the wallet as of
+     * asOfHeight, in txid order. This is a superset; callers must still check
+     * each output. See setUnspentTxs.
+     */
+    std::vector<const CWalletTx*> GetTxsWithUnspentOutputs(const std::optional<int>& asOfHeight) const;
+
     bool SelectorMatchesAddress(const ZTXOSelector& source, const CTxDestination& a0) const;
     bool SelectorMatchesAddress(const ZTXOSelector& source, const libzcash::SproutPaymentAddress& a0) const;
     bool SelectorMatchesAddress(const ZTXOSelector& source, const libzcash::SaplingPaymentAddress& a0) const;
@@ -1679,7 +1838,10 @@ public:
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey) {
+        fUnspentTxsStale = true;
+        return CCryptoKeyStore::AddKeyPubKey(key, pubkey);
+    }
     //! Load metadata (used by LoadWallet)
     void LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
 
@@ -1915,7 +2077,8 @@ public:
     std::optional<int> ScanForWalletTransactions(
         CBlockIndex* pindexStart,
         bool fUpdate,
-        bool isInitScan);
+        bool isInitScan,
+        CBlockIndex** pindexScannedRet = nullptr);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime);
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime);
@@ -1928,6 +2091,28 @@ public:
     CAmount GetUnconfirmedTransparentBalance() const;
     CAmount GetImmatureBalance(const std::optional<int>& asOfHeight) const;
     CAmount GetLegacyBalance(const isminefilter& filter, int minDepth) const;
+    /**
+     * Returns the total value of the unspent, unlocked transparent outputs
+     * with at least minDepth confirmations that AvailableCoins returns,
+     * counting watch-only outputs only if fIncludeWatchOnly is set.
+     */
+    CAmount GetAvailableTransparentBalance(int minDepth, bool fIncludeWatchOnly) const;
+    /**
+     * Returns the total value of the unspent, unlocked Sprout, Sapling and
+     * Orchard notes with at least minDepth confirmations that
+     * GetFilteredNotes returns, counting notes that the wallet has no
+     * spending key for only if fIncludeWatchOnly is set.
+     */
+    CAmount GetAvailableShieldedBalance(int minDepth, bool fIncludeWatchOnly) const;
+    /**
+     * Returns the total value in each pool of the inputs that
+     * FindSpendableInputs selects for an account selector with minDepth,
+     * where the selector is as returned by ZTXOSelectorForAccount with
+     * requireSpendingKey unset and TransparentCoinbasePolicy::Allow.
+     */
+    std::map<libzcash::OutputPool, CAmount> GetBalanceForAccount(
+            const ZTXOSelector& selector,
+            int minDepth) const;
 
     /**
      * Insert additional inputs into the transaction by
@@ -5,6 +5,8 @@
 #ifndef ZCASH_WEIGHTED_MAP_H
 #define ZCASH_WEIGHTED_MAP_H
 
+#include "memusage.h"
+
 #include <map>
 #include <optional>
 #include <set>
@@ -123,6 +125,12 @@ public:
         return nodes.size();
     }
 
+    // Return the heap memory used by the map's tree and index.
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::DynamicUsage(nodes) + memusage::DynamicUsage(indexMap);
+    }
+
     // Return false if the key already exists in the map.
     // Otherwise, add an entry mapping `key` to `value` with the given weight,
     // and return true. The weight must be positive.
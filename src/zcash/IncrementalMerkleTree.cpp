@@ -977,6 +977,43 @@ void IncrementalMerkleTree<Depth, Hash>::append(Hash obj) {
     }
 }
 
+template<size_t Depth, typename Hash>
+IncrementalMerkleTreeDelta<Depth, Hash> IncrementalMerkleTree<Depth, Hash>::delta_from(const IncrementalMerkleTree<Depth, Hash>& base) const {
+    Delta delta;
+    delta.left = left;
+    delta.right = right;
+
+    // Parents are only ever appended, so they can only be shared if both
+    // trees have the same number of them.
+    size_t shared = 0;
+    if (parents.size() == base.parents.size()) {
+        while (shared < parents.size() &&
+               parents[parents.size() - shared - 1] == base.parents[parents.size() - shared - 1]) {
+            shared++;
+        }
+    }
+
+    delta.parents.assign(parents.begin(), parents.end() - shared);
+    delta.nSharedParents = shared;
+    return delta;
+}
+
+template<size_t Depth, typename Hash>
+void IncrementalMerkleTree<Depth, Hash>::apply_delta(const IncrementalMerkleTreeDelta<Depth, Hash>& delta) {
+    if (delta.nSharedParents > 0 && delta.parents.size() + delta.nSharedParents != parents.size()) {
+        throw std::runtime_error("delta was not taken against this tree");
+    }
+
+    std::vector<std::optional<Hash>> new_parents(delta.parents);
+    new_parents.insert(new_parents.end(), parents.end() - delta.nSharedParents, parents.end());
+
+    left = delta.left;
+    right = delta.right;
+    parents = std::move(new_parents);
+
+    wfcheck();
+}
+
 // This is for allowing the witness to determine if a subtree has filled
 // to a particular depth, or for append() to ensure we're not appending
 // to a full tree.
@@ -139,6 +139,29 @@ bool operator==(const EmptyMerkleRoots<Depth, Hash>& a,
 template<size_t Depth, typename Hash>
 class IncrementalWitness;
 
+//! The difference between an incremental Merkle tree and an earlier state
+//! of the same tree. Appending leaves only replaces the leaves and the
+//! lowest collapsed parents, so the later tree is described by those plus
+//! the number of rootward parents that it shares with the earlier one.
+template<size_t Depth, typename Hash>
+class IncrementalMerkleTreeDelta {
+public:
+    std::optional<Hash> left;
+    std::optional<Hash> right;
+    std::vector<std::optional<Hash>> parents;
+    uint32_t nSharedParents = 0;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(left);
+        READWRITE(right);
+        READWRITE(parents);
+        READWRITE(VARINT(nSharedParents));
+    }
+};
+
 template<size_t Depth, typename Hash>
 class IncrementalMerkleTree {
 
@@ -147,6 +170,8 @@ friend class IncrementalWitness<Depth, Hash>;
 public:
     static_assert(Depth >= 1);
 
+    typedef IncrementalMerkleTreeDelta<Depth, Hash> Delta;
+
     IncrementalMerkleTree() { }
 
     size_t DynamicMemoryUsage() const {
@@ -182,6 +207,14 @@ public:
         return IncrementalWitness<Depth, Hash>(*this);
     }
 
+    //! Returns the delta that turns `base` into this tree. It is smallest
+    //! when `base` is an earlier state of this tree, but is correct for any
+    //! `base`.
+    Delta delta_from(const IncrementalMerkleTree& base) const;
+    //! Turns this tree, which must be the `base` that the delta was taken
+    //! against, into the tree that the delta was taken from.
+    void apply_delta(const Delta& delta);
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
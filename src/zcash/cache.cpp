@@ -15,8 +15,18 @@ std::unique_ptr<BundleValidityCache> NewBundleValidityCache(rust::Str kind, size
               (nElems * sizeof(BundleCacheEntry)) >> 20, nMaxCacheSize >> 20, kind, nElems);
     return cache;
 }
+
+void CopyBundleCacheEntries(const BundleValidityCache& cache, rust::Vec<uint8_t>& entries)
+{
+    cache.for_each([&](const BundleCacheEntry& entry) {
+        for (uint8_t b : entry) {
+            entries.push_back(b);
+        }
+    });
+}
 } // namespace libzcash
 
 // Explicit instantiations for libzcash::BundleValidityCache
 template void libzcash::BundleValidityCache::insert(libzcash::BundleCacheEntry e);
 template bool libzcash::BundleValidityCache::contains(const libzcash::BundleCacheEntry& e, const bool erase) const;
+template void libzcash::BundleValidityCache::clear();
@@ -39,6 +39,12 @@ public:
 typedef CuckooCache::cache<BundleCacheEntry, BundleCacheHasher> BundleValidityCache;
 
 std::unique_ptr<BundleValidityCache> NewBundleValidityCache(rust::Str kind, size_t nMaxCacheSize);
+
+/**
+ * Append the entries of the cache that haven't been marked for garbage
+ * collection to `entries`, 32 bytes each.
+ */
+void CopyBundleCacheEntries(const BundleValidityCache& cache, rust::Vec<uint8_t>& entries);
 } // namespace libzcash
 
 #endif // ZCASH_ZCASH_CACHE_H
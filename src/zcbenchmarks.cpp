@@ -312,6 +312,39 @@ double benchmark_try_decrypt_sapling_notes(size_t nKeys)
     return timer_stop(tv_start);
 }
 
+double benchmark_batch_scan_sapling_notes(size_t nKeys)
+{
+    auto masterKey = GetTestMasterSaplingSpendingKey();
+
+    CWallet wallet(Params());
+
+    for (int i = 0; i < nKeys; i++) {
+        auto sk = masterKey.Derive(i);
+        wallet.AddSaplingSpendingKey(sk);
+    }
+
+    // Generate a key that has not been added to the wallet
+    auto sk = masterKey.Derive(nKeys);
+    auto tx = GetValidSaplingReceive(Params(), wallet, sk, 10);
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    std::vector<unsigned char> txBytes(ssTx.begin(), ssTx.end());
+
+    // Scan the transaction as a block connection would: the wallet's batch
+    // scanner is rebuilt with its current keys, and then trial decrypts the
+    // outputs in a batch on the global threadpool.
+    struct timeval tv_start;
+    timer_start(tv_start);
+    auto batchScanner = wallet.GetBatchScanner();
+    batchScanner->AddTransaction(tx, txBytes, uint256(), 1);
+    batchScanner->Flush();
+    batchScanner->SyncTransaction(tx, nullptr, 1);
+    double elapsed = timer_stop(tv_start);
+    assert(wallet.mapWallet.empty());
+    return elapsed;
+}
+
 CWalletTx CreateSproutTxWithNoteData(const libzcash::SproutSpendingKey& sk) {
     auto wtx = GetValidSproutReceive(sk, 10, true);
     auto note = GetSproutNote(sk, wtx, 0, 1);